@@ -4,16 +4,18 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// game-style memory allocator
+// game-style memory allocators
 //
-// this is a placeholder for a game-style memory allocator
 // using malloc and free is frowned upon in grown-up circles.
 //
-// these functions are poor for the following reasons:
+// the system functions are poor for the following reasons:
 //
 // 1) free() has to compute the size of the block to free
 // 2) these functions use heavy weight locks to guard the heap.
 // 3) implementations are quite variable
+//
+// allocator:       size-class pools with per-thread caches, the default for all containers.
+// arena_allocator: per-thread linear allocator for per-frame and scoped temporary data.
 
 // this is a dummy class used to customise the placement new and delete
 struct dynarray_dummy_t {};
@@ -49,60 +51,352 @@ void operator delete(void *ptr, void *place, dynarray_dummy_t x) {}
 
 
 namespace octet { namespace containers {
+  /// Default allocator for containers and resources.
+  ///
+  /// Small blocks come from pools of fixed size classes. Each thread keeps a short
+  /// free list for every size class, so most calls to malloc() and free() take no lock at all.
+  /// Blocks move between the thread caches and the shared pools in batches.
+  /// Blocks larger than max_small_size go to the system heap.
+  ///
+  /// As with the rest of octet, the caller must pass the size of the block to free();
+  /// this saves a header on every allocation.
+  ///
+  /// Example
+  ///
+  ///     allocator::stats_t stats;
+  ///     allocator::get_stats(stats);
+  ///     printf("%d bytes in use, peak %d\n", (int)stats.num_bytes, (int)stats.peak_bytes);
   class allocator {
+  public:
+    enum {
+      alignment = 16,
+      max_small_size = 2048,
+      num_classes = 40,
+      chunk_size = 65536,
+      cache_bytes = 16384,
+    };
+
+    /// counters for one size class
+    struct class_stats_t {
+      /// size of blocks in this class
+      size_t block_size;
+      /// number of blocks carved from chunks
+      size_t num_blocks;
+      /// number of calls to malloc() that used this class
+      size_t num_allocs;
+      /// number of calls to free() that used this class
+      size_t num_frees;
+    };
+
+    /// snapshot of the allocator counters
+    struct stats_t {
+      /// bytes currently allocated by callers
+      size_t num_bytes;
+      /// largest value of num_bytes so far
+      size_t peak_bytes;
+      /// bytes currently allocated from the system heap for large blocks
+      size_t large_bytes;
+      /// bytes of chunk memory owned by the pools
+      size_t pool_bytes;
+      /// per size class counters
+      class_stats_t classes[num_classes];
+    };
+
+  private:
+    // shared pool for one size class
+    struct pool_t {
+      std::mutex lock;
+      void *free_list;
+      char *chunk_pos;
+      char *chunk_end;
+      unsigned block_size;
+      unsigned batch_size;
+      size_t num_blocks;
+      size_t num_allocs;
+      size_t num_frees;
+    };
+
+    // per-thread free lists; must be plain old data for OCTET_THREAD_LOCAL.
+    struct thread_cache_t {
+      void *free_list[num_classes];
+      unsigned num_free[num_classes];
+      unsigned num_allocs[num_classes];
+      unsigned num_frees[num_classes];
+    };
+
     // singleton state, a bit like an old-world global variable
     struct state_t {
-      size_t num_bytes;
+      std::atomic<size_t> num_bytes;
+      std::atomic<size_t> peak_bytes;
+      std::atomic<size_t> large_bytes;
+      std::atomic<size_t> pool_bytes;
+      pool_t pools[num_classes];
+
+      // map (size + alignment - 1) / alignment to a size class
+      unsigned char class_index[max_small_size / alignment + 1];
+
+      state_t() : num_bytes(0), peak_bytes(0), large_bytes(0), pool_bytes(0) {
+        // 16 byte steps to 256, then four steps per doubling to 2048.
+        unsigned size = 0;
+        for (unsigned c = 0; c != num_classes; ++c) {
+          size += c < 16 ? 16 : c < 24 ? 32 : c < 32 ? 64 : 128;
+          pool_t &p = pools[c];
+          p.free_list = 0;
+          p.chunk_pos = p.chunk_end = 0;
+          p.block_size = size;
+          p.batch_size = cache_bytes / size < 4 ? 4 : cache_bytes / size > 64 ? 64 : cache_bytes / size;
+          p.num_blocks = p.num_allocs = p.num_frees = 0;
+        }
+        assert(size == max_small_size);
+
+        unsigned c = 0;
+        for (unsigned i = 0; i <= max_small_size / alignment; ++i) {
+          while (pools[c].block_size < i * alignment) ++c;
+          class_index[i] = (unsigned char)c;
+        }
+      }
     };
 
+    // never destroyed: static destructors may still free memory at exit.
     static state_t &state() {
-      static state_t instance;
+      static state_t *instance = new state_t();
+      return *instance;
+    }
+
+    static thread_cache_t &cache() {
+      static OCTET_THREAD_LOCAL thread_cache_t instance;
       return instance;
     }
 
+    static unsigned get_class(size_t size) {
+      return state().class_index[(size + alignment - 1) / alignment];
+    }
+
+    static void add_bytes(size_t size) {
+      #if OCTET_ALLOCATOR_STATS
+        state_t &s = state();
+        size_t num_bytes = s.num_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        size_t peak = s.peak_bytes.load(std::memory_order_relaxed);
+        while (num_bytes > peak && !s.peak_bytes.compare_exchange_weak(peak, num_bytes, std::memory_order_relaxed)) {
+        }
+      #endif
+    }
+
+    static void sub_bytes(size_t size) {
+      #if OCTET_ALLOCATOR_STATS
+        state().num_bytes.fetch_sub(size, std::memory_order_relaxed);
+      #endif
+    }
+
+    // move this thread's counters into the shared pool. pool lock must be held.
+    static void flush_counts(pool_t &p, thread_cache_t &tc, unsigned c) {
+      p.num_allocs += tc.num_allocs[c];
+      p.num_frees += tc.num_frees[c];
+      tc.num_allocs[c] = tc.num_frees[c] = 0;
+    }
+
+    // fill the thread cache with a batch of blocks from the shared pool.
+    static void refill(thread_cache_t &tc, unsigned c) {
+      pool_t &p = state().pools[c];
+      std::lock_guard<std::mutex> lock(p.lock);
+      flush_counts(p, tc, c);
+      for (unsigned i = 0; i != p.batch_size; ++i) {
+        void *block = p.free_list;
+        if (block) {
+          p.free_list = *(void**)block;
+        } else {
+          if (p.chunk_pos == p.chunk_end) {
+            size_t bytes = chunk_size;
+            p.chunk_pos = (char*)system_malloc(bytes);
+            p.chunk_end = p.chunk_pos + bytes - bytes % p.block_size;
+            state().pool_bytes += bytes;
+          }
+          block = p.chunk_pos;
+          p.chunk_pos += p.block_size;
+          p.num_blocks++;
+        }
+        *(void**)block = tc.free_list[c];
+        tc.free_list[c] = block;
+        tc.num_free[c]++;
+      }
+    }
+
+    // give up to max_blocks blocks from the thread cache back to the shared pool.
+    static void drain(thread_cache_t &tc, unsigned c, unsigned max_blocks) {
+      pool_t &p = state().pools[c];
+      std::lock_guard<std::mutex> lock(p.lock);
+      flush_counts(p, tc, c);
+      for (unsigned i = 0; i != max_blocks && tc.free_list[c]; ++i) {
+        void *block = tc.free_list[c];
+        tc.free_list[c] = *(void**)block;
+        tc.num_free[c]--;
+        *(void**)block = p.free_list;
+        p.free_list = block;
+      }
+    }
+
   public:
-    // todo: implement this from scratch using a pool allocator
-    static void *malloc(size_t size) {
-      state().num_bytes += size;
+    /// Allocate directly from the system heap with the platform's alignment rules.
+    static void *system_malloc(size_t size) {
       #if OCTET_MAC
         void *res = 0;
-        posix_memalign(&res, 16, size);
+        posix_memalign(&res, alignment, size);
       #elif OCTET_SSE
-        void *res = ::_aligned_malloc(size, 16);
+        void *res = ::_aligned_malloc(size, alignment);
       #elif OCTET_VITA
-        void *res = ::memalign(size, 16);
+        void *res = ::memalign(alignment, size);
       #else
         void *res = ::malloc(size);
       #endif
-      //printf("malloc %p[%d] -> %d\n", res, size, state().num_bytes);
       return res;
     }
 
-    static void free(void *ptr, size_t size) {
-      state().num_bytes -= size;
-      //printf("free %p[%d] -> %d\n", ptr, size, state().num_bytes);
+    /// Free a block from system_malloc()
+    static void system_free(void *ptr) {
       #if OCTET_MAC
-        return ::free(ptr);
+        ::free(ptr);
       #elif OCTET_SSE
-        return ::_aligned_free(ptr);
+        ::_aligned_free(ptr);
       #else
-        return ::free(ptr);
+        ::free(ptr);
       #endif
     }
 
-    static void *realloc(void *ptr, size_t old_size, size_t size) {
-      state().num_bytes += size - old_size;
+    /// Reallocate a block from system_malloc()
+    static void *system_realloc(void *ptr, size_t size) {
       #if OCTET_MAC
-        void *res = ::realloc(ptr, size);
+        return ::realloc(ptr, size);
       #elif OCTET_SSE
-        void *res = ::_aligned_realloc(ptr, size, 16);
+        return ::_aligned_realloc(ptr, size, alignment);
       #else
-        void *res = ::realloc(ptr, size);
+        return ::realloc(ptr, size);
       #endif
+    }
+
+    /// Allocate a block of at least "size" bytes aligned to 16 bytes.
+    static void *malloc(size_t size) {
+      add_bytes(size);
+      #if OCTET_POOL_ALLOCATOR
+        if (size <= max_small_size) {
+          unsigned c = get_class(size);
+          thread_cache_t &tc = cache();
+          if (!tc.free_list[c]) refill(tc, c);
+          void *res = tc.free_list[c];
+          tc.free_list[c] = *(void**)res;
+          tc.num_free[c]--;
+          tc.num_allocs[c]++;
+          return res;
+        }
+      #endif
+      #if OCTET_ALLOCATOR_STATS
+        state().large_bytes += size;
+      #endif
+      void *res = system_malloc(size);
+      //printf("malloc %p[%d] -> %d\n", res, size, state().num_bytes);
+      return res;
+    }
+
+    /// Free a block; size must be the same as the size passed to malloc().
+    static void free(void *ptr, size_t size) {
+      if (!ptr) return;
+      sub_bytes(size);
+      #if OCTET_POOL_ALLOCATOR
+        if (size <= max_small_size) {
+          unsigned c = get_class(size);
+          thread_cache_t &tc = cache();
+          *(void**)ptr = tc.free_list[c];
+          tc.free_list[c] = ptr;
+          tc.num_frees[c]++;
+          // keep at most two batches in the cache
+          unsigned batch_size = state().pools[c].batch_size;
+          if (++tc.num_free[c] > batch_size * 2) {
+            drain(tc, c, batch_size);
+          }
+          return;
+        }
+      #endif
+      #if OCTET_ALLOCATOR_STATS
+        state().large_bytes -= size;
+      #endif
+      //printf("free %p[%d] -> %d\n", ptr, size, state().num_bytes);
+      system_free(ptr);
+    }
+
+    /// Change the size of a block, copying the contents if the block moves.
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      if (!ptr) return malloc(size);
+      #if OCTET_POOL_ALLOCATOR
+        bool old_small = old_size <= max_small_size;
+        bool new_small = size <= max_small_size;
+        if (old_small && new_small && get_class(old_size) == get_class(size)) {
+          sub_bytes(old_size);
+          add_bytes(size);
+          return ptr;
+        } else if (old_small || new_small) {
+          void *res = malloc(size);
+          memcpy(res, ptr, old_size < size ? old_size : size);
+          free(ptr, old_size);
+          return res;
+        }
+      #endif
+      sub_bytes(old_size);
+      add_bytes(size);
+      #if OCTET_ALLOCATOR_STATS
+        state().large_bytes += size - old_size;
+      #endif
+      void *res = system_realloc(ptr, size);
       //printf("realloc %p[%d] -> %p[%d] %d\n", ptr, old_size, res, size, state().num_bytes);
       return res;
     }
 
+    /// Return this thread's cached blocks to the shared pools.
+    /// Worker threads should call this before they exit.
+    static void flush_thread_cache() {
+      thread_cache_t &tc = cache();
+      for (unsigned c = 0; c != num_classes; ++c) {
+        drain(tc, c, tc.num_free[c]);
+      }
+    }
+
+    /// Get a snapshot of the allocator counters.
+    ///
+    /// Per class counts from other threads are updated when their caches refill or drain.
+    static void get_stats(stats_t &stats) {
+      state_t &s = state();
+      thread_cache_t &tc = cache();
+      stats.num_bytes = s.num_bytes;
+      stats.peak_bytes = s.peak_bytes;
+      stats.large_bytes = s.large_bytes;
+      stats.pool_bytes = s.pool_bytes;
+      for (unsigned c = 0; c != num_classes; ++c) {
+        pool_t &p = s.pools[c];
+        std::lock_guard<std::mutex> lock(p.lock);
+        flush_counts(p, tc, c);
+        class_stats_t &cs = stats.classes[c];
+        cs.block_size = p.block_size;
+        cs.num_blocks = p.num_blocks;
+        cs.num_allocs = p.num_allocs;
+        cs.num_frees = p.num_frees;
+      }
+    }
+
+    /// Write the allocator counters to a file, eg. log() or stdout.
+    static void dump_stats(FILE *file) {
+      stats_t stats;
+      get_stats(stats);
+      fprintf(file, "allocator: %u bytes peak %u large %u pools %u\n",
+        (unsigned)stats.num_bytes, (unsigned)stats.peak_bytes, (unsigned)stats.large_bytes, (unsigned)stats.pool_bytes
+      );
+      for (unsigned c = 0; c != num_classes; ++c) {
+        class_stats_t &cs = stats.classes[c];
+        if (cs.num_allocs) {
+          fprintf(file, "  %5u: blocks %u allocs %u live %u\n",
+            (unsigned)cs.block_size, (unsigned)cs.num_blocks, (unsigned)cs.num_allocs, (unsigned)(cs.num_allocs - cs.num_frees)
+          );
+        }
+      }
+    }
+
     // crude check of stack integrity
     static void test(const char *label) {
       printf("test %s\n", label);
@@ -110,5 +404,194 @@ namespace octet { namespace containers {
       ::free(::malloc(32));
     }
   };
-} }
 
+  /// Linear allocator for temporary and per-frame data.
+  ///
+  /// Use this as the allocator_t parameter of a container.
+  /// Memory is reclaimed all at once when a scoped_arena goes out of scope or when reset()
+  /// is called, typically once a frame. free() only reclaims the most recent allocation.
+  ///
+  /// Each thread has its own arena. Containers must not outlive the scope they were allocated in.
+  ///
+  /// Example
+  ///
+  ///     {
+  ///       scoped_arena scope;
+  ///       dynarray<vec3, arena_allocator> temp;
+  ///       temp.resize(1000);
+  ///       ...
+  ///     } // all the memory used by temp is available again here.
+  class arena_allocator {
+  public:
+    enum {
+      alignment = 16,
+      chunk_size = 256 * 1024,
+    };
+
+    // header of a chunk of arena memory; 32 bytes to keep the data aligned.
+    struct chunk_t {
+      chunk_t *next;
+      size_t size;
+      size_t used;
+      size_t pad;
+    };
+
+    /// position in the arena to rewind to.
+    struct mark_t {
+      chunk_t *chunk;
+      size_t used;
+    };
+
+  private:
+    // must be plain old data for OCTET_THREAD_LOCAL.
+    struct state_t {
+      chunk_t *chunks;
+      chunk_t *spare;
+      size_t num_bytes;
+      size_t peak_bytes;
+    };
+
+    static state_t &state() {
+      static OCTET_THREAD_LOCAL state_t instance;
+      return instance;
+    }
+
+    static char *get_data(chunk_t *chunk) {
+      return (char*)(chunk + 1);
+    }
+
+    static size_t round_up(size_t size) {
+      return (size + alignment - 1) & ~(size_t)(alignment - 1);
+    }
+
+    static chunk_t *new_chunk(state_t &s, size_t size) {
+      chunk_t *chunk = s.spare;
+      if (chunk && chunk->size >= size) {
+        s.spare = chunk->next;
+      } else {
+        size_t bytes = size > chunk_size ? size : chunk_size;
+        chunk = (chunk_t*)allocator::malloc(sizeof(chunk_t) + bytes);
+        chunk->size = bytes;
+      }
+      chunk->used = 0;
+      chunk->next = s.chunks;
+      s.chunks = chunk;
+      return chunk;
+    }
+
+  public:
+    /// Allocate a block from this thread's arena.
+    static void *malloc(size_t size) {
+      size = round_up(size);
+      state_t &s = state();
+      chunk_t *chunk = s.chunks;
+      if (!chunk || chunk->used + size > chunk->size) {
+        chunk = new_chunk(s, size);
+      }
+      void *res = get_data(chunk) + chunk->used;
+      chunk->used += size;
+      s.num_bytes += size;
+      if (s.num_bytes > s.peak_bytes) s.peak_bytes = s.num_bytes;
+      return res;
+    }
+
+    /// Free a block. Only the most recent allocation is actually reclaimed.
+    static void free(void *ptr, size_t size) {
+      size = round_up(size);
+      state_t &s = state();
+      chunk_t *chunk = s.chunks;
+      if (ptr && chunk && (char*)ptr + size == get_data(chunk) + chunk->used) {
+        chunk->used -= size;
+        s.num_bytes -= size;
+      }
+    }
+
+    /// Change the size of a block. The most recent allocation grows in place.
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      state_t &s = state();
+      chunk_t *chunk = s.chunks;
+      size_t old_bytes = round_up(old_size);
+      size_t new_bytes = round_up(size);
+      if (ptr && chunk && (char*)ptr + old_bytes == get_data(chunk) + chunk->used && chunk->used - old_bytes + new_bytes <= chunk->size) {
+        chunk->used += new_bytes - old_bytes;
+        s.num_bytes += new_bytes - old_bytes;
+        if (s.num_bytes > s.peak_bytes) s.peak_bytes = s.num_bytes;
+        return ptr;
+      }
+      void *res = malloc(size);
+      if (ptr) {
+        memcpy(res, ptr, old_size < size ? old_size : size);
+      }
+      return res;
+    }
+
+    /// Get the current position in this thread's arena.
+    static mark_t get_mark() {
+      chunk_t *chunk = state().chunks;
+      mark_t mark = { chunk, chunk ? chunk->used : 0 };
+      return mark;
+    }
+
+    /// Free everything allocated since get_mark() returned "mark".
+    static void rewind(const mark_t &mark) {
+      state_t &s = state();
+      while (s.chunks != mark.chunk) {
+        chunk_t *chunk = s.chunks;
+        s.chunks = chunk->next;
+        s.num_bytes -= chunk->used;
+        chunk->next = s.spare;
+        s.spare = chunk;
+      }
+      if (s.chunks) {
+        s.num_bytes -= s.chunks->used - mark.used;
+        s.chunks->used = mark.used;
+      }
+    }
+
+    /// Free everything in this thread's arena, eg. at the end of a frame. Keeps the chunks for reuse.
+    static void reset() {
+      mark_t mark = { 0, 0 };
+      rewind(mark);
+    }
+
+    /// Free everything and return the chunks to the main allocator.
+    static void release() {
+      reset();
+      state_t &s = state();
+      while (s.spare) {
+        chunk_t *chunk = s.spare;
+        s.spare = chunk->next;
+        allocator::free(chunk, sizeof(chunk_t) + chunk->size);
+      }
+    }
+
+    /// Bytes currently allocated from this thread's arena.
+    static size_t get_num_bytes() {
+      return state().num_bytes;
+    }
+
+    /// Largest number of bytes allocated from this thread's arena.
+    static size_t get_peak_bytes() {
+      return state().peak_bytes;
+    }
+  };
+
+  /// Rewinds the arena_allocator to its previous position when it goes out of scope.
+  class scoped_arena {
+    arena_allocator::mark_t mark;
+
+    // do not define these.
+    scoped_arena(const scoped_arena &rhs);
+    void operator=(const scoped_arena &rhs);
+  public:
+    /// Remember the current position of this thread's arena.
+    scoped_arena() {
+      mark = arena_allocator::get_mark();
+    }
+
+    /// Free everything allocated in this scope.
+    ~scoped_arena() {
+      arena_allocator::rewind(mark);
+    }
+  };
+} }
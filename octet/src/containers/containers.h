@@ -26,8 +26,8 @@
 #define OCTET_CONTAINERS_INCLUDED
 
 #include "../containers/allocator.h"
-#include "../containers/dictionary.h"
 #include "../containers/hash_map.h"
+#include "../containers/dictionary.h"
 #include "../containers/double_list.h"
 #include "../containers/dynarray.h"
 #include "../containers/string.h"
@@ -12,114 +12,243 @@ namespace octet { namespace containers {
   /// This is like a JavaScript or Python dictionary but for text keys only.
   /// It is about twenty times faster than using std::map<std::string, xxx>
   ///
+  /// Keys are interned in blocks owned by the dictionary, so a key pointer from get_key()
+  /// stays valid until the dictionary is reset, even if the key is erased.
+  /// Keys may also be given as a pointer and length (a string view) that need not be
+  /// terminated, for example a name in the middle of a file.
+  ///
   /// Example:
   ///
   ///     dictionary<int> my_dict;
-  ///     my_dict["fred"] = 27; 
-  ///     my_dict["anne"] = 28; 
+  ///     my_dict["fred"] = 27;
+  ///     my_dict["anne"] = 28;
   ///
   ///     int annes_age = my_dict["anne"];
+  ///     int freds_age = my_dict.get("fred and anne", 4);
   ///
   template <class value_t, class allocator_t=allocator> class dictionary {
-    struct entry_t { const char *key; unsigned hash; value_t value; };
+    struct entry_t { const char *key; unsigned hash; unsigned length; value_t value; };
     entry_t *entries;
+    uint8_t *ctrl;
     unsigned num_entries;
     unsigned max_entries;
-  
-    // hash is a compromise between fewer collisions and
-    // faster hash calculation.
-    unsigned calc_hash( const char *key ) {
-      unsigned hash = 0;
-      for (int i = 0; key[i]; ++i) {
-        hash = ( hash << 5 ) ^ ( hash << 3 ) ^ (key[i] & 0xff);
+
+    // interned keys live in blocks which are freed by reset().
+    enum { key_block_size = 4096 };
+    struct key_block { key_block *next; size_t size; };
+    key_block *key_blocks;
+    char *key_ptr;
+    size_t key_bytes_left;
+
+    // FNV-1a, then mixed so that the top bits are good for the control bytes.
+    static unsigned calc_hash( const char *key, size_t length ) {
+      unsigned hash = 2166136261u;
+      for (size_t i = 0; i != length; ++i) {
+        hash = ( hash ^ (key[i] & 0xff) ) * 16777619u;
       }
-      return hash;
+      return hash_map_cmp::fuzz_hash(hash);
     }
-  
-    // internal method to find an entry for a key
-    entry_t *find( const char *key, unsigned hash ) {
+
+    // internal method to find an entry for a key or the empty slot where it would go.
+    unsigned find( const char *key, size_t length, unsigned hash ) const {
       unsigned mask = max_entries - 1;
-      for (unsigned i = 0; i != max_entries; ++i) {
-        entry_t *entry = &entries[ ( i + hash ) & mask ];
-        if (!entry->key) {
-          return entry;
+      uint8_t h2 = hash_map_ctrl::get_h2(hash);
+      unsigned pos = hash & mask;
+      for (;;) {
+        const uint8_t *group = ctrl + pos;
+        unsigned empty = hash_map_ctrl::match(group, hash_map_ctrl::ctrl_empty);
+        unsigned limit = empty ? (empty & (0u - empty)) - 1 : 0xffffffffu;
+        for (unsigned found = hash_map_ctrl::match(group, h2) & limit; found; found &= found - 1) {
+          unsigned index = (pos + hash_map_ctrl::lowest_bit(found)) & mask;
+          const entry_t *entry = &entries[index];
+          if (entry->hash == hash && entry->length == length && !memcmp(entry->key, key, length)) {
+            return index;
+          }
         }
-        if (entry->hash == hash && !strcmp(entry->key, key)) {
-          return entry;
+
+        if (empty) {
+          return (pos + hash_map_ctrl::lowest_bit(empty)) & mask;
         }
+        pos = (pos + hash_map_ctrl::group_size) & mask;
+      }
+    }
+
+    bool is_used_slot(unsigned index) const {
+      return ctrl[index] != hash_map_ctrl::ctrl_empty;
+    }
+
+    // copy a key and a terminator into the key blocks.
+    const char *intern( const char *key, size_t length ) {
+      size_t bytes = length + 1;
+      if (bytes > key_bytes_left) {
+        size_t size = sizeof(key_block) + (bytes > key_block_size ? bytes : key_block_size);
+        key_block *block = (key_block *)allocator_t::malloc(size);
+        block->next = key_blocks;
+        block->size = size;
+        key_blocks = block;
+        key_ptr = (char*)(block + 1);
+        key_bytes_left = size - sizeof(key_block);
       }
-      return 0;
+      char *result = key_ptr;
+      memcpy(result, key, length);
+      result[length] = 0;
+      key_ptr += bytes;
+      key_bytes_left -= bytes;
+      return result;
     }
-  
-    // grow the dictionary when needed
-    void expand() {
+
+    // make a new table and move the entries into it.
+    void resize_table(unsigned new_max_entries) {
       entry_t *old_entries = entries;
+      uint8_t *old_ctrl = ctrl;
       unsigned old_max_entries = max_entries;
-      entries = (entry_t *)allocator_t::malloc(sizeof(entry_t) * max_entries*2);
-      memset(entries, 0, sizeof(entry_t) * max_entries*2);
-      max_entries *= 2;
+
+      max_entries = new_max_entries;
+      entries = (entry_t *)allocator_t::malloc(sizeof(entry_t) * max_entries);
+      memset(entries, 0, sizeof(entry_t) * max_entries);
+      ctrl = (uint8_t *)allocator_t::malloc(hash_map_ctrl::get_ctrl_size(max_entries));
+      memset(ctrl, hash_map_ctrl::ctrl_empty, hash_map_ctrl::get_ctrl_size(max_entries));
+
       for (unsigned i = 0; i != old_max_entries; ++i) {
-        entry_t *old_entry = &old_entries[i];
-        if (old_entry->key) {
-          entry_t *new_entry = find(old_entry->key, old_entry->hash);
-          *new_entry = *old_entry;
+        if (old_ctrl[i] != hash_map_ctrl::ctrl_empty) {
+          entry_t *old_entry = &old_entries[i];
+          unsigned index = find(old_entry->key, old_entry->length, old_entry->hash);
+          memcpy((void*)&entries[index], (void*)old_entry, sizeof(entry_t));
+          hash_map_ctrl::set(ctrl, max_entries, index, old_ctrl[i]);
         }
       }
-      allocator_t::free(old_entries, sizeof(entry_t) * old_max_entries);
+
+      if (old_entries) {
+        allocator_t::free(old_entries, sizeof(entry_t) * old_max_entries);
+        allocator_t::free(old_ctrl, hash_map_ctrl::get_ctrl_size(old_max_entries));
+      }
     }
 
     void release() {
-      for (unsigned i = 0; i != max_entries; ++i) {
-        entry_t *entry = &entries[i];
-        if (entry->key ) {
-          allocator_t::free((void*)entry->key, strlen(entry->key)+1);
-        }
+      while (key_blocks) {
+        key_block *next = key_blocks->next;
+        allocator_t::free(key_blocks, key_blocks->size);
+        key_blocks = next;
       }
+      key_ptr = 0;
+      key_bytes_left = 0;
       allocator_t::free(entries, sizeof(entry_t) * max_entries);
+      allocator_t::free(ctrl, hash_map_ctrl::get_ctrl_size(max_entries));
       entries = 0;
+      ctrl = 0;
       num_entries = 0;
       max_entries = 0;
     }
 
     void init() {
+      entries = 0;
+      ctrl = 0;
       num_entries = 0;
-      max_entries = 4;
-      entries = (entry_t*)allocator_t::malloc(sizeof(entry_t) * max_entries);
-      memset(entries, 0, sizeof(entry_t) * max_entries);
+      max_entries = 0;
+      key_blocks = 0;
+      key_ptr = 0;
+      key_bytes_left = 0;
+      resize_table(4);
     }
+
+    // do not define these.
+    dictionary(const dictionary &rhs);
+    void operator=(const dictionary &rhs);
   public:
     /// make a new dictionary
     dictionary() {
       init();
     }
 
-    /// Access an element by name.
+    /// Make room for num_entries keys so that the dictionary does not grow while they are added.
+    void reserve(unsigned num_entries) {
+      unsigned new_max_entries = hash_map_ctrl::get_table_size(num_entries);
+      if (new_max_entries > max_entries) {
+        resize_table(new_max_entries);
+      }
+    }
+
+    /// Rebuild the table with at least min_entries slots (rounded up to a power of two).
+    /// The table will not shrink below what the current keys need; rehash(0) shrinks to fit.
+    void rehash(unsigned min_entries) {
+      unsigned new_max_entries = hash_map_ctrl::get_table_size(num_entries);
+      while (new_max_entries < min_entries) {
+        new_max_entries *= 2;
+      }
+      resize_table(new_max_entries);
+    }
+
+    /// Access an element by a key that is length bytes long.
     /// This will create a new element if one does not exist.
-    /// For more detail, use get_index(), get_key() and get_value()
-    value_t &operator[]( const char *key ) {
-      unsigned hash = calc_hash( key );
-      entry_t *entry = find( key, hash );
-      if (!entry || !entry->key) {
+    value_t &get( const char *key, size_t length ) {
+      unsigned hash = calc_hash( key, length );
+      unsigned index = find( key, length, hash );
+      if (!is_used_slot(index)) {
         // reducing this ratio decreases hot search time at the
         // expense of size (cold search time).
-        if (num_entries > max_entries * 3 / 4) {
-          expand();
-          entry = find(key, hash);
+        if (num_entries >= max_entries * 3 / 4) {
+          resize_table(max_entries * 2);
+          index = find(key, length, hash);
         }
         num_entries++;
-        size_t bytes = strlen(key) + 1;
-        entry->key = (char *)allocator_t::malloc(bytes);
+        entry_t *entry = &entries[index];
+        entry->key = intern(key, length);
         entry->hash = hash;
-        memcpy((void*)entry->key, key, bytes);
+        entry->length = (unsigned)length;
+        hash_map_ctrl::set(ctrl, max_entries, index, hash_map_ctrl::get_h2(hash));
       }
-      return entry->value;
+      return entries[index].value;
+    }
+
+    /// Access an element by name.
+    /// This will create a new element if one does not exist.
+    /// For more detail, use get_index(), get_key() and get_value()
+    value_t &operator[]( const char *key ) {
+      return get( key, strlen(key) );
     }
 
     /// Return true if the dictionary contains key.
-    bool contains(const char *key) {
-      unsigned hash = calc_hash( key );
-      entry_t *entry = find( key, hash );
-      return entry && entry->key;
+    bool contains(const char *key) const {
+      return get_index(key, strlen(key)) != -1;
+    }
+
+    /// Return true if the dictionary contains a key that is length bytes long.
+    bool contains(const char *key, size_t length) const {
+      return get_index(key, length) != -1;
+    }
+
+    /// Remove a key and its value. Returns false if the key was not in the dictionary.
+    ///
+    /// Indices of other keys may change.
+    bool erase(const char *key) {
+      return erase(key, strlen(key));
+    }
+
+    /// Remove a key that is length bytes long.
+    bool erase(const char *key, size_t length) {
+      unsigned hash = calc_hash( key, length );
+      unsigned hole = find( key, length, hash );
+      if (!is_used_slot(hole)) {
+        return false;
+      }
+
+      entries[hole].value.~value_t();
+      num_entries--;
+
+      // move later entries of the run back into the hole if that is nearer their home slot.
+      unsigned mask = max_entries - 1;
+      for (unsigned index = (hole + 1) & mask; is_used_slot(index); index = (index + 1) & mask) {
+        unsigned home = entries[index].hash & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+          memcpy((void*)&entries[hole], (void*)&entries[index], sizeof(entry_t));
+          hash_map_ctrl::set(ctrl, max_entries, hole, ctrl[index]);
+          hole = index;
+        }
+      }
+
+      memset((void*)&entries[hole], 0, sizeof(entry_t));
+      hash_map_ctrl::set(ctrl, max_entries, hole, hash_map_ctrl::ctrl_empty);
+      return true;
     }
 
     /// Return the number of entries stored in the dictionary.
@@ -133,22 +262,40 @@ namespace octet { namespace containers {
     }
 
     /// When iterating, get the key for a certain index. Index can also be found by get_index()
+    /// Returns NULL for unused indices.
     const char *get_key(unsigned index) const {
       assert(index < max_entries);
       return entries[index].key;
     }
 
+    /// When iterating, get the length of the key for a certain index.
+    unsigned get_key_length(unsigned index) const {
+      assert(index < max_entries);
+      return entries[index].length;
+    }
+
     /// When iterating, access a specified value.
     value_t &get_value(unsigned index) {
       assert(index < max_entries);
       return entries[index].value;
     }
 
+    /// When iterating, read a specified value.
+    const value_t &get_value(unsigned index) const {
+      assert(index < max_entries);
+      return entries[index].value;
+    }
+
     /// Get the index for a certain key, or -1 if the key is not found.
-    int get_index(const char *key) {
-      unsigned hash = calc_hash( key );
-      entry_t *entry = find( key, hash );
-      return entry && entry->key ? (int)(entry - entries) : -1;
+    int get_index(const char *key) const {
+      return get_index(key, strlen(key));
+    }
+
+    /// Get the index for a key that is length bytes long, or -1 if the key is not found.
+    int get_index(const char *key, size_t length) const {
+      unsigned hash = calc_hash( key, length );
+      unsigned index = find( key, length, hash );
+      return is_used_slot(index) ? (int)index : -1;
     }
 
     /// Reset the dictionary to empty and free up the resources.
@@ -156,10 +303,10 @@ namespace octet { namespace containers {
       release();
       init();
     }
-  
+
     /// Bye bye dictionary. Use the allocator to free up memory.
     ~dictionary() {
-      reset();
+      release();
     }
   };
 } }
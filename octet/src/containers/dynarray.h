@@ -7,6 +7,116 @@
 
 
 namespace octet { namespace containers {
+  /// Says if a type can be moved to a new address with memcpy, without calling constructors.
+  ///
+  /// This is true of all trivially copyable types and many of our own classes, such as
+  /// ref, string and dynarray which just hold a pointer. Specialise this for your own types:
+  ///
+  ///     template <> struct is_relocatable<my_handle> { enum { value = 1 }; };
+  template <class item_t> struct is_relocatable {
+    enum { value = std::is_trivially_copyable<item_t>::value };
+  };
+
+  /// Moving, shifting and copying of array elements, used by dynarray and small_dynarray.
+  ///
+  /// Relocatable types (or any type if use_new_delete is false) are moved with memmove.
+  template <class item_t, bool use_new_delete> class dynarray_items {
+  public:
+    enum { use_memcpy = !use_new_delete || is_relocatable<item_t>::value };
+
+    /// Move n items to uninitialized memory, leaving the source uninitialized.
+    static void relocate(item_t *dest, item_t *src, size_t n) {
+      if (use_memcpy) {
+        if (n) memcpy((void*)dest, (void*)src, n * sizeof(item_t));
+      } else {
+        dynarray_dummy_t x;
+        for (size_t i = 0; i != n; ++i) {
+          new (dest + i, x) item_t(std::move(src[i]));
+          src[i].~item_t();
+        }
+      }
+    }
+
+    /// Copy n items to uninitialized memory.
+    static void copy(item_t *dest, const item_t *src, size_t n) {
+      if (!use_new_delete || std::is_trivially_copyable<item_t>::value) {
+        if (n) memcpy((void*)dest, (const void*)src, n * sizeof(item_t));
+      } else {
+        dynarray_dummy_t x;
+        for (size_t i = 0; i != n; ++i) {
+          new (dest + i, x) item_t(src[i]);
+        }
+      }
+    }
+
+    /// Default construct n items in uninitialized memory.
+    static void construct(item_t *dest, size_t n) {
+      if (use_new_delete) {
+        dynarray_dummy_t x;
+        for (size_t i = 0; i != n; ++i) {
+          new (dest + i, x) item_t;
+        }
+      }
+    }
+
+    /// Destroy n items.
+    static void destroy(item_t *dest, size_t n) {
+      if (use_new_delete) {
+        for (size_t i = 0; i != n; ++i) {
+          dest[i].~item_t();
+        }
+      }
+    }
+
+    /// Make an uninitialized gap of n items at pos in an array of size items that has room for size + n.
+    /// Returns false if the gap holds moved-from items that must be assigned rather than constructed.
+    static bool open_gap(item_t *data, size_t size, size_t pos, size_t n) {
+      if (use_memcpy) {
+        memmove((void*)(data + pos + n), (void*)(data + pos), (size - pos) * sizeof(item_t));
+        return true;
+      } else {
+        dynarray_dummy_t x;
+        for (size_t i = size + n; i-- > pos + n; ) {
+          if (i >= size) {
+            new (data + i, x) item_t(std::move(data[i - n]));
+          } else {
+            data[i] = std::move(data[i - n]);
+          }
+        }
+        return false;
+      }
+    }
+
+    /// Fill the gap made by open_gap() with copies of src.
+    static void fill_gap(item_t *data, size_t size, size_t pos, const item_t *src, size_t n, bool uninitialized) {
+      if (uninitialized) {
+        copy(data + pos, src, n);
+      } else {
+        dynarray_dummy_t x;
+        for (size_t i = 0; i != n; ++i) {
+          if (pos + i < size) {
+            data[pos + i] = src[i];
+          } else {
+            new (data + pos + i, x) item_t(src[i]);
+          }
+        }
+      }
+    }
+
+    /// Remove n items at pos from an array of size items, moving the rest down.
+    static void close_gap(item_t *data, size_t size, size_t pos, size_t n) {
+      if (use_memcpy) {
+        destroy(data + pos, n);
+        memmove((void*)(data + pos), (void*)(data + pos + n), (size - pos - n) * sizeof(item_t));
+      } else {
+        for (size_t i = pos; i + n < size; ++i) {
+          data[i] = std::move(data[i + n]);
+        }
+        destroy(data + size - n, n);
+      }
+    }
+  };
+
   /// Dynamic array class similar to std::vector.
   ///
   /// Example
@@ -24,16 +134,36 @@ namespace octet { namespace containers {
   ///     dynarray<int> ints;          // ok. int is well-behaved.
   ///     dynarray<mesh> meshes;       // bad! mesh contains other arrays.
   ///     dynarray<ref<mesh> > meshes; // ok. managed pointers to meshes.
+  ///
+  /// When the array grows, trivially copyable and relocatable types (see is_relocatable)
+  /// are moved with memcpy; other types are moved with their move constructors.
   template <class item_t, class allocator_t=allocator, bool use_new_delete=true> class dynarray {
     item_t *data_;
     typedef unsigned int_size_t;
+    typedef dynarray_items<item_t, use_new_delete> items;
 
     // note we don't use size_t for these as we don't expect to use arrays > 4G and we care about performance!
     int_size_t size_;
     int_size_t capacity_;
     enum { min_capacity = 8 };
 
+    // make room for at least new_length items, growing geometrically.
+    void grow(size_t new_length) {
+      if (new_length > capacity_) {
+        int_size_t new_capacity = capacity_ == 0 ? min_capacity : capacity_ * 2;
+        while (new_capacity < new_length) new_capacity *= 2;
+        // sized arrays made in one go do not need the slack.
+        if (capacity_ == 0 && new_length > min_capacity) new_capacity = (int_size_t)new_length;
+        reserve(new_capacity);
+      }
+    }
+
   public:
+    /// pointer iterators, for STL compatibility.
+    typedef item_t *iterator;
+    typedef const item_t *const_iterator;
+    typedef item_t value_type;
+
     /// Create a new, empty, dynamic array
     dynarray() {
       data_ = 0;
@@ -43,30 +173,54 @@ namespace octet { namespace containers {
 
     /// Create a new dynamic array of a certain size.
     dynarray(int_size_t size) {
-      data_ = (item_t*)allocator::malloc(size * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(size * sizeof(item_t));
       size_ = capacity_ = size;
-      if (use_new_delete) {
-        dynarray_dummy_t x;
-        for (int_size_t i = 0; i != size; ++i) {
-          new (data_ + i, x)item_t;
-        }
-      }
+      items::construct(data_, size);
     }
 
     /// Create a copy of a dynamic array.
     ///
     /// Note: this is very slow and will happen frequently in naive code.
+    /// Trivially copyable types are copied with memcpy.
     dynarray(const dynarray &rhs) {
-      data_ = (item_t*)allocator::malloc(rhs.size_ * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(rhs.size_ * sizeof(item_t));
       size_ = capacity_ = rhs.size_;
-      if (use_new_delete) {
-        dynarray_dummy_t x;
-        for (int_size_t i = 0; i != size_; ++i) {
-          new (data_ + i, x)item_t(rhs.data_[i]);
-        }
-      } else {
-        memcpy(data_, rhs.data_, rhs.size_ * sizeof(item_t));
+      items::copy(data_, rhs.data_, size_);
+    }
+
+    /// Take the contents of another array, leaving it empty.
+    dynarray(dynarray &&rhs) {
+      data_ = rhs.data_;
+      size_ = rhs.size_;
+      capacity_ = rhs.capacity_;
+      rhs.data_ = 0;
+      rhs.size_ = 0;
+      rhs.capacity_ = 0;
+    }
+
+    /// Replace the contents with a copy of another array.
+    dynarray &operator=(const dynarray &rhs) {
+      if (this != &rhs) {
+        resize(0);
+        reserve(rhs.size_);
+        items::copy(data_, rhs.data_, rhs.size_);
+        size_ = rhs.size_;
       }
+      return *this;
+    }
+
+    /// Replace the contents with those of another array, leaving it empty.
+    dynarray &operator=(dynarray &&rhs) {
+      if (this != &rhs) {
+        reset();
+        data_ = rhs.data_;
+        size_ = rhs.size_;
+        capacity_ = rhs.capacity_;
+        rhs.data_ = 0;
+        rhs.size_ = 0;
+        rhs.capacity_ = 0;
+      }
+      return *this;
     }
 
     /// Destroy the array and its contents.
@@ -74,71 +228,140 @@ namespace octet { namespace containers {
       reset();
     }
 
-    /// iterator class for use with this dynamic array.
+    /// iterator start for STL compatibility
     ///
     /// Note: this is for STL compatibility. We recommend that you use code like this instead:
     ///
     ///     for (unsigned i = 0; i != array.size(); ++i) {
     ///       // access array[i]
     ///     }
-    class iterator {
-      int_size_t elem;
-      dynarray *vec;
-      friend class dynarray;
-    public:
-      iterator(dynarray *vec_, int_size_t elem_) : vec(vec_), elem(elem_) {}
-      item_t *operator ->() { return &(*vec)[elem]; }
-      item_t &operator *() { return (*vec)[elem]; }
-      bool operator != (const iterator &rhs) const { return elem != rhs.elem; }
-      void operator++() { elem++; }
-      void operator--() { elem--; }
-      void operator++(int) { elem++; }
-      void operator--(int) { elem--; }
-    };
-
-    /// iterator start for STL compatibility
     iterator begin() {
-      return iterator(this, 0);
+      return data_;
     }
 
     /// iterator end for STL compatibility
     iterator end() {
-      return iterator(this, size_);
+      return data_ + size_;
+    }
+
+    /// const iterator start for STL compatibility
+    const_iterator begin() const {
+      return data_;
     }
-  
+
+    /// const iterator end for STL compatibility
+    const_iterator end() const {
+      return data_ + size_;
+    }
+
+    /// Insert a copy of the items [first, last) before position elem.
+    /// The items must not be in this array.
+    void insert(unsigned elem, const item_t *first, const item_t *last) {
+      assert(elem <= size_);
+      int_size_t n = (int_size_t)(last - first);
+      if (n == 0) return;
+      grow(size_ + n);
+      bool uninitialized = items::open_gap(data_, size_, elem, n);
+      items::fill_gap(data_, size_, elem, first, n, uninitialized);
+      size_ += n;
+    }
+
     /// iterator insert for STL compatibility
     iterator insert(iterator it, const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      for (int_size_t i = old_length; i != it.elem; --i) {
-        data_[i] = data_[i-1];
+      int_size_t elem = (int_size_t)(it - data_);
+      if (&new_item >= data_ && &new_item < data_ + size_) {
+        // inserting an item from this array.
+        item_t tmp(new_item);
+        insert(elem, &tmp, &tmp + 1);
+      } else {
+        insert(elem, &new_item, &new_item + 1);
       }
-      data_[it.elem] = new_item;
-      return it;
+      return data_ + elem;
+    }
+
+    /// iterator range insert for STL compatibility
+    iterator insert(iterator it, const item_t *first, const item_t *last) {
+      int_size_t elem = (int_size_t)(it - data_);
+      insert(elem, first, last);
+      return data_ + elem;
+    }
+
+    /// Add copies of n items to the end of the array.
+    void append(const item_t *src, size_t n) {
+      if (src >= data_ && src < data_ + size_) {
+        // appending part of this array, which may move.
+        size_t offset = src - data_;
+        grow(size_ + n);
+        src = data_ + offset;
+      } else {
+        grow(size_ + n);
+      }
+      items::copy(data_ + size_, src, n);
+      size_ += (int_size_t)n;
+    }
+
+    /// Add copies of the items of another array to the end of this one.
+    void append(const dynarray &rhs) {
+      append(rhs.data_, rhs.size_);
     }
 
     /// iterator erase for STL compatibility
     iterator erase(iterator it) {
-      for (int_size_t i = it.elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
-      }
-      resize(size_-1);
-      return it;
+      int_size_t elem = (int_size_t)(it - data_);
+      erase(elem);
+      return data_ + elem;
     }
-  
+
     /// Erase an item; move subsequent items down to fill the gap.
     void erase(unsigned elem) {
-      for (int_size_t i = elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
-      }
-      resize(size_-1);
+      erase(elem, 1);
+    }
+
+    /// Erase n items; move subsequent items down to fill the gap.
+    void erase(unsigned elem, unsigned n) {
+      assert(elem + n <= size_);
+      items::close_gap(data_, size_, elem, n);
+      size_ -= n;
     }
 
     /// Add an item at the back of the array.
     void push_back(const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      data_[old_length] = new_item;
+      if (size_ == capacity_ && &new_item >= data_ && &new_item < data_ + size_) {
+        // pushing an item from this array which is about to move.
+        item_t tmp(new_item);
+        push_back(std::move(tmp));
+        return;
+      }
+      grow(size_ + 1);
+      dynarray_dummy_t x;
+      new (data_ + size_, x) item_t(new_item);
+      size_++;
+    }
+
+    /// Move an item to the back of the array.
+    void push_back(item_t &&new_item) {
+      emplace_back(std::move(new_item));
+    }
+
+    /// Construct an item at the back of the array from constructor arguments.
+    template <class... args_t> item_t &emplace_back(args_t&&... args) {
+      if (size_ == capacity_) {
+        // the arguments may refer to items in this array, so construct before we move it.
+        int_size_t new_capacity = capacity_ == 0 ? min_capacity : capacity_ * 2;
+        item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
+        dynarray_dummy_t x;
+        new (new_data + size_, x) item_t(std::forward<args_t>(args)...);
+        items::relocate(new_data, data_, size_);
+        if (data_) {
+          allocator_t::free(data_, capacity_ * sizeof(item_t));
+        }
+        data_ = new_data;
+        capacity_ = new_capacity;
+      } else {
+        dynarray_dummy_t x;
+        new (data_ + size_, x) item_t(std::forward<args_t>(args)...);
+      }
+      return data_[size_++];
     }
 
     /// Get the last element in the array.
@@ -151,13 +374,13 @@ namespace octet { namespace containers {
     bool empty() const {
       return size_ == 0;
     }
-  
+
     /// Access an element in the array.
     item_t &operator[](size_t elem) { return data_[elem]; }
 
     /// Read an element in the array.
     const item_t &operator[](size_t elem) const { return data_[elem]; }
-  
+
     /// Return number of elements in the array
     int_size_t size() const { return size_; }
 
@@ -169,70 +392,26 @@ namespace octet { namespace containers {
 
     /// Get a pointer to the first element of the array.
     item_t *data() { return data_; }
-  
+
     /// Resize the array to make it bigger or smaller.
+    ///
+    /// Growing beyond the capacity at least doubles it, so repeatedly growing an array is cheap.
     void resize(size_t new_length) {
-      bool trace = false; // hack this for detailed traces
-      dynarray_dummy_t x;
-      if (new_length >= size_ && new_length <= capacity_) {
-        if (trace) printf("case 1: growing dynarray up to capacity_\n");
-        if (use_new_delete) {
-          int_size_t len = size_; // avoid aliases
-          while (len < new_length) {
-            new (data_ + len, x)item_t;
-            ++len;
-          }
-        }
-        size_ = (int_size_t)new_length;
-      } else if (new_length > capacity_) {
-        if (trace) printf("case 2: growing dynarray beyond capacity_\n");
-        int_size_t new_capacity = ((int_size_t)new_length < size_ ? size_ : (int_size_t)new_length);
-
-        if (new_length == size_ + 1) {
-          // growing array by 1: round up to power of two.
-          new_capacity = capacity_ == 0 ? min_capacity : capacity_ * 2;
-          while (new_capacity < new_length) new_capacity *= 2;
-        }
-
-        reserve(new_capacity);
-
-        if (use_new_delete) {
-          // initialize the rest to default
-          for (int_size_t i = size_; i < new_length; ++i) {
-            new (data_ + i, x) item_t;
-          }
-        }
-
-        size_ = (int_size_t)new_length;
+      if (new_length > size_) {
+        grow(new_length);
+        items::construct(data_ + size_, new_length - size_);
       } else {
-        if (trace) printf("case 3: shrinking dynarray\n");
-
-        if (use_new_delete) {
-          int_size_t len = size_; // avoid aliases
-          while (len > new_length) {
-            --len;
-            data_[len].~item_t();
-          }
-        }
-        size_ = (int_size_t)new_length;
-        //if (size_ == 0) reset();
+        items::destroy(data_ + new_length, size_ - new_length);
       }
+      size_ = (int_size_t)new_length;
     }
 
     /// Reserve an amount of memory to use with this array.
     /// Use this before you start a loop with push_back calls, for example.
     void reserve(int_size_t new_capacity) {
-      if (new_capacity >= size_) {
-        dynarray_dummy_t x;
-        item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
-      
-        if (use_new_delete) {
-          // initialize new data_ elements from old ones
-          for (int_size_t i = 0; i != size_; ++i) {
-            new (new_data + i, x) item_t(data_[i]);
-            data_[i].~item_t();
-          }
-        }
+      if (new_capacity >= size_ && new_capacity != capacity_) {
+        item_t *new_data = new_capacity ? (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity) : 0;
+        items::relocate(new_data, data_, size_);
 
         // free up data_
         if (data_) {
@@ -244,20 +423,22 @@ namespace octet { namespace containers {
       }
     }
 
+    /// Free any memory not used by the items in the array.
+    void shrink_to_fit() {
+      reserve(size_);
+    }
+
     /// Shrink the size of the array by one.
     void pop_back() {
       assert(size_ != 0);
       size_--;
+      items::destroy(data_ + size_, 1);
     }
 
     /// Reset the array to zero size, freeing up the data.
     /// This is not the same as resize(0)
     void reset() {
-      if (use_new_delete) {
-        for (int_size_t i = 0; i != size_; ++i) {
-          data_[i].~item_t();
-        }
-      }
+      items::destroy(data_, size_);
       if (data_) {
         allocator_t::free(data_, capacity_ * sizeof(item_t));
       }
@@ -267,6 +448,188 @@ namespace octet { namespace containers {
     }
   };
 
+  template <class item_t, class allocator_t, bool use_new_delete> struct is_relocatable<dynarray<item_t, allocator_t, use_new_delete> > {
+    enum { value = 1 };
+  };
+
+  /// Dynamic array that keeps up to N items inside itself before using the heap.
+  ///
+  /// Use this for small temporary arrays, for example the inputs of a polygon
+  /// or the joints of a vertex, to avoid calls to the allocator.
+  ///
+  /// Example
+  ///
+  ///     small_dynarray<int, 8> indices;
+  ///     for (unsigned i = 0; i != num_sides; ++i) {
+  ///       indices.push_back(i); // no allocation unless num_sides > 8
+  ///     }
+  template <class item_t, unsigned N, class allocator_t=allocator> class small_dynarray {
+    typedef unsigned int_size_t;
+    typedef dynarray_items<item_t, true> items;
+
+    item_t *data_;
+    int_size_t size_;
+    int_size_t capacity_;
+
+    // space for N items, constructed on demand.
+    union storage_t {
+      double align_;
+      char bytes_[N * sizeof(item_t)];
+    } storage;
+
+    item_t *get_storage() {
+      return (item_t*)storage.bytes_;
+    }
+
+    bool is_small() const {
+      return data_ == (const item_t*)storage.bytes_;
+    }
+
+    void grow(size_t new_length) {
+      if (new_length > capacity_) {
+        int_size_t new_capacity = capacity_ * 2;
+        while (new_capacity < new_length) new_capacity *= 2;
+        reserve(new_capacity);
+      }
+    }
+
+    void init() {
+      data_ = get_storage();
+      size_ = 0;
+      capacity_ = N;
+    }
+
+    // do not define these.
+    small_dynarray(const small_dynarray &rhs);
+    void operator=(const small_dynarray &rhs);
+  public:
+    typedef item_t *iterator;
+    typedef const item_t *const_iterator;
+    typedef item_t value_type;
+
+    /// Create a new, empty array.
+    small_dynarray() {
+      init();
+    }
+
+    /// Create an array of a certain size.
+    small_dynarray(int_size_t size) {
+      init();
+      resize(size);
+    }
+
+    /// Destroy the array and its contents.
+    ~small_dynarray() {
+      reset();
+    }
+
+    iterator begin() { return data_; }
+    iterator end() { return data_ + size_; }
+    const_iterator begin() const { return data_; }
+    const_iterator end() const { return data_ + size_; }
+
+    /// Add an item at the back of the array.
+    void push_back(const item_t &new_item) {
+      emplace_back(new_item);
+    }
+
+    /// Move an item to the back of the array.
+    void push_back(item_t &&new_item) {
+      emplace_back(std::move(new_item));
+    }
+
+    /// Construct an item at the back of the array from constructor arguments.
+    template <class... args_t> item_t &emplace_back(args_t&&... args) {
+      // construct first in case the arguments refer to items in this array.
+      item_t tmp(std::forward<args_t>(args)...);
+      grow(size_ + 1);
+      dynarray_dummy_t x;
+      new (data_ + size_, x) item_t(std::move(tmp));
+      return data_[size_++];
+    }
+
+    /// Add copies of n items to the end of the array.
+    void append(const item_t *src, size_t n) {
+      grow(size_ + n);
+      items::copy(data_ + size_, src, n);
+      size_ += (int_size_t)n;
+    }
+
+    /// Erase an item; move subsequent items down to fill the gap.
+    void erase(unsigned elem) {
+      assert(elem < size_);
+      items::close_gap(data_, size_, elem, 1);
+      size_--;
+    }
+
+    /// Shrink the size of the array by one.
+    void pop_back() {
+      assert(size_ != 0);
+      size_--;
+      items::destroy(data_ + size_, 1);
+    }
+
+    /// Get the last element in the array.
+    item_t &back() const {
+      assert(size_);
+      return data_[size_-1];
+    }
+
+    /// Return true if the array is empty.
+    bool empty() const { return size_ == 0; }
+
+    /// Access an element in the array.
+    item_t &operator[](size_t elem) { return data_[elem]; }
+
+    /// Read an element in the array.
+    const item_t &operator[](size_t elem) const { return data_[elem]; }
+
+    /// Return number of elements in the array
+    int_size_t size() const { return size_; }
+
+    /// Return the number of elements in the array before we have to reallocate the memory
+    int_size_t capacity() const { return capacity_; }
+
+    /// Get a constant pointer to the first element of the array.
+    const item_t *data() const { return data_; }
+
+    /// Get a pointer to the first element of the array.
+    item_t *data() { return data_; }
+
+    /// Resize the array to make it bigger or smaller.
+    void resize(size_t new_length) {
+      if (new_length > size_) {
+        grow(new_length);
+        items::construct(data_ + size_, new_length - size_);
+      } else {
+        items::destroy(data_ + new_length, size_ - new_length);
+      }
+      size_ = (int_size_t)new_length;
+    }
+
+    /// Reserve space for new_capacity items. Arrays larger than N go on the heap.
+    void reserve(int_size_t new_capacity) {
+      if (new_capacity > capacity_) {
+        item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
+        items::relocate(new_data, data_, size_);
+        if (!is_small()) {
+          allocator_t::free(data_, capacity_ * sizeof(item_t));
+        }
+        data_ = new_data;
+        capacity_ = new_capacity;
+      }
+    }
+
+    /// Reset the array to zero size, freeing any heap memory.
+    void reset() {
+      items::destroy(data_, size_);
+      if (!is_small()) {
+        allocator_t::free(data_, capacity_ * sizeof(item_t));
+      }
+      init();
+    }
+  };
+
   inline void vformat(dynarray <char> &ary, const char *fmt, va_list v) {
     unsigned old_size = ary.size();
     #ifdef WIN32
@@ -303,4 +666,3 @@ namespace octet { namespace containers {
   }
 
 } }
-
@@ -11,16 +11,61 @@
 namespace octet { namespace containers {
 
   /// A support class for hash_map that is used to implement different kinds of key.
+  ///
+  /// Derive from this to hash your own key type, for example:
+  ///
+  ///     class vertex_cmp : public hash_map_cmp {
+  ///     public:
+  ///       static unsigned get_hash(const vertex &key) { return fuzz_hash(key.get_hash()); }
+  ///     };
   class hash_map_cmp {
   public:
-    // mix in some bits from higher positions to lower positions
-    static unsigned fuzz_hash(unsigned hash) { return hash ^ (hash >> 3) ^ (hash >> 5); }
+    /// mix the bits of a 32 bit hash so that every input bit affects every output bit.
+    static unsigned fuzz_hash(unsigned hash) {
+      hash ^= hash >> 16;
+      hash *= 0x85ebca6bu;
+      hash ^= hash >> 13;
+      hash *= 0xc2b2ae35u;
+      hash ^= hash >> 16;
+      return hash;
+    }
+
+    /// mix a 64 bit value down to a 32 bit hash.
+    static unsigned mix64(uint64_t key) {
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdull;
+      key ^= key >> 33;
+      key *= 0xc4ceb9fe1a85ec53ull;
+      key ^= key >> 33;
+      return (unsigned)key;
+    }
 
-    static unsigned get_hash(void *key) { return fuzz_hash((unsigned)(intptr_t)key); }
+    /// hash a block of bytes eight at a time, in the style of xxHash64.
+    static unsigned hash_bytes(const void *bytes, size_t size) {
+      const uint64_t prime1 = 0x9e3779b185ebca87ull, prime2 = 0xc2b2ae3d27d4eb4full;
+      const uint8_t *src = (const uint8_t*)bytes;
+      uint64_t acc = 0x27d4eb2f165667c5ull + size;
+      for (; size >= 8; size -= 8, src += 8) {
+        uint64_t lane;
+        memcpy(&lane, src, 8);
+        acc += lane * prime2;
+        acc = (acc << 31 | acc >> 33) * prime1;
+      }
+      if (size) {
+        uint64_t lane = 0;
+        memcpy(&lane, src, size);
+        acc += lane * prime2;
+        acc = (acc << 31 | acc >> 33) * prime1;
+      }
+      return mix64(acc);
+    }
+
+    static unsigned get_hash(void *key) { return mix64((uint64_t)(uintptr_t)key); }
     static unsigned get_hash(int key) { return fuzz_hash((unsigned)key); }
     static unsigned get_hash(unsigned key) { return fuzz_hash((unsigned)key); }
-    static unsigned get_hash(uint64_t key) { return fuzz_hash((unsigned)(key ^ (key >> 32))); }
+    static unsigned get_hash(uint64_t key) { return mix64(key); }
 
+    // deprecated: hash_map no longer reserves an "empty" key value; zero keys are allowed.
     static bool is_empty(void *key) { return !key; }
     static bool is_empty(int key) { return !key; }
     static bool is_empty(unsigned key) { return !key; }
@@ -29,11 +74,92 @@ namespace octet { namespace containers {
     //template <typename T> static bool equals(const T &lhs, const T &rhs) { return lhs == rhs; }
   };
 
+  /// Control bytes shared by hash_map and dictionary.
+  ///
+  /// Each slot has a control byte: ctrl_empty or the top seven bits of the hash of its key.
+  /// A probe compares sixteen control bytes at a time and only touches the entries
+  /// whose bytes match. The first group_size bytes are repeated after the end so that
+  /// a group can be read from any slot without wrapping.
+  ///
+  /// Probing is linear, so erase() moves later entries back rather than leaving tombstones.
+  class hash_map_ctrl {
+  public:
+    enum {
+      group_size = 16,
+      ctrl_empty = 0x80,
+    };
+
+    static uint8_t get_h2(unsigned hash) {
+      return (uint8_t)(hash >> 25);
+    }
+
+    // move the top bit of each byte to the bottom eight bits.
+    static unsigned gather(uint64_t highs) {
+      return (unsigned)((highs * 0x0002040810204081ull) >> 56);
+    }
+
+    /// bit i is set if byte i of the group equals value.
+    static unsigned match(const uint8_t *group, uint8_t value) {
+      #if OCTET_SSE
+        __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+        return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)value)));
+      #else
+        // eight bytes at a time. bytes that do not match may be reported after one that does,
+        // but callers check the keys anyway.
+        uint64_t lo, hi;
+        memcpy(&lo, group, 8);
+        memcpy(&hi, group + 8, 8);
+        const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+        if (value & 0x80) {
+          // ctrl_empty is the only byte with the top bit set.
+          return gather(lo & highs) | gather(hi & highs) << 8;
+        }
+        lo ^= ones * value;
+        hi ^= ones * value;
+        return gather((lo - ones) & ~lo & highs) | gather((hi - ones) & ~hi & highs) << 8;
+      #endif
+    }
+
+    /// index of the lowest set bit; mask must not be zero.
+    static unsigned lowest_bit(unsigned mask) {
+      #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (unsigned)index;
+      #else
+        return (unsigned)__builtin_ctz(mask);
+      #endif
+    }
+
+    /// number of control bytes to allocate for a table.
+    static unsigned get_ctrl_size(unsigned max_entries) {
+      return max_entries + group_size;
+    }
+
+    /// set a control byte and its copies past the end.
+    static void set(uint8_t *ctrl, unsigned max_entries, unsigned index, uint8_t value) {
+      ctrl[index] = value;
+      for (unsigned i = max_entries + index; i < max_entries + group_size; i += max_entries) {
+        ctrl[i] = value;
+      }
+    }
+
+    /// smallest power of two table that holds num_entries within the load limit.
+    static unsigned get_table_size(unsigned num_entries) {
+      unsigned max_entries = 4;
+      while (num_entries > max_entries * 3 / 4) {
+        max_entries *= 2;
+      }
+      return max_entries;
+    }
+  };
+
   /// A map fom a key type to an object type.
   ///
   /// Do not use for strings, use %dictionary instead.
   ///
   /// A hash map is like a dictionary in JavaScript or Python, but works with only one type of key and value.
+  /// Any key value may be used, including zero. New values are zero filled.
   ///
   /// Example:
   ///
@@ -43,62 +169,96 @@ namespace octet { namespace containers {
   ///     printf("[5]=%d [9]=%d\n", int_to_int[5], int_to_int[9]);
   ///
   ///     for (unsigned i = 0; i != int_to_int.size(); ++i) {
-  ///       printf("key=d value=%d\n", int_to_int.get_key(i), int_to_int.get_value(i));
+  ///       if (int_to_int.is_used(i)) {
+  ///         printf("key=d value=%d\n", int_to_int.get_key(i), int_to_int.get_value(i));
+  ///       }
   ///     }
   template <typename key_t, typename value_t, class cmp_t=hash_map_cmp, class allocator_t=allocator> class hash_map {
     // internal gubbins to implement the hash map
     struct entry_t { key_t key; unsigned hash; value_t value; };
 
     entry_t *entries;
+    uint8_t *ctrl;
     unsigned num_entries;
     unsigned max_entries;
 
-    // internal method to find an existing key in the map
-    entry_t *find( const key_t &key, unsigned hash ) {
+    // internal method to find an existing key in the map or the empty slot where it would go.
+    unsigned find( const key_t &key, unsigned hash ) const {
       unsigned mask = max_entries - 1;
-      for (unsigned i = 0; i != max_entries; ++i) {
-        entry_t *entry = &entries[ ( i + hash ) & mask ];
-        if (cmp_t::is_empty(entry->key)) {
-          return entry;
+      uint8_t h2 = hash_map_ctrl::get_h2(hash);
+      unsigned pos = hash & mask;
+      for (;;) {
+        const uint8_t *group = ctrl + pos;
+        unsigned empty = hash_map_ctrl::match(group, hash_map_ctrl::ctrl_empty);
+
+        // with linear probing, the key can not be beyond the first empty slot.
+        unsigned limit = empty ? (empty & (0u - empty)) - 1 : 0xffffffffu;
+        for (unsigned found = hash_map_ctrl::match(group, h2) & limit; found; found &= found - 1) {
+          unsigned index = (pos + hash_map_ctrl::lowest_bit(found)) & mask;
+          const entry_t *entry = &entries[index];
+          if (entry->hash == hash && entry->key == key) {
+            return index;
+          }
         }
-        if (entry->hash == hash && entry->key == key) {
-          return entry;
+
+        if (empty) {
+          return (pos + hash_map_ctrl::lowest_bit(empty)) & mask;
         }
+        pos = (pos + hash_map_ctrl::group_size) & mask;
       }
-      assert(0 && "hash_map: all entries are used. expand() did not get called");
-      return 0;
     }
-  
-    // increase the size of the map if we have run out of space
-    void expand() {
+
+    bool is_used_slot(unsigned index) const {
+      return ctrl[index] != hash_map_ctrl::ctrl_empty;
+    }
+
+    // make a new table and move the entries into it.
+    void resize_table(unsigned new_max_entries) {
       entry_t *old_entries = entries;
+      uint8_t *old_ctrl = ctrl;
       unsigned old_max_entries = max_entries;
-      entries = (entry_t *)allocator_t::malloc(sizeof(entry_t) * max_entries*2);
-      memset(entries, 0, sizeof(entry_t) * max_entries*2);
-      max_entries *= 2;
+
+      max_entries = new_max_entries;
+      entries = (entry_t *)allocator_t::malloc(sizeof(entry_t) * max_entries);
+      memset(entries, 0, sizeof(entry_t) * max_entries);
+      ctrl = (uint8_t *)allocator_t::malloc(hash_map_ctrl::get_ctrl_size(max_entries));
+      memset(ctrl, hash_map_ctrl::ctrl_empty, hash_map_ctrl::get_ctrl_size(max_entries));
+
       for (unsigned i = 0; i != old_max_entries; ++i) {
-        entry_t *old_entry = &old_entries[i];
-        if (!cmp_t::is_empty(old_entry->key)) {
-          entry_t *new_entry = find(old_entry->key, old_entry->hash);
-          *new_entry = *old_entry;
+        if (old_ctrl[i] != hash_map_ctrl::ctrl_empty) {
+          entry_t *old_entry = &old_entries[i];
+          unsigned index = find(old_entry->key, old_entry->hash);
+          memcpy((void*)&entries[index], (void*)old_entry, sizeof(entry_t));
+          hash_map_ctrl::set(ctrl, max_entries, index, old_ctrl[i]);
         }
       }
-      allocator_t::free(old_entries, sizeof(entry_t) * old_max_entries);
+
+      if (old_entries) {
+        allocator_t::free(old_entries, sizeof(entry_t) * old_max_entries);
+        allocator_t::free(old_ctrl, hash_map_ctrl::get_ctrl_size(old_max_entries));
+      }
     }
 
     void release() {
       allocator_t::free(entries, sizeof(entry_t) * max_entries);
+      allocator_t::free(ctrl, hash_map_ctrl::get_ctrl_size(max_entries));
       entries = 0;
+      ctrl = 0;
       num_entries = 0;
       max_entries = 0;
     }
 
     void init() {
+      entries = 0;
+      ctrl = 0;
       num_entries = 0;
-      max_entries = 4;
-      entries = (entry_t*)allocator_t::malloc(sizeof(entry_t) * max_entries);
-      memset(entries, 0, sizeof(entry_t) * max_entries);
+      max_entries = 0;
+      resize_table(4);
     }
+
+    // do not define these.
+    hash_map(const hash_map &rhs);
+    void operator=(const hash_map &rhs);
   public:
     // Create an empty map.
     hash_map() {
@@ -110,39 +270,92 @@ namespace octet { namespace containers {
       release();
       init();
     }
-  
+
+    /// Make room for num_entries keys so that the map does not grow while they are added.
+    void reserve(unsigned num_entries) {
+      unsigned new_max_entries = hash_map_ctrl::get_table_size(num_entries);
+      if (new_max_entries > max_entries) {
+        resize_table(new_max_entries);
+      }
+    }
+
+    /// Rebuild the table with at least min_entries slots (rounded up to a power of two).
+    /// The table will not shrink below what the current keys need; rehash(0) shrinks to fit.
+    void rehash(unsigned min_entries) {
+      unsigned new_max_entries = hash_map_ctrl::get_table_size(num_entries);
+      while (new_max_entries < min_entries) {
+        new_max_entries *= 2;
+      }
+      resize_table(new_max_entries);
+    }
+
     /// Access the map by key
     value_t &operator[]( const key_t &key ) {
       unsigned hash = cmp_t::get_hash(key);
-      entry_t *entry = find( key, hash );
-      if (cmp_t::is_empty(entry->key)) {
+      unsigned index = find( key, hash );
+      if (!is_used_slot(index)) {
         // reducing this ratio decreases hot search time at the
         // expense of size (cold search time).
         if (num_entries >= max_entries * 3 / 4) {
-          expand();
-          entry = find(key, hash);
+          resize_table(max_entries * 2);
+          index = find(key, hash);
         }
         num_entries++;
-        entry->key = key;
-        entry->hash = hash;
+        entries[index].key = key;
+        entries[index].hash = hash;
+        hash_map_ctrl::set(ctrl, max_entries, index, hash_map_ctrl::get_h2(hash));
       }
-      return entry->value;
+      return entries[index].value;
     }
 
     /// Does the map have this key?
-    bool contains(const key_t &key) {
+    bool contains(const key_t &key) const {
+      unsigned hash = cmp_t::get_hash(key);
+      return is_used_slot(find( key, hash ));
+    }
+
+    /// Remove a key and its value. Returns false if the key was not in the map.
+    ///
+    /// Indices of other keys may change.
+    bool erase(const key_t &key) {
       unsigned hash = cmp_t::get_hash(key);
-      entry_t *entry = find( key, hash );
-      return !cmp_t::is_empty(entry->key);
+      unsigned hole = find( key, hash );
+      if (!is_used_slot(hole)) {
+        return false;
+      }
+
+      entries[hole].value.~value_t();
+      num_entries--;
+
+      // move later entries of the run back into the hole if that is nearer their home slot.
+      unsigned mask = max_entries - 1;
+      for (unsigned index = (hole + 1) & mask; is_used_slot(index); index = (index + 1) & mask) {
+        unsigned home = entries[index].hash & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+          memcpy((void*)&entries[hole], (void*)&entries[index], sizeof(entry_t));
+          hash_map_ctrl::set(ctrl, max_entries, hole, ctrl[index]);
+          hole = index;
+        }
+      }
+
+      memset((void*)&entries[hole], 0, sizeof(entry_t));
+      hash_map_ctrl::set(ctrl, max_entries, hole, hash_map_ctrl::ctrl_empty);
+      return true;
     }
 
-    /// Get an integer that represents the position in the map of this key.
+    /// Get an integer that represents the position in the map of this key or -1 if it is not there.
     ///
-    /// Note: only valid if the map does not change size.
-    int get_index(const key_t &key) {
+    /// Note: only valid if the map does not change.
+    int get_index(const key_t &key) const {
       unsigned hash = cmp_t::get_hash(key);
-      entry_t *entry = find( key, hash );
-      return entry ? (int)(entry - entries) : -1;
+      unsigned index = find( key, hash );
+      return is_used_slot(index) ? (int)index : -1;
+    }
+
+    /// Is there a key at this index?
+    bool is_used(int index) const {
+      assert((unsigned)index < max_entries);
+      return is_used_slot((unsigned)index);
     }
 
     /// For a specfic index, get the key.
@@ -159,19 +372,28 @@ namespace octet { namespace containers {
       return entries[index].value;
     }
 
+    /// For a specific index, get the value
+    value_t &get_value(int index) {
+      assert((unsigned)index < max_entries);
+      return entries[index].value;
+    }
+
     /// bye bye hash map
     ~hash_map() {
-      allocator_t::free(entries, sizeof(entry_t) * max_entries);
-      entries = 0;
-      num_entries = 0;
-      max_entries = 0;
+      release();
     }
 
     /// Get the maximum number of keys and values in the map.
     ///
     /// Used for iteration.
-    unsigned size() { return max_entries; }
-    
+    unsigned size() const { return max_entries; }
+
+    /// Get the number of keys in the map.
+    unsigned get_size() const { return num_entries; }
+
+    /// Get the maximum number of keys and values in the map, for iteration.
+    unsigned get_num_indices() const { return max_entries; }
+
     //key_t key(unsigned i) { return entries[i].key; }
     //value_t value(unsigned i) { return entries[i].value; }
   };
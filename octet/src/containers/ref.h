@@ -90,4 +90,9 @@ namespace octet { namespace containers {
       item = 0;
     }
   };
+
+  /// ref is a single pointer, so dynarray can move it with memcpy.
+  template <class item_t> struct is_relocatable<ref<item_t> > {
+    enum { value = 1 };
+  };
 } }
@@ -24,15 +24,32 @@ namespace octet { namespace containers {
   class string {
     char *data_;
 
+    // bytes allocated for data_. The allocator needs this to free it, and
+    // strlen(data_) is shorter if the string has a zero in it.
+    unsigned alloc_size;
+
     static char *null_string() { static char c; return &c; }
 
     void release() {
       if (data_ != null_string()) {
-        allocator::free((void*)data_, size() + 1);
+        allocator::free((void*)data_, alloc_size);
         data_ = null_string();
+        alloc_size = 0;
       }
     }
 
+    // data_ must be the null string.
+    void allocate(size_t bytes) {
+      data_ = (char*)allocator::malloc(bytes);
+      alloc_size = (unsigned)bytes;
+    }
+
+    // grow or shrink data_, which must not be the null string.
+    void reallocate(size_t bytes) {
+      data_ = (char*)allocator::realloc(data_, alloc_size, bytes);
+      alloc_size = (unsigned)bytes;
+    }
+
     // When dealing with windows or java, we will come across the less popular
     // utf16 encoding scheme. All other sources of text will likely be in UTF8, ANSI or shift-JIS
     // We use UTF8 internally as it is compact and popular.
@@ -145,19 +162,19 @@ namespace octet { namespace containers {
     }
   public:
     /// Default constructor: empty string.
-    string() { data_ = null_string(); }
+    string() { data_ = null_string(); alloc_size = 0; }
 
     /// Copy a UTF8 C string
-    string(const char *value) { data_ = null_string(); *this = value; }
+    string(const char *value) { data_ = null_string(); alloc_size = 0; *this = value; }
     
     /// Copy of a UFT16 C string
-    string(const wchar_t *value) { data_ = null_string(); *this = value; }
+    string(const wchar_t *value) { data_ = null_string(); alloc_size = 0; *this = value; }
     
     /// Copy of another string
-    string(const string& rhs) { data_ = null_string(); *this = rhs.c_str(); }
+    string(const string& rhs) { data_ = null_string(); alloc_size = 0; *this = rhs.c_str(); }
     
     /// Copy of a substring
-    string(const char *value, unsigned size) { data_ = null_string(); set(value, size); }
+    string(const char *value, unsigned size) { data_ = null_string(); alloc_size = 0; set(value, size); }
 
     /// Free up memory used by the string.
     ~string() { release(); }
@@ -191,10 +208,10 @@ namespace octet { namespace containers {
         int len = _vscprintf(fmt, v);
         if (len) {
           if (cur_len) {
-            data_ = (char*)allocator::realloc(data_, cur_len+1, cur_len + len + 1);
+            reallocate(cur_len + len + 1);
             vsprintf_s(data_ + cur_len, len+1, fmt, v);
           } else {
-            data_ = (char*)allocator::malloc(len+1);
+            allocate(len+1);
             vsprintf_s(data_, len+1, fmt, v);
           }
         }
@@ -211,7 +228,7 @@ namespace octet { namespace containers {
       if (value) {
         unsigned size = urldecode_impl(0, value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          allocate(size+1);
           urldecode_impl(data_, value);
         }
       }
@@ -224,7 +241,7 @@ namespace octet { namespace containers {
       if (value) {
         unsigned size = urlencode_impl(0, value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          allocate(size+1);
           urlencode_impl(data_, value);
         }
       }
@@ -237,7 +254,7 @@ namespace octet { namespace containers {
       if (value) {
         size_t size = strlen(value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          allocate(size+1);
           memcpy((char*)data_, value, size+1);
         }
       }
@@ -250,7 +267,7 @@ namespace octet { namespace containers {
       if (value) {
         unsigned size = utf16_to_utf8(0, value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          allocate(size+1);
           utf16_to_utf8(data_, value);
         }
       }
@@ -258,14 +275,14 @@ namespace octet { namespace containers {
     }
 
     /// copy another string
-    string &operator=(const string& rhs) { data_ = null_string(); *this = rhs.c_str(); return *this; }
+    string &operator=(const string& rhs) { if (&rhs != this) *this = rhs.c_str(); return *this; }
 
     /// copy a substring
     string &set(const char *value, unsigned size) {
       release();
       if (value) {
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          allocate(size+1);
           memcpy((char*)data_, value, size);
           data_[size] = 0;
         }
@@ -278,9 +295,9 @@ namespace octet { namespace containers {
       int size = (int)strlen(data_);
       if (new_len < size) {
         if (data_ == null_string()) {
-          data_ = (char*)allocator::malloc(new_len+1);
+          allocate(new_len+1);
         } else {
-          data_ = (char*)allocator::realloc((void*)data_, size+1, new_len+1);
+          reallocate(new_len+1);
         }
         data_[new_len] = 0;
       }
@@ -302,9 +319,9 @@ namespace octet { namespace containers {
         size_t data_size = strlen(data_);
         size_t rhs_size = strlen(rhs);
         if (data_ == null_string()) {
-          data_ = (char*)allocator::malloc(data_size+rhs_size+1);
+          allocate(data_size+rhs_size+1);
         } else {
-          data_ = (char*)allocator::realloc(data_, data_size + 1, data_size+rhs_size+1);
+          reallocate(data_size+rhs_size+1);
         }
         memcpy(data_ + data_size, rhs, rhs_size+1);
       }
@@ -322,6 +339,7 @@ namespace octet { namespace containers {
         memcpy(new_data + pos + rhs_size, data_, data_size - pos + 1);
         release();
         data_ = new_data;
+        alloc_size = (unsigned)(data_size+rhs_size+1);
       }
       return *this;
     }
@@ -408,4 +426,9 @@ namespace octet { namespace containers {
       return size() == 0;
     }
   };
+
+  /// string only points to its data, so dynarray can move it with memcpy.
+  template <> struct is_relocatable<string> {
+    enum { value = 1 };
+  };
 } }
@@ -20,12 +20,12 @@ namespace octet {
     void app_init() {
       app_scene =  new visual_scene();
 
+      // the first run writes a cooked copy of the duck which later runs load quickly.
       resource_dict dict;
-      if (!loader.load_xml("assets/duck_triangulate.dae")) {
+      if (!loader.load_cooked("assets/duck_triangulate.dae", dict)) {
         // failed to load file
         return;
       }
-      loader.get_resources(dict);
 
       dynarray<resource*> meshes;
       dict.find_all(meshes, atom_mesh);
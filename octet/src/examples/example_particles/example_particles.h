@@ -47,15 +47,13 @@ namespace octet {
       p.uv_bottom_left = vec2p(0, 1);
       p.uv_top_right = vec2p(0.125f, 1-0.125f);
       p.enabled = true;
-      int pidx = system->add_billboard_particle(p);
 
       mesh_particle_system::particle_animator pa;
       memset(&pa, 0, sizeof(pa));
-      pa.link = pidx;
       pa.acceleration = vec3p(0, -9.8f, 0);
       pa.vel = vec3p(r.get(-3.0f, 3.0f), r.get(5.0f, 15.0f), 0.0f);
       pa.lifetime = 50;
-      system->add_particle_animator(pa);
+      system->add_billboard_particle(p, pa);
 
       system->set_cameraToWorld(ci->get_node()->calcModelToWorld());
       system->animate(1.0f/30);
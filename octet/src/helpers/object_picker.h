@@ -11,8 +11,11 @@ namespace octet { namespace helpers {
   class object_picker {
     app *the_app;
     dynarray<ref<mesh_instance> > objects;
+    visual_scene::cast_result picked;
   public:
     object_picker() {
+      the_app = 0;
+      picked.mi = 0;
     }
 
     void init(app *the_app) {
@@ -20,7 +23,8 @@ namespace octet { namespace helpers {
     }
 
     void update(visual_scene *the_scene) {
-      bool is_mouse_down = the_app->is_key_down(key_lmb);
+      // only cast when the button goes down, not every frame it is held.
+      bool is_mouse_down = the_app->is_key_going_down(key_lmb);
       if (is_mouse_down) {
         int mx = 0, my = 0;
         int vx = 0, vy = 0;
@@ -37,12 +41,16 @@ namespace octet { namespace helpers {
         ray the_ray = cam->get_ray(x, y);
         //the_scene->add_debug_line(the_ray.get_start(), the_ray.get_end());
 
-        visual_scene::cast_result res;
-        the_scene->cast_ray(res, the_ray);
-        if (res.mi) {
-          //printf("%s\n", res.depth.toString());
+        the_scene->cast_ray(picked, the_ray);
+        if (picked.mi) {
+          //printf("%s\n", picked.depth.toString());
         }
       }
     }
+
+    /// The result of the last pick; picked.mi is NULL if nothing was hit.
+    const visual_scene::cast_result &get_picked() const {
+      return picked;
+    }
   };
 }}
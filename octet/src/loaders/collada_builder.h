@@ -27,49 +27,171 @@ namespace octet { namespace loaders {
     // 0 = none, 1 = summary, 2 = details
     enum { debug = 0 };
 
-    TiXmlDocument doc;
+    // the file stays mapped while we build; the document refers to its text.
+    file_view source;
+    xml_document doc;
     string doc_path;
-    dictionary<TiXmlElement *, allocator> ids;
+
+    // ids are indexed the first time one is looked up.
+    dictionary<xml_element *, allocator> ids;
+    bool ids_indexed;
     dynarray<float> temp_floats;
 
+    // animation keys are dropped if interpolation stays within this fraction of the channel's range.
+    float anim_tolerance;
+
+    // a cooked file is this header followed by the resources written by binary_writer.
+    struct cooked_header {
+      char magic[8];
+      uint32_t version;
+      float anim_tolerance;
+      uint64_t source_size;
+      uint64_t source_time;
+      uint64_t source_hash;
+    };
+
+    // change this when the cooked resources change.
+    enum { cooked_version = 2 };
+
+    // FNV-1a hash of a file, eight bytes at a time.
+    static uint64_t hash_file(const char *path) {
+      file_map map(path, file_map::advice_sequential);
+      const uint8_t *src = map.get_data();
+      const uint8_t *src_max = src + map.get_size();
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (; src_max - src >= 8; src += 8) {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+      }
+      for (; src != src_max; ++src) {
+        hash = (hash ^ *src) * 0x100000001b3ull;
+      }
+      return hash;
+    }
+
+    // read resources from a cooked file if it was made from this version of the collada file.
+    bool read_cooked(const char *cooked_path, const char *path, uint64_t source_size, uint64_t source_time, resource_dict &dict) {
+      cooked_header hdr;
+      bool new_time = false;
+      {
+        file_map cooked(cooked_path, file_map::advice_sequential);
+        const uint8_t *src = cooked.get_data();
+        if (!src || cooked.get_size() < sizeof(hdr)) return false;
+
+        memcpy(&hdr, src, sizeof(hdr));
+        if (
+          memcmp(hdr.magic, "octetdae", 8) || hdr.version != cooked_version ||
+          hdr.anim_tolerance != anim_tolerance || hdr.source_size != source_size
+        ) {
+          return false;
+        }
+
+        // a new timestamp with the same contents (eg. after a checkout) is still good.
+        if (hdr.source_time != source_time) {
+          if (hash_file(path) != hdr.source_hash) return false;
+          new_time = true;
+        }
+
+        resource_dict cooked_dict;
+        binary_reader reader(src + sizeof(hdr), src + cooked.get_size());
+        cooked_dict.visit(reader);
+        if (reader.get_error()) {
+          printf("warning: %s is damaged\n", cooked_path);
+          return false;
+        }
+        dict.add_resources(cooked_dict);
+      }
+
+      // save hashing the file next time.
+      if (new_time) {
+        hdr.source_time = source_time;
+        FILE *file = fopen(cooked_path, "r+b");
+        if (file) {
+          fwrite(&hdr, 1, sizeof(hdr), file);
+          fclose(file);
+        }
+      }
+      return true;
+    }
+
+    // write resources to a cooked file. A temporary file is renamed so that readers never see half a file.
+    void write_cooked(const char *cooked_path, const char *path, uint64_t source_size, uint64_t source_time, resource_dict &dict) {
+      cooked_header hdr;
+      memcpy(hdr.magic, "octetdae", 8);
+      hdr.version = cooked_version;
+      hdr.anim_tolerance = anim_tolerance;
+      hdr.source_size = source_size;
+      hdr.source_time = source_time;
+      hdr.source_hash = hash_file(path);
+
+      string tmp_path;
+      tmp_path.format("%s.tmp", cooked_path);
+      FILE *file = fopen(tmp_path, "wb");
+      if (!file) {
+        printf("warning: can not write %s\n", tmp_path.c_str());
+        return;
+      }
+
+      fwrite(&hdr, 1, sizeof(hdr), file);
+      bool ok = false;
+      {
+        binary_writer writer(file);
+        dict.visit(writer);
+        ok = !writer.get_error();
+      }
+      ok = !ferror(file) && ok;
+      fclose(file);
+
+      remove(cooked_path);
+      if (!ok || rename(tmp_path, cooked_path)) {
+        remove(tmp_path);
+      }
+    }
+
     // find all the ids in an xml file
-    void find_ids(TiXmlElement *parent) {
-      for (TiXmlElement *elem = parent->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
-        const char *attrib = elem->Attribute("id");
+    void find_ids(xml_element *parent) {
+      for (xml_element *elem = parent->first_child(); elem; elem = elem->next_sibling()) {
+        const char *attrib = elem->get_attribute("id");
         if (attrib) {
-          //printf("%s %s\n", elem->Value(), attrib);
+          //printf("%s %s\n", elem->get_name(), attrib);
           ids[attrib] = elem;
         }
         find_ids(elem);
       }
     }
 
-    TiXmlElement *find_id(const char *source) {
-      if (source) {
-        if (source[0] == '#') source++;
-        return ids[source];
+    xml_element *find_id(const char *id) {
+      if (!ids_indexed && doc.get_root()) {
+        find_ids(doc.get_root());
+        ids_indexed = true;
+      }
+      if (id) {
+        if (id[0] == '#') id++;
+        int index = ids.get_index(id);
+        return index == -1 ? 0 : ids.get_value(index);
       }
       return 0;
     }
 
-    TiXmlElement *child(TiXmlElement *parent, const char *value) {
-      return parent ? parent->FirstChildElement(value) : NULL;
+    xml_element *child(xml_element *parent, const char *value) {
+      return parent ? parent->first_child(value) : NULL;
     }
 
-    TiXmlElement *sibling(TiXmlElement *element, const char *value) {
-      return element ? element->NextSiblingElement(value) : NULL;
+    xml_element *sibling(xml_element *element, const char *value) {
+      return element ? element->next_sibling(value) : NULL;
     }
 
-    const char *attr(TiXmlElement *parent, const char *value) {
-      return parent ? parent->Attribute(value) : NULL;
+    const char *attr(xml_element *parent, const char *value) {
+      return parent ? parent->get_attribute(value) : NULL;
     }
 
-    const char *text(TiXmlElement *parent) {
-      return parent ? parent->GetText() : NULL;
+    const char *text(xml_element *parent) {
+      return parent ? parent->get_text() : NULL;
     }
 
-    const char *value(TiXmlElement *parent) {
-      return parent ? parent->Value() : NULL;
+    const char *value(xml_element *parent) {
+      return parent ? parent->get_name() : NULL;
     }
 
     int semantic_to_attr(const char *semantic, const char *set) {
@@ -100,50 +222,18 @@ namespace octet { namespace loaders {
       return 8;
     }
 
-    // convert a string like "1.2 3.4 43.12" into an array of float values
-    void atofv(dynarray<float> &values, const char *src) {  
+    // convert the text of an element like "1.2 3.4 43.12" into an array of float values.
+    // the text is parsed where it is in the file.
+    void atofv(dynarray<float> &values, xml_element *elem) {
       values.resize(0);
-      if (!src) return;
-
-      while (*src > 0 && *src <= ' ') ++src;
-      while(*src != 0) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
-        }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
-        }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
-      }
+      if (!elem) return;
+      xml_pull_parser::parse_floats(values, elem->get_text_begin(), elem->get_text_end());
     }
 
-    // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, const char *src) {  
-      //values.resize(0);
-      if (!src) return;
-
-      while (*src > 0 && *src <= ' ') ++src;
-      while(*src != 0) {
-        int whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (*src > 0 && *src <= ' ') ++src;
-      }
+    // convert the text of an element like "1 3 9 12 34" to an array of integers, adding to values.
+    void atoiv(dynarray<int> &values, xml_element *elem) {
+      if (!elem) return;
+      xml_pull_parser::parse_ints(values, elem->get_text_begin(), elem->get_text_end());
     }
 
     // convert an ascii sequence of integers like "fred bert harry" into an array of strings
@@ -200,54 +290,54 @@ namespace octet { namespace loaders {
     };
 
     // parse and <input> tag
-    void parse_input(parse_input_state &state, TiXmlElement *input) {
-      const char *source = input->Attribute("source");
-      const char *semantic = input->Attribute("semantic");
-      const char *set = input->Attribute("set");
+    void parse_input(parse_input_state &state, xml_element *input) {
+      const char *source = input->get_attribute("source");
+      const char *semantic = input->get_attribute("semantic");
+      const char *set = input->get_attribute("set");
 
       if (!source || !semantic) {
         printf("warning: bad input\n");
         return;
       }
 
-      TiXmlElement *source_elem = source ? find_id(source) : 0;
+      xml_element *source_elem = source ? find_id(source) : 0;
       if (!source_elem) {
         printf("warning: source not found\n");
         return;
       }
 
-      TiXmlElement *input2 = child(source_elem, "input");
+      xml_element *input2 = child(source_elem, "input");
       if (input2) {
         // recursive <input> tag:; includes other inputs
-        for (;input2 != 0; input2 = input2->NextSiblingElement("input")) {
+        for (;input2 != 0; input2 = input2->next_sibling("input")) {
           parse_input(state, input2);
         }
         return;
       }
 
-      if (strcmp(source_elem->Value(), "source")) {
+      if (strcmp(source_elem->get_name(), "source")) {
         printf("warning: source not found\n");
         return;
       }
 
-      TiXmlElement *tc = child(source_elem, "technique_common");
+      xml_element *tc = child(source_elem, "technique_common");
       if (!tc) {
         printf("warning: no technique_common\n");
         return;
       }
 
-      TiXmlElement *accessor = child(tc, "accessor");
+      xml_element *accessor = child(tc, "accessor");
       if (!accessor) {
         printf("warning: no accessor\n");
         return;
       }
 
-      const char *accessor_source = accessor->Attribute("source");
-      const char *accessor_offset = accessor->Attribute("offset");
-      const char *accessor_stride = accessor->Attribute("stride");
+      const char *accessor_source = accessor->get_attribute("source");
+      const char *accessor_offset = accessor->get_attribute("offset");
+      const char *accessor_stride = accessor->get_attribute("stride");
       int accessor_offset_int = accessor_offset ? atoi(accessor_offset) : 0;
       int accessor_stride_int = accessor_stride ? atoi(accessor_stride) : 0;
-      TiXmlElement *accessor_source_elem = accessor_source ? find_id(accessor_source) : 0;
+      xml_element *accessor_source_elem = accessor_source ? find_id(accessor_source) : 0;
 
       if (!accessor_source_elem || accessor_stride_int == 0) {
         printf("warning: bad or no accessor source\n");
@@ -257,14 +347,14 @@ namespace octet { namespace loaders {
       unsigned size = 0;
       const char *param_type = 0;
       for (
-        TiXmlElement *param = child(accessor, "param");
+        xml_element *param = child(accessor, "param");
         param != 0;
-        param = param->NextSiblingElement("param")
+        param = param->next_sibling("param")
       ) {
-        const char *param_name = param->Attribute("name");
+        const char *param_name = param->get_attribute("name");
 
         if (param_name) {
-          param_type = param->Attribute("type");
+          param_type = param->get_attribute("type");
           size++;
         } else {
           accessor_offset_int++;
@@ -298,8 +388,8 @@ namespace octet { namespace loaders {
         state.attr_offset += size;
       } else if (state.pass == 2) {
         dynarray<float> accessor_floats;
-        if (!strcmp(accessor_source_elem->Value(), "float_array")) {
-          atofv(accessor_floats, accessor_source_elem->GetText());
+        if (!strcmp(accessor_source_elem->get_name(), "float_array")) {
+          atofv(accessor_floats, accessor_source_elem);
         }
 
         // attribute building pass
@@ -338,7 +428,7 @@ namespace octet { namespace loaders {
           }
         } else if (!strcmp(semantic, "WEIGHT")) {
           dynarray<float> accessor_floats;
-          atofv(accessor_floats, accessor_source_elem->GetText());
+          atofv(accessor_floats, accessor_source_elem);
           assert(state.skinst->raw_weights.size() >= num_vertices);
           for (unsigned i = 0; i != num_vertices; ++i) {
             unsigned index = state.p[i * state.input_stride + state.input_offset];
@@ -350,28 +440,28 @@ namespace octet { namespace loaders {
     }
 
     // effects use "newparam" tags to store samplers and textures
-    TiXmlElement *find_param(TiXmlElement *profile_COMMON, const char *sid, const char *child_name) {
+    xml_element *find_param(xml_element *profile_COMMON, const char *sid, const char *child_name) {
       if (!sid) return NULL;
 
       for (
-        TiXmlElement *new_param = child(profile_COMMON, "newparam");
-        new_param; new_param = new_param->NextSiblingElement("newparam")
+        xml_element *new_param = child(profile_COMMON, "newparam");
+        new_param; new_param = new_param->next_sibling("newparam")
       ) {
-        const char *sid_param = new_param->Attribute("sid");
+        const char *sid_param = new_param->get_attribute("sid");
         if (sid_param && !strcmp(sid_param, sid)) {
-          return new_param->FirstChildElement(child_name);
+          return new_param->first_child(child_name);
         }
       }
       return NULL;
     }
 
     // get a texture or a solid colour
-    param *get_param(param_buffer_info &pbi, GLint &texture_slot, resource_dict &dict, TiXmlElement *shader, TiXmlElement *profile_COMMON, const char *value, const vec4 &deflt) {
-      TiXmlElement *section = child(shader, value);
-      TiXmlElement *color = child(section, "color");
-      TiXmlElement *texture = child(section, "texture");
+    param *get_param(param_buffer_info &pbi, GLint &texture_slot, resource_dict &dict, xml_element *shader, xml_element *profile_COMMON, const char *value, const vec4 &deflt) {
+      xml_element *section = child(shader, value);
+      xml_element *color = child(section, "color");
+      xml_element *texture = child(section, "texture");
       if (color) {
-        atofv(temp_floats, color->GetText());
+        atofv(temp_floats, color);
         if (temp_floats.size() == 3) {
           temp_floats.push_back(1);
         }
@@ -389,15 +479,15 @@ namespace octet { namespace loaders {
       } else if (texture) {
         // todo: handle multiple texcoords
         const char *texture_name = attr(texture, "texture");
-        TiXmlElement *sampler2D = find_param(profile_COMMON, texture_name, "sampler2D");
-        TiXmlElement *source = child(sampler2D, "source");
+        xml_element *sampler2D = find_param(profile_COMMON, texture_name, "sampler2D");
+        xml_element *source = child(sampler2D, "source");
         const char *surface_name = text(source);
-        TiXmlElement *surface = find_param(profile_COMMON, surface_name, "surface");
-        TiXmlElement *init_from = child(surface, "init_from");
+        xml_element *surface = find_param(profile_COMMON, surface_name, "surface");
+        xml_element *init_from = child(surface, "init_from");
         const char *image_name = text(init_from);
         image *img = dict.get_image(image_name);
         if (img) return new param_sampler(pbi, app_utils::get_atom(value), img, new sampler(), param::stage_fragment);
-        /*TiXmlElement *image = find_id(image_name);
+        /*xml_element *image = find_id(image_name);
         const char *url_attr = text(child(image, "init_from"));
         if (url_attr) {
           string new_path;
@@ -410,11 +500,11 @@ namespace octet { namespace loaders {
     }
 
     // get a floating point number (or the default)
-    param_color *get_float(param_buffer_info &pbi, TiXmlElement *shader, const char *value, float deflt) {
-      TiXmlElement *section = child(shader, value);
-      TiXmlElement *float_ = child(section, "float");
+    param_color *get_float(param_buffer_info &pbi, xml_element *shader, const char *value, float deflt) {
+      xml_element *section = child(shader, value);
+      xml_element *float_ = child(section, "float");
       if (float_) {
-        atofv(temp_floats, float_->GetText());
+        atofv(temp_floats, float_);
         if (temp_floats.size() >= 1) {
           return new param_color(pbi, vec4(temp_floats[0], 0, 0, 0), app_utils::get_atom(value), param::stage_fragment);
         }
@@ -424,7 +514,7 @@ namespace octet { namespace loaders {
 
     // add all the materials from the collada file to the resources collection
     void add_materials(resource_dict &dict) {
-      TiXmlElement *lib_mat = child(doc.RootElement(), "library_materials");
+      xml_element *lib_mat = child(doc.get_root(), "library_materials");
 
       if (!dict.has_resource("default_material")) {
         material *defmat = new material(vec4(0.5, 0.5, 0.5, 1));
@@ -433,16 +523,16 @@ namespace octet { namespace loaders {
 
       if (!lib_mat) return;
 
-      for (TiXmlElement *mat_elem = lib_mat->FirstChildElement(); mat_elem != NULL; mat_elem = mat_elem->NextSiblingElement()) {
-        TiXmlElement *ieffect = child(mat_elem, "instance_effect");
+      for (xml_element *mat_elem = lib_mat->first_child(); mat_elem != NULL; mat_elem = mat_elem->next_sibling()) {
+        xml_element *ieffect = child(mat_elem, "instance_effect");
         const char *url = attr(ieffect, "url");
-        TiXmlElement *effect = find_id(url);
-        TiXmlElement *profile_COMMON = child(effect, "profile_COMMON");
-        TiXmlElement *technique = child(profile_COMMON, "technique");
-        TiXmlElement *phong = child(technique, "phong");
-        TiXmlElement *blinn = child(technique, "blinn");
-        TiXmlElement *lambert = child(technique, "lambert");
-        TiXmlElement *shader = phong ? phong : blinn ? blinn : lambert;
+        xml_element *effect = find_id(url);
+        xml_element *profile_COMMON = child(effect, "profile_COMMON");
+        xml_element *technique = child(profile_COMMON, "technique");
+        xml_element *phong = child(technique, "phong");
+        xml_element *blinn = child(technique, "blinn");
+        xml_element *lambert = child(technique, "lambert");
+        xml_element *shader = phong ? phong : blinn ? blinn : lambert;
         dynarray<uint8_t> static_buffer(256);
         param_buffer_info pbi(static_buffer);
         GLint texture_slot = 0;
@@ -467,14 +557,14 @@ namespace octet { namespace loaders {
     }
 
     // add geometry and skins from the collada file to the resources collection
-    void add_mesh_instances(TiXmlElement *technique_common, const char *url, scene_node *node, skeleton *skel, resource_dict &dict, visual_scene &s) {
+    void add_mesh_instances(xml_element *technique_common, const char *url, scene_node *node, skeleton *skel, resource_dict &dict, visual_scene &s) {
       if (!url) return;
 
-      TiXmlElement *instance = child(technique_common, "instance_material");
+      xml_element *instance = child(technique_common, "instance_material");
       if (instance) {
-        for (; instance != NULL; instance = instance->NextSiblingElement("instance_material")) {
-          const char *symbol = instance->Attribute("symbol");
-          const char *target = instance->Attribute("target");
+        for (; instance != NULL; instance = instance->next_sibling("instance_material")) {
+          const char *symbol = instance->get_attribute("symbol");
+          const char *target = instance->get_attribute("target");
           material *mat = dict.get_material(target);
           if (!mat) mat = dict.get_material("default_material");
           const char *mesh_url = url;
@@ -509,23 +599,23 @@ namespace octet { namespace loaders {
     }
 
     // add an <instance_geometry> mesh instance
-    void add_instance_geometry(TiXmlElement *element, scene_node *node, resource_dict &dict, visual_scene &s) {
-      const char *url = element->Attribute("url");
+    void add_instance_geometry(xml_element *element, scene_node *node, resource_dict &dict, visual_scene &s) {
+      const char *url = element->get_attribute("url");
       url += url[0] == '#';
-      TiXmlElement *bind_material = child(element, "bind_material");
-      TiXmlElement *technique_common = child(bind_material, "technique_common");
+      xml_element *bind_material = child(element, "bind_material");
+      xml_element *technique_common = child(bind_material, "technique_common");
 
       add_mesh_instances(technique_common, url, node, 0, dict, s);
     }
 
     // add an <instance_controller> skin instance
-    void add_instance_controller(TiXmlElement *element, scene_node *node, resource_dict &dict, visual_scene &s) {
+    void add_instance_controller(xml_element *element, scene_node *node, resource_dict &dict, visual_scene &s) {
       const char *controller_url = attr(element, "url");
-      TiXmlElement *bind_material = child(element, "bind_material");
-      TiXmlElement *technique_common = child(bind_material, "technique_common");
+      xml_element *bind_material = child(element, "bind_material");
+      xml_element *technique_common = child(bind_material, "technique_common");
 
       int num_bones = 0;
-      for (TiXmlElement *skel_elem = child(element, "skeleton"); skel_elem; skel_elem = sibling(skel_elem, "skeleton")) {
+      for (xml_element *skel_elem = child(element, "skeleton"); skel_elem; skel_elem = sibling(skel_elem, "skeleton")) {
         num_bones++;
       }
 
@@ -534,12 +624,12 @@ namespace octet { namespace loaders {
       //skin *skn = mesh->get_skin();
 
       skeleton *skel = new skeleton();
-      TiXmlElement *skel_elem = child(element, "skeleton");
+      xml_element *skel_elem = child(element, "skeleton");
       dictionary<int> skin_joints;
       while (skel_elem) {
         const char *skeleton_id = text(skel_elem);
-        TiXmlElement *node_elem = find_id(skeleton_id);
-        scene_node *node = (scene_node*)node_elem->GetUserData();
+        xml_element *node_elem = find_id(skeleton_id);
+        scene_node *node = (scene_node*)node_elem->get_user_data();
         if (node) {
           dynarray<scene_node*> nodes;
           dynarray<int> parents;
@@ -552,36 +642,36 @@ namespace octet { namespace loaders {
         skel_elem = sibling(skel_elem, "skeleton");
       }
 
-      //const char *url = skin->Attribute("source");
+      //const char *url = skin->get_attribute("source");
       add_mesh_instances(technique_common, controller_url, node, skel, dict, s);
     }
 
     // utility to get a float
-    float quick_float(TiXmlElement *parent, const char *name, float deflt=0) {
-      TiXmlElement *child = parent->FirstChildElement(name);
-      return child ? (float)atof(child->GetText()) : deflt;
+    float quick_float(xml_element *parent, const char *name, float deflt=0) {
+      xml_element *child = parent->first_child(name);
+      return child ? (float)atof(child->get_text()) : deflt;
     }
 
     // utility to get a float
-    vec4 quick_vec(TiXmlElement *parent, const char *name) {
-      TiXmlElement *child = parent->FirstChildElement(name);
+    vec4 quick_vec(xml_element *parent, const char *name) {
+      xml_element *child = parent->first_child(name);
       dynarray<float> v;
-      if (child) atofv(v, child->GetText());
+      if (child) atofv(v, child);
       unsigned s = v.size();
       return vec4(v[0], s > 1 ? v[1] : 0, s > 2 ? v[2] : 0, s > 3 ? v[3] : 1);
     }
 
     // add a camera to the scene
-    void add_instance_camera(TiXmlElement *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
-      const char *url = elem->Attribute("url");
-      TiXmlElement *cam = find_id(url);
+    void add_instance_camera(xml_element *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
+      const char *url = elem->get_attribute("url");
+      xml_element *cam = find_id(url);
       if (!cam) return;
 
-      TiXmlElement *optics = child(cam, "optics");
-      TiXmlElement *technique_common = child(optics, "technique_common");
-      TiXmlElement *perspective = child(technique_common, "perspective");
-      TiXmlElement *ortho = child(technique_common, "ortho");
-      TiXmlElement *params = perspective ? perspective : ortho;
+      xml_element *optics = child(cam, "optics");
+      xml_element *technique_common = child(optics, "technique_common");
+      xml_element *perspective = child(technique_common, "perspective");
+      xml_element *ortho = child(technique_common, "ortho");
+      xml_element *params = perspective ? perspective : ortho;
       if (params) {
         float n = quick_float(params, "znear");
         float f = quick_float(params, "zfar");
@@ -602,21 +692,21 @@ namespace octet { namespace loaders {
     }
 
     // add a light to the scene
-    void add_instance_light(TiXmlElement *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
-      const char *url = elem->Attribute("url");
-      TiXmlElement *light_elem = find_id(url);
+    void add_instance_light(xml_element *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
+      const char *url = elem->get_attribute("url");
+      xml_element *light_elem = find_id(url);
       if (!light_elem) return;
 
       light *_light = new light();
       light_instance *il = new light_instance(node, _light);
       s.add_light_instance(il);
       
-      TiXmlElement *technique_common = child(light_elem, "technique_common");
-      TiXmlElement *ambient = child(technique_common, "ambient");
-      TiXmlElement *directional = child(technique_common, "directional");
-      TiXmlElement *spot = child(technique_common, "spot");
-      TiXmlElement *point = child(technique_common, "point");
-      TiXmlElement *params = ambient ? ambient : directional ? directional : spot ? spot : point;
+      xml_element *technique_common = child(light_elem, "technique_common");
+      xml_element *ambient = child(technique_common, "ambient");
+      xml_element *directional = child(technique_common, "directional");
+      xml_element *spot = child(technique_common, "spot");
+      xml_element *point = child(technique_common, "point");
+      xml_element *params = ambient ? ambient : directional ? directional : spot ? spot : point;
 
       _light->set_color(vec4(1, 1, 1, 1));
       if (params) {
@@ -637,18 +727,18 @@ namespace octet { namespace loaders {
 
     // add a geometry element to the list of mesh states
     void add_geometry(resource_dict &dict) {
-      TiXmlElement *lib_geom = doc.RootElement()->FirstChildElement("library_geometries");
+      xml_element *lib_geom = doc.get_root()->first_child("library_geometries");
       if (!lib_geom) return;
 
-      for (TiXmlElement *geometry = lib_geom->FirstChildElement(); geometry != NULL; geometry = geometry->NextSiblingElement()) {
-        TiXmlElement *mesh_elem = child(geometry, "mesh");
-        const char *id = geometry->Attribute("id");
+      for (xml_element *geometry = lib_geom->first_child(); geometry != NULL; geometry = geometry->next_sibling()) {
+        xml_element *mesh_elem = child(geometry, "mesh");
+        const char *id = geometry->get_attribute("id");
 
-        for (TiXmlElement *mesh_child = mesh_elem ? mesh_elem->FirstChildElement() : 0;
+        for (xml_element *mesh_child = mesh_elem ? mesh_elem->first_child() : 0;
           mesh_child != NULL;
-          mesh_child = mesh_child->NextSiblingElement()
+          mesh_child = mesh_child->next_sibling()
         ) {
-          if (is_mesh_component(mesh_child->Value())) {
+          if (is_mesh_component(mesh_child->get_name())) {
             mesh *msh = new mesh();
             get_mesh_component(msh, id, mesh_child, NULL, dict);
           }
@@ -658,34 +748,34 @@ namespace octet { namespace loaders {
 
     // add a geometry element to the list of mesh states
     void add_controllers(resource_dict &dict) {
-      TiXmlElement *lib_ctrl = doc.RootElement()->FirstChildElement("library_controllers");
+      xml_element *lib_ctrl = doc.get_root()->first_child("library_controllers");
       if (!lib_ctrl) return;
 
-      for (TiXmlElement *controller = lib_ctrl->FirstChildElement(); controller != NULL; controller = controller->NextSiblingElement()) {
-        TiXmlElement *skin_elem = child(controller, "skin");
-        const char *controller_id = controller->Attribute("id");
-        TiXmlElement *geometry = find_id(attr(skin_elem, "source"));
-        TiXmlElement *bind_shape_matrix = child(skin_elem, "bind_shape_matrix");
-        TiXmlElement *joints_elem = child(skin_elem, "joints");
+      for (xml_element *controller = lib_ctrl->first_child(); controller != NULL; controller = controller->next_sibling()) {
+        xml_element *skin_elem = child(controller, "skin");
+        const char *controller_id = controller->get_attribute("id");
+        xml_element *geometry = find_id(attr(skin_elem, "source"));
+        xml_element *bind_shape_matrix = child(skin_elem, "bind_shape_matrix");
+        xml_element *joints_elem = child(skin_elem, "joints");
         skin_state skinst;
 
         if (bind_shape_matrix) {
-          atofv(skinst.bind_shape_matrix, text(bind_shape_matrix));
+          atofv(skinst.bind_shape_matrix, bind_shape_matrix);
         }
 
         if (joints_elem) {
-          TiXmlElement *input = child(joints_elem, "input");
+          xml_element *input = child(joints_elem, "input");
           while (input) {
             const char *semantic = attr(input, "semantic");
             const char *source_id = attr(input, "source");
             if (!strcmp(semantic, "JOINT")) {
-              TiXmlElement *name_array = child(find_id(source_id), "Name_array");
+              xml_element *name_array = child(find_id(source_id), "Name_array");
               if (name_array) {
                 skinst.joints = text(name_array);
               }
             } else if (!strcmp(semantic, "INV_BIND_MATRIX")) {
-              TiXmlElement *float_array = child(find_id(source_id), "float_array");
-              atofv(skinst.inv_bind_matrices, text(float_array));
+              xml_element *float_array = child(find_id(source_id), "float_array");
+              atofv(skinst.inv_bind_matrices, float_array);
             }
             input = sibling(input, "input");
           }
@@ -710,17 +800,17 @@ namespace octet { namespace loaders {
           mesh_skin->add_joint(bindToModel, app_utils::get_atom(joints[i]));
         }
 
-        TiXmlElement *vertex_weights = child(skin_elem, "vertex_weights");
+        xml_element *vertex_weights = child(skin_elem, "vertex_weights");
         if (vertex_weights && geometry) {
           get_skin(controller, vertex_weights, &skinst);
-          TiXmlElement *mesh_elem = child(geometry, "mesh");
-          //const char *id = geometry->Attribute("id");
+          xml_element *mesh_elem = child(geometry, "mesh");
+          //const char *id = geometry->get_attribute("id");
 
-          for (TiXmlElement *mesh_child = mesh_elem ? mesh_elem->FirstChildElement() : 0;
+          for (xml_element *mesh_child = mesh_elem ? mesh_elem->first_child() : 0;
             mesh_child != NULL;
-            mesh_child = mesh_child->NextSiblingElement()
+            mesh_child = mesh_child->next_sibling()
           ) {
-            if (is_mesh_component(mesh_child->Value())) {
+            if (is_mesh_component(mesh_child->get_name())) {
               mesh *msh = new mesh(mesh_skin);
               get_mesh_component(msh, controller_id, mesh_child, &skinst, dict);
             }
@@ -731,10 +821,10 @@ namespace octet { namespace loaders {
 
     // add <library_images> to the scene
     void add_images(resource_dict &dict) {
-      TiXmlElement *lib_anim = doc.RootElement()->FirstChildElement("library_images");
+      xml_element *lib_anim = doc.get_root()->first_child("library_images");
       if (!lib_anim) return;
 
-      for (TiXmlElement *elem = child(lib_anim, "image"); elem != NULL; elem = sibling(elem, "image")) {
+      for (xml_element *elem = child(lib_anim, "image"); elem != NULL; elem = sibling(elem, "image")) {
         const char *url_attr = text(child(elem, "init_from"));
         if (url_attr) {
           string new_path;
@@ -745,18 +835,57 @@ namespace octet { namespace loaders {
       }
     }
 
+    // convert collada bezier control points or hermite tangents to slopes in value per second.
+    // bezier tangents may be (time, value) pairs or values only.
+    static bool tangents_to_slopes(dynarray<float> &in_tangents, dynarray<float> &out_tangents, const dynarray<float> &times, const dynarray<float> &values, bool is_bezier) {
+      unsigned num_times = times.size();
+      if (num_times < 2 || values.size() % num_times) return false;
+      unsigned num_floats = values.size() / num_times;
+      bool pairs = is_bezier && in_tangents.size() == values.size() * 2 && out_tangents.size() == values.size() * 2;
+      if (!pairs && (in_tangents.size() != values.size() || out_tangents.size() != values.size())) return false;
+
+      dynarray<float> in_slopes(values.size()), out_slopes(values.size());
+      for (unsigned j = 0; j != num_times; ++j) {
+        float dt_in = j ? times[j] - times[j-1] : times[1] - times[0];
+        float dt_out = j + 1 < num_times ? times[j+1] - times[j] : dt_in;
+        for (unsigned i = 0; i != num_floats; ++i) {
+          unsigned idx = j * num_floats + i;
+          float v = values[idx];
+          float in_slope, out_slope;
+          if (pairs) {
+            float in_dt = times[j] - in_tangents[idx*2], out_dt = out_tangents[idx*2] - times[j];
+            in_slope = in_dt > 0 ? (v - in_tangents[idx*2+1]) / in_dt : 0;
+            out_slope = out_dt > 0 ? (out_tangents[idx*2+1] - v) / out_dt : 0;
+          } else if (is_bezier) {
+            // control points a third of the way along the segment.
+            in_slope = dt_in > 0 ? (v - in_tangents[idx]) * 3 / dt_in : 0;
+            out_slope = dt_out > 0 ? (out_tangents[idx] - v) * 3 / dt_out : 0;
+          } else {
+            // hermite tangents are per segment.
+            in_slope = dt_in > 0 ? in_tangents[idx] / dt_in : 0;
+            out_slope = dt_out > 0 ? out_tangents[idx] / dt_out : 0;
+          }
+          in_slopes[idx] = in_slope;
+          out_slopes[idx] = out_slope;
+        }
+      }
+      in_tangents = in_slopes;
+      out_tangents = out_slopes;
+      return true;
+    }
+
     // add <library_animations> to the scene
     // collada animations range from sensible (array of matrices) to crazy (complex rotations and translations)
     void add_animations(resource_dict &dict) {
-      TiXmlElement *lib_anim = doc.RootElement()->FirstChildElement("library_animations");
+      xml_element *lib_anim = doc.get_root()->first_child("library_animations");
       if (!lib_anim) return;
 
-      for (TiXmlElement *anim_elem = child(lib_anim, "animation"); anim_elem != NULL; anim_elem = sibling(anim_elem, "animation")) {
+      for (xml_element *anim_elem = child(lib_anim, "animation"); anim_elem != NULL; anim_elem = sibling(anim_elem, "animation")) {
         animation *anim = new animation();
         const char *id = attr(anim_elem, "id");
         dict.set_resource(id, anim);
         if (debug > 0) log("animation %s\n", id);
-        for (TiXmlElement *channel_elem = child(anim_elem, "channel"); channel_elem != NULL; channel_elem = sibling(channel_elem, "channel")) {
+        for (xml_element *channel_elem = child(anim_elem, "channel"); channel_elem != NULL; channel_elem = sibling(channel_elem, "channel")) {
           const char *target = attr(channel_elem, "target");
           string node_name = target;
           string sub_target_name;
@@ -778,42 +907,65 @@ namespace octet { namespace loaders {
           atom_t component_sid = app_utils::get_atom(component_name);
           
           if (debug > 0) log("  channel target %s %s %s\n", node_name.c_str(), sub_target_name.c_str(), component_name.c_str());
-          TiXmlElement *sampler_elem = find_id(attr(channel_elem, "source"));
+          xml_element *sampler_elem = find_id(attr(channel_elem, "source"));
           if (sampler_elem) {
             dynarray<float> times;
             dynarray<float> values;
-            //dynarray<string> interpolation;
+            dynarray<float> in_tangents;
+            dynarray<float> out_tangents;
+            animation::interpolation_t interpolation = animation::interp_linear;
+            bool is_bezier = false;
 
-            TiXmlElement *input = child(sampler_elem, "input");
+            xml_element *input = child(sampler_elem, "input");
             while (input) {
               const char *semantic = attr(input, "semantic");
               const char *source_id = attr(input, "source");
               if (!strcmp(semantic, "INPUT")) {
-                TiXmlElement *float_array = child(find_id(source_id), "float_array");
-                atofv(times, text(float_array));
+                xml_element *float_array = child(find_id(source_id), "float_array");
+                atofv(times, float_array);
               } else if (!strcmp(semantic, "OUTPUT")) {
-                TiXmlElement *float_array = child(find_id(source_id), "float_array");
-                atofv(values, text(float_array));
+                xml_element *float_array = child(find_id(source_id), "float_array");
+                atofv(values, float_array);
+              } else if (!strcmp(semantic, "IN_TANGENT")) {
+                xml_element *float_array = child(find_id(source_id), "float_array");
+                atofv(in_tangents, float_array);
+              } else if (!strcmp(semantic, "OUT_TANGENT")) {
+                xml_element *float_array = child(find_id(source_id), "float_array");
+                atofv(out_tangents, float_array);
               } else if (!strcmp(semantic, "INTERPOLATION")) {
-                /*TiXmlElement *name_array = child(find_id(source_id), "Name_array");
-                if (name_array) {
-                  atonv(interpolation, text(name_array));
-                }*/
+                // we use one interpolation for the whole channel: curves if there are any, steps if they are all steps.
+                xml_element *name_array = child(find_id(source_id), "Name_array");
+                const char *names = name_array ? text(name_array) : NULL;
+                if (names) {
+                  is_bezier = strstr(names, "BEZIER") != NULL;
+                  if (is_bezier || strstr(names, "HERMITE")) {
+                    interpolation = animation::interp_hermite;
+                  } else if (strstr(names, "STEP") && !strstr(names, "LINEAR")) {
+                    interpolation = animation::interp_step;
+                  }
+                }
               }
               input = sibling(input, "input");
             }
 
             resource *target = dict.get_resource(node_name);
-            anim->add_channel(target, node_sid, sub_target_sid, component_sid, times, values);
+            bool has_tangents = false;
+            if (interpolation == animation::interp_hermite) {
+              has_tangents = tangents_to_slopes(in_tangents, out_tangents, times, values, is_bezier);
+            }
+            anim->add_compressed_channel(
+              target, node_sid, sub_target_sid, component_sid, times, values,
+              interpolation, anim_tolerance, has_tangents ? &in_tangents : NULL, has_tangents ? &out_tangents : NULL
+            );
           }
         }
       }
     }
 
     // build the scene_node heirachy
-    void build_heirachy(dynarray<TiXmlElement *> &node_elems, dynarray<scene_node *> &nodes, TiXmlElement *scene_element, resource_dict &dict, visual_scene &s) {
+    void build_heirachy(dynarray<xml_element *> &node_elems, dynarray<scene_node *> &nodes, xml_element *scene_element, resource_dict &dict, visual_scene &s) {
       // create a stack to avoid recursion (a bad thing in games)
-      dynarray<TiXmlElement *> stack;
+      dynarray<xml_element *> stack;
       dynarray<scene_node *> node_stack;
       stack.reserve(64);
       node_stack.reserve(64);
@@ -821,11 +973,11 @@ namespace octet { namespace loaders {
       node_stack.push_back(s.get_root_node());
       stack.push_back(scene_element);
       while (!stack.empty()) {
-        TiXmlElement *parent_elem = stack.back();
+        xml_element *parent_elem = stack.back();
         scene_node *parent = node_stack.back();
         stack.pop_back();
         node_stack.pop_back();
-        TiXmlElement *node_elem = child(parent_elem, "node");
+        xml_element *node_elem = child(parent_elem, "node");
         while (node_elem) {
           mat4t nodeToParent;
           nodeToParent.loadIdentity();
@@ -839,24 +991,24 @@ namespace octet { namespace loaders {
           node_stack.push_back(new_node);
           nodes.push_back(new_node);
           node_elems.push_back(node_elem);
-          node_elem->SetUserData(new_node);
+          node_elem->set_user_data(new_node);
           node_elem = sibling(node_elem, "node");
         }
       }
     }
 
     // add matrices and instances
-    void build_matrices(dynarray<TiXmlElement *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
+    void build_matrices(dynarray<xml_element *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
       for (int ni = 0; ni != node_elems.size(); ++ni) {
-        TiXmlElement *node_elem = node_elems[ni];
+        xml_element *node_elem = node_elems[ni];
         scene_node *node = nodes[ni];
         mat4t &matrix = node->access_nodeToParent();
         matrix.loadIdentity();
 
-        for (TiXmlElement *child = node_elem->FirstChildElement(); child != NULL; child = child->NextSiblingElement()) {
-          const char *value = child->Value();
+        for (xml_element *child = node_elem->first_child(); child != NULL; child = child->next_sibling()) {
+          const char *value = child->get_name();
           if (!strcmp(value, "matrix")) {
-            atofv(temp_floats, child->GetText());
+            atofv(temp_floats, child);
             if (temp_floats.size() >= 16) {
               mat4t tmp(
                 vec4(temp_floats[0], temp_floats[4], temp_floats[8], temp_floats[12]),
@@ -867,17 +1019,17 @@ namespace octet { namespace loaders {
               matrix.multMatrix(tmp);
             }
           } else if (!strcmp(value, "rotate")) {
-            atofv(temp_floats, child->GetText());
+            atofv(temp_floats, child);
             if (temp_floats.size() >= 4) {
               matrix.rotate(temp_floats[3], temp_floats[0], temp_floats[1], temp_floats[2]);
             }
           } else if (!strcmp(value, "scale")) {
-            atofv(temp_floats, child->GetText());
+            atofv(temp_floats, child);
             if (temp_floats.size() >= 3) {
               matrix.scale(temp_floats[0], temp_floats[1], temp_floats[2]);
             }
           } else if (!strcmp(value, "translate")) {
-            atofv(temp_floats, child->GetText());
+            atofv(temp_floats, child);
             if (temp_floats.size() >= 3) {
               matrix.translate(temp_floats[0], temp_floats[1], temp_floats[2]);
             }
@@ -887,13 +1039,13 @@ namespace octet { namespace loaders {
     }
 
     // add instances
-    void build_instances(dynarray<TiXmlElement *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
+    void build_instances(dynarray<xml_element *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
       for (int ni = 0; ni != node_elems.size(); ++ni) {
-        TiXmlElement *node_elem = node_elems[ni];
+        xml_element *node_elem = node_elems[ni];
         scene_node *node = nodes[ni];
 
-        for (TiXmlElement *child = node_elem->FirstChildElement(); child != NULL; child = child->NextSiblingElement()) {
-          const char *value = child->Value();
+        for (xml_element *child = node_elem->first_child(); child != NULL; child = child->next_sibling()) {
+          const char *value = child->get_name();
           if (!strcmp(value, "instance_geometry")) {
             add_instance_geometry(child, node, dict, s);
           } else if (!strcmp(value, "instance_controller")) {
@@ -934,14 +1086,14 @@ namespace octet { namespace loaders {
     }
 
     // find the maximum input offset and infer the input stride (this is not explicit in the spec)
-    int get_input_stride(TiXmlElement *mesh_child) {
+    int get_input_stride(xml_element *mesh_child) {
       int input_stride = 1;
       int implicit_offset = 0;
-      for (TiXmlElement *input_elem = child(mesh_child, "input");
+      for (xml_element *input_elem = child(mesh_child, "input");
         input_elem != NULL;
-        input_elem = input_elem->NextSiblingElement("input")
+        input_elem = input_elem->next_sibling("input")
       ) {
-        const char *offset = input_elem->Attribute("offset");
+        const char *offset = input_elem->get_attribute("offset");
         int int_offset = offset ? atoi(offset) : implicit_offset++;
         if (int_offset+1 > input_stride) {
           input_stride = int_offset+1;
@@ -951,8 +1103,8 @@ namespace octet { namespace loaders {
     }
 
     // get triangles from a trilist or polylist
-    void get_mesh_component(mesh *mesh, const char *id, TiXmlElement *mesh_child, skin_state *skinst, resource_dict &dict) {
-      TiXmlElement *pelem = child(mesh_child, "p");
+    void get_mesh_component(mesh *mesh, const char *id, xml_element *mesh_child, skin_state *skinst, resource_dict &dict) {
+      xml_element *pelem = child(mesh_child, "p");
 
       if (!pelem) {
         printf("warning: no <p>\n");
@@ -979,7 +1131,7 @@ namespace octet { namespace loaders {
       parse_input_state state;
       state.s = mesh;
       while (pelem) {
-        atoiv(state.p, pelem->GetText());
+        atoiv(state.p, pelem);
         pelem = sibling(pelem, "p");
       }
       state.input_stride = get_input_stride(mesh_child);
@@ -997,11 +1149,11 @@ namespace octet { namespace loaders {
       unsigned num_vertices = p_size / state.input_stride;
 
       // find the output size
-      for (TiXmlElement *input = child(mesh_child, "input");
+      for (xml_element *input = child(mesh_child, "input");
         input != NULL;
-        input = input->NextSiblingElement("input")
+        input = input->next_sibling("input")
       ) {
-        const char *offset = input->Attribute("offset");
+        const char *offset = input->get_attribute("offset");
         state.input_offset = offset ? atoi(offset) : 0;
         state.pass = 1;
         parse_input(state, input);
@@ -1031,11 +1183,11 @@ namespace octet { namespace loaders {
       state.vertex_input_offset = 0;
 
       // build the attributes
-      for (TiXmlElement *input = child(mesh_child, "input");
+      for (xml_element *input = child(mesh_child, "input");
         input != NULL;
-        input = input->NextSiblingElement("input")
+        input = input->next_sibling("input")
       ) {
-        const char *offset = input->Attribute("offset");
+        const char *offset = input->get_attribute("offset");
         state.input_offset = offset ? atoi(offset) : 0;
         state.pass = 2;
         parse_input(state, input);
@@ -1063,15 +1215,14 @@ namespace octet { namespace loaders {
         }
       }
 
-      TiXmlElement *vcount_elem = child(mesh_child, "vcount");
+      xml_element *vcount_elem = child(mesh_child, "vcount");
 
       // build an initial index based on the mesh_child value
-      // todo: optimise the mesh.
       unsigned num_indices = 0;
       if (vcount_elem) {
         // polygons
         dynarray<int> vcount;
-        atoiv(vcount, vcount_elem->GetText());
+        atoiv(vcount, vcount_elem);
         num_indices = convert_polygons_to_triangles(state, vcount);
       } else {
         // just plain triangles
@@ -1093,25 +1244,32 @@ namespace octet { namespace loaders {
       mesh->assign(vsize, isize, (unsigned char*)&state.vertices[0], (unsigned char*)&state.indices[0]);
       mesh->set_params(state.attr_stride * 4, num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
       mesh->calc_aabb();
+
+      // the file has one vertex per index in file order; merge and reorder them for the GPU.
+      float acmr = debug > 0 ? mesh->get_acmr() : 0;
+      mesh->optimize();
+      if (debug > 0) {
+        log("mesh component %s: %d vertices, ACMR %.3f -> %.3f\n", id, mesh->get_num_vertices(), acmr, mesh->get_acmr());
+      }
       if (debug > 1) mesh->dump(log("mesh\n"));
     }
 
     // get blend weights and matrices from a skin
     // after this we are still not home yet as the weights need to be indexed by the POSITION of the skinned mesh.
-    void get_skin(TiXmlElement *geometry, TiXmlElement *mesh_child, skin_state *skin) {
-      TiXmlElement *pelem = child(mesh_child, "v");
+    void get_skin(xml_element *geometry, xml_element *mesh_child, skin_state *skin) {
+      xml_element *pelem = child(mesh_child, "v");
 
       if (!pelem) {
         printf("warning: no <v>\n");
         return;
       }
 
-      TiXmlElement *vcount_elem = child(mesh_child, "vcount");
+      xml_element *vcount_elem = child(mesh_child, "vcount");
       if (!vcount_elem) {
         printf("warning: no vcount element in skin\n");
       }
 
-      atoiv(skin->vcount, vcount_elem->GetText());
+      atoiv(skin->vcount, vcount_elem);
 
       int num_vertices = 0;
       int num_vcs = skin->vcount.size();
@@ -1125,7 +1283,7 @@ namespace octet { namespace loaders {
       parse_input_state state;
       state.s = NULL;
       while (pelem) {
-        atoiv(state.p, pelem->GetText());
+        atoiv(state.p, pelem);
         pelem = sibling(pelem, "p");
       }
       state.input_stride = get_input_stride(mesh_child);
@@ -1135,11 +1293,11 @@ namespace octet { namespace loaders {
       state.input_offset = 0;
 
       // build the raw skin paramerters
-      for (TiXmlElement *input = child(mesh_child, "input");
+      for (xml_element *input = child(mesh_child, "input");
         input != NULL;
-        input = input->NextSiblingElement("input")
+        input = input->next_sibling("input")
       ) {
-        const char *offset = input->Attribute("offset");
+        const char *offset = input->get_attribute("offset");
         state.input_offset = offset ? atoi(offset) : 0;
         state.pass = 3;
         parse_input(state, input);
@@ -1193,12 +1351,12 @@ namespace octet { namespace loaders {
 
     // add all the scenes from the collada file to the resources collection
     void add_scenes(resource_dict &dict) {
-      TiXmlElement *lib = doc.RootElement()->FirstChildElement("library_visual_scenes");
+      xml_element *lib = doc.get_root()->first_child("library_visual_scenes");
 
       if (!lib) return;
 
-      for (TiXmlElement *elem = lib->FirstChildElement(); elem != NULL; elem = elem->NextSiblingElement()) {
-        dynarray<TiXmlElement *> node_elems;
+      for (xml_element *elem = lib->first_child(); elem != NULL; elem = elem->next_sibling()) {
+        dynarray<xml_element *> node_elems;
         dynarray<scene_node *> nodes;
         visual_scene *scn = new visual_scene();
         dict.set_resource(attr(elem, "id"), scn);
@@ -1211,53 +1369,63 @@ namespace octet { namespace loaders {
 
   public:
     collada_builder() {
+      anim_tolerance = 1.0f / 4096;
+      ids_indexed = false;
+    }
+
+    /// Set how far (as a fraction of each channel's range) animations may stray when keys are removed.
+    /// Zero keeps every key.
+    void set_animation_tolerance(float tolerance) {
+      anim_tolerance = tolerance;
     }
 
     // public function to load a collada file
     bool load_xml(const char *url) {
       doc_path = url;
       doc_path.truncate(doc_path.filename_pos());
-      const char *path = app_utils::get_path(url);
-      char buf[256];
-      getcwd(buf, sizeof(buf));
-      doc.LoadFile(path);
-
-      TiXmlElement *top = doc.RootElement();
-      if (!top) {
-        printf("file %s not found\n", path);
+      ids.reset();
+      ids_indexed = false;
+
+      app_utils::get_url(source, url);
+      if (!source.size()) {
         return false;
       }
 
-      if (strcmp(top->Value(), "COLLADA")) {
+      if (!doc.parse((const char*)source.get_src(), (const char*)source.get_src_max())) {
+        printf("error: %s in %s\n", doc.get_error(), url);
+        return false;
+      }
+
+      xml_element *top = doc.get_root();
+      if (strcmp(top->get_name(), "COLLADA")) {
         printf("warning: not a collada file");
         return false;
       }
 
-      find_ids(top);
       return true;
     }
 
     // once loaded, use this to access the first component in the mesh
     void get_mesh(mesh &s, const char *id, resource_dict &dict) {
-      TiXmlElement *geometry = find_id(id);
+      xml_element *geometry = find_id(id);
       s.init();
 
-      if (!geometry || strcmp(geometry->Value(), "geometry")) {
+      if (!geometry || strcmp(geometry->get_name(), "geometry")) {
         printf("warning: geometry %s not found\n", id);
         return;
       }
 
-      TiXmlElement *mesh = child(geometry, "mesh");
+      xml_element *mesh = child(geometry, "mesh");
       if (!mesh) {
         printf("warning: geometry %s has no mesh\n", id);
         return;
       }
 
-      for (TiXmlElement *mesh_child = mesh->FirstChildElement();
+      for (xml_element *mesh_child = mesh->first_child();
         mesh_child != NULL;
-        mesh_child = mesh_child->NextSiblingElement()
+        mesh_child = mesh_child->next_sibling()
       ) {
-        if (is_mesh_component(mesh_child->Value())) {
+        if (is_mesh_component(mesh_child->get_name())) {
           get_mesh_component(&s, id, mesh_child, NULL, dict);
           return;
         }
@@ -1266,9 +1434,10 @@ namespace octet { namespace loaders {
 
     // get the url from the default visual scene
     const char *get_default_scene() {
-      TiXmlElement *scene = doc.RootElement()->FirstChildElement("scene");
-      TiXmlElement *ivs = child(scene, "instance_visual_scene");
-      return ivs ? ivs->Attribute("url") : 0;
+      if (!doc.get_root()) return 0;
+      xml_element *scene = doc.get_root()->first_child("scene");
+      xml_element *ivs = child(scene, "instance_visual_scene");
+      return ivs ? ivs->get_attribute("url") : 0;
     }
 
     // extract resources from the collada file into a collection.
@@ -1287,5 +1456,38 @@ namespace octet { namespace loaders {
       // animations refer to all other objects
       add_animations(dict);
     }
+
+    /// Load a collada file and add its resources to a dictionary, using a cooked copy of the resources if it is up to date.
+    ///
+    /// The first load parses the XML like load_xml() and get_resources() and writes the resources
+    /// next to the collada file (eg. assets/duck.dae.cooked) with binary_writer.
+    /// Later loads map the cooked file and read the resources back, skipping the XML and mesh building.
+    /// The cooked file is remade when the collada file changes size or contents.
+    /// Returns false if the collada file could not be loaded.
+    bool load_cooked(const char *url, resource_dict &dict) {
+      string path = app_utils::get_path(url);
+      string cooked_path;
+      cooked_path.format("%s.cooked", path.c_str());
+
+      uint64_t source_size = 0, source_time = 0;
+      if (!app_utils::get_file_info(path, source_size, source_time)) {
+        printf("file %s not found\n", path.c_str());
+        return false;
+      }
+
+      if (read_cooked(cooked_path, path, source_size, source_time, dict)) {
+        return true;
+      }
+
+      if (!load_xml(url)) {
+        return false;
+      }
+
+      resource_dict new_dict;
+      get_resources(new_dict);
+      write_cooked(cooked_path, path, source_size, source_time, new_dict);
+      dict.add_resources(new_dict);
+      return true;
+    }
   };
 }}
@@ -0,0 +1,495 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// DXT (S3TC) texture encoder
+//
+// See http://en.wikipedia.org/wiki/S3_Texture_Compression
+//
+namespace octet { namespace loaders {
+  /// DXT1 and DXT5 block encoder.
+  ///
+  /// Each 4x4 block of pixels becomes two 565 colours and sixteen 2 bit indices
+  /// into a palette of four colours on the line between them (DXT1, 8 bytes).
+  /// DXT5 adds two alpha values and sixteen 3 bit indices (16 bytes).
+  ///
+  /// The encoder has no state, so rows of blocks can be encoded on different threads.
+  ///
+  /// Example
+  ///
+  ///     dxt_encoder enc(dxt_encoder::quality_normal);
+  ///     dynarray<uint8_t> dxt(dxt_encoder::get_size(width, height, false));
+  ///     enc.encode(dxt.data(), rgb, width, height, 3, 0, dxt_encoder::get_block_rows(height));
+  class dxt_encoder {
+  public:
+    /// How hard to look for the best colours.
+    enum quality_t {
+      /// The corners of the bounding box of the colours.
+      quality_fast,
+      /// The principal axis of the colours, refined by least squares.
+      quality_normal,
+      /// The best of every split of the colours, in order along the axis, into four clusters. Much slower.
+      quality_high,
+    };
+
+  private:
+    quality_t quality;
+
+    // the four colours of a palette, 0..255.
+    struct palette {
+      int rgb[4][3];
+    };
+
+    static unsigned pack565(const float *c) {
+      unsigned r = (unsigned)(clamp01(c[0]) * 31 + 0.5f);
+      unsigned g = (unsigned)(clamp01(c[1]) * 63 + 0.5f);
+      unsigned b = (unsigned)(clamp01(c[2]) * 31 + 0.5f);
+      return r << 11 | g << 5 | b;
+    }
+
+    static float clamp01(float v) {
+      return v < 0 ? 0 : v > 1 ? 1 : v;
+    }
+
+    // make the colours a decoder will make for two 565 colours (four colour mode).
+    static void make_palette(palette &pal, unsigned c0, unsigned c1) {
+      int e0[3] = { (int)(c0 >> 11), (int)(c0 >> 5) & 63, (int)c0 & 31 };
+      int e1[3] = { (int)(c1 >> 11), (int)(c1 >> 5) & 63, (int)c1 & 31 };
+      e0[0] = e0[0] << 3 | e0[0] >> 2; e0[1] = e0[1] << 2 | e0[1] >> 4; e0[2] = e0[2] << 3 | e0[2] >> 2;
+      e1[0] = e1[0] << 3 | e1[0] >> 2; e1[1] = e1[1] << 2 | e1[1] >> 4; e1[2] = e1[2] << 3 | e1[2] >> 2;
+      for (unsigned i = 0; i != 3; ++i) {
+        pal.rgb[0][i] = e0[i];
+        pal.rgb[1][i] = e1[i];
+        pal.rgb[2][i] = (2 * e0[i] + e1[i]) / 3;
+        pal.rgb[3][i] = (e0[i] + 2 * e1[i]) / 3;
+      }
+    }
+
+    // choose the nearest palette entry for each pixel. returns the total squared error.
+    static unsigned match_palette(uint32_t &indices, const palette &pal, const uint8_t *rgba) {
+      unsigned total = 0;
+      indices = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        const uint8_t *p = rgba + i * 4;
+        unsigned best = ~0u, best_index = 0;
+        for (unsigned j = 0; j != 4; ++j) {
+          int dr = p[0] - pal.rgb[j][0], dg = p[1] - pal.rgb[j][1], db = p[2] - pal.rgb[j][2];
+          unsigned err = (unsigned)(dr * dr + dg * dg + db * db);
+          if (err < best) { best = err; best_index = j; }
+        }
+        indices |= best_index << (i * 2);
+        total += best;
+      }
+      return total;
+    }
+
+    // quantise two end points and find the indices. returns the squared error.
+    static unsigned fit_endpoints(unsigned &c0, unsigned &c1, uint32_t &indices, const float *e0, const float *e1, const uint8_t *rgba) {
+      c0 = pack565(e0);
+      c1 = pack565(e1);
+      palette pal;
+      make_palette(pal, c0, c1);
+      return match_palette(indices, pal, rgba);
+    }
+
+    // fast: the corners of the bounding box, inset a little, on the diagonal that follows the colours.
+    static void fit_range(float *e0, float *e1, const uint8_t *rgba) {
+      int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 }, mean[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        for (unsigned c = 0; c != 3; ++c) {
+          int v = rgba[i * 4 + c];
+          lo[c] = v < lo[c] ? v : lo[c];
+          hi[c] = v > hi[c] ? v : hi[c];
+          mean[c] += v;
+        }
+      }
+
+      // the channel with the biggest range decides which way the others go.
+      unsigned major = 0;
+      for (unsigned c = 1; c != 3; ++c) {
+        if (hi[c] - lo[c] > hi[major] - lo[major]) major = c;
+      }
+      int cov[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        int dm = rgba[i * 4 + major] * 16 - mean[major];
+        for (unsigned c = 0; c != 3; ++c) {
+          cov[c] += dm * (rgba[i * 4 + c] * 16 - mean[c]);
+        }
+      }
+
+      for (unsigned c = 0; c != 3; ++c) {
+        float inset = (hi[c] - lo[c]) * (1.0f / 16);
+        float a = (lo[c] + inset) * (1.0f / 255), b = (hi[c] - inset) * (1.0f / 255);
+        if (cov[c] < 0) { float t = a; a = b; b = t; }
+        e0[c] = b;
+        e1[c] = a;
+      }
+    }
+
+    // the principal axis of the colours by the power method.
+    static void principal_axis(float *mean, float *axis, const float (*pts)[3]) {
+      mean[0] = mean[1] = mean[2] = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        for (unsigned c = 0; c != 3; ++c) mean[c] += pts[i][c];
+      }
+      for (unsigned c = 0; c != 3; ++c) mean[c] *= 1.0f / 16;
+
+      float cov[6] = { 0, 0, 0, 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        float r = pts[i][0] - mean[0], g = pts[i][1] - mean[1], b = pts[i][2] - mean[2];
+        cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+        cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+      }
+
+      float v[3] = { 1, 1, 1 };
+      for (unsigned iter = 0; iter != 8; ++iter) {
+        float x = cov[0] * v[0] + cov[1] * v[1] + cov[2] * v[2];
+        float y = cov[1] * v[0] + cov[3] * v[1] + cov[4] * v[2];
+        float z = cov[2] * v[0] + cov[4] * v[1] + cov[5] * v[2];
+        float m = fabsf(x) > fabsf(y) ? fabsf(x) : fabsf(y);
+        m = fabsf(z) > m ? fabsf(z) : m;
+        if (m < 1e-12f) break;
+        v[0] = x / m; v[1] = y / m; v[2] = z / m;
+      }
+      float len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+      for (unsigned c = 0; c != 3; ++c) axis[c] = v[c] / len;
+    }
+
+    // normal: the extent of the colours along the principal axis.
+    static void fit_axis(float *e0, float *e1, const float (*pts)[3]) {
+      float mean[3], axis[3];
+      principal_axis(mean, axis, pts);
+      float pmin = 1e9f, pmax = -1e9f;
+      for (unsigned i = 0; i != 16; ++i) {
+        float p = (pts[i][0] - mean[0]) * axis[0] + (pts[i][1] - mean[1]) * axis[1] + (pts[i][2] - mean[2]) * axis[2];
+        pmin = p < pmin ? p : pmin;
+        pmax = p > pmax ? p : pmax;
+      }
+      for (unsigned c = 0; c != 3; ++c) {
+        e0[c] = mean[c] + axis[c] * pmax;
+        e1[c] = mean[c] + axis[c] * pmin;
+      }
+    }
+
+    // best end points for a given set of indices by least squares. returns false if there is no unique answer.
+    static bool refine(float *e0, float *e1, uint32_t indices, const float (*pts)[3]) {
+      static const float weight0[4] = { 1, 0, 2.0f/3, 1.0f/3 };
+      float aa = 0, bb = 0, ab = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        float a = weight0[(indices >> (i * 2)) & 3], b = 1 - a;
+        aa += a * a; bb += b * b; ab += a * b;
+        for (unsigned c = 0; c != 3; ++c) { ax[c] += a * pts[i][c]; bx[c] += b * pts[i][c]; }
+      }
+      float det = aa * bb - ab * ab;
+      if (fabsf(det) < 1e-6f) return false;
+      float rdet = 1.0f / det;
+      for (unsigned c = 0; c != 3; ++c) {
+        e0[c] = (ax[c] * bb - bx[c] * ab) * rdet;
+        e1[c] = (bx[c] * aa - ax[c] * ab) * rdet;
+      }
+      return true;
+    }
+
+    // high: try every split of the colours sorted along the axis into four runs
+    // with weights 1, 2/3, 1/3, 0 of the first end point and solve for the end points of each.
+    static bool fit_clusters(float *e0, float *e1, const float (*pts)[3]) {
+      float mean[3], axis[3];
+      principal_axis(mean, axis, pts);
+
+      // sort by projection (insertion sort of 16)
+      unsigned order[16];
+      float proj[16];
+      for (unsigned i = 0; i != 16; ++i) {
+        float p = pts[i][0] * axis[0] + pts[i][1] * axis[1] + pts[i][2] * axis[2];
+        unsigned j = i;
+        for (; j && proj[j-1] < p; --j) {
+          proj[j] = proj[j-1];
+          order[j] = order[j-1];
+        }
+        proj[j] = p;
+        order[j] = i;
+      }
+
+      // prefix sums of the sorted colours
+      float sum[17][3];
+      sum[0][0] = sum[0][1] = sum[0][2] = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        for (unsigned c = 0; c != 3; ++c) sum[i+1][c] = sum[i][c] + pts[order[i]][c];
+      }
+
+      float best = 1e30f;
+      for (unsigned i = 0; i <= 16; ++i) {
+        for (unsigned j = i; j <= 16; ++j) {
+          for (unsigned k = j; k <= 16; ++k) {
+            float n1 = (float)i, n2 = (float)(j - i), n3 = (float)(k - j), n4 = (float)(16 - k);
+            float aa = n1 + n2 * (4.0f/9) + n3 * (1.0f/9);
+            float bb = n4 + n3 * (4.0f/9) + n2 * (1.0f/9);
+            float ab = (n2 + n3) * (2.0f/9);
+            float det = aa * bb - ab * ab;
+            if (det < 1e-6f) continue;
+            float rdet = 1.0f / det;
+            float a[3], b[3], err = 0;
+            for (unsigned c = 0; c != 3; ++c) {
+              float s2 = sum[j][c] - sum[i][c], s3 = sum[k][c] - sum[j][c];
+              float ax = sum[i][c] + s2 * (2.0f/3) + s3 * (1.0f/3);
+              float bx = sum[16][c] - sum[k][c] + s3 * (2.0f/3) + s2 * (1.0f/3);
+              a[c] = clamp01((ax * bb - bx * ab) * rdet);
+              b[c] = clamp01((bx * aa - ax * ab) * rdet);
+              // the error less the sum of squares of the colours, which is the same for every split.
+              err += aa * a[c] * a[c] + bb * b[c] * b[c] + 2 * ab * a[c] * b[c] - 2 * (a[c] * ax + b[c] * bx);
+            }
+            if (err < best) {
+              best = err;
+              for (unsigned c = 0; c != 3; ++c) { e0[c] = a[c]; e1[c] = b[c]; }
+            }
+          }
+        }
+      }
+      return best < 1e30f;
+    }
+
+    // write a colour block, making sure that c0 > c1 for four colour mode.
+    static void write_colour_block(uint8_t *dest, unsigned c0, unsigned c1, uint32_t indices) {
+      if (c0 < c1) {
+        unsigned t = c0; c0 = c1; c1 = t;
+        indices ^= 0x55555555;
+      } else if (c0 == c1) {
+        indices = 0;
+      }
+      dest[0] = (uint8_t)c0; dest[1] = (uint8_t)(c0 >> 8);
+      dest[2] = (uint8_t)c1; dest[3] = (uint8_t)(c1 >> 8);
+      dest[4] = (uint8_t)indices; dest[5] = (uint8_t)(indices >> 8);
+      dest[6] = (uint8_t)(indices >> 16); dest[7] = (uint8_t)(indices >> 24);
+    }
+
+    // encode the colour of a block of 16 RGBA pixels.
+    void encode_colour(uint8_t *dest, const uint8_t *rgba) const {
+      float e0[3], e1[3];
+      unsigned c0, c1;
+      uint32_t indices;
+
+      if (quality == quality_fast) {
+        fit_range(e0, e1, rgba);
+        fit_endpoints(c0, c1, indices, e0, e1, rgba);
+        write_colour_block(dest, c0, c1, indices);
+        return;
+      }
+
+      float pts[16][3];
+      for (unsigned i = 0; i != 16; ++i) {
+        for (unsigned c = 0; c != 3; ++c) pts[i][c] = rgba[i * 4 + c] * (1.0f / 255);
+      }
+
+      unsigned err = ~0u;
+      if (quality == quality_high && fit_clusters(e0, e1, pts)) {
+        err = fit_endpoints(c0, c1, indices, e0, e1, rgba);
+      }
+
+      // the best clusters may be worse once quantised to 565, so try the axis too.
+      fit_axis(e0, e1, pts);
+      unsigned ac0, ac1;
+      uint32_t aindices;
+      unsigned aerr = fit_endpoints(ac0, ac1, aindices, e0, e1, rgba);
+      if (aerr < err) { err = aerr; c0 = ac0; c1 = ac1; indices = aindices; }
+
+      // refine with least squares while it gets better.
+      for (unsigned iter = 0; iter != 2 && err; ++iter) {
+        if (!refine(e0, e1, indices, pts)) break;
+        uint32_t rindices;
+        unsigned rc0, rc1;
+        unsigned rerr = fit_endpoints(rc0, rc1, rindices, e0, e1, rgba);
+        if (rerr >= err) break;
+        err = rerr; c0 = rc0; c1 = rc1; indices = rindices;
+      }
+
+      write_colour_block(dest, c0, c1, indices);
+    }
+
+    // encode the alpha of a block of 16 RGBA pixels (DXT5).
+    void encode_alpha(uint8_t *dest, const uint8_t *rgba) const {
+      int lo = 255, hi = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        int a = rgba[i * 4 + 3];
+        lo = a < lo ? a : lo;
+        hi = a > hi ? a : hi;
+      }
+
+      // eight value mode: a0 > a1, indices 0 and 1 are the ends, 2..7 between a0 and a1.
+      uint64_t indices = 0;
+      if (hi != lo) {
+        int range = hi - lo;
+        for (unsigned i = 0; i != 16; ++i) {
+          int step = ((rgba[i * 4 + 3] - lo) * 14 + range) / (range * 2);
+          unsigned index = step == 7 ? 0 : step == 0 ? 1 : 8 - step;
+          indices |= (uint64_t)index << (i * 3);
+        }
+      }
+      dest[0] = (uint8_t)hi;
+      dest[1] = (uint8_t)lo;
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[2 + i] = (uint8_t)(indices >> (i * 8));
+      }
+    }
+
+  public:
+    dxt_encoder(quality_t quality = quality_normal) : quality(quality) {
+    }
+
+    /// number of rows of 4x4 blocks in an image.
+    static unsigned get_block_rows(unsigned height) {
+      return (height + 3) / 4;
+    }
+
+    /// size in bytes of an image of DXT1 (or DXT5 if "alpha") blocks.
+    static unsigned get_size(unsigned width, unsigned height, bool alpha) {
+      return ((width + 3) / 4) * ((height + 3) / 4) * (alpha ? 16 : 8);
+    }
+
+    /// Encode one block of 16 RGBA pixels, row by row.
+    /// writes 16 bytes of DXT5 if "alpha" is set, otherwise 8 bytes of DXT1.
+    void encode_block(uint8_t *dest, const uint8_t *rgba, bool alpha) const {
+      if (alpha) {
+        encode_alpha(dest, rgba);
+        dest += 8;
+      }
+      encode_colour(dest, rgba);
+    }
+
+    /// Encode rows of blocks [block_row_begin, block_row_end) of an image with num_comps (3 or 4) bytes per pixel.
+    /// Four component images make DXT5 blocks, three component ones DXT1.
+    /// "dest" is the start of the whole encoded image.
+    void encode(uint8_t *dest, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps, unsigned block_row_begin, unsigned block_row_end) const {
+      bool alpha = num_comps == 4;
+      unsigned block_size = alpha ? 16 : 8;
+      unsigned blocks_x = (width + 3) / 4;
+      dest += block_row_begin * blocks_x * block_size;
+
+      uint8_t rgba[64];
+      for (unsigned by = block_row_begin; by != block_row_end; ++by) {
+        for (unsigned bx = 0; bx != blocks_x; ++bx) {
+          // blocks on the right and top edges repeat the last pixels.
+          for (unsigned j = 0; j != 4; ++j) {
+            unsigned y = by * 4 + j < height ? by * 4 + j : height - 1;
+            for (unsigned i = 0; i != 4; ++i) {
+              unsigned x = bx * 4 + i < width ? bx * 4 + i : width - 1;
+              const uint8_t *p = src + (y * width + x) * num_comps;
+              uint8_t *q = rgba + (j * 4 + i) * 4;
+              q[0] = p[0]; q[1] = p[1]; q[2] = p[2];
+              q[3] = alpha ? p[3] : 0xff;
+            }
+          }
+          encode_block(dest, rgba, alpha);
+          dest += block_size;
+        }
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class dxt_encoder_unit_test {
+      // decode a DXT1 colour block to 16 RGB colours.
+      static void decode_colour(int (*rgb)[3], const uint8_t *src) {
+        unsigned c[2] = { src[0] + src[1] * 256u, src[2] + src[3] * 256u };
+        int pal[4][3];
+        for (unsigned j = 0; j != 2; ++j) {
+          unsigned r = c[j] >> 11, g = (c[j] >> 5) & 63, b = c[j] & 31;
+          pal[j][0] = r << 3 | r >> 2; pal[j][1] = g << 2 | g >> 4; pal[j][2] = b << 3 | b >> 2;
+        }
+        for (unsigned i = 0; i != 3; ++i) {
+          // four colours if c0 > c1, otherwise three and black.
+          pal[2][i] = c[0] > c[1] ? (2 * pal[0][i] + pal[1][i]) / 3 : (pal[0][i] + pal[1][i]) / 2;
+          pal[3][i] = c[0] > c[1] ? (pal[0][i] + 2 * pal[1][i]) / 3 : 0;
+        }
+        uint32_t indices = src[4] | src[5] << 8 | src[6] << 16 | (uint32_t)src[7] << 24;
+        for (unsigned k = 0; k != 16; ++k) {
+          memcpy(rgb[k], pal[(indices >> (k * 2)) & 3], sizeof(rgb[k]));
+        }
+      }
+
+      // decode a DXT5 alpha block to 16 alphas.
+      static void decode_alpha(int *alpha, const uint8_t *src) {
+        int a0 = src[0], a1 = src[1], pal[8] = { a0, a1 };
+        for (int i = 1; i != 7; ++i) {
+          pal[i + 1] = a0 > a1 ? ((7 - i) * a0 + i * a1) / 7 : i < 5 ? ((5 - i) * a0 + i * a1) / 5 : i == 5 ? 0 : 255;
+        }
+        uint64_t indices = 0;
+        for (unsigned i = 0; i != 6; ++i) indices |= (uint64_t)src[2 + i] << (i * 8);
+        for (unsigned k = 0; k != 16; ++k) {
+          alpha[k] = pal[(indices >> (k * 3)) & 7];
+        }
+      }
+
+      // largest difference in any component between a block and its encoding.
+      static int max_error(const dxt_encoder &enc, const uint8_t *rgba, bool alpha) {
+        uint8_t block[16];
+        enc.encode_block(block, rgba, alpha);
+        int rgb[16][3], a[16];
+        decode_colour(rgb, block + (alpha ? 8 : 0));
+        if (alpha) decode_alpha(a, block);
+        int result = 0;
+        for (unsigned k = 0; k != 16; ++k) {
+          for (unsigned i = 0; i != (alpha ? 4u : 3u); ++i) {
+            int diff = abs((i == 3 ? a[k] : rgb[k][i]) - rgba[k * 4 + i]);
+            result = diff > result ? diff : result;
+          }
+        }
+        return result;
+      }
+
+    public:
+      dxt_encoder_unit_test() {
+        // a solid colour, a checker of two colours that 565 holds exactly,
+        // a ramp along a line in colour space and a solid colour with an alpha ramp.
+        uint8_t solid[64], two[64], ramp[64], alpha_ramp[64];
+        for (unsigned k = 0; k != 16; ++k) {
+          static const uint8_t colours[2][3] = { { 0x21, 0xc3, 0x42 }, { 0xde, 0x41, 0xbd } };
+          const uint8_t *c = colours[(k ^ (k >> 2)) & 1];
+          uint8_t s[4] = { 200, 100, 50, 255 }, t[4] = { c[0], c[1], c[2], 255 };
+          uint8_t r[4] = { (uint8_t)(k * 16), (uint8_t)(255 - k * 12), (uint8_t)(64 + k * 8), 255 };
+          uint8_t a[4] = { 200, 100, 50, (uint8_t)(k * 17) };
+          memcpy(solid + k * 4, s, 4);
+          memcpy(two + k * 4, t, 4);
+          memcpy(ramp + k * 4, r, 4);
+          memcpy(alpha_ramp + k * 4, a, 4);
+        }
+
+        for (unsigned quality = dxt_encoder::quality_fast; quality <= dxt_encoder::quality_high; ++quality) {
+          dxt_encoder enc((dxt_encoder::quality_t)quality);
+          assert(max_error(enc, solid, false) <= 4 && max_error(enc, solid, true) <= 4);
+          assert(max_error(enc, two, false) <= (quality == dxt_encoder::quality_fast ? 12 : 0));
+          // four colours on a range of 240 are 80 apart.
+          assert(max_error(enc, ramp, false) <= 40);
+          // eight alphas on a range of 255 are 36 apart.
+          assert(max_error(enc, alpha_ramp, true) <= 19);
+        }
+
+        // encoding rows of blocks separately is the same as all at once, and edge blocks repeat the last pixels.
+        enum { width = 6, height = 5 };
+        uint8_t pixels[width * height * 3];
+        for (unsigned i = 0; i != sizeof(pixels); ++i) pixels[i] = (uint8_t)(i * 37 + (i >> 3) * 11);
+        dxt_encoder enc;
+        uint8_t all[4 * 8], rows[4 * 8], edge[8];
+        assert(dxt_encoder::get_block_rows(height) == 2 && dxt_encoder::get_size(width, height, false) == sizeof(all));
+        enc.encode(all, pixels, width, height, 3, 0, 2);
+        enc.encode(rows, pixels, width, height, 3, 1, 2);
+        enc.encode(rows, pixels, width, height, 3, 0, 1);
+        assert(!memcmp(all, rows, sizeof(all)));
+
+        uint8_t block[64];
+        for (unsigned k = 0; k != 16; ++k) {
+          unsigned x = 4 + (k & 3) < width ? 4 + (k & 3) : width - 1;
+          unsigned y = 4 + (k >> 2) < height ? 4 + (k >> 2) : height - 1;
+          memcpy(block + k * 4, pixels + (y * width + x) * 3, 3);
+          block[k * 4 + 3] = 255;
+        }
+        enc.encode_block(edge, block, false);
+        assert(!memcmp(all + 3 * 8, edge, 8));
+      }
+    };
+
+    static dxt_encoder_unit_test dxt_encoder_unit_test;
+  #endif
+}}
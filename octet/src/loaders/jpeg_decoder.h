@@ -8,11 +8,41 @@
 // jpeg file decoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
 namespace octet { namespace loaders {
+  /// Baseline and progressive JPEG decoder.
+  ///
+  /// Huffman codes are decoded with lookup tables, blocks are transformed with the fixed point
+  /// inverse DCT of libjpeg's "islow" (eight columns at a time with SSE2) and colour is converted
+  /// eight pixels at a time.
+  /// Subsampled chroma (4:2:0, 4:2:2) is upsampled with a triangle filter.
+  ///
+  /// Files with restart markers (DRI) are split at the markers and the segments are decoded
+  /// with the parallel_for given to set_parallel_for(), as are the inverse DCT of progressive
+  /// files and the colour conversion. Without one, everything runs on the calling thread.
+  ///
+  /// Example
+  ///
+  ///     jpeg_decoder dec;
+  ///     dec.get_image(bytes, format, width, height, src, src_max);
   class jpeg_decoder {
+  public:
+    /// A range of work items [begin, end).
+    typedef std::function<void (unsigned begin, unsigned end)> range_fn;
+
+    /// Calls fn on ranges that cover [0, num), no longer than grain, possibly on several threads.
+    typedef std::function<void (unsigned num, unsigned grain, const range_fn &fn)> parallel_for_fn;
+
+  private:
     enum { debug = 0 };
 
+    // Huffman codes up to fast_bits long are decoded with one table lookup.
+    enum { fast_bits = 9, fast_size = 1 << fast_bits };
+
+    // the inverse DCT keeps pass1_bits of fraction between its passes.
+    // it uses const_bits fixed point multipliers with 32 bit intermediates.
+    enum { pass1_bits = 2, const_bits = 13 };
+
     // image dimensions
     unsigned precision;
     unsigned width;
@@ -21,6 +51,10 @@ namespace octet { namespace loaders {
 
     // What kind of image
     unsigned sof_code;
+    bool progressive;
+
+    // number of MCUs between restart markers or zero.
+    unsigned restart_interval;
 
     // progressive parameters
     unsigned spectral_start;
@@ -28,54 +62,55 @@ namespace octet { namespace loaders {
     unsigned successive_high;
     unsigned successive_low;
 
-    // how many blocks in a MCU (see mcu_block below)
-    unsigned num_mcu_blocks;
-    unsigned num_components_in_scan;
+    // the image is tiled by MCUs (minimal coding units) of max_hsamp x max_vsamp blocks.
+    unsigned max_hsamp;
+    unsigned max_vsamp;
+    unsigned mcus_x;
+    unsigned mcus_y;
 
-    // skip a number of bits in the file.
-    // there is a special case where every 0xff byte is followed by 0x00
-    static void skip_bits(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      shift -= bits;
-      while (shift < 0) {
-        // grab more bytes
-        uint8_t byte = *src++;
-        acc = acc * 256 + byte;
-        if (byte == 0xff) {
-          // in JPEG, an 0xff byte is followed by a zero
-          // do not advance past any other 0xff marker
-          src += src[0] == 0x00 ? 1 : -1;
-        }
-        shift += 8;
-      }
-    }
+    // true when there are decoded samples to convert.
+    bool have_samples;
+
+    parallel_for_fn parallel_for;
 
     // this is a component usually Y (brightness), Cb (blueness) and Cr (redness)
     // from the file.
     // Some JPEGs have 2x2 blocks for Y and only 1x1 for Cb and Cr (4:2:0)
     // as you can't see colour in high resolution.
+    // Each component is decoded into its own plane of samples at its own resolution.
     struct component {
       uint8_t id;
       uint8_t hsamp;
       uint8_t vsamp;
       uint8_t quantisation_table;
+      uint8_t dc_table;
+      uint8_t ac_table;
+
+      // samples in this component (the rest of the plane is padding to whole MCUs)
+      unsigned width;
+      unsigned height;
+
+      dynarray<uint8_t> plane;
+      unsigned stride;
+
+      // progressive files build up the coefficients of every block over several scans.
+      // blocks_x x blocks_y blocks of 64 coefficients in natural order.
+      dynarray<int16_t> blocks;
+      unsigned blocks_x;
+      unsigned blocks_y;
     } components[4];
 
-    // this is a component that is used for a particluar "scan"
+    // the components that are used for a particluar "scan"
     // of the image data. With progressive files there may be more than
     // one scan.
-    struct scan_component {
-      uint8_t comp;
-      uint8_t ac_table;
-      uint8_t dc_table;
-      unsigned width_in_blocks;
-      unsigned height_in_blocks;
-      int last_dc;
-    } scan_components[4];
+    unsigned num_components_in_scan;
+    unsigned scan_components[4];
 
     // quantisation table. We multiply the dc and ac coefficients by these numbers.
-    // this is the lossy part of the compression
+    // this is the lossy part of the compression.
+    // The tables are in natural order.
     struct quant_table {
-      float table[64];
+      int16_t table[64];
     } quant_tables[4];
 
     // A huffman table maps variable length codes to lengths and values.
@@ -83,41 +118,89 @@ namespace octet { namespace loaders {
     // where each code is distinct from the previous one, even if it has more bits.
     // (ie. 100(0) and 100(1) are less than 1010).
     struct huffman_table {
-      unsigned min_len;
-      uint8_t huffval[257];
-      uint16_t maxcodes[17];
-      uint16_t offset[17];
+      // length << 8 | value for codes up to fast_bits long, indexed by the next fast_bits bits.
+      uint16_t fast[fast_size];
+
+      // for AC tables, a whole coefficient: value << 8 | run << 4 | length of code and value bits.
+      int16_t fast_ac[fast_size];
 
-      // decode a variable length huffman code
-      // we grab the next 16 bits and look in the maxcodes table to see how many
-      // bits the code has. After that, we strip the right hand bits and
-      // look up the code in a table.
-      unsigned decode(unsigned &acc, const uint8_t *&src, int &shift) {
-        unsigned i = min_len;
-        unsigned short acc16 = acc >> shift;
+      // longer codes: the first code of each length (left aligned in 16 bits) that is too big.
+      uint32_t limit[18];
+      int delta[17];
+      uint8_t values[256];
 
-        // find the shortest code that this could be
-        for (; acc16 > maxcodes[i]; ++i) {
+      // true once a DHT segment has built this table.
+      bool defined;
+    } huffman_tables[2][4];
+
+    // Bits of the entropy coded data, most significant bit first.
+    // In JPEG, an 0xff byte is followed by a zero, which we skip.
+    // At any other marker we stop and read zeros.
+    struct bit_reader {
+      uint64_t acc;
+      int count;
+      const uint8_t *src;
+      const uint8_t *src_max;
+
+      void init(const uint8_t *src_, const uint8_t *src_max_) {
+        acc = 0;
+        count = 0;
+        src = src_;
+        src_max = src_max_;
+      }
+
+      void refill() {
+        while (count <= 56) {
+          unsigned byte = 0;
+          if (src < src_max) {
+            byte = *src;
+            if (byte != 0xff) {
+              src++;
+            } else if (src + 1 < src_max && src[1] == 0x00) {
+              src += 2;
+            } else {
+              // do not advance past any other 0xff marker
+              byte = 0;
+            }
+          }
+          acc |= (uint64_t)byte << (56 - count);
+          count += 8;
         }
+      }
 
-        unsigned code = ( acc16 >> (15-i) ) - offset[i];
-        skip_bits(i + 1, acc, src, shift);
-        return huffval[code];
+      unsigned peek(unsigned bits) const {
+        return (unsigned)(acc >> (64 - bits));
       }
-    } huffman_tables[2][4];
 
-    // a mcu_block is an 8x8 component of a MCU
-    // (Minimal coding unit). The image is tiled by MCUs
-    // which have components.
-    struct mcu_block {
-      huffman_table *dc_table;
-      huffman_table *ac_table;
-      quant_table *quant;
-      scan_component *scan_comp;
-    } mcu_blocks[8];
+      void skip(unsigned bits) {
+        acc <<= bits;
+        count -= bits;
+      }
 
-    float dct_coeffs[8*64];
-    float ycrcb_values[8*64];
+      // negative numbers need to be twiddled as all numbers coming in are positive.
+      int receive_extend(unsigned bits) {
+        int v = (int)peek(bits);
+        skip(bits);
+        return v < (1 << (bits-1)) ? v - (1 << bits) + 1 : v;
+      }
+
+      // get 1 to 16 bits.
+      unsigned get_bits(unsigned bits) {
+        if (count < (int)bits) refill();
+        unsigned v = peek(bits);
+        skip(bits);
+        return v;
+      }
+    };
+
+    // Everything that changes while decoding the entropy coded data between two restart markers.
+    // Each segment has its own, so that segments can be decoded on different threads.
+    struct segment_state {
+      int16_t coeffs[64];
+      bit_reader br;
+      int last_dc[4];
+      unsigned eobrun;
+    };
 
     unsigned u2(const uint8_t *src) {
       return src[0] * 256 + src[1];
@@ -125,8 +208,9 @@ namespace octet { namespace loaders {
 
     // dct coefficients are stored in zig-zag order because the top
     // left is far more common.
-    uint8_t zig_zag(unsigned i) {
-      static const uint8_t zig_zag_[64] = {
+    // The extra entries catch runs that go past the end of a bad block.
+    static const uint8_t *de_zig_zag() {
+      static const uint8_t zig_zag_[64+16] = {
         0, 1, 8, 16, 9, 2, 3, 10,
         17, 24, 32, 25, 18, 11, 4, 5,
         12, 19, 26, 33, 40, 48, 41, 34,
@@ -135,240 +219,772 @@ namespace octet { namespace loaders {
         29, 22, 15, 23, 30, 37, 44, 51,
         58, 59, 52, 45, 38, 31, 39, 46,
         53, 60, 61, 54, 47, 55, 62, 63,
+        63, 63, 63, 63, 63, 63, 63, 63,
+        63, 63, 63, 63, 63, 63, 63, 63,
       };
-      return i < 63 ? zig_zag_[i] : 63;
+      return zig_zag_;
     }
 
-    // negative numbers need to be twiddled as all numbers coming in are positive.
-    static int extend(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      uint16_t acc16 = acc >> shift;
-      unsigned v = acc16 >> (16 - bits);
-      return v < ( 1u << ( bits-1 ) ) ? (int)v + ( -1 << bits ) + 1 : (int)v;
+    // clamp to 0..255 range.
+    static OCTET_HOT uint8_t clamp(int v) {
+      return (unsigned)v > 255 ? (uint8_t)(v < 0 ? 0 : 255) : (uint8_t)v;
     }
 
-    // decode one block of an MCU which may contain many blocks
-    // The Y component may have four blocks, for example, and only one each of Cr, Cb
-    void decode_mcu_block(unsigned block_num, unsigned &acc, const uint8_t *&src, int &shift, float *outptr) {
-      mcu_block &block = mcu_blocks[block_num];
-
-      unsigned value = block.dc_table->decode(acc, src, shift);
-
-      int dc = 0;
-      if (value) {
-        dc = extend(value, acc, src, shift);
-        skip_bits(value, acc, src, shift);
-        //if (debug) printf("dc=%d\n", dc);
-      }
-      int abs_dc = block.scan_comp->last_dc += dc;
-      outptr[0] = abs_dc * block.quant->table[0];
-
-      for (int ac_coef = 1; ac_coef < 64; ++ac_coef) {
-        unsigned value = block.ac_table->decode(acc, src, shift);
-        unsigned skip = value >> 4;
-        value &= 0x0f;
-        ac_coef += skip;
-
-        if (value) {
-          int ac = extend(value, acc, src, shift);
-          skip_bits(value, acc, src, shift);
-          //if (debug) printf("ac=%d,%d coef=%d zig_zag=%d\n", skip, ac, ac_coef, zig_zag(ac_coef));
-          outptr[zig_zag(ac_coef)] = (float)ac * block.quant->table[ac_coef];
-        } else if (skip != 15) {
-          break;
+    // build the lookup tables from the counts of codes of each length.
+    bool build_huffman(huffman_table &h, const uint8_t *num_codes, const uint8_t *values, unsigned count, bool is_ac) {
+      h.defined = false;
+      memset(h.fast, 0, sizeof(h.fast));
+      memcpy(h.values, values, count);
+
+      unsigned code = 0;
+      unsigned index = 0;
+      for (unsigned len = 1; len <= 16; ++len) {
+        h.delta[len] = (int)index - (int)code;
+        for (unsigned i = 0; i != num_codes[len-1]; ++i, ++code, ++index) {
+          if (code >= (1u << len)) return false;
+          if (len <= fast_bits) {
+            unsigned first = code << (fast_bits - len);
+            for (unsigned j = 0; j != 1u << (fast_bits - len); ++j) {
+              h.fast[first + j] = (uint16_t)(len << 8 | values[index]);
+            }
+          }
         }
+        h.limit[len] = code << (16 - len);
+        code *= 2;
+      }
+      h.limit[17] = 0xffffffff;
+
+      // for AC tables, decode the value too if it fits.
+      memset(h.fast_ac, 0, sizeof(h.fast_ac));
+      if (is_ac) {
+        for (unsigned i = 0; i != fast_size; ++i) {
+          unsigned entry = h.fast[i];
+          unsigned len = entry >> 8;
+          unsigned run = (entry >> 4) & 15;
+          unsigned size = entry & 15;
+          if (len && size && len + size <= fast_bits) {
+            int v = (int)((i << len) & (fast_size - 1)) >> (fast_bits - size);
+            if (v < (1 << (size - 1))) v += 1 - (1 << size);
+            if (v >= -128 && v <= 127) {
+              h.fast_ac[i] = (int16_t)(v * 256 + run * 16 + len + size);
+            }
+          }
+        }
+      }
+      h.defined = true;
+      return true;
+    }
+
+    // decode a variable length huffman code
+    // most codes are found with one look up. For longer ones,
+    // we look in the limit table to see how many bits the code has.
+    // returns -1 for a bad code. The reader must have at least 16 bits.
+    static OCTET_HOT int decode_huffman(bit_reader &br, const huffman_table &h) {
+      unsigned entry = h.fast[br.peek(fast_bits)];
+      if (entry) {
+        br.skip(entry >> 8);
+        return entry & 0xff;
       }
+
+      unsigned acc16 = br.peek(16);
+      unsigned len = fast_bits + 1;
+      while (acc16 >= h.limit[len]) {
+        len++;
+      }
+      if (len > 16) return -1;
+
+      int index = (int)(acc16 >> (16 - len)) + h.delta[len];
+      if ((unsigned)index >= 256) return -1;
+      br.skip(len);
+      return h.values[index];
+    }
+
+    // decode one block of an MCU into s.coeffs in natural order.
+    // returns the number of coefficients decoded in zig-zag order (1 means only DC) or 0 for bad data.
+    OCTET_HOT unsigned decode_block(segment_state &s, unsigned comp) const {
+      const component &c = components[comp];
+      const huffman_table &dc_table = huffman_tables[0][c.dc_table];
+      const huffman_table &ac_table = huffman_tables[1][c.ac_table];
+      const uint8_t *zig_zag = de_zig_zag();
+      bit_reader &br = s.br;
+      int16_t *coeffs = s.coeffs;
+
+      memset(coeffs, 0, sizeof(s.coeffs));
+      br.refill();
+
+      int value = decode_huffman(br, dc_table);
+      if (value < 0 || value > 16) return 0;
+
+      int dc = value ? br.receive_extend(value) : 0;
+      s.last_dc[comp] += dc;
+      coeffs[0] = (int16_t)s.last_dc[comp];
+
+      unsigned k = 1;
+      unsigned num_coeffs = 1;
+      do {
+        if (br.count < 32) br.refill();
+
+        // short code and small value: one look up.
+        int fast = ac_table.fast_ac[br.peek(fast_bits)];
+        if (fast) {
+          k += (fast >> 4) & 15;
+          br.skip(fast & 15);
+          coeffs[zig_zag[k++]] = (int16_t)(fast >> 8);
+          num_coeffs = k;
+          continue;
+        }
+
+        int rs = decode_huffman(br, ac_table);
+        if (rs < 0) return 0;
+        unsigned run = rs >> 4;
+        unsigned size = rs & 15;
+        if (size) {
+          k += run;
+          coeffs[zig_zag[k++]] = (int16_t)br.receive_extend(size);
+          num_coeffs = k;
+        } else if (run == 15) {
+          k += 16;
+        } else {
+          // end of block
+          break;
+        }
+      } while (k < 64);
+
       if (debug) {
         for (int j = 0; j != 8; ++j) {
           for (int i = 0; i != 8; ++i) {
-            printf("%3.0f ", outptr[i+j*8]);
+            printf("%4d ", coeffs[i+j*8]);
           }
           printf("\n");
         }
       }
+      return num_coeffs;
     }
 
-    // one dimensional inverse DCT.
-    // c0 is the DC term and c1..c7 increase in frequency
-    // example: c0 = 128, c1..c7 = 0 -> 128, 128, 128, 128, 128, 128, 128, 128
-    // todo: improve this!
-    OCTET_HOT void idct(float &c0, float &c1, float &c2, float &c3, float &c4, float &c5, float &c6, float &c7) {
-      float c2c6_1 = (c2 + c6) * 0.541196100f;
-      float c2c6_2 = c2c6_1 + c6 * -1.847759065f;
-      float c2c6_3 = c2c6_1 + c2 * 0.765366865f;
-    
-      float c0c4_1 = c0 + c4;
-      float c0c4_2 = c0 - c4;
-    
-      float ceven_1 = c0c4_1 + c2c6_3;
-      float ceven_2 = c0c4_1 - c2c6_3;
-      float ceven_3 = c0c4_2 + c2c6_2;
-      float ceven_4 = c0c4_2 - c2c6_2;
-    
-      float c1c7 = c7 + c1;
-      float c3c5 = c5 + c3;
-      float c7c3 = c7 + c3;
-      float c5c1 = c5 + c1;
-      float codd_0 = (c7c3 + c5c1) * 1.175875602f;
-    
-      float codd_4 = c7 * 0.298631336f;
-      float codd_3 = c5 * 2.053119869f;
-      float codd_2 = c3 * 3.072711026f;
-      float codd_1 = c1 * 1.501321110f;
-      c1c7 = c1c7 * -0.899976223f;
-      c3c5 = c3c5 * -2.562915447f;
-      c7c3 = c7c3 * -1.961570560f;
-      c5c1 = c5c1 * -0.390180644f;
-    
-      c7c3 += codd_0;
-      c5c1 += codd_0;
-    
-      codd_4 += c1c7 + c7c3;
-      codd_3 += c3c5 + c5c1;
-      codd_2 += c3c5 + c7c3;
-      codd_1 += c1c7 + c5c1;
-    
-      c0 = ceven_1 + codd_1;
-      c7 = ceven_1 - codd_1;
-      c1 = ceven_3 + codd_2;
-      c6 = ceven_3 - codd_2;
-      c2 = ceven_4 + codd_3;
-      c5 = ceven_4 - codd_3;
-      c3 = ceven_2 + codd_4;
-      c4 = ceven_2 - codd_4;
+    // progressive files send the coefficients of a block in several scans.
+    // a scan has either the DC or a band of AC coefficients (spectral_start..spectral_end)
+    // and either the top bits (first scan) or one more bit (refinement) of them.
+    // See JPEG spec G.1.2
+
+    // first scan of the DC coefficient: like baseline, scaled by the missing low bits.
+    bool decode_dc_first(segment_state &s, unsigned comp, int16_t *block) const {
+      s.br.refill();
+      int value = decode_huffman(s.br, huffman_tables[0][components[comp].dc_table]);
+      if (value < 0 || value > 16) return false;
+      s.last_dc[comp] += value ? s.br.receive_extend(value) : 0;
+      block[0] = (int16_t)(s.last_dc[comp] * (1 << successive_low));
+      return true;
+    }
+
+    // refine the DC coefficient by one bit.
+    bool decode_dc_refine(segment_state &s, int16_t *block) const {
+      if (s.br.get_bits(1)) block[0] |= (int16_t)(1 << successive_low);
+      return true;
+    }
+
+    // first scan of a band of AC coefficients. "eobrun" counts blocks with no more coefficients in the band.
+    bool decode_ac_first(segment_state &s, unsigned comp, int16_t *block) const {
+      if (s.eobrun) {
+        s.eobrun--;
+        return true;
+      }
+
+      const huffman_table &ac_table = huffman_tables[1][components[comp].ac_table];
+      const uint8_t *zig_zag = de_zig_zag();
+      bit_reader &br = s.br;
+      unsigned k = spectral_start;
+      do {
+        if (br.count < 32) br.refill();
+        int rs = decode_huffman(br, ac_table);
+        if (rs < 0) return false;
+        unsigned run = rs >> 4;
+        unsigned size = rs & 15;
+        if (size) {
+          k += run;
+          block[zig_zag[k++]] = (int16_t)(br.receive_extend(size) * (1 << successive_low));
+        } else if (run == 15) {
+          k += 16;
+        } else {
+          // end of band for this block and the next "eobrun" blocks.
+          s.eobrun = (1 << run) - 1;
+          if (run) s.eobrun += br.get_bits(run);
+          break;
+        }
+      } while (k <= spectral_end);
+      return true;
+    }
+
+    // add one bit to a coefficient that is already non-zero.
+    static void refine_coeff(bit_reader &br, int16_t *coeff, int bit) {
+      if (br.get_bits(1) && (*coeff & bit) == 0) {
+        *coeff += (int16_t)(*coeff > 0 ? bit : -bit);
+      }
+    }
+
+    // refine a band of AC coefficients by one bit.
+    // coefficients that were zero may become +-1 (at this bit), the others get a correction bit each.
+    bool decode_ac_refine(segment_state &s, unsigned comp, int16_t *block) const {
+      const uint8_t *zig_zag = de_zig_zag();
+      bit_reader &br = s.br;
+      int bit = 1 << successive_low;
+      unsigned k = spectral_start;
+
+      if (s.eobrun) {
+        s.eobrun--;
+        for (; k <= spectral_end; ++k) {
+          int16_t *coeff = block + zig_zag[k];
+          if (*coeff) refine_coeff(br, coeff, bit);
+        }
+        return true;
+      }
+
+      const huffman_table &ac_table = huffman_tables[1][components[comp].ac_table];
+      do {
+        if (br.count < 32) br.refill();
+        int rs = decode_huffman(br, ac_table);
+        if (rs < 0) return false;
+        unsigned run = rs >> 4;
+        unsigned size = rs & 15;
+        int value = 0;
+        if (size == 0) {
+          if (run != 15) {
+            // end of band: refine the rest of this block.
+            s.eobrun = (1 << run) - 1;
+            if (run) s.eobrun += br.get_bits(run);
+            run = 64;
+          }
+          // else skip 16 zero coefficients, refining non-zero ones on the way.
+        } else if (size == 1) {
+          value = br.get_bits(1) ? bit : -bit;
+        } else {
+          return false;
+        }
+
+        // skip "run" zero coefficients and put the new one in the next zero.
+        while (k <= spectral_end) {
+          int16_t *coeff = block + zig_zag[k++];
+          if (*coeff) {
+            refine_coeff(br, coeff, bit);
+          } else if (run == 0) {
+            *coeff = (int16_t)value;
+            break;
+          } else {
+            run--;
+          }
+        }
+      } while (k <= spectral_end);
+      return true;
+    }
+
+    // one dimensional inverse DCT using the Loeffler, Ligtenberg and Moschytz factorisation,
+    // with the const_bits multipliers of libjpeg's jidctint.c.
+    // c0 is the DC term and c1..c7 increase in frequency. The results are scaled by 1 << const_bits.
+    #define OCTET_JPEG_IDCT_1D(c0, c1, c2, c3, c4, c5, c6, c7) { \
+      int z1 = (c2 + c6) * 4433; /* 0.541196100 */ \
+      int t2 = z1 - c6 * 15137; /* 1.847759065 */ \
+      int t3 = z1 + c2 * 6270; /* 0.765366865 */ \
+      int t0 = (c0 + c4) * (1 << const_bits); \
+      int t1 = (c0 - c4) * (1 << const_bits); \
+      int e0 = t0 + t3, e3 = t0 - t3; \
+      int e1 = t1 + t2, e2 = t1 - t2; \
+      int z3 = c7 + c3, z4 = c5 + c1; \
+      int z5 = (z3 + z4) * 9633; /* 1.175875602 */ \
+      int za = (c7 + c1) * -7373; /* -0.899976223 */ \
+      int zb = (c5 + c3) * -20995; /* -2.562915447 */ \
+      z3 = z3 * -16069 + z5; /* -1.961570560 */ \
+      z4 = z4 * -3196 + z5; /* -0.390180644 */ \
+      int o0 = c7 * 2446 + za + z3; /* 0.298631336 */ \
+      int o1 = c5 * 16819 + zb + z4; /* 2.053119869 */ \
+      int o2 = c3 * 25172 + zb + z3; /* 3.072711026 */ \
+      int o3 = c1 * 12299 + za + z4; /* 1.501321110 */ \
+      c0 = e0 + o3; c7 = e0 - o3; \
+      c1 = e1 + o2; c6 = e1 - o2; \
+      c2 = e2 + o1; c5 = e2 - o1; \
+      c3 = e3 + o0; c4 = e3 - o0; \
     }
 
     // Two dimensional inverse DCT
-    // we can do the rows and columns separately.
-    // Optimisations include spotting blank rows and columns, but this
-    // is just a reference design.
-    void inverse_dct(float *inptr) {
-      // do rows
+    // we can do the columns and rows separately.
+    // columns with only a DC term are common and skip the transform.
+    static OCTET_HOT void inverse_dct_scalar(uint8_t *dest, int stride, const int16_t *inptr, const int16_t *quant) {
+      int work[64];
+
+      // do columns, keeping pass1_bits of fraction.
+      const int col_shift = const_bits - pass1_bits;
+      const int col_round = 1 << (col_shift - 1);
       for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*0+i], inptr[8*1+i], inptr[8*2+i], inptr[8*3+i], inptr[8*4+i], inptr[8*5+i], inptr[8*6+i], inptr[8*7+i]);
+        const int16_t *in = inptr + i;
+        const int16_t *q = quant + i;
+        int *ws = work + i;
+        if (!(in[8] | in[16] | in[24] | in[32] | in[40] | in[48] | in[56])) {
+          int dc = in[0] * q[0] * (1 << pass1_bits);
+          for (unsigned j = 0; j != 8; ++j) ws[j*8] = dc;
+          continue;
+        }
+        int c0 = in[0] * q[0], c1 = in[8] * q[8], c2 = in[16] * q[16], c3 = in[24] * q[24];
+        int c4 = in[32] * q[32], c5 = in[40] * q[40], c6 = in[48] * q[48], c7 = in[56] * q[56];
+        OCTET_JPEG_IDCT_1D(c0, c1, c2, c3, c4, c5, c6, c7)
+        ws[0] = (c0 + col_round) >> col_shift; ws[8] = (c1 + col_round) >> col_shift;
+        ws[16] = (c2 + col_round) >> col_shift; ws[24] = (c3 + col_round) >> col_shift;
+        ws[32] = (c4 + col_round) >> col_shift; ws[40] = (c5 + col_round) >> col_shift;
+        ws[48] = (c6 + col_round) >> col_shift; ws[56] = (c7 + col_round) >> col_shift;
       }
 
-      // do columns
-      for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*i+0], inptr[8*i+1], inptr[8*i+2], inptr[8*i+3], inptr[8*i+4], inptr[8*i+5], inptr[8*i+6], inptr[8*i+7]);
+      // do rows, removing the scale of 8 and the fraction bits and adding 128.
+      // the rounding and the 128 go in the DC term, which the transform adds to every output.
+      const int dc_shift = pass1_bits + 3;
+      const int shift = const_bits + dc_shift;
+      const int bias = (128 << dc_shift) + (1 << (dc_shift-1));
+      for (unsigned j = 0; j != 8; ++j) {
+        int *ws = work + j * 8;
+        uint8_t *out = dest + j * stride;
+        int c0 = ws[0] + bias, c1 = ws[1], c2 = ws[2], c3 = ws[3];
+        int c4 = ws[4], c5 = ws[5], c6 = ws[6], c7 = ws[7];
+        if (!(c1 | c2 | c3 | c4 | c5 | c6 | c7)) {
+          memset(out, clamp(c0 >> dc_shift), 8);
+          continue;
+        }
+        OCTET_JPEG_IDCT_1D(c0, c1, c2, c3, c4, c5, c6, c7)
+        out[0] = clamp(c0 >> shift); out[1] = clamp(c1 >> shift);
+        out[2] = clamp(c2 >> shift); out[3] = clamp(c3 >> shift);
+        out[4] = clamp(c4 >> shift); out[5] = clamp(c5 >> shift);
+        out[6] = clamp(c6 >> shift); out[7] = clamp(c7 >> shift);
       }
+    }
 
-      if (debug) {
-        for (int j = 0; j != 8; ++j) {
-          for (int i = 0; i != 8; ++i) {
-            printf("%f ", inptr[i+j*8]);
+    #undef OCTET_JPEG_IDCT_1D
+
+    #if OCTET_SSE
+      // a pair of 16 bit constants for _mm_madd_epi16: x * a + y * b for interleaved x and y.
+      static OCTET_HOT __m128i pair_sse2(short a, short b) {
+        return _mm_set_epi16(b, a, b, a, b, a, b, a);
+      }
+
+      // (x + round) >> shift in 32 bits for two sets of four lanes, saturated back to eight 16 bit lanes.
+      static OCTET_HOT __m128i descale_sse2(__m128i lo, __m128i hi, __m128i round, __m128i shift) {
+        return _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(lo, round), shift), _mm_sra_epi32(_mm_add_epi32(hi, round), shift));
+      }
+
+      // the scalar inverse DCT of eight columns at once. each register is a row.
+      // products are summed in 32 bits with _mm_madd_epi16, so the results are the same as the scalar version.
+      static OCTET_HOT void idct_columns_sse2(__m128i *r, __m128i round, __m128i shift) {
+        // even part
+        __m128i c26_lo = _mm_unpacklo_epi16(r[2], r[6]), c26_hi = _mm_unpackhi_epi16(r[2], r[6]);
+        __m128i c04_lo = _mm_unpacklo_epi16(r[0], r[4]), c04_hi = _mm_unpackhi_epi16(r[0], r[4]);
+        __m128i k_t3 = pair_sse2(10703, 4433), k_t2 = pair_sse2(4433, -10704);
+        __m128i k_t0 = pair_sse2(1 << const_bits, 1 << const_bits), k_t1 = pair_sse2(1 << const_bits, -(1 << const_bits));
+        __m128i t3_lo = _mm_madd_epi16(c26_lo, k_t3), t3_hi = _mm_madd_epi16(c26_hi, k_t3);
+        __m128i t2_lo = _mm_madd_epi16(c26_lo, k_t2), t2_hi = _mm_madd_epi16(c26_hi, k_t2);
+        __m128i t0_lo = _mm_madd_epi16(c04_lo, k_t0), t0_hi = _mm_madd_epi16(c04_hi, k_t0);
+        __m128i t1_lo = _mm_madd_epi16(c04_lo, k_t1), t1_hi = _mm_madd_epi16(c04_hi, k_t1);
+        __m128i e0_lo = _mm_add_epi32(t0_lo, t3_lo), e0_hi = _mm_add_epi32(t0_hi, t3_hi);
+        __m128i e3_lo = _mm_sub_epi32(t0_lo, t3_lo), e3_hi = _mm_sub_epi32(t0_hi, t3_hi);
+        __m128i e1_lo = _mm_add_epi32(t1_lo, t2_lo), e1_hi = _mm_add_epi32(t1_hi, t2_hi);
+        __m128i e2_lo = _mm_sub_epi32(t1_lo, t2_lo), e2_hi = _mm_sub_epi32(t1_hi, t2_hi);
+
+        // odd part, with the shared z terms folded into the constants.
+        __m128i z3 = _mm_add_epi16(r[7], r[3]), z4 = _mm_add_epi16(r[5], r[1]);
+        __m128i z34_lo = _mm_unpacklo_epi16(z3, z4), z34_hi = _mm_unpackhi_epi16(z3, z4);
+        __m128i c71_lo = _mm_unpacklo_epi16(r[7], r[1]), c71_hi = _mm_unpackhi_epi16(r[7], r[1]);
+        __m128i c53_lo = _mm_unpacklo_epi16(r[5], r[3]), c53_hi = _mm_unpackhi_epi16(r[5], r[3]);
+        __m128i k_z3 = pair_sse2(-6436, 9633), k_z4 = pair_sse2(9633, 6437);
+        __m128i k_o0 = pair_sse2(-4927, -7373), k_o3 = pair_sse2(-7373, 4926);
+        __m128i k_o1 = pair_sse2(-4176, -20995), k_o2 = pair_sse2(-20995, 4177);
+        __m128i z3_lo = _mm_madd_epi16(z34_lo, k_z3), z3_hi = _mm_madd_epi16(z34_hi, k_z3);
+        __m128i z4_lo = _mm_madd_epi16(z34_lo, k_z4), z4_hi = _mm_madd_epi16(z34_hi, k_z4);
+        __m128i o0_lo = _mm_add_epi32(_mm_madd_epi16(c71_lo, k_o0), z3_lo), o0_hi = _mm_add_epi32(_mm_madd_epi16(c71_hi, k_o0), z3_hi);
+        __m128i o3_lo = _mm_add_epi32(_mm_madd_epi16(c71_lo, k_o3), z4_lo), o3_hi = _mm_add_epi32(_mm_madd_epi16(c71_hi, k_o3), z4_hi);
+        __m128i o1_lo = _mm_add_epi32(_mm_madd_epi16(c53_lo, k_o1), z4_lo), o1_hi = _mm_add_epi32(_mm_madd_epi16(c53_hi, k_o1), z4_hi);
+        __m128i o2_lo = _mm_add_epi32(_mm_madd_epi16(c53_lo, k_o2), z3_lo), o2_hi = _mm_add_epi32(_mm_madd_epi16(c53_hi, k_o2), z3_hi);
+
+        r[0] = descale_sse2(_mm_add_epi32(e0_lo, o3_lo), _mm_add_epi32(e0_hi, o3_hi), round, shift);
+        r[7] = descale_sse2(_mm_sub_epi32(e0_lo, o3_lo), _mm_sub_epi32(e0_hi, o3_hi), round, shift);
+        r[1] = descale_sse2(_mm_add_epi32(e1_lo, o2_lo), _mm_add_epi32(e1_hi, o2_hi), round, shift);
+        r[6] = descale_sse2(_mm_sub_epi32(e1_lo, o2_lo), _mm_sub_epi32(e1_hi, o2_hi), round, shift);
+        r[2] = descale_sse2(_mm_add_epi32(e2_lo, o1_lo), _mm_add_epi32(e2_hi, o1_hi), round, shift);
+        r[5] = descale_sse2(_mm_sub_epi32(e2_lo, o1_lo), _mm_sub_epi32(e2_hi, o1_hi), round, shift);
+        r[3] = descale_sse2(_mm_add_epi32(e3_lo, o0_lo), _mm_add_epi32(e3_hi, o0_hi), round, shift);
+        r[4] = descale_sse2(_mm_sub_epi32(e3_lo, o0_lo), _mm_sub_epi32(e3_hi, o0_hi), round, shift);
+      }
+
+      static OCTET_HOT void transpose_sse2(__m128i *r) {
+        __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+        __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+        __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+        __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+        r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+        r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+        r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+        r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+      }
+
+      // SSE2 version of inverse_dct_scalar: columns, then rows of the transposed block.
+      static OCTET_HOT void inverse_dct_sse2(uint8_t *dest, int stride, const int16_t *inptr, const int16_t *quant) {
+        __m128i r[8];
+        for (unsigned i = 0; i != 8; ++i) {
+          r[i] = _mm_mullo_epi16(_mm_loadu_si128((const __m128i*)(inptr + i*8)), _mm_loadu_si128((const __m128i*)(quant + i*8)));
+        }
+        // columns keep pass1_bits of fraction.
+        const int col_shift = const_bits - pass1_bits;
+        idct_columns_sse2(r, _mm_set1_epi32(1 << (col_shift - 1)), _mm_cvtsi32_si128(col_shift));
+        transpose_sse2(r);
+
+        // rows remove the scale of 8 and the fraction bits and add 128.
+        const int row_shift = const_bits + pass1_bits + 3;
+        idct_columns_sse2(r, _mm_set1_epi32((128 << row_shift) + (1 << (row_shift - 1))), _mm_cvtsi32_si128(row_shift));
+        transpose_sse2(r);
+
+        for (unsigned i = 0; i != 8; i += 2) {
+          __m128i bytes = _mm_packus_epi16(r[i], r[i+1]);
+          _mm_storel_epi64((__m128i*)(dest + i * stride), bytes);
+          _mm_storel_epi64((__m128i*)(dest + (i+1) * stride), _mm_unpackhi_epi64(bytes, bytes));
+        }
+      }
+    #endif
+
+    // transform a block of coefficients to 8x8 samples.
+    static OCTET_HOT void inverse_dct(uint8_t *dest, int stride, const int16_t *coeffs, const int16_t *quant, unsigned num_coeffs) {
+      if (num_coeffs <= 1) {
+        // flat block: only the DC term.
+        const int shift = 3;
+        uint8_t value = clamp((coeffs[0] * quant[0] + (128 << shift) + (1 << (shift-1))) >> shift);
+        for (unsigned j = 0; j != 8; ++j) {
+          memset(dest + j * stride, value, 8);
+        }
+      } else {
+        #if OCTET_SSE
+          inverse_dct_sse2(dest, stride, coeffs, quant);
+        #else
+          inverse_dct_scalar(dest, stride, coeffs, quant);
+        #endif
+      }
+    }
+
+    // decode one block of a scan: straight into the plane for baseline, into the coefficients for progressive.
+    OCTET_HOT bool decode_block_at(segment_state &s, unsigned comp, unsigned bx, unsigned by) {
+      component &c = components[comp];
+      if (!progressive) {
+        unsigned num_coeffs = decode_block(s, comp);
+        if (!num_coeffs) return false;
+        const int16_t *quant = quant_tables[c.quantisation_table].table;
+        inverse_dct(c.plane.data() + by * 8 * c.stride + bx * 8, c.stride, s.coeffs, quant, num_coeffs);
+        return true;
+      }
+
+      int16_t *block = c.blocks.data() + (by * c.blocks_x + bx) * 64;
+      if (spectral_start == 0) {
+        return successive_high == 0 ? decode_dc_first(s, comp, block) : decode_dc_refine(s, block);
+      } else {
+        return successive_high == 0 ? decode_ac_first(s, comp, block) : decode_ac_refine(s, comp, block);
+      }
+    }
+
+    // number of MCUs in the current scan.
+    // a single component is not interleaved: its "MCUs" are single blocks covering only the component.
+    unsigned get_num_scan_mcus() const {
+      if (num_components_in_scan == 1) {
+        const component &c = components[scan_components[0]];
+        return ((c.width + 7) / 8) * ((c.height + 7) / 8);
+      } else {
+        return mcus_x * mcus_y;
+      }
+    }
+
+    // decode MCUs [begin, end) of the current scan.
+    bool decode_mcus(segment_state &s, unsigned begin, unsigned end) {
+      if (num_components_in_scan == 1) {
+        unsigned comp = scan_components[0];
+        unsigned xblocks = (components[comp].width + 7) / 8;
+        for (unsigned m = begin; m != end; ++m) {
+          if (!decode_block_at(s, comp, m % xblocks, m / xblocks)) return false;
+        }
+      } else {
+        // each MCU has hsamp x vsamp blocks of each component.
+        for (unsigned m = begin; m != end; ++m) {
+          unsigned x = m % mcus_x, y = m / mcus_x;
+          for (unsigned i = 0; i != num_components_in_scan; ++i) {
+            unsigned comp = scan_components[i];
+            const component &c = components[comp];
+            for (unsigned v = 0; v != c.vsamp; ++v) {
+              for (unsigned h = 0; h != c.hsamp; ++h) {
+                if (!decode_block_at(s, comp, x * c.hsamp + h, y * c.vsamp + v)) return false;
+              }
+            }
           }
-          printf("\n");
         }
       }
+      return true;
+    }
+
+    // run fn over [0, num), on many threads if we have a parallel_for.
+    void run_parallel(unsigned num, unsigned grain, const range_fn &fn) {
+      if (parallel_for && num > grain) {
+        parallel_for(num, grain, fn);
+      } else if (num) {
+        fn(0, num);
+      }
     }
 
-    // clamp to 0..255 range without using branches.
-    // fabsf is usually implemented in hardware (with fast math options)
-    OCTET_HOT uint8_t clamp(float v) {
-      // v + fabsf(v) = 2v when v > 0
-      // v + fabsf(v) = 0  when v < 0
-      float clamp0 = v + fabsf(v);
+    // decode the entropy coded data of a scan starting at src.
+    // Restart markers split the scan into segments which start afresh, so we find them all first
+    // and decode the segments in parallel.
+    // returns the end of the scan or null for bad data.
+    const uint8_t *decode_scan(const uint8_t *src, const uint8_t *src_end) {
+      dynarray<const uint8_t *> segments;
+      segments.push_back(src);
+      const uint8_t *scan_end = src_end;
+      for (const uint8_t *p = src; p + 1 < src_end; ) {
+        p = (const uint8_t *)memchr(p, 0xff, src_end - 1 - p);
+        if (!p) break;
+        unsigned marker = p[1];
+        if (marker == 0xff) {
+          p++;
+        } else if (marker == 0x00) {
+          p += 2;
+        } else if (marker >= 0xd0 && marker <= 0xd7) {
+          p += 2;
+          segments.push_back(p);
+        } else {
+          scan_end = p;
+          break;
+        }
+      }
+
+      unsigned num_mcus = get_num_scan_mcus();
+      unsigned segment_mcus = restart_interval ? restart_interval : num_mcus;
+      unsigned num_segments = (num_mcus + segment_mcus - 1) / segment_mcus;
+      if (debug) printf("scan: %d mcus %d segments %d markers\n", num_mcus, num_segments, segments.size() - 1);
 
-      // v - fabsf(v-n) = n when v > n
-      // v - fabsf(v-n) = 2v - n when v < n
-      return (uint8_t)( ( clamp0 - fabsf( clamp0 - (255.999f * 2) ) ) * 0.25f + 128 );
+      std::atomic<bool> ok(true);
+      run_parallel(num_segments, 1, [&](unsigned begin, unsigned end) {
+        segment_state s;
+        for (unsigned i = begin; i != end && ok; ++i) {
+          // missing segments read as zeros.
+          s.br.init(i < segments.size() ? segments[i] : scan_end, scan_end);
+          memset(s.last_dc, 0, sizeof(s.last_dc));
+          s.eobrun = 0;
+          unsigned mcu_end = num_mcus - i * segment_mcus > segment_mcus ? (i + 1) * segment_mcus : num_mcus;
+          if (!decode_mcus(s, i * segment_mcus, mcu_end)) ok = false;
+        }
+      });
+      return ok ? scan_end : 0;
     }
 
-    // convert from Y to RGB
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444_greyscale(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f);
-          outptr[1] = clamp(128 + y * 0.125f);
-          outptr[2] = clamp(128 + y * 0.125f);
-          outptr[3] = 0xff;
-          outptr += 4;
+    // progressive files have the coefficients of every block once all the scans are done.
+    void finish_progressive() {
+      for (unsigned i = 0; i != num_components; ++i) {
+        component &c = components[i];
+        const int16_t *quant = quant_tables[c.quantisation_table].table;
+        run_parallel(c.blocks_y, 4, [&](unsigned begin, unsigned end) {
+          for (unsigned by = begin; by != end; ++by) {
+            for (unsigned bx = 0; bx != c.blocks_x; ++bx) {
+              const int16_t *block = c.blocks.data() + (by * c.blocks_x + bx) * 64;
+              unsigned num_coeffs = 1;
+              for (unsigned k = 1; k != 64; ++k) {
+                if (block[k]) { num_coeffs = 64; break; }
+              }
+              inverse_dct(c.plane.data() + by * 8 * c.stride + bx * 8, c.stride, block, quant, num_coeffs);
+            }
+          }
+        });
+        c.blocks.reset();
+      }
+    }
+
+    // make a row of a component at full resolution.
+    // "near" is the nearest row of the component, "far" the next nearest.
+    // Halved components use the triangle filter of libjpeg's "fancy" upsampling, others repeat samples.
+    static void upsample_row(uint8_t *dest, const uint8_t *near_row, const uint8_t *far_row, unsigned width, unsigned hfactor, unsigned vfactor, int16_t *tmp) {
+      // tmp has a spare entry at each end so that the filter needs no edge cases.
+      int16_t *colsum = tmp + 1;
+      unsigned i = 0;
+      if (vfactor == 2) {
+        #if OCTET_SSE
+          const __m128i zero = _mm_setzero_si128();
+          for (; i + 8 <= width; i += 8) {
+            __m128i n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(near_row + i)), zero);
+            __m128i f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(far_row + i)), zero);
+            _mm_storeu_si128((__m128i*)(colsum + i), _mm_add_epi16(_mm_add_epi16(n, n), _mm_add_epi16(n, f)));
+          }
+        #endif
+        for (; i != width; ++i) colsum[i] = (int16_t)(near_row[i] * 3 + far_row[i]);
+      } else {
+        for (; i != width; ++i) colsum[i] = (int16_t)(near_row[i] * 4);
+      }
+      colsum[-1] = colsum[0];
+      colsum[width] = colsum[width-1];
+
+      if (hfactor == 2) {
+        i = 0;
+        #if OCTET_SSE
+          const __m128i three = _mm_set1_epi16(3), eight = _mm_set1_epi16(8), seven = _mm_set1_epi16(7);
+          for (; i + 8 <= width; i += 8) {
+            __m128i cur = _mm_mullo_epi16(_mm_loadu_si128((const __m128i*)(colsum + i)), three);
+            __m128i prev = _mm_loadu_si128((const __m128i*)(colsum + i - 1));
+            __m128i next = _mm_loadu_si128((const __m128i*)(colsum + i + 1));
+            __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(cur, prev), eight), 4);
+            __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(cur, next), seven), 4);
+            __m128i bytes = _mm_packus_epi16(_mm_unpacklo_epi16(even, odd), _mm_unpackhi_epi16(even, odd));
+            _mm_storeu_si128((__m128i*)(dest + i * 2), bytes);
+          }
+        #endif
+        for (; i != width; ++i) {
+          const int16_t *cur = colsum + i;
+          dest[i*2+0] = (uint8_t)((cur[0] * 3 + cur[-1] + 8) >> 4);
+          dest[i*2+1] = (uint8_t)((cur[0] * 3 + cur[1] + 7) >> 4);
+        }
+      } else {
+        for (i = 0; i != width * hfactor; ++i) {
+          dest[i] = (uint8_t)((colsum[i / hfactor] + 2) >> 2);
         }
-        outptr += stride - 32;
       }
     }
 
     // convert from YCrCb to RGB
     // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          float cb = inptr[64];
-          float cr = inptr[128];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-        }
-        outptr += stride - 32;
+    static OCTET_HOT void color_convert_ycc(uint8_t *outptr, const uint8_t *y, const uint8_t *cb, const uint8_t *cr, unsigned n) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        // results have two bits of fraction; the chroma is pre-shifted to keep six bits of the constants.
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i c128 = _mm_set1_epi16(128);
+        const __m128i two = _mm_set1_epi16(2);
+        const __m128i alpha = _mm_set1_epi8((char)0xff);
+        for (; i + 8 <= n; i += 8) {
+          __m128i yv = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + i)), zero), 2);
+          __m128i cbv = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(cb + i)), zero), c128), 6);
+          __m128i crv = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(cr + i)), zero), c128), 6);
+          __m128i r = _mm_add_epi16(yv, _mm_mulhi_epi16(crv, _mm_set1_epi16(5743)));
+          __m128i g = _mm_sub_epi16(_mm_sub_epi16(yv, _mm_mulhi_epi16(cbv, _mm_set1_epi16(1410))), _mm_mulhi_epi16(crv, _mm_set1_epi16(2925)));
+          __m128i b = _mm_add_epi16(yv, _mm_mulhi_epi16(cbv, _mm_set1_epi16(7258)));
+          r = _mm_srai_epi16(_mm_add_epi16(r, two), 2);
+          g = _mm_srai_epi16(_mm_add_epi16(g, two), 2);
+          b = _mm_srai_epi16(_mm_add_epi16(b, two), 2);
+          __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+          __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+          _mm_storeu_si128((__m128i*)(outptr + i * 4), _mm_unpacklo_epi16(rg, ba));
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+        }
+      #endif
+      // 16.16 fixed point
+      for (; i != n; ++i) {
+        int yv = y[i];
+        int cbv = cb[i] - 128;
+        int crv = cr[i] - 128;
+        uint8_t *out = outptr + i * 4;
+        out[0] = clamp(yv + ((crv * 91881 + 32768) >> 16));
+        out[1] = clamp(yv + ((cbv * -22554 + crv * -46802 + 32768) >> 16));
+        out[2] = clamp(yv + ((cbv * 116130 + 32768) >> 16));
+        out[3] = 0xff;
       }
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_411(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y0 = inptr[0x00];
-          float y1 = inptr[0x40];
-          float y2 = inptr[0x80];
-          float y3 = inptr[0xc0];
-          float cb = inptr[0x100];
-          float cr = inptr[0x140];
-          inptr++;
-          outptr[0] = clamp(128 + y0 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y0 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y0 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y1 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y1 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y1 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += stride - 4;
-          outptr[0] = clamp(128 + y2 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y2 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y2 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y3 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y3 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y3 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += -stride + 4;
-        }
-        outptr += stride*2 - 64;
+    // convert from Y to RGB
+    static OCTET_HOT void color_convert_greyscale(uint8_t *outptr, const uint8_t *y, unsigned n) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        const __m128i alpha = _mm_set1_epi8((char)0xff);
+        for (; i + 16 <= n; i += 16) {
+          __m128i yv = _mm_loadu_si128((const __m128i*)(y + i));
+          __m128i yy_lo = _mm_unpacklo_epi8(yv, yv), yy_hi = _mm_unpackhi_epi8(yv, yv);
+          __m128i ya_lo = _mm_unpacklo_epi8(yv, alpha), ya_hi = _mm_unpackhi_epi8(yv, alpha);
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 0), _mm_unpacklo_epi16(yy_lo, ya_lo));
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 16), _mm_unpackhi_epi16(yy_lo, ya_lo));
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 32), _mm_unpacklo_epi16(yy_hi, ya_hi));
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 48), _mm_unpackhi_epi16(yy_hi, ya_hi));
+        }
+      #endif
+      for (; i != n; ++i) {
+        uint8_t *out = outptr + i * 4;
+        out[0] = out[1] = out[2] = y[i];
+        out[3] = 0xff;
+      }
+    }
+
+    // upsample the component planes and convert them to RGBA, bottom row first.
+    void color_convert(dynarray<uint8_t> &image, uint16_t &format) {
+      size_t base = image.size();
+      image.resize((unsigned)(base + width * height * 4));
+      format = 0x1908; // GL_RGBA
+      uint8_t *image_base = image.data() + base;
+      unsigned row_width = mcus_x * max_hsamp * 8;
+
+      // bands of rows are independent, so convert them in parallel.
+      run_parallel(height, 64, [&](unsigned begin, unsigned end) {
+        dynarray<uint8_t> rows(row_width * num_components);
+        dynarray<int16_t> tmp(row_width + 2);
+        for (unsigned y = begin; y != end; ++y) {
+          convert_row(image_base, y, rows.data(), row_width, tmp.data());
+        }
+      });
+    }
+
+    // upsample and convert row y of the image.
+    void convert_row(uint8_t *image_base, unsigned y, uint8_t *rows, unsigned row_width, int16_t *tmp) {
+      const uint8_t *src[3];
+      for (unsigned i = 0; i != num_components; ++i) {
+        component &c = components[i];
+        unsigned hfactor = max_hsamp / c.hsamp;
+        unsigned vfactor = max_vsamp / c.vsamp;
+        if (hfactor == 1 && vfactor == 1) {
+          src[i] = c.plane.data() + y * c.stride;
+        } else {
+          unsigned cy = y / vfactor;
+          unsigned fy = vfactor != 2 ? cy : y & 1 ? cy + 1 : cy - 1;
+          if (fy >= c.height) fy = cy;
+          uint8_t *dest = rows + i * row_width;
+          upsample_row(dest, c.plane.data() + cy * c.stride, c.plane.data() + fy * c.stride, c.width, hfactor, vfactor, tmp);
+          src[i] = dest;
+        }
+      }
+
+      uint8_t *outptr = image_base + (height - 1 - y) * width * 4;
+      if (num_components == 1) {
+        color_convert_greyscale(outptr, src[0], width);
+      } else {
+        color_convert_ycc(outptr, src[0], src[1], src[2], width);
       }
     }
 
     // JPEG files are split up into chunks starting with 0xff
-    unsigned decode_chunk(const uint8_t *src, dynarray<uint8_t> &image, uint16_t &format) {
+    unsigned decode_chunk(const uint8_t *src, const uint8_t *src_end) {
+      if (src + 2 > src_end) return 0;
       if (debug) printf("decode_chunk %02x\n", src[1]);
 
+      // most markers are followed by the length of the segment, which must all be in the file.
+      // SOI, EOI, RSTn and TEM have no length and some files have unknown markers without one.
       unsigned length = 2;
+      unsigned marker = src[1];
+      bool standalone = marker == 0x01 || marker == 0xff || (marker >= 0xd0 && marker <= 0xd9);
+      if (!standalone && !(src + 2 < src_end && src[2] == 0xff)) {
+        if (src + 4 > src_end) return 0;
+        length = u2(src + 2) + 2;
+        if (length < 4 || length > (size_t)(src_end - src)) {
+          printf("warning: JPEG segment %02x is too long\n", marker);
+          return 0;
+        }
+      }
 
-      switch (src[1]) {
+      switch (marker) {
         // different kinds of image (SOF0-7)
         case 0xc0: case 0xc1: case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7: {
+          if (length < 10 || length < 10 + src[9] * 3u) return 0;
           sof_code = src[1];
-          length = u2(src + 2) + 2;
           precision = src[4];
           height = u2(src + 5);
           width = u2(src + 7);
           num_components = src[9];
 
-          if (src[1] != 0xc0) {
-            printf("warning: only baseline JPEG is supported - disable progressive\n");
+          // baseline, extended and progressive huffman coded images only.
+          if (src[1] != 0xc0 && src[1] != 0xc1 && src[1] != 0xc2) {
+            printf("warning: unsupported JPEG type SOF%d\n", src[1] - 0xc0);
             return 0;
           }
+          progressive = src[1] == 0xc2;
 
           if (precision != 8 || width == 0 || height == 0 || num_components > 4) {
             printf("warning: precision=%d width=%d height=%d num_components=%d\n", precision, width, height, num_components);
@@ -383,22 +999,47 @@ namespace octet { namespace loaders {
             return 0;
           }
 
+          max_hsamp = 1;
+          max_vsamp = 1;
           for (unsigned i = 0; i != num_components; ++i) {
             component &c = components[i];
             c.id = src[10 + i*3 + 0];
             c.hsamp = src[10 + i*3 + 1] >> 4;
             c.vsamp = src[10 + i*3 + 1] & 15;
             c.quantisation_table = src[10 + i*3 + 2] & 3;
+            if (c.hsamp < 1 || c.hsamp > 4 || c.vsamp < 1 || c.vsamp > 4) return 0;
+            max_hsamp = c.hsamp > max_hsamp ? c.hsamp : max_hsamp;
+            max_vsamp = c.vsamp > max_vsamp ? c.vsamp : max_vsamp;
             if (debug) printf("id=%d h=%d v=%d q=%d\n", c.id, c.hsamp, c.vsamp, c.quantisation_table);
           }
-          
+
+          mcus_x = (width + max_hsamp * 8 - 1) / (max_hsamp * 8);
+          mcus_y = (height + max_vsamp * 8 - 1) / (max_vsamp * 8);
+
+          // each component has a plane of samples padded to whole MCUs.
+          for (unsigned i = 0; i != num_components; ++i) {
+            component &c = components[i];
+            if (max_hsamp % c.hsamp || max_vsamp % c.vsamp) {
+              printf("warning: unsupported sampling %dx%d\n", c.hsamp, c.vsamp);
+              return 0;
+            }
+            c.width = (width * c.hsamp + max_hsamp - 1) / max_hsamp;
+            c.height = (height * c.vsamp + max_vsamp - 1) / max_vsamp;
+            c.stride = mcus_x * c.hsamp * 8;
+            c.plane.resize(c.stride * mcus_y * c.vsamp * 8);
+            c.blocks_x = mcus_x * c.hsamp;
+            c.blocks_y = mcus_y * c.vsamp;
+            if (progressive) {
+              c.blocks.resize(c.blocks_x * c.blocks_y * 64);
+              memset(c.blocks.data(), 0, c.blocks.size() * sizeof(int16_t));
+            }
+          }
         } break;
 
         // huffman tables
         case 0xc4: {
-          length = u2(src + 2) + 2;
-          src += 4;
           const uint8_t *src_max = src + length;
+          src += 4;
           while (src + 17 <= src_max) {
             unsigned index = src[0];
             unsigned is_ac = (index >> 4) & 1;
@@ -411,30 +1052,9 @@ namespace octet { namespace loaders {
             }
             src += 17;
             if (src + count > src_max || count > 256) return 0;
-            memcpy(h.huffval, src, count);
+            if (!build_huffman(h, num_codes, src, count, is_ac != 0)) return 0;
             src += count;
 
-            unsigned dest = 0;
-            unsigned code = 0;
-            h.min_len = 0;
-            bool done_min_len = false;
-            for (unsigned len = 1; len < 17; ++len) {
-              h.offset[len-1] = code - dest;
-              if (!done_min_len && num_codes[len-1]) {
-                h.min_len = len - 1;
-                done_min_len = true;
-              }
-              for (unsigned i = 0; i != num_codes[len-1]; ++i) {
-                if (debug) printf("code=%04x len=%d\n", ( ( code + i ) << (16 - len) ), len );
-              }
-              dest += num_codes[len-1];
-              code = code + num_codes[len-1];
-              h.maxcodes[len-1] = ( code << (16 - len) ) - 1;
-              code *= 2;
-              if (debug) printf("h.maxcodes[%d] = %04x\n", len-1, h.maxcodes[len-1]);
-            }
-            h.maxcodes[16] = 0xffff;
-            
             if (debug) printf("DHT %d\n", index);
           }
         } break;
@@ -452,18 +1072,15 @@ namespace octet { namespace loaders {
         // image data
         case 0xda: {
           const uint8_t *src0 = src;
-          length = u2(src + 2) + 2;
+          if (length < 5) return 0;
+          const uint8_t *src_max = src + length;
           src += 4;
           num_components_in_scan = *src++;
-          unsigned max_hsamp = 1;
-          unsigned max_vsamp = 1;
-          num_mcu_blocks = 0;
-          const uint8_t *src_max = src + length;
+          if (num_components_in_scan < 1 || num_components_in_scan > num_components) return 0;
+          if (length < 8 + num_components_in_scan * 2) return 0;
+          unsigned num_mcu_blocks = 0;
           for (unsigned i = 0; i != num_components_in_scan; ++i) {
-            scan_component &sc = scan_components[i];
             unsigned id = *src++;
-            sc.ac_table = *src & 0x0f;
-            sc.dc_table = *src++ >> 4;
             unsigned comp = 0;
             while (comp < num_components) {
               if (components[comp].id == id) break;
@@ -471,31 +1088,15 @@ namespace octet { namespace loaders {
             }
             if (comp >= num_components) return 0;
             component &c = components[comp];
-            max_hsamp = c.hsamp > max_hsamp ? c.hsamp : max_hsamp;
-            max_vsamp = c.vsamp > max_vsamp ? c.vsamp : max_vsamp;
-            sc.comp = comp;
-            if (debug) printf("SOS comp=%d ac=%d dc=%d\n", comp, sc.ac_table, sc.dc_table);
-            unsigned samps = c.hsamp * c.vsamp;
-
-            if (num_mcu_blocks + samps > sizeof(mcu_blocks)/sizeof(mcu_blocks[0])) {
-              printf("too many mcu blocks\n");
-              return 0;
-            }
-
-            for (unsigned j = 0; j != samps; ++j) {
-              mcu_block &m = mcu_blocks[num_mcu_blocks++];
-              m.dc_table = &huffman_tables[0][sc.dc_table];
-              m.ac_table = &huffman_tables[1][sc.ac_table];
-              m.quant = &quant_tables[c.quantisation_table];
-              m.scan_comp = &sc;
-            }
-
-            sc.last_dc = 0;
+            c.ac_table = *src & 0x03;
+            c.dc_table = (*src++ >> 4) & 0x03;
+            scan_components[i] = comp;
+            num_mcu_blocks += c.hsamp * c.vsamp;
+            if (debug) printf("SOS comp=%d ac=%d dc=%d\n", comp, c.ac_table, c.dc_table);
           }
 
-          // at present, we only support YCrCb in 4:4:4
-          if (num_mcu_blocks != 1 && num_mcu_blocks != 3 && num_mcu_blocks != 6) {
-            printf("only 4:4:4 and 4:1:1 greyscale and ycrcb supported (%d mcu blocks)\n", num_mcu_blocks);
+          if (num_mcu_blocks > 10) {
+            printf("too many mcu blocks\n");
             return 0;
           }
 
@@ -503,70 +1104,57 @@ namespace octet { namespace loaders {
           spectral_end = *src++;
           successive_high = src[0] >> 4;
           successive_low = *src++ & 0x0f;
-          if (src > src_max) return 0;
 
-          for (unsigned i = 0; i != num_components_in_scan; ++i) {
-            scan_component &sc = scan_components[i];
-            component &c = components[sc.comp];
-            sc.width_in_blocks = width * c.hsamp / max_hsamp;
-            sc.height_in_blocks = height * c.hsamp / max_hsamp;
+          // progressive scans have either the DC of any components or a band of AC of one.
+          // refinements add exactly one bit to the previous scan.
+          if (progressive) {
+            bool ok = spectral_start == 0 ? spectral_end == 0 : spectral_start <= spectral_end && spectral_end < 64 && num_components_in_scan == 1;
+            if (!ok || successive_low > 13 || (successive_high && successive_high != successive_low + 1)) {
+              printf("warning: bad progressive scan %d..%d\n", spectral_start, spectral_end);
+              return 0;
+            }
           }
 
-          width = (width + max_hsamp * 8 - 1) & ~(max_hsamp * 8 - 1);
-          height = (height + max_vsamp * 8 - 1) & ~(max_vsamp * 8 - 1);
-
-          unsigned xmax = ( width + max_hsamp * 8 - 1 ) / (max_hsamp * 8);
-          unsigned ymax = ( height + max_vsamp * 8 - 1 ) / (max_vsamp * 8);
-
-          unsigned acc = 0;
-          int shift = 0;
-          skip_bits(16, acc, src, shift);
-          
-          int stride = width * 4;
-
-          unsigned size = width * height * 4;
-          size_t base = image.size();
-          image.resize(base + size);
-          format = 0x1908; // GL_RGBA
-
-          uint8_t *image_base = image.data() + base;
-
-          for (unsigned y = 0; y != ymax; ++y) {
-            for (unsigned x = 0; x != xmax; ++x) {
-              float *coeffs = dct_coeffs;
-              memset(coeffs, 0, 64 * num_mcu_blocks * sizeof(float));
-              for (unsigned b = 0; b < num_mcu_blocks; ++b) {
-                decode_mcu_block(b, acc, src, shift, coeffs);
-                inverse_dct(coeffs);
-                coeffs += 64;
-              }
-              if (num_mcu_blocks == 1) {
-                // assume 4:4:4 Greyscale
-                color_convert_444_greyscale(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 3) {
-                // assume 4:4:4 YCbCr
-                color_convert_444(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 6) {
-                // assume 4:1:1 YCbCr
-                color_convert_411(&image_base[((height - 1 - y * 16) * stride) + (x * 16 * 4)], -stride, dct_coeffs);
-              }
+          // the scan must only use huffman tables that we have been sent.
+          // DHT segments may come between progressive scans, so check every scan:
+          // baseline uses both tables, DC refinements neither, other progressive scans one.
+          bool needs_dc = !progressive || (spectral_start == 0 && successive_high == 0);
+          bool needs_ac = !progressive || spectral_start != 0;
+          for (unsigned i = 0; i != num_components_in_scan; ++i) {
+            const component &c = components[scan_components[i]];
+            if ((needs_dc && !huffman_tables[0][c.dc_table].defined) || (needs_ac && !huffman_tables[1][c.ac_table].defined)) {
+              printf("warning: JPEG scan uses an undefined huffman table\n");
+              return 0;
             }
           }
-          skip_bits(shift, acc, src, shift);
+
+          src = decode_scan(src_max, src_end);
+          if (!src) return 0;
+          have_samples = true;
           length = (unsigned)(src - src0);
         } break;
 
+        // restart interval
+        case 0xdd: {
+          if (length < 6) return 0;
+          restart_interval = u2(src + 4);
+          if (debug) printf("DRI %d\n", restart_interval);
+        } break;
+
         // quantisation tables (the lossy bit)
         case 0xdb: {
-          length = u2(src + 2) + 2;
           const uint8_t *src_max = src + length;
           src += 4;
           while (src < src_max) {
             unsigned prec = (src[0] >> 4) & 1;
             unsigned n = src[0] & 0x0f;
+            if (src + 1 + 64 * (prec + 1) > src_max) return 0;
             src++;
+            quant_table &q = quant_tables[n&3];
+            const uint8_t *zig_zag = de_zig_zag();
             for (unsigned i = 0; i != 64; ++i) {
-              quant_tables[n&3].table[i] = (float)( prec ? u2(src) : *src );
+              unsigned value = prec ? u2(src) : *src;
+              q.table[zig_zag[i]] = (int16_t)(value > 32767 ? 32767 : value);
               src += prec + 1;
             }
             if (debug) printf("DQT %d %d\n", prec, n);
@@ -575,37 +1163,224 @@ namespace octet { namespace loaders {
 
         // JFIF stubset of JPEG
         case 0xe0: {
-          length = u2(src + 2) + 2;
           if (debug) printf("M_APP0 (JFIF)\n");
         } break;
 
         // unknown chunk
         default: {
-          if (src[2] != 0xff) length = u2(src + 2) + 2;
           if (debug) printf("unknown\n");
         } break;
       }
       return length;
     }
   public:
+    jpeg_decoder() {
+      // undefined tables decode nothing: the limit sentinel stops long codes at 17 bits.
+      memset(huffman_tables, 0, sizeof(huffman_tables));
+      for (unsigned i = 0; i != 8; ++i) {
+        huffman_tables[i / 4][i % 4].limit[17] = 0xffffffff;
+      }
+      memset(quant_tables, 0, sizeof(quant_tables));
+      width = height = num_components = 0;
+      mcus_x = mcus_y = 0;
+      progressive = false;
+      restart_interval = 0;
+      have_samples = false;
+    }
+
+    /// Decode restart segments and convert rows on many threads with this function.
+    void set_parallel_for(const parallel_for_fn &fn) {
+      parallel_for = fn;
+    }
+
     // get an opengl texture from a file in memory
     void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
+      // forget the frame of any previous image: its progressive blocks have gone.
+      have_samples = false;
+      restart_interval = 0;
+      num_components = 0;
+      progressive = false;
+      for (unsigned i = 0; i != 8; ++i) {
+        huffman_tables[i / 4][i % 4].defined = false;
+      }
       while (src < src_max) {
         if (src[0] != 0xff) {
           printf("warning: bad JPEG file\n");
           return;
         }
-        unsigned length = decode_chunk(src, image, format);
+        unsigned length = decode_chunk(src, src_max);
         if (!length) {
-          printf("warning: bad JPEG file @ chunk %02x\n", src[1]);
+          printf("warning: bad JPEG file @ chunk %02x\n", src + 1 < src_max ? src[1] : 0);
           return;
         }
         src += length;
       }
+
+      if (have_samples) {
+        if (progressive) finish_progressive();
+        color_convert(image, format);
+      }
       width_ = width;
       height_ = height;
-      num_components = 3;
+    }
+
+    /// Print the time to decode each JPEG in the assets directory, on the calling thread and
+    /// with the parallel_for given (if any). prefix is the directory that holds assets/ (eg. app_utils::prefix()).
+    static void benchmark(const char *prefix, const parallel_for_fn &parallel = parallel_for_fn()) {
+      static const char *names[] = {
+        "grass.jpg", "NASA-Jupiter-512.jpg", "duckCM.jpg",
+        "reije081.home.xs4all.nl/front.jpg", "reije081.home.xs4all.nl/back.jpg",
+        "reije081.home.xs4all.nl/left.jpg", "reije081.home.xs4all.nl/right.jpg",
+        "reije081.home.xs4all.nl/top.jpg", "reije081.home.xs4all.nl/bottom.jpg",
+      };
+      for (unsigned i = 0; i != sizeof(names) / sizeof(names[0]); ++i) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%sassets/%s", prefix, names[i]);
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+          printf("jpeg_decoder: %s not found\n", path);
+          continue;
+        }
+        fseek(file, 0, SEEK_END);
+        dynarray<uint8_t> src((unsigned)ftell(file));
+        fseek(file, 0, SEEK_SET);
+        size_t size = fread(src.data(), 1, src.size(), file);
+        fclose(file);
+
+        double best_ms[2] = { 0, 0 };
+        uint16_t w = 0, h = 0;
+        for (unsigned threaded = 0; threaded != (parallel ? 2 : 1); ++threaded) {
+          for (unsigned run = 0; run != 5; ++run) {
+            jpeg_decoder dec;
+            if (threaded) dec.set_parallel_for(parallel);
+            dynarray<uint8_t> image;
+            uint16_t format = 0;
+            std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+            dec.get_image(image, format, w, h, src.data(), src.data() + size);
+            double ms = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count() * 1e3;
+            best_ms[threaded] = run == 0 || ms < best_ms[threaded] ? ms : best_ms[threaded];
+          }
+        }
+        printf(
+          "jpeg_decoder %s: %dx%d %.2f ms (%.1f Mpixels/s), threaded %.2f ms\n",
+          names[i], w, h, best_ms[0], w * h / best_ms[0] * 1e-3, best_ms[1]
+        );
+      }
     }
   };
-}}
 
+  #if OCTET_UNIT_TEST
+    class jpeg_decoder_unit_test {
+      static void decode(dynarray<uint8_t> &image, uint16_t &width, uint16_t &height, const uint8_t *src, size_t size) {
+        jpeg_decoder dec;
+        uint16_t format = 0;
+        width = height = 0;
+        dec.get_image(image, format, width, height, src, src + size);
+      }
+
+      // src is a 16x16 greyscale image of (x * 16 + y * 8) & 255 with its first DHT of each table at dht_offsets.
+      static void test(const uint8_t *src, size_t size, const unsigned *dht_offsets, unsigned num_dhts) {
+        dynarray<uint8_t> image;
+        uint16_t width, height;
+        decode(image, width, height, src, size);
+        assert(width == 16 && height == 16 && image.size() == 16 * 16 * 4);
+        for (unsigned y = 0; y != 16; ++y) {
+          for (unsigned x = 0; x != 16; ++x) {
+            // rows are stored bottom up.
+            const uint8_t *pixel = image.data() + ((15 - y) * 16 + x) * 4;
+            int diff = pixel[0] - (int)((x * 16 + y * 8) & 255);
+            assert(diff >= -12 && diff <= 12 && pixel[1] == pixel[0] && pixel[2] == pixel[0] && pixel[3] == 0xff);
+          }
+        }
+
+        // every truncated file must stop cleanly without reading past the end.
+        dynarray<uint8_t> copy((unsigned)size);
+        for (size_t i = 0; i != size; ++i) {
+          dynarray<uint8_t> prefix(i ? (unsigned)i : 1);
+          memcpy(prefix.data(), src, i);
+          image.resize(0);
+          decode(image, width, height, prefix.data(), i);
+          assert(image.size() == 0 || image.size() == 16 * 16 * 4);
+        }
+
+        // turn each DHT into a comment: a scan then uses an undefined table and must give no image.
+        for (unsigned i = 0; i != num_dhts; ++i) {
+          memcpy(copy.data(), src, size);
+          assert(copy[dht_offsets[i] + 1] == 0xc4);
+          copy[dht_offsets[i] + 1] = 0xfe;
+          image.resize(0);
+          decode(image, width, height, copy.data(), size);
+          assert(image.size() == 0);
+        }
+      }
+
+    public:
+      jpeg_decoder_unit_test() {
+        // from libjpeg at quality 90 with optimized tables.
+        static const uint8_t baseline[] = {
+          0xff, 0xd8, 0xff, 0xdb, 0x00, 0x43, 0x00, 0x03, 0x02, 0x02, 0x03, 0x02, 0x02, 0x03, 0x03, 0x03,
+          0x03, 0x04, 0x03, 0x03, 0x04, 0x05, 0x08, 0x05, 0x05, 0x04, 0x04, 0x05, 0x0a, 0x07, 0x07, 0x06,
+          0x08, 0x0c, 0x0a, 0x0c, 0x0c, 0x0b, 0x0a, 0x0b, 0x0b, 0x0d, 0x0e, 0x12, 0x10, 0x0d, 0x0e, 0x11,
+          0x0e, 0x0b, 0x0b, 0x10, 0x16, 0x10, 0x11, 0x13, 0x14, 0x15, 0x15, 0x15, 0x0c, 0x0f, 0x17, 0x18,
+          0x16, 0x14, 0x18, 0x12, 0x14, 0x15, 0x14, 0xff, 0xc0, 0x00, 0x0b, 0x08, 0x00, 0x10, 0x00, 0x10,
+          0x01, 0x01, 0x11, 0x00, 0xff, 0xc4, 0x00, 0x16, 0x00, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+          0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x06, 0x07, 0xff, 0xc4, 0x00, 0x28,
+          0x10, 0x00, 0x00, 0x03, 0x06, 0x05, 0x04, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+          0x00, 0x01, 0x02, 0x03, 0x05, 0x06, 0x07, 0x08, 0x11, 0x12, 0x00, 0x04, 0x13, 0x22, 0x23, 0x14,
+          0x34, 0x41, 0x51, 0x17, 0x18, 0x21, 0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3f, 0x00,
+          0xc2, 0xa5, 0xb6, 0x1b, 0x76, 0xbc, 0x5e, 0xbc, 0x61, 0xab, 0x16, 0x22, 0x1f, 0xd6, 0x29, 0x70,
+          0x6c, 0x3d, 0x59, 0x31, 0xd2, 0x79, 0x33, 0x96, 0xb2, 0x18, 0x3b, 0x2b, 0x4c, 0xfa, 0xc5, 0x35,
+          0x8a, 0x7e, 0xa6, 0x72, 0x71, 0x10, 0x8a, 0xaf, 0x6a, 0x81, 0x69, 0xf4, 0x6c, 0x11, 0x01, 0x38,
+          0x62, 0x52, 0x5b, 0x61, 0xb7, 0x6b, 0xc5, 0xeb, 0xc6, 0x0f, 0xf3, 0x99, 0x10, 0xfe, 0x69, 0x98,
+          0xf2, 0x3a, 0xac, 0xd1, 0xbd, 0xdb, 0x70, 0x75, 0x59, 0x08, 0xec, 0xa6, 0xa6, 0x7c, 0x4c, 0x5e,
+          0xb9, 0x4d, 0xc9, 0x94, 0xe1, 0x43, 0xa6, 0x44, 0x2d, 0x11, 0x31, 0x47, 0xa6, 0xbc, 0x83, 0x45,
+          0x07, 0x1f, 0xff, 0xd9
+        };
+        static const unsigned baseline_dhts[] = { 0x54, 0x6c };
+        test(baseline, sizeof(baseline), baseline_dhts, 2);
+
+        // the progressive version sends its AC table after the DC scan.
+        static const uint8_t progressive[] = {
+          0xff, 0xd8, 0xff, 0xdb, 0x00, 0x43, 0x00, 0x03, 0x02, 0x02, 0x03, 0x02, 0x02, 0x03, 0x03, 0x03,
+          0x03, 0x04, 0x03, 0x03, 0x04, 0x05, 0x08, 0x05, 0x05, 0x04, 0x04, 0x05, 0x0a, 0x07, 0x07, 0x06,
+          0x08, 0x0c, 0x0a, 0x0c, 0x0c, 0x0b, 0x0a, 0x0b, 0x0b, 0x0d, 0x0e, 0x12, 0x10, 0x0d, 0x0e, 0x11,
+          0x0e, 0x0b, 0x0b, 0x10, 0x16, 0x10, 0x11, 0x13, 0x14, 0x15, 0x15, 0x15, 0x0c, 0x0f, 0x17, 0x18,
+          0x16, 0x14, 0x18, 0x12, 0x14, 0x15, 0x14, 0xff, 0xc2, 0x00, 0x0b, 0x08, 0x00, 0x10, 0x00, 0x10,
+          0x01, 0x01, 0x11, 0x00, 0xff, 0xc4, 0x00, 0x16, 0x00, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+          0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x05, 0x06, 0xff, 0xda, 0x00, 0x08,
+          0x01, 0x01, 0x00, 0x00, 0x00, 0x01, 0xc2, 0x35, 0xc9, 0x3f, 0xff, 0xc4, 0x00, 0x18, 0x10, 0x00,
+          0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+          0x05, 0x06, 0x15, 0x16, 0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x01, 0x05, 0x02, 0x9b, 0x5a,
+          0x36, 0x61, 0xcc, 0x4e, 0x4d, 0xad, 0x2c, 0xd8, 0x6d, 0x51, 0xff, 0x00, 0xff, 0xc4, 0x00, 0x24,
+          0x10, 0x00, 0x00, 0x05, 0x03, 0x02, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+          0x00, 0x00, 0x01, 0x02, 0x03, 0x21, 0x04, 0x11, 0x61, 0x31, 0x41, 0x14, 0x23, 0x34, 0x42, 0x51,
+          0x72, 0x82, 0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x06, 0x3f, 0x02, 0x4c, 0x07, 0xaa, 0x91,
+          0x15, 0x2b, 0xe5, 0x31, 0xee, 0x7b, 0xe9, 0xb4, 0x9c, 0xf8, 0x09, 0x81, 0xc2, 0xb7, 0xd3, 0x50,
+          0x5d, 0xa2, 0xca, 0xfb, 0xcf, 0x4c, 0x5b, 0xe7, 0x23, 0xff, 0xc4, 0x00, 0x1a, 0x10, 0x00, 0x02,
+          0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x21,
+          0x11, 0x31, 0x41, 0x00, 0x10, 0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x01, 0x3f, 0x21, 0xea,
+          0xc5, 0x41, 0x79, 0x98, 0xb0, 0x20, 0x85, 0x0a, 0xef, 0x95, 0x0a, 0xfa, 0x5e, 0xa2, 0xe0, 0x36,
+          0x11, 0x62, 0xc3, 0x9f, 0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x00, 0x10, 0xbf, 0xff,
+          0xc4, 0x00, 0x1b, 0x10, 0x00, 0x02, 0x02, 0x03, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+          0x00, 0x00, 0x00, 0x00, 0x01, 0x11, 0x00, 0x31, 0x41, 0x51, 0xa1, 0x21, 0xff, 0xda, 0x00, 0x08,
+          0x01, 0x01, 0x00, 0x01, 0x3f, 0x10, 0xe2, 0xe2, 0x37, 0x1b, 0x8a, 0xae, 0x2a, 0x7f, 0x2d, 0x48,
+          0x23, 0x38, 0xb8, 0x8d, 0xe6, 0xa6, 0xb6, 0x80, 0x53, 0xb1, 0x27, 0xbd, 0x14, 0xff, 0xd9
+        };
+        static const unsigned progressive_dhts[] = { 0x54, 0x7a };
+        test(progressive, sizeof(progressive), progressive_dhts, 2);
+
+        // a refinement must add exactly one bit: change the last DC scan's Ah/Al of 1/0 to 2/0.
+        dynarray<uint8_t> copy(sizeof(progressive));
+        memcpy(copy.data(), progressive, sizeof(progressive));
+        assert(copy[0x134 + 1] == 0xda && copy[0x134 + 9] == 0x10);
+        copy[0x134 + 9] = 0x20;
+        dynarray<uint8_t> image;
+        uint16_t width, height;
+        decode(image, width, height, copy.data(), sizeof(progressive));
+        assert(image.size() == 0);
+      }
+    };
+
+    static jpeg_decoder_unit_test jpeg_decoder_unit_test;
+  #endif
+}}
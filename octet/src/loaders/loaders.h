@@ -31,8 +31,10 @@
   #include "../loaders/gif_decoder.h"
   #include "../loaders/jpeg_decoder.h"
   #include "../loaders/jpeg_encoder.h"
+  #include "../loaders/dxt_encoder.h"
   #include "../loaders/tga_decoder.h"
   #include "../loaders/dds_decoder.h"
   #include "../loaders/nifti_decoder.h"
+  #include "../loaders/xml_pull_parser.h"
 
 #endif
@@ -222,25 +222,30 @@ namespace octet { namespace loaders {
 
     void flush() {
       std::sort(faces.begin(), faces.end());
-      face *f = 0;
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, faces.size() * sizeof(f->vtx));
 
-      {
-        gl_resource::wolock vl(vertices);
-        for (size_t i = 0; i != faces.size(); ++i) {
-          memcpy(vl.u8() + i * sizeof(f->vtx), faces[i].vtx, sizeof(f->vtx));
-        }
-      }
+      // one mesh per material, merged and reordered for the GPU.
+      dynarray<mesh::vertex> mesh_vertices;
+      for (size_t first = 0; first != faces.size(); ) {
+        size_t last = first + 1;
+        while (last != faces.size() && faces[last].material_index == faces[first].material_index) ++last;
 
-      int prev_mi = -1;
-      for (size_t i = 0; i != faces.size(); ++i) {
-        if (faces[i].material_index != prev_mi) {
-          mesh *msh = new mesh();
-          msh->set_default_attributes();
-          msh->set_vertices(vertices);
-          material *mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
-          mesh_instance *mi = new mesh_instance(node, msh, mat);
+        mesh_vertices.resize(0);
+        indices.resize(0);
+        for (size_t i = first; i != last; ++i) {
+          for (unsigned j = 0; j != 3; ++j) {
+            indices.push_back(mesh_vertices.size());
+            mesh_vertices.push_back(faces[i].vtx[j]);
+          }
         }
+
+        mesh *msh = new mesh();
+        msh->set_default_attributes();
+        msh->set_vertices(mesh_vertices);
+        msh->set_indices(indices);
+        msh->optimize();
+        material *mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
+        mesh_instance *mi = new mesh_instance(node, msh, mat);
+        first = last;
       }
 
       faces.resize(0);
@@ -0,0 +1,942 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// XML pull parser for files in memory
+//
+// The parser reads tokens straight from the buffer (usually a mapped file) without copying.
+// Text is handed out as pointer ranges, so numeric arrays can be parsed in place.
+//
+// xml_document uses the parser to build a compact index of the elements. Only names and
+// attributes are copied; text stays in the buffer until someone asks for it as a string.
+//
+
+namespace octet { namespace loaders {
+  /// Pull parser for XML in memory.
+  ///
+  /// Call next() to get the next token: the start of an element (with its attributes),
+  /// the end of an element or a run of text. Comments, processing instructions and
+  /// declarations are skipped. Empty elements like <a/> give a begin and an end token.
+  ///
+  /// Example
+  ///
+  ///     xml_pull_parser parser(src, src_max);
+  ///     for (;;) {
+  ///       xml_pull_parser::token_t token = parser.next();
+  ///       if (token == xml_pull_parser::token_begin) ...
+  ///       if (token == xml_pull_parser::token_eof || token == xml_pull_parser::token_error) break;
+  ///     }
+  class xml_pull_parser {
+  public:
+    /// Kinds of token returned by next().
+    enum token_t {
+      token_eof,
+      token_error,
+      token_begin,
+      token_end,
+      token_text,
+    };
+
+    /// An attribute of the current element. The value has not had its entities decoded.
+    struct attribute {
+      const char *name;
+      const char *name_end;
+      const char *value;
+      const char *value_end;
+    };
+
+  private:
+    struct name_range {
+      const char *name;
+      const char *name_end;
+    };
+
+    const char *src;
+    const char *src_max;
+
+    const char *name;
+    const char *name_end;
+    const char *text;
+    const char *text_end;
+    bool cdata;
+    bool pending_end;
+    const char *error;
+
+    dynarray<attribute> attributes;
+    dynarray<name_range> stack;
+
+    static bool is_space(char c) {
+      return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    static bool is_name_end(char c) {
+      return is_space(c) || c == '/' || c == '>' || c == '=' || c == '<';
+    }
+
+    bool starts_with(const char *str, size_t len) const {
+      return (size_t)(src_max - src) >= len && !memcmp(src, str, len);
+    }
+
+    // find a string, returns src_max if it is not there.
+    const char *find(const char *from, const char *str, size_t len) const {
+      while (from != src_max) {
+        const char *p = (const char*)memchr(from, str[0], src_max - from);
+        if (!p || (size_t)(src_max - p) < len) break;
+        if (!memcmp(p, str, len)) return p;
+        from = p + 1;
+      }
+      return src_max;
+    }
+
+    void skip_space() {
+      while (src != src_max && is_space(*src)) ++src;
+    }
+
+    const char *read_name() {
+      const char *begin = src;
+      while (src != src_max && !is_name_end(*src)) ++src;
+      return begin;
+    }
+
+    token_t fail(const char *msg) {
+      error = msg;
+      src = src_max;
+      return token_error;
+    }
+
+    // skip to the end of a construct such as a comment. Returns false if there is no end.
+    bool skip_past(const char *str, size_t len) {
+      const char *p = find(src, str, len);
+      if (p == src_max) return false;
+      src = p + len;
+      return true;
+    }
+
+    // skip <!DOCTYPE ...> and friends, which may contain [ ] sections.
+    bool skip_declaration() {
+      int depth = 0;
+      for (; src != src_max; ++src) {
+        if (*src == '[') {
+          depth++;
+        } else if (*src == ']') {
+          depth--;
+        } else if (*src == '>' && depth <= 0) {
+          ++src;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    token_t read_start_tag() {
+      ++src;
+      name = read_name();
+      name_end = src;
+      if (name == name_end) return fail("expected an element name");
+
+      attributes.resize(0);
+      for (;;) {
+        skip_space();
+        if (src == src_max) return fail("unexpected end of file in a tag");
+        if (*src == '>') {
+          ++src;
+          break;
+        }
+        if (*src == '/') {
+          if (src_max - src < 2 || src[1] != '>') return fail("expected />");
+          src += 2;
+          pending_end = true;
+          break;
+        }
+
+        attribute a;
+        a.name = read_name();
+        a.name_end = src;
+        if (a.name == a.name_end) return fail("expected an attribute name");
+        skip_space();
+        if (src == src_max || *src != '=') return fail("expected = after an attribute name");
+        ++src;
+        skip_space();
+        if (src == src_max || (*src != '"' && *src != '\'')) return fail("expected a quoted attribute value");
+        char quote = *src++;
+        const char *end = (const char*)memchr(src, quote, src_max - src);
+        if (!end) return fail("unterminated attribute value");
+        a.value = src;
+        a.value_end = end;
+        src = end + 1;
+        attributes.push_back(a);
+      }
+
+      name_range n = { name, name_end };
+      stack.push_back(n);
+      return token_begin;
+    }
+
+    token_t read_end_tag() {
+      src += 2;
+      name = read_name();
+      name_end = src;
+      skip_space();
+      if (src == src_max || *src != '>') return fail("expected > in an end tag");
+      ++src;
+
+      if (stack.size() == 0) return fail("unexpected end tag");
+      const name_range &top = stack.back();
+      if (top.name_end - top.name != name_end - name || memcmp(top.name, name, name_end - name)) {
+        return fail("mismatched end tag");
+      }
+      stack.pop_back();
+      return token_end;
+    }
+
+  public:
+    /// Parse the bytes from src to src_max. The bytes must stay put while parsing.
+    xml_pull_parser(const char *src, const char *src_max) {
+      this->src = src;
+      this->src_max = src_max;
+      name = name_end = text = text_end = 0;
+      cdata = false;
+      pending_end = false;
+      error = 0;
+
+      // skip a UTF-8 byte order mark.
+      if (starts_with("\xef\xbb\xbf", 3)) this->src += 3;
+    }
+
+    /// Get the next token.
+    token_t next() {
+      if (error) return token_error;
+
+      if (pending_end) {
+        pending_end = false;
+        stack.pop_back();
+        return token_end;
+      }
+
+      for (;;) {
+        if (src == src_max) {
+          return stack.size() ? fail("unexpected end of file") : token_eof;
+        }
+
+        if (*src != '<') {
+          text = src;
+          const char *lt = (const char*)memchr(src, '<', src_max - src);
+          src = text_end = lt ? lt : src_max;
+          cdata = false;
+          return token_text;
+        }
+
+        if (starts_with("<!--", 4)) {
+          if (!skip_past("-->", 3)) return fail("unterminated comment");
+        } else if (starts_with("<![CDATA[", 9)) {
+          text = src + 9;
+          src = text;
+          if (!skip_past("]]>", 3)) return fail("unterminated CDATA");
+          text_end = src - 3;
+          cdata = true;
+          return token_text;
+        } else if (starts_with("<?", 2)) {
+          if (!skip_past("?>", 2)) return fail("unterminated processing instruction");
+        } else if (starts_with("<!", 2)) {
+          if (!skip_declaration()) return fail("unterminated declaration");
+        } else if (starts_with("</", 2)) {
+          return read_end_tag();
+        } else {
+          return read_start_tag();
+        }
+      }
+    }
+
+    /// Name of the element for token_begin and token_end.
+    const char *get_name() const { return name; }
+
+    /// End of the name of the element.
+    const char *get_name_end() const { return name_end; }
+
+    /// Number of attributes of the element for token_begin.
+    unsigned get_num_attributes() const { return attributes.size(); }
+
+    /// Get an attribute of the element for token_begin.
+    const attribute &get_attribute(unsigned i) const { return attributes[i]; }
+
+    /// Start of the text for token_text. Entities are not decoded.
+    const char *get_text() const { return text; }
+
+    /// End of the text for token_text.
+    const char *get_text_end() const { return text_end; }
+
+    /// True if the text came from a CDATA section, which has no entities.
+    bool is_cdata() const { return cdata; }
+
+    /// Number of elements we are inside.
+    unsigned get_depth() const { return stack.size(); }
+
+    /// Description of the error for token_error.
+    const char *get_error() const { return error; }
+
+    /// Copy text, decoding entities such as &amp; into dest.
+    /// dest needs as many bytes as the text. Returns the end of the decoded text.
+    static char *decode(char *dest, const char *src, const char *src_max) {
+      while (src != src_max) {
+        const char *amp = (const char*)memchr(src, '&', src_max - src);
+        const char *run_end = amp ? amp : src_max;
+        memcpy(dest, src, run_end - src);
+        dest += run_end - src;
+        src = run_end;
+        if (src == src_max) break;
+
+        const char *semi = (const char*)memchr(src, ';', src_max - src);
+        if (!semi || semi - src > 10) {
+          *dest++ = *src++;
+          continue;
+        }
+
+        const char *ent = src + 1;
+        size_t len = semi - ent;
+        unsigned code = 0;
+        if (len == 3 && !memcmp(ent, "amp", 3)) code = '&';
+        else if (len == 2 && !memcmp(ent, "lt", 2)) code = '<';
+        else if (len == 2 && !memcmp(ent, "gt", 2)) code = '>';
+        else if (len == 4 && !memcmp(ent, "quot", 4)) code = '"';
+        else if (len == 4 && !memcmp(ent, "apos", 4)) code = '\'';
+        else if (len >= 2 && ent[0] == '#') code = ent[1] == 'x' ? strtoul(ent + 2, 0, 16) : strtoul(ent + 1, 0, 10);
+
+        if (code == 0) {
+          *dest++ = *src++;
+          continue;
+        }
+
+        // utf-8 is never longer than the entity.
+        if (code < 0x80) {
+          *dest++ = (char)code;
+        } else if (code < 0x800) {
+          *dest++ = (char)(0xc0 | (code >> 6));
+          *dest++ = (char)(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+          *dest++ = (char)(0xe0 | (code >> 12));
+          *dest++ = (char)(0x80 | ((code >> 6) & 0x3f));
+          *dest++ = (char)(0x80 | (code & 0x3f));
+        } else {
+          *dest++ = (char)(0xf0 | ((code >> 18) & 0x07));
+          *dest++ = (char)(0x80 | ((code >> 12) & 0x3f));
+          *dest++ = (char)(0x80 | ((code >> 6) & 0x3f));
+          *dest++ = (char)(0x80 | (code & 0x3f));
+        }
+        src = semi + 1;
+      }
+      return dest;
+    }
+
+  private:
+    // read eight bytes, little endian.
+    static uint64_t load8(const char *src) {
+      uint64_t v;
+      memcpy(&v, src, 8);
+      return v;
+    }
+
+    // number of digits (0 to 8) at the start of eight bytes, checking all the bytes at once.
+    // a carry only crosses a byte after a non-digit, so the first non-digit is always found.
+    static unsigned count_digits(uint64_t v) {
+      uint64_t x = v ^ 0x3030303030303030ull;
+      uint64_t non_digits = (x | (x + 0x0606060606060606ull)) & 0xf0f0f0f0f0f0f0f0ull;
+      if (!non_digits) return 8;
+      unsigned lo = (unsigned)non_digits;
+      return lo ? hash_map_ctrl::lowest_bit(lo) >> 3 : 4 + (hash_map_ctrl::lowest_bit((unsigned)(non_digits >> 32)) >> 3);
+    }
+
+    // value of the first n (1 to 8) digits of eight bytes, two, four then eight digits at a time.
+    static uint32_t eight_digits(uint64_t v, unsigned n) {
+      v -= 0x3030303030303030ull;
+      // the first digit is in the bottom byte. Shifting up puts zeros in front.
+      v <<= (8 - n) * 8;
+      v = (v * 10) + (v >> 8);
+      v = (((v & 0x000000ff000000ffull) * (100 + (1000000ull << 32))) + (((v >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32)))) >> 32;
+      return (uint32_t)v;
+    }
+
+    // add a run of digits to a mantissa of up to 19 significant digits.
+    // returns the end of the run; num_digits is the number of digits added and dropped the number that did not fit.
+    static const char *read_digits(uint64_t &mant, unsigned &sig_digits, int &num_digits, int &dropped, const char *src, const char *src_max) {
+      static const uint32_t pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+      num_digits = 0;
+      dropped = 0;
+
+      // eight digits at a time while there is room in the mantissa.
+      while (sig_digits <= 11 && src_max - src >= 8) {
+        uint64_t v = load8(src);
+        unsigned n = count_digits(v);
+        if (n == 0) return src;
+        mant = mant * pow10[n] + eight_digits(v, n);
+        sig_digits = mant ? sig_digits + n : 0;
+        num_digits += n;
+        src += n;
+        if (n != 8) return src;
+      }
+
+      for (; src != src_max && (unsigned)(*src - '0') < 10; ++src) {
+        if (sig_digits < 19) {
+          mant = mant * 10 + (*src - '0');
+          sig_digits += mant != 0;
+          num_digits++;
+        } else {
+          dropped++;
+        }
+      }
+      return src;
+    }
+
+    static const double *get_pow10() {
+      static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+      return pow10;
+    }
+
+  public:
+    /// Parse one number like -1.25e-3. Returns NULL if there is no number at src.
+    /// The result is the nearest float, like strtof().
+    static const char *parse_float(float &result, const char *src, const char *src_max) {
+      const double *pow10 = get_pow10();
+
+      bool negative = false;
+      if (src != src_max && (*src == '-' || *src == '+')) {
+        negative = *src++ == '-';
+      }
+
+      uint64_t mant = 0;
+      unsigned sig_digits = 0;
+      int num_int = 0, num_frac = 0, dropped = 0, frac_dropped = 0;
+      src = read_digits(mant, sig_digits, num_int, dropped, src, src_max);
+      int exp10 = dropped;
+
+      if (src != src_max && *src == '.') {
+        src = read_digits(mant, sig_digits, num_frac, frac_dropped, src + 1, src_max);
+        exp10 -= num_frac;
+      }
+
+      if (num_int + dropped + num_frac + frac_dropped == 0) return NULL;
+
+      if (src != src_max && (*src == 'e' || *src == 'E')) {
+        const char *p = src + 1;
+        int esign = 1;
+        if (p != src_max && (*p == '-' || *p == '+')) {
+          esign = *p++ == '-' ? -1 : 1;
+        }
+        if (p != src_max && (unsigned)(*p - '0') < 10) {
+          int exp = 0;
+          for (; p != src_max && (unsigned)(*p - '0') < 10; ++p) {
+            if (exp < 10000) exp = exp * 10 + (*p - '0');
+          }
+          exp10 += exp * esign;
+          src = p;
+        }
+      }
+
+      double value = (double)mant;
+      if (mant == 0 || exp10 == 0) {
+      } else if (exp10 > 0 && exp10 <= 22) {
+        value *= pow10[exp10];
+      } else if (exp10 < 0 && exp10 >= -22) {
+        value /= pow10[-exp10];
+      } else {
+        value *= pow(10.0, exp10);
+      }
+
+      result = (float)(negative ? -value : value);
+      return src;
+    }
+
+    /// Parse a list of numbers like "1.2 3.4 43.12" in place.
+    /// Stops at the end or at anything that is not a number.
+    static void parse_floats(dynarray<float> &values, const char *src, const char *src_max) {
+      const double *pow10 = get_pow10();
+      values.resize(0);
+      for (;;) {
+        while (src != src_max && is_space(*src)) ++src;
+
+        // most numbers are short, like -123.4567. Up to 15 digits are exact in a double,
+        // so one divide gives the nearest float. Away from the end we need no range checks.
+        if (src_max - src >= 32) {
+          const char *begin = src + (*src == '-');
+          const char *p = begin, *limit = begin + 15;
+          uint64_t mant = 0;
+          for (; (unsigned)(*p - '0') < 10 && p != limit; ++p) {
+            mant = mant * 10 + (*p - '0');
+          }
+          const char *int_end = p;
+          unsigned num_frac = 0;
+          if (*p == '.') {
+            const char *frac = ++p;
+            for (++limit; (unsigned)(*p - '0') < 10 && p != limit; ++p) {
+              mant = mant * 10 + (*p - '0');
+            }
+            num_frac = (unsigned)(p - frac);
+          }
+          if ((int_end != begin || num_frac) && (unsigned)(*p - '0') >= 10 && *p != 'e' && *p != 'E') {
+            double value = (double)mant / pow10[num_frac];
+            values.push_back((float)(*src == '-' ? -value : value));
+            src = p;
+            continue;
+          }
+        }
+
+        float value;
+        const char *end = src == src_max ? NULL : parse_float(value, src, src_max);
+        if (!end) break;
+        values.push_back(value);
+        src = end;
+      }
+    }
+
+    /// Parse a list of integers like "1 3 9 12 34" in place, adding them to values.
+    /// Stops at the end or at anything that is not a number.
+    static void parse_ints(dynarray<int> &values, const char *src, const char *src_max) {
+      for (;;) {
+        while (src != src_max && is_space(*src)) ++src;
+        if (src == src_max) break;
+
+        bool negative = false;
+        if (*src == '-' || *src == '+') {
+          negative = *src++ == '-';
+        }
+
+        // indices are short, so add up the digits one at a time.
+        if (src_max - src >= 32 && (unsigned)(*src - '0') < 10) {
+          const char *limit = src + 9;
+          int value = 0;
+          for (; (unsigned)(*src - '0') < 10 && src != limit; ++src) {
+            value = value * 10 + (*src - '0');
+          }
+          if ((unsigned)(*src - '0') >= 10) {
+            values.push_back(negative ? -value : value);
+            continue;
+          }
+          src -= 9;
+        }
+
+        uint64_t mant = 0;
+        unsigned sig_digits = 0;
+        int num_digits = 0, dropped = 0;
+        src = read_digits(mant, sig_digits, num_digits, dropped, src, src_max);
+        if (num_digits + dropped == 0) break;
+
+        int value = (int)mant;
+        values.push_back(negative ? -value : value);
+      }
+    }
+  };
+
+  /// An element of an xml_document.
+  class xml_element {
+    friend class xml_document;
+
+    const char *name;
+    const char **attributes;
+    unsigned num_attributes;
+    xml_element *first_child_;
+    xml_element *next_sibling_;
+    const char *text_begin;
+    const char *text_end;
+    const char *text;
+    bool cdata;
+    void *user_data;
+    class xml_document *doc;
+
+  public:
+    /// Name of the element, eg. "float_array".
+    const char *get_name() const {
+      return name;
+    }
+
+    /// Get the value of an attribute, or NULL if there is no such attribute.
+    const char *get_attribute(const char *attr_name) const {
+      for (unsigned i = 0; i != num_attributes; ++i) {
+        if (!strcmp(attributes[i*2], attr_name)) return attributes[i*2+1];
+      }
+      return NULL;
+    }
+
+    /// Get the first child element, or the first child element with a name.
+    xml_element *first_child(const char *child_name = NULL) const {
+      xml_element *elem = first_child_;
+      while (elem && child_name && strcmp(elem->name, child_name)) elem = elem->next_sibling_;
+      return elem;
+    }
+
+    /// Get the next element, or the next element with a name.
+    xml_element *next_sibling(const char *sibling_name = NULL) const {
+      xml_element *elem = next_sibling_;
+      while (elem && sibling_name && strcmp(elem->name, sibling_name)) elem = elem->next_sibling_;
+      return elem;
+    }
+
+    /// Start of the text of the element in the source. Entities are not decoded.
+    /// Use this with get_text_end() to parse large arrays in place.
+    const char *get_text_begin() const {
+      return text_begin;
+    }
+
+    /// End of the text of the element in the source.
+    const char *get_text_end() const {
+      return text_end;
+    }
+
+    /// Get the text of the element as a string, or NULL if there is no text.
+    /// Entities are decoded and white space is condensed. The string is made the first time it is needed.
+    inline const char *get_text();
+
+    /// Attach some data to the element.
+    void set_user_data(void *value) {
+      user_data = value;
+    }
+
+    /// Get the data attached to the element.
+    void *get_user_data() const {
+      return user_data;
+    }
+  };
+
+  /// A compact index of the elements of an XML file in memory.
+  ///
+  /// Unlike a DOM, the text is left in the source buffer, which must outlive the document.
+  ///
+  /// Example
+  ///
+  ///     file_view view;
+  ///     app_utils::get_url(view, "assets/duck.dae");
+  ///     xml_document doc;
+  ///     if (doc.parse((const char*)view.get_src(), (const char*)view.get_src_max())) {
+  ///       xml_element *root = doc.get_root();
+  ///     }
+  class xml_document {
+    enum { block_size = 0x10000 };
+
+    struct block {
+      uint8_t *data;
+      size_t size;
+      size_t used;
+    };
+
+    // the last block is the one we are allocating from.
+    dynarray<block> blocks;
+    size_t bytes_used;
+
+    xml_element *root;
+    const char *error;
+
+    // do not define these.
+    xml_document(const xml_document &rhs);
+    void operator=(const xml_document &rhs);
+
+    void *alloc(size_t bytes) {
+      bytes = (bytes + 7) & ~(size_t)7;
+      bytes_used += bytes;
+      if (bytes > block_size / 4) {
+        // big allocations get a block of their own, in front of the current block.
+        block b = { (uint8_t*)allocator::malloc(bytes), bytes, bytes };
+        blocks.push_back(b);
+        if (blocks.size() >= 2) std::swap(blocks[blocks.size()-1], blocks[blocks.size()-2]);
+        return b.data;
+      }
+      if (blocks.size() == 0 || blocks.back().used + bytes > blocks.back().size) {
+        block b = { (uint8_t*)allocator::malloc(block_size), block_size, 0 };
+        blocks.push_back(b);
+      }
+      block &b = blocks.back();
+      void *result = b.data + b.used;
+      b.used += bytes;
+      return result;
+    }
+
+    const char *copy_string(const char *src, const char *src_max) {
+      char *dest = (char*)alloc(src_max - src + 1);
+      *xml_pull_parser::decode(dest, src, src_max) = 0;
+      return dest;
+    }
+
+    xml_element *new_element(const xml_pull_parser &parser) {
+      xml_element *elem = (xml_element*)alloc(sizeof(xml_element));
+      elem->name = copy_string(parser.get_name(), parser.get_name_end());
+      elem->num_attributes = parser.get_num_attributes();
+      elem->attributes = (const char **)alloc(sizeof(const char *) * 2 * elem->num_attributes);
+      for (unsigned i = 0; i != elem->num_attributes; ++i) {
+        const xml_pull_parser::attribute &a = parser.get_attribute(i);
+        elem->attributes[i*2] = copy_string(a.name, a.name_end);
+        elem->attributes[i*2+1] = copy_string(a.value, a.value_end);
+      }
+      elem->first_child_ = NULL;
+      elem->next_sibling_ = NULL;
+      elem->text_begin = elem->text_end = elem->text = NULL;
+      elem->cdata = false;
+      elem->user_data = NULL;
+      elem->doc = this;
+      return elem;
+    }
+
+    static bool is_space(char c) {
+      return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+  public:
+    xml_document() {
+      bytes_used = 0;
+      root = NULL;
+      error = NULL;
+    }
+
+    ~xml_document() {
+      reset();
+    }
+
+    /// Free the elements.
+    void reset() {
+      for (unsigned i = 0; i != blocks.size(); ++i) {
+        allocator::free(blocks[i].data, blocks[i].size);
+      }
+      blocks.reset();
+      bytes_used = 0;
+      root = NULL;
+      error = NULL;
+    }
+
+    /// Index the elements of the XML from src to src_max.
+    /// The bytes must not move or go away while the document is in use.
+    bool parse(const char *src, const char *src_max) {
+      reset();
+
+      xml_pull_parser parser(src, src_max);
+      dynarray<xml_element *> stack;
+      dynarray<xml_element *> last_child;
+      stack.reserve(64);
+      last_child.reserve(64);
+
+      for (;;) {
+        xml_pull_parser::token_t token = parser.next();
+        if (token == xml_pull_parser::token_begin) {
+          xml_element *elem = new_element(parser);
+          if (stack.size() == 0) {
+            if (root) {
+              error = "more than one root element";
+              return false;
+            }
+            root = elem;
+          } else if (last_child.back()) {
+            last_child.back()->next_sibling_ = elem;
+          } else {
+            stack.back()->first_child_ = elem;
+          }
+          if (stack.size()) last_child.back() = elem;
+          stack.push_back(elem);
+          last_child.push_back(NULL);
+        } else if (token == xml_pull_parser::token_end) {
+          stack.pop_back();
+          last_child.pop_back();
+        } else if (token == xml_pull_parser::token_text) {
+          // like TinyXML, the text of an element is text before any child elements.
+          xml_element *parent = stack.size() ? stack.back() : NULL;
+          if (parent && !parent->first_child_ && !parent->text_begin) {
+            const char *begin = parser.get_text(), *end = parser.get_text_end();
+            bool blank = !parser.is_cdata();
+            for (const char *p = begin; blank && p != end; ++p) blank = is_space(*p);
+            if (!blank) {
+              parent->text_begin = begin;
+              parent->text_end = end;
+              parent->cdata = parser.is_cdata();
+            }
+          }
+        } else if (token == xml_pull_parser::token_eof) {
+          break;
+        } else {
+          error = parser.get_error();
+          return false;
+        }
+      }
+
+      if (!root) {
+        error = "no root element";
+        return false;
+      }
+      return true;
+    }
+
+    /// The top level element.
+    xml_element *get_root() const {
+      return root;
+    }
+
+    /// Description of an error from parse().
+    const char *get_error() const {
+      return error;
+    }
+
+    /// Bytes used by the elements, attributes and strings; not including the source.
+    size_t get_bytes_used() const {
+      return bytes_used;
+    }
+
+    /// Make a string from some text, decoding entities and condensing white space like TinyXML.
+    /// Returns NULL if there is no text.
+    const char *make_text(const char *src, const char *src_max, bool cdata) {
+      if (cdata) {
+        char *dest = (char*)alloc(src_max - src + 1);
+        memcpy(dest, src, src_max - src);
+        dest[src_max - src] = 0;
+        return dest;
+      }
+
+      while (src != src_max && is_space(*src)) ++src;
+      while (src != src_max && is_space(src_max[-1])) --src_max;
+      if (src == src_max) return NULL;
+
+      char *dest = (char*)alloc(src_max - src + 1);
+      char *end = xml_pull_parser::decode(dest, src, src_max);
+      char *d = dest;
+      for (const char *p = dest; p != end; ) {
+        if (is_space(*p)) {
+          *d++ = ' ';
+          while (p != end && is_space(*p)) ++p;
+        } else {
+          *d++ = *p++;
+        }
+      }
+      *d = 0;
+      return dest;
+    }
+  };
+
+  inline const char *xml_element::get_text() {
+    if (!text && text_begin) {
+      text = doc->make_text(text_begin, text_end, cdata);
+    }
+    return text;
+  }
+
+  #if OCTET_UNIT_TEST
+    class xml_pull_parser_unit_test {
+      static bool equal(const char *str, const char *str_end, const char *expected) {
+        return (size_t)(str_end - str) == strlen(expected) && !memcmp(str, expected, str_end - str);
+      }
+
+      // skip text between tags.
+      static xml_pull_parser::token_t next_tag(xml_pull_parser &parser) {
+        xml_pull_parser::token_t token;
+        while ((token = parser.next()) == xml_pull_parser::token_text) {
+        }
+        return token;
+      }
+
+      // parse_float must give the same float as strtof.
+      static void check_float(const char *str) {
+        float value = 0;
+        const char *end = xml_pull_parser::parse_float(value, str, str + strlen(str));
+        float expected = strtof(str, 0);
+        assert(end == str + strlen(str) && !memcmp(&value, &expected, sizeof(float)));
+      }
+
+    public:
+      xml_pull_parser_unit_test() {
+        static const char xml[] =
+          "\xef\xbb\xbf<?xml version=\"1.0\"?>\n"
+          "<!DOCTYPE doc [ <!ENTITY e \"x\"> ]>\n"
+          "<!-- a <comment> -->\n"
+          "<doc a=\"1\" b = '&lt;2&gt;'>\n"
+          "  <empty/>\n"
+          "  <text>  one &amp;\n  two&#65;&#x42; </text>\n"
+          "  <cdata><![CDATA[<not & parsed>]]></cdata>\n"
+          "  <array count=\"4\">1.5 -2 3e2 .25</array>\n"
+          "  <p>0 1 -2 30</p><p>4</p>\n"
+          "</doc>\n";
+        const char *xml_end = xml + sizeof(xml) - 1;
+
+        // tokens, attributes and depth from the pull parser.
+        xml_pull_parser parser(xml, xml_end);
+        assert(next_tag(parser) == xml_pull_parser::token_begin && equal(parser.get_name(), parser.get_name_end(), "doc"));
+        assert(parser.get_num_attributes() == 2 && parser.get_depth() == 1);
+        const xml_pull_parser::attribute &b = parser.get_attribute(1);
+        assert(equal(b.name, b.name_end, "b") && equal(b.value, b.value_end, "&lt;2&gt;"));
+        assert(next_tag(parser) == xml_pull_parser::token_begin && equal(parser.get_name(), parser.get_name_end(), "empty"));
+        assert(parser.get_depth() == 2 && parser.next() == xml_pull_parser::token_end && parser.get_depth() == 1);
+        unsigned num_begins = 2, num_ends = 1, num_cdata = 0;
+        xml_pull_parser::token_t token;
+        while ((token = parser.next()) != xml_pull_parser::token_eof) {
+          assert(token != xml_pull_parser::token_error);
+          if (token == xml_pull_parser::token_text && parser.is_cdata()) {
+            assert(equal(parser.get_text(), parser.get_text_end(), "<not & parsed>"));
+            num_cdata++;
+          }
+          num_begins += token == xml_pull_parser::token_begin;
+          num_ends += token == xml_pull_parser::token_end;
+        }
+        assert(num_begins == 7 && num_ends == 7 && num_cdata == 1 && parser.get_depth() == 0);
+
+        // entities become utf-8.
+        static const char entities[] = "&amp;&lt;&gt;&quot;&apos;&#65;&#x42;&#xe9;&#x20ac;&bad;&";
+        char decoded[sizeof(entities)];
+        char *decoded_end = xml_pull_parser::decode(decoded, entities, entities + sizeof(entities) - 1);
+        assert(equal(decoded, decoded_end, "&<>\"'AB\xc3\xa9\xe2\x82\xac&bad;&"));
+
+        // the document index.
+        xml_document doc;
+        assert(doc.parse(xml, xml_end));
+        xml_element *root = doc.get_root();
+        assert(!strcmp(root->get_name(), "doc") && !strcmp(root->get_attribute("b"), "<2>") && !root->get_attribute("c"));
+        assert(root->get_text() == NULL && !strcmp(root->first_child()->get_name(), "empty"));
+        assert(!strcmp(root->first_child("text")->get_text(), "one & twoAB"));
+        assert(!strcmp(root->first_child("cdata")->get_text(), "<not & parsed>"));
+        xml_element *p = root->first_child("p");
+        assert(p && p->next_sibling("p") && !p->next_sibling("p")->next_sibling());
+
+        // numbers are parsed in place.
+        xml_element *array = root->first_child("array");
+        dynarray<float> floats;
+        xml_pull_parser::parse_floats(floats, array->get_text_begin(), array->get_text_end());
+        assert(floats.size() == 4 && floats[0] == 1.5f && floats[1] == -2 && floats[2] == 300 && floats[3] == 0.25f);
+        dynarray<int> ints;
+        xml_pull_parser::parse_ints(ints, p->get_text_begin(), p->get_text_end());
+        assert(ints.size() == 4 && ints[0] == 0 && ints[2] == -2 && ints[3] == 30);
+        floats.resize(0);
+        static const char partial[] = "1 2 x 3";
+        xml_pull_parser::parse_floats(floats, partial, partial + sizeof(partial) - 1);
+        assert(floats.size() == 2);
+
+        // floats round like strtof, including long mantissas and small and large exponents.
+        static const char *const float_strs[] = {
+          "0", "-0", "1", "0.1", "3.14159265358979323846", "1e38", "3.4028234e38", "1.17549435e-38",
+          "1.4e-45", "123456789012345678901234567890", "0.000000000000000000000000000001", "16777217", "-7.5e-3",
+        };
+        for (unsigned i = 0; i != sizeof(float_strs) / sizeof(float_strs[0]); ++i) {
+          check_float(float_strs[i]);
+        }
+        uint32_t seed = 12345;
+        for (unsigned i = 0; i != 20000; ++i) {
+          seed = seed * 1664525 + 1013904223;
+          uint32_t bits = seed & 0xf7ffffff;
+          float f;
+          memcpy(&f, &bits, sizeof(f));
+          char str[64];
+          sprintf(str, i & 1 ? "%.9g" : "%.17g", i & 1 ? f : f * (1.0 + (seed >> 8) * 1e-9));
+          check_float(str);
+        }
+
+        // bad documents fail, and truncated ones never read past the end.
+        static const char *const bad[] = {
+          "<a><b></a>", "<a></a><b/>", "<a x=1/>", "<a><!-- </a>", "</a>", "", "<a>",
+        };
+        for (unsigned i = 0; i != sizeof(bad) / sizeof(bad[0]); ++i) {
+          assert(!doc.parse(bad[i], bad[i] + strlen(bad[i])) && doc.get_error());
+        }
+        for (size_t i = 0; i != sizeof(xml) - 1; ++i) {
+          dynarray<char> prefix(i ? (unsigned)i : 1);
+          memcpy(prefix.data(), xml, i);
+          doc.parse(prefix.data(), prefix.data() + i);
+        }
+      }
+    };
+
+    static xml_pull_parser_unit_test xml_pull_parser_unit_test;
+  #endif
+} }
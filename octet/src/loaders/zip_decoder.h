@@ -6,315 +6,380 @@
 //
 //
 // zip deflate format decoder
-// 
+//
 namespace octet { namespace loaders {
+  /// Inflate (RFC 1951 deflate) decoder for zip files.
+  ///
+  /// Huffman codes are decoded with two-level lookup tables from a 64 bit bit buffer
+  /// that is refilled a word at a time. Matches are expanded with overlapping word copies.
+  ///
+  /// The input is read in place, so a memory mapped zip file can be inflated
+  /// straight into the destination buffer without a temporary copy.
+  ///
+  /// Example
+  ///
+  ///     zip_decoder decoder;
+  ///     dynarray<uint8_t> buffer(usize);
+  ///     if (decoder.inflate(buffer.data(), usize, src, csize) != usize) {
+  ///       printf("bad zip data\n");
+  ///     }
   class zip_decoder {
-    enum { debug = 1 };
+    enum { debug = 0 };
+
+    // codes up to root_bits long are found with one lookup, longer ones with a second lookup.
+    enum {
+      lit_root_bits = 10,
+      dist_root_bits = 8,
+      length_root_bits = 7,
+      max_code_length = 15,
+    };
+
+    // table entry: symbol (or subtable offset) << 16 | flags << 8 | bits to consume.
+    enum {
+      entry_link = 0x80,
+      entry_invalid = 0x40,
+      entry_sub_bits_mask = 0x1f,
+    };
 
     struct huffman_table {
-      uint8_t min_lit_length;
-      uint8_t max_lit_length;
-      uint8_t min_dist_length;
-      uint8_t max_dist_length;
-
-      //uint8_t lit_lengths[288];
-      uint16_t lit_codes[288];
-      uint16_t lit_limits[18];
-      uint16_t lit_base[18];
-
-      //uint8_t dist_lengths[32];
-      uint16_t dist_codes[32];
-      uint16_t dist_limits[18];
-      uint16_t dist_base[18];
+      dynarray<uint32_t> entries;
+      unsigned root_bits;
     };
 
-    huffman_table fixed_;
-    huffman_table var_;
-
-    // on ARM we can do this faster with the "rev" instruction
-    inline static uint16_t rev16(uint16_t value) {
-      // small table version.
-      //static const uint8_t r16[] = { 0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf };
-      //return r16[value&0x0f] * 0x1000 | r16[(value>>4)&0x0f] * 0x100 | r16[(value>>8)&0x0f] * 0x10 | r16[value>>12];
-
-      // this table is probably too big to be efficient. L1 cache misses are very expensive.
-      static const uint8_t r256[] = {
-        0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 
-        0x00+0x10, 0x80+0x10, 0x40+0x10, 0xc0+0x10, 0x20+0x10, 0xa0+0x10, 0x60+0x10, 0xe0+0x10, 
-        0x00+8, 0x80+8, 0x40+8, 0xc0+8, 0x20+8, 0xa0+8, 0x60+8, 0xe0+8, 
-        0x00+0x10+8, 0x80+0x10+8, 0x40+0x10+8, 0xc0+0x10+8, 0x20+0x10+8, 0xa0+0x10+8, 0x60+0x10+8, 0xe0+0x10+8, 
-        0x00+ 4, 0x80+ 4, 0x40+ 4, 0xc0+ 4, 0x20+ 4, 0xa0+ 4, 0x60+ 4, 0xe0+ 4, 
-        0x00+0x10+ 4, 0x80+0x10+ 4, 0x40+0x10+ 4, 0xc0+0x10+ 4, 0x20+0x10+ 4, 0xa0+0x10+ 4, 0x60+0x10+ 4, 0xe0+0x10+ 4, 
-        0x00+8+ 4, 0x80+8+ 4, 0x40+8+ 4, 0xc0+8+ 4, 0x20+8+ 4, 0xa0+8+ 4, 0x60+8+ 4, 0xe0+8+ 4, 
-        0x00+0x10+8+ 4, 0x80+0x10+8+ 4, 0x40+0x10+8+ 4, 0xc0+0x10+8+ 4, 0x20+0x10+8+ 4, 0xa0+0x10+8+ 4, 0x60+0x10+8+ 4, 0xe0+0x10+8+ 4, 
-        0x00+ 2, 0x80+ 2, 0x40+ 2, 0xc0+ 2, 0x20+ 2, 0xa0+ 2, 0x60+ 2, 0xe0+ 2, 
-        0x00+0x10+ 2, 0x80+0x10+ 2, 0x40+0x10+ 2, 0xc0+0x10+ 2, 0x20+0x10+ 2, 0xa0+0x10+ 2, 0x60+0x10+ 2, 0xe0+0x10+ 2, 
-        0x00+8+ 2, 0x80+8+ 2, 0x40+8+ 2, 0xc0+8+ 2, 0x20+8+ 2, 0xa0+8+ 2, 0x60+8+ 2, 0xe0+8+ 2, 
-        0x00+0x10+8+ 2, 0x80+0x10+8+ 2, 0x40+0x10+8+ 2, 0xc0+0x10+8+ 2, 0x20+0x10+8+ 2, 0xa0+0x10+8+ 2, 0x60+0x10+8+ 2, 0xe0+0x10+8+ 2, 
-        0x00+ 4+ 2, 0x80+ 4+ 2, 0x40+ 4+ 2, 0xc0+ 4+ 2, 0x20+ 4+ 2, 0xa0+ 4+ 2, 0x60+ 4+ 2, 0xe0+ 4+ 2, 
-        0x00+0x10+ 4+ 2, 0x80+0x10+ 4+ 2, 0x40+0x10+ 4+ 2, 0xc0+0x10+ 4+ 2, 0x20+0x10+ 4+ 2, 0xa0+0x10+ 4+ 2, 0x60+0x10+ 4+ 2, 0xe0+0x10+ 4+ 2, 
-        0x00+8+ 4+ 2, 0x80+8+ 4+ 2, 0x40+8+ 4+ 2, 0xc0+8+ 4+ 2, 0x20+8+ 4+ 2, 0xa0+8+ 4+ 2, 0x60+8+ 4+ 2, 0xe0+8+ 4+ 2, 
-        0x00+0x10+8+ 4+ 2, 0x80+0x10+8+ 4+ 2, 0x40+0x10+8+ 4+ 2, 0xc0+0x10+8+ 4+ 2, 0x20+0x10+8+ 4+ 2, 0xa0+0x10+8+ 4+ 2, 0x60+0x10+8+ 4+ 2, 0xe0+0x10+8+ 4+ 2, 
-        0x00+ 1, 0x80+ 1, 0x40+ 1, 0xc0+ 1, 0x20+ 1, 0xa0+ 1, 0x60+ 1, 0xe0+ 1, 
-        0x00+0x10+ 1, 0x80+0x10+ 1, 0x40+0x10+ 1, 0xc0+0x10+ 1, 0x20+0x10+ 1, 0xa0+0x10+ 1, 0x60+0x10+ 1, 0xe0+0x10+ 1, 
-        0x00+8+ 1, 0x80+8+ 1, 0x40+8+ 1, 0xc0+8+ 1, 0x20+8+ 1, 0xa0+8+ 1, 0x60+8+ 1, 0xe0+8+ 1, 
-        0x00+0x10+8+ 1, 0x80+0x10+8+ 1, 0x40+0x10+8+ 1, 0xc0+0x10+8+ 1, 0x20+0x10+8+ 1, 0xa0+0x10+8+ 1, 0x60+0x10+8+ 1, 0xe0+0x10+8+ 1, 
-        0x00+ 4+ 1, 0x80+ 4+ 1, 0x40+ 4+ 1, 0xc0+ 4+ 1, 0x20+ 4+ 1, 0xa0+ 4+ 1, 0x60+ 4+ 1, 0xe0+ 4+ 1, 
-        0x00+0x10+ 4+ 1, 0x80+0x10+ 4+ 1, 0x40+0x10+ 4+ 1, 0xc0+0x10+ 4+ 1, 0x20+0x10+ 4+ 1, 0xa0+0x10+ 4+ 1, 0x60+0x10+ 4+ 1, 0xe0+0x10+ 4+ 1, 
-        0x00+8+ 4+ 1, 0x80+8+ 4+ 1, 0x40+8+ 4+ 1, 0xc0+8+ 4+ 1, 0x20+8+ 4+ 1, 0xa0+8+ 4+ 1, 0x60+8+ 4+ 1, 0xe0+8+ 4+ 1, 
-        0x00+0x10+8+ 4+ 1, 0x80+0x10+8+ 4+ 1, 0x40+0x10+8+ 4+ 1, 0xc0+0x10+8+ 4+ 1, 0x20+0x10+8+ 4+ 1, 0xa0+0x10+8+ 4+ 1, 0x60+0x10+8+ 4+ 1, 0xe0+0x10+8+ 4+ 1, 
-        0x00+ 2+ 1, 0x80+ 2+ 1, 0x40+ 2+ 1, 0xc0+ 2+ 1, 0x20+ 2+ 1, 0xa0+ 2+ 1, 0x60+ 2+ 1, 0xe0+ 2+ 1, 
-        0x00+0x10+ 2+ 1, 0x80+0x10+ 2+ 1, 0x40+0x10+ 2+ 1, 0xc0+0x10+ 2+ 1, 0x20+0x10+ 2+ 1, 0xa0+0x10+ 2+ 1, 0x60+0x10+ 2+ 1, 0xe0+0x10+ 2+ 1, 
-        0x00+8+ 2+ 1, 0x80+8+ 2+ 1, 0x40+8+ 2+ 1, 0xc0+8+ 2+ 1, 0x20+8+ 2+ 1, 0xa0+8+ 2+ 1, 0x60+8+ 2+ 1, 0xe0+8+ 2+ 1, 
-        0x00+0x10+8+ 2+ 1, 0x80+0x10+8+ 2+ 1, 0x40+0x10+8+ 2+ 1, 0xc0+0x10+8+ 2+ 1, 0x20+0x10+8+ 2+ 1, 0xa0+0x10+8+ 2+ 1, 0x60+0x10+8+ 2+ 1, 0xe0+0x10+8+ 2+ 1, 
-        0x00+ 4+ 2+ 1, 0x80+ 4+ 2+ 1, 0x40+ 4+ 2+ 1, 0xc0+ 4+ 2+ 1, 0x20+ 4+ 2+ 1, 0xa0+ 4+ 2+ 1, 0x60+ 4+ 2+ 1, 0xe0+ 4+ 2+ 1, 
-        0x00+0x10+ 4+ 2+ 1, 0x80+0x10+ 4+ 2+ 1, 0x40+0x10+ 4+ 2+ 1, 0xc0+0x10+ 4+ 2+ 1, 0x20+0x10+ 4+ 2+ 1, 0xa0+0x10+ 4+ 2+ 1, 0x60+0x10+ 4+ 2+ 1, 0xe0+0x10+ 4+ 2+ 1, 
-        0x00+8+ 4+ 2+ 1, 0x80+8+ 4+ 2+ 1, 0x40+8+ 4+ 2+ 1, 0xc0+8+ 4+ 2+ 1, 0x20+8+ 4+ 2+ 1, 0xa0+8+ 4+ 2+ 1, 0x60+8+ 4+ 2+ 1, 0xe0+8+ 4+ 2+ 1, 
-        0x00+0x10+8+ 4+ 2+ 1, 0x80+0x10+8+ 4+ 2+ 1, 0x40+0x10+8+ 4+ 2+ 1, 0xc0+0x10+8+ 4+ 2+ 1, 0x20+0x10+8+ 4+ 2+ 1, 0xa0+0x10+8+ 4+ 2+ 1, 0x60+0x10+8+ 4+ 2+ 1, 0xe0+0x10+8+ 4+ 2+ 1, 
-      };
-      return r256[value&0xff] << 8 | r256[(value>>8)&0xff];
+    huffman_table fixed_lit_;
+    huffman_table fixed_dist_;
+    huffman_table var_lit_;
+    huffman_table var_dist_;
+    huffman_table lengths_;
+
+    // 64 bit little-endian bit buffer. bytes past the end of the input read as zero
+    // so that the decoder never has to test for the end of the input in the inner loop.
+    struct bit_stream {
+      uint64_t bits;
+      unsigned count;
+      unsigned overrun;
+      const uint8_t *src;
+      const uint8_t *src_max;
+
+      void refill() {
+        if (src_max - src >= 8) {
+          uint64_t word;
+          memcpy(&word, src, 8);
+          bits |= word << count;
+          src += (63 - count) >> 3;
+          count |= 56;
+        } else {
+          while (count <= 56) {
+            if (src != src_max) {
+              bits |= (uint64_t)*src++ << count;
+            } else {
+              overrun++;
+            }
+            count += 8;
+          }
+        }
+      }
 
-      //value = ( ( value >> 1 ) & 0x5555 ) | ( ( value & 0x5555 ) << 1 );
-      //value = ( ( value >> 2 ) & 0x3333 ) | ( ( value & 0x3333 ) << 2 );
-      //value = ( ( value >> 4 ) & 0x0f0f ) | ( ( value & 0x0f0f ) << 4 );
-      //value = ( ( value >> 8 ) & 0x00ff ) | ( ( value & 0x00ff ) << 8 );
-      //return value;
-    }
+      unsigned peek(unsigned n) const {
+        return (unsigned)bits & ((1u << n) - 1);
+      }
 
-    bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base) {
-      min_length = 16;
-      max_length = 0;
-      for (unsigned i = 0; i != num_lengths; ++i) {
-        if (debug) printf("%d,", lengths[i]);
-        if (lengths[i]) {
-          if (min_length > lengths[i]) min_length = lengths[i];
-          if (max_length < lengths[i]) max_length = lengths[i];
-        }
+      void consume(unsigned n) {
+        bits >>= n;
+        count -= n;
       }
-      if (debug) printf("\n");
 
-      if (debug) printf("min_length=%d\n", min_length);
-      if (debug) printf("max_length=%d\n", max_length);
+      unsigned get(unsigned n) {
+        unsigned value = peek(n);
+        consume(n);
+        return value;
+      }
 
-      if ( min_length <= 0 || min_length > max_length || max_length > 16 ) {
-        return false;
+      // true if we have used any of the zeros past the end of the data.
+      bool is_overrun() const {
+        return overrun * 8 > count;
       }
 
+      // give back the whole bytes in the bit buffer and return the byte aligned read pointer.
+      const uint8_t *align() {
+        consume(count & 7);
+        unsigned bytes = count >> 3;
+        if (bytes < overrun) return 0;
+        src -= bytes - overrun;
+        bits = 0;
+        count = 0;
+        overrun = 0;
+        return src;
+      }
+    };
+
+    static unsigned reverse_bits(unsigned code, unsigned length) {
+      unsigned result = 0;
+      for (unsigned i = 0; i != length; ++i) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+      }
+      return result;
+    }
+
+    /// build a lookup table from canonical code lengths.
+    /// The table is indexed by the next root_bits bits of the stream; codes longer than that
+    /// link to a subtable indexed by the bits that follow.
+    bool build_huffman(huffman_table &table, const uint8_t *lengths, unsigned num_lengths, unsigned root_bits) {
+      unsigned count[max_code_length+1];
+      unsigned next_code[max_code_length+1];
+      memset(count, 0, sizeof(count));
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        if (lengths[i] > max_code_length) return false;
+        count[lengths[i]]++;
+      }
+      count[0] = 0;
+
+      // canonical codes: shorter codes come first, then in symbol order.
+      // incomplete codes are allowed (eg. a single distance code); the gaps decode as errors.
+      int left = 1;
       unsigned code = 0;
-      unsigned huffcode = 0;
-      for (unsigned length = min_length; length <= max_length; ++length) {
-        base[length-min_length] = huffcode - code;
-        for (unsigned i = 0; i != num_lengths; ++i) {
-          if (lengths[i] == length) {
-            codes[code++] = i;
-            //dump_bits(huffcode << (16-length), 16, "huffcode");
-            huffcode++;
-          }
-        }
-        limits[length-min_length] = (uint16_t)( ( huffcode << (16-length) ) - 1 );
-        if (debug) printf("length %d: lim=%04x base=%04x\n", length, ( huffcode << (16-length) ) - 1, base[length-min_length]);
-        if (( huffcode << (16-length) ) - 1 > 0xffff) {
+      for (unsigned length = 1; length <= max_code_length; ++length) {
+        left = left * 2 - (int)count[length];
+        if (left < 0) {
           if (debug) printf("invalid huffman table\n");
           return false;
         }
-        huffcode *= 2;
+        code = (code + count[length-1]) << 1;
+        next_code[length] = code;
+      }
+
+      // find the longest code for each root prefix to size the subtables.
+      unsigned root_size = 1u << root_bits;
+      unsigned root_mask = root_size - 1;
+      uint8_t sub_length[1 << lit_root_bits];
+      memset(sub_length, 0, root_size);
+      unsigned codes[288 + 32];
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        unsigned length = lengths[i];
+        if (length) {
+          codes[i] = reverse_bits(next_code[length]++, length);
+          if (length > root_bits) {
+            uint8_t &sub = sub_length[codes[i] & root_mask];
+            if (sub < length) sub = (uint8_t)length;
+          }
+        }
+      }
+
+      unsigned size = root_size;
+      for (unsigned i = 0; i != root_size; ++i) {
+        if (sub_length[i]) size += 1u << (sub_length[i] - root_bits);
+      }
+
+      table.root_bits = root_bits;
+      table.entries.resize(size);
+      uint32_t *entries = table.entries.data();
+      for (unsigned i = 0; i != size; ++i) {
+        entries[i] = entry_invalid << 8;
+      }
+
+      unsigned offset = root_size;
+      for (unsigned i = 0; i != root_size; ++i) {
+        if (sub_length[i]) {
+          unsigned sub_bits = sub_length[i] - root_bits;
+          entries[i] = offset << 16 | (entry_link | sub_bits) << 8 | root_bits;
+          offset += 1u << sub_bits;
+        }
       }
 
-      // prevent escape from bitstream decoding loop.
-      limits[max_length+1-min_length] = 0xffff;
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        unsigned length = lengths[i];
+        if (!length) continue;
+        unsigned rev = codes[i];
+        if (length <= root_bits) {
+          for (unsigned j = rev; j < root_size; j += 1u << length) {
+            entries[j] = i << 16 | length;
+          }
+        } else {
+          uint32_t link = entries[rev & root_mask];
+          unsigned sub_size = 1u << ((link >> 8) & entry_sub_bits_mask);
+          uint32_t *sub = entries + (link >> 16);
+          unsigned sub_length = length - root_bits;
+          for (unsigned j = rev >> root_bits; j < sub_size; j += 1u << sub_length) {
+            sub[j] = i << 16 | sub_length;
+          }
+        }
+      }
       return true;
     }
 
-    /// debug function for dumping bit fields
-    void dump_bits(unsigned value, unsigned bits, const char *name) {
-      char tmp[64];
-      assert(bits<63);
-      for (unsigned i = 0; i != bits; ++i) tmp[i] = ( ( value >> (bits-1-i) ) & 1 ) + '0';
-      tmp[bits] = 0;
-      printf("[%s] %s\n", tmp, name);
+    /// decode one symbol. the bit buffer must hold at least max_code_length bits.
+    /// returns ~0 for an invalid code.
+    static unsigned decode_symbol(bit_stream &bs, const huffman_table &table) {
+      const uint32_t *entries = table.entries.data();
+      uint32_t entry = entries[bs.peek(table.root_bits)];
+      if (entry & (entry_link << 8)) {
+        bs.consume(entry & 0xff);
+        entry = entries[(entry >> 16) + bs.peek((entry >> 8) & entry_sub_bits_mask)];
+      }
+      if (entry & (entry_invalid << 8)) return ~0u;
+      bs.consume(entry & 0xff);
+      return entry >> 16;
     }
 
-    /// peek a fixed number of little-endian bits from the bitstream
-    /// note: this will have to be fixed on PPC and other big-endian devices
-    unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
-      unsigned i = bitptr >> 3, j = bitptr & 7;
-      unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      if (name) dump_bits(value, bits, name);
-      return value;
+    /// copy a match of "length" bytes from "distance" bytes back.
+    /// the source may overlap the destination: a short distance repeats a pattern.
+    static void copy_match(uint8_t *dest, uint8_t *dest_max, unsigned length, unsigned distance) {
+      const uint8_t *from = dest - distance;
+      uint8_t *end = dest + length;
+      if (distance >= 8 && dest_max - end >= 8) {
+        // each word is read from bytes that have already been written.
+        do {
+          memcpy(dest, from, 8);
+          dest += 8;
+          from += 8;
+        } while (dest < end);
+      } else if (distance == 1) {
+        memset(dest, *from, length);
+      } else {
+        // double the repeating pattern with each copy so that the copies never overlap.
+        for (unsigned done = 0; done < length;) {
+          unsigned n = distance + done;
+          if (n > length - done) n = length - done;
+          memcpy(dest + done, from, n);
+          done += n;
+        }
+      }
     }
 
-    unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      bitptr = ( bitptr + 7 ) & ~7;
-      unsigned bytes_to_copy = peek(src, bitptr, 16, "bytes_to_copy");
-      unsigned clength = peek(src, bitptr + 16, 16, "store length check");
-      bitptr += 32;
+    bool decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, bit_stream &bs) {
+      const uint8_t *src = bs.align();
+      if (!src || bs.src_max - src < 4) return false;
+
+      unsigned bytes_to_copy = src[0] | src[1] << 8;
+      unsigned clength = src[2] | src[3] << 8;
+      src += 4;
 
-      if (bytes_to_copy != (clength^0xffff)) return ~0;
-      if (dest + bytes_to_copy > dest_max) return ~0;
-      if ((src + bitptr/8) + bytes_to_copy > src_max) return ~0;
+      if (bytes_to_copy != (clength^0xffff)) return false;
+      if ((size_t)(dest_max - dest) < bytes_to_copy) return false;
+      if ((size_t)(bs.src_max - src) < bytes_to_copy) return false;
 
-      memcpy(dest, src + bitptr/8, bytes_to_copy);
+      memcpy(dest, src, bytes_to_copy);
       dest += bytes_to_copy;
-      bitptr += bytes_to_copy * 8;
-      return bitptr;
+      bs.src = src + bytes_to_copy;
+      return true;
     }
 
-    unsigned decode_lz77(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, huffman_table *table_) {
+    bool decode_lz77(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, bit_stream &bs, const huffman_table &lit, const huffman_table &dist) {
+      static const uint16_t length_base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+      };
+      static const uint8_t length_extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+      };
+      static const uint16_t dist_base[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+      };
+      static const uint8_t dist_extra[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+      };
+
       for(;;) {
-        if (src + bitptr/8 > src_max) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > table_->lit_limits[index]) {
-          index++;
-        }
-        unsigned length = table_->min_lit_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = table_->lit_codes[offset - table_->lit_base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "code");
+        // one refill gives at least 56 bits: enough for a length, a distance and their extra bits.
+        bs.refill();
+        if (bs.is_overrun()) return false;
 
+        unsigned code = decode_symbol(bs, lit);
         if (code < 256) {
-          if (dest+1 > dest_max) return ~0;
-          *dest++ = code;
-          if (debug) printf("%02x\n", code);
-        } else if (code == 256) {
-          return bitptr;
-        } else {
-          unsigned block_length;
-          unsigned distance;
-          {
-            if (debug) printf("[%d]\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
-            };
-            static const uint8_t base[] = {
-              3-3, 4-3, 5-3, 6-3, 7-3, 8-3, 9-3, 10-3,
-              11-3, 13-3, 15-3, 17-3, 19-3, 23-3, 27-3, 31-3,
-              35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
-              131-3, 163-3, 195-3, 227-3, 258-3,
-            };
-            if (code-257 > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code-257 ];
-            block_length = base[ code-257 ] + 3 + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
-          }
-          {
-            //if (src + (bitptr + table_->max_dist_length)/8 > src_max ) return ~0;
-            unsigned peek16 = peek(src, bitptr, 16, NULL);
-            unsigned value = rev16(peek16);
-            unsigned index = 0;
-            while (value > table_->dist_limits[index]) {
-              index++;
+          if (dest == dest_max) return false;
+          *dest++ = (uint8_t)code;
+
+          // most literals are short codes, so try for a second one without a refill.
+          if (bs.count >= max_code_length) {
+            code = decode_symbol(bs, lit);
+            if (code < 256) {
+              if (dest == dest_max) return false;
+              *dest++ = (uint8_t)code;
+              continue;
             }
-            unsigned length = table_->min_dist_length + index;
-            unsigned offset = ( value >> ( 16 - length ) );
-            unsigned code = table_->dist_codes[offset - table_->dist_base[index]];
-            bitptr += length;
-
-            if (debug) printf("{%d}\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0, 0,
-            };
-            static const uint16_t base[] = {
-              1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-            };
-            if (code > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code ];
-            distance = base[ code ] + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
+          } else {
+            continue;
           }
+        }
 
-          if (debug) printf("length=%d distance=%d\n", block_length, distance);
+        if (code == 256) {
+          return true;
+        } else if (code - 257 >= sizeof(length_extra)) {
+          return false;
+        }
 
-          if (dest+block_length > dest_max) return ~0;
+        unsigned block_length = length_base[code - 257] + bs.get(length_extra[code - 257]);
 
-          for(unsigned i = 0; i != block_length; ++i) {
-            dest[0] = dest[-(int)distance];
-            dest++;
-          }
-        }
-      }
-    }
+        // the second literal may have used some of the bits we need.
+        if (bs.count < max_code_length + 13) bs.refill();
+
+        unsigned dcode = decode_symbol(bs, dist);
+        if (dcode >= sizeof(dist_extra)) return false;
+        unsigned distance = dist_base[dcode] + bs.get(dist_extra[dcode]);
 
-    unsigned decode_fixed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &fixed_);
+        if (debug) printf("length=%d distance=%d\n", block_length, distance);
+
+        if (distance > (size_t)(dest - dest_begin)) return false;
+        if (block_length > (size_t)(dest_max - dest)) return false;
+
+        copy_match(dest, dest_max, block_length, distance);
+        dest += block_length;
+      }
     }
 
-    unsigned decode_variable(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      unsigned num_lit_codes = peek(src, bitptr, 5, "num_lit_codes") + 257;
-      unsigned num_dist_codes = peek(src, bitptr+5, 5, "num_dist_codes") + 1;
-      unsigned num_length_codes = peek(src, bitptr+10, 4, "num_length_codes") + 4;
-      
-      bitptr += 14;
+    bool decode_variable(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, bit_stream &bs) {
+      bs.refill();
+      unsigned num_lit_codes = bs.get(5) + 257;
+      unsigned num_dist_codes = bs.get(5) + 1;
+      unsigned num_length_codes = bs.get(4) + 4;
+      if (num_lit_codes > 286 || num_dist_codes > 30) return false;
 
       uint8_t lengths[288 + 32];
-      memset(lengths, 0, 20);
-      if (src + bitptr/8 + num_length_codes > src_max ) return ~0;
+      memset(lengths, 0, 19);
+      static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
       for (unsigned i = 0; i != num_length_codes; ++i) {
-        static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-        lengths[order[i]] = peek(src, bitptr, 3, "length code lenghs");
-        bitptr += 3;
+        if (bs.count < 3) bs.refill();
+        lengths[order[i]] = (uint8_t)bs.get(3);
       }
-      
-      uint16_t codes[19];
-      uint16_t limits[18];
-      uint16_t base[18];
-      uint8_t min_length;
-      uint8_t max_length;
-      if (!build_huffman(lengths, 19, min_length, max_length, codes, limits, base)) return ~0;
-      
+
+      if (!build_huffman(lengths_, lengths, 19, length_root_bits)) return false;
+
       unsigned todo = num_lit_codes + num_dist_codes;
       for(unsigned done = 0; done < todo;) {
-        if (src + bitptr/8 + max_length > src_max ) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > limits[index]) {
-          index++;
-        }
-        unsigned length = min_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = codes[offset - base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "length");
-        //fprintf(source_.debug(), "code=%03x\n", code);
+        bs.refill();
+        if (bs.is_overrun()) return false;
+        unsigned code = decode_symbol(bs, lengths_);
         unsigned copy = 1;
         if (code < 16) {
         } else if(code == 16) {
-          if (src + (bitptr+2)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 2, NULL) + 3;
-          bitptr += 2;
-          if (done == 0) return ~0;
+          if (done == 0) return false;
+          copy = bs.get(2) + 3;
           code = lengths[ done-1 ];
         } else if(code == 17) {
-          if (src + (bitptr+3)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 3, NULL) + 3;
-          bitptr += 3;
+          copy = bs.get(3) + 3;
           code = 0;
         } else if(code == 18) {
-          if (src + (bitptr+7)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 7, NULL) + 11;
-          bitptr += 7;
+          copy = bs.get(7) + 11;
           code = 0;
         } else {
-          return ~0;
+          return false;
         }
-        if (done + copy > todo) return ~0;
-        do {
-          lengths[done++] = code;
-        } while( --copy );
+        if (done + copy > todo) return false;
+        memset(lengths + done, code, copy);
+        done += copy;
       }
 
-      if (debug) printf("lengths done\n");
+      if (!lengths[256]) return false;
 
       if(
-        !build_huffman(lengths, num_lit_codes, var_.min_lit_length, var_.max_lit_length, var_.lit_codes, var_.lit_limits, var_.lit_base) ||
-        !build_huffman(lengths+num_lit_codes, num_dist_codes, var_.min_dist_length, var_.max_dist_length, var_.dist_codes, var_.dist_limits, var_.dist_base)
+        !build_huffman(var_lit_, lengths, num_lit_codes, lit_root_bits) ||
+        !build_huffman(var_dist_, lengths+num_lit_codes, num_dist_codes, dist_root_bits)
       ) {
-        return ~0;
+        return false;
       }
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &var_);
+      return decode_lz77(dest, dest_begin, dest_max, bs, var_lit_, var_dist_);
     }
   public:
     zip_decoder() {
@@ -325,33 +390,105 @@ namespace octet { namespace loaders {
       memset(lit_lengths + 256, 7, 280-256);
       memset(lit_lengths + 280, 8, 288-280);
       memset(dist_lengths, 5, 32);
-      build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
-      build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      build_huffman(fixed_lit_, lit_lengths, 288, lit_root_bits);
+      build_huffman(fixed_dist_, dist_lengths, 32, dist_root_bits);
     }
 
-    void decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
-      unsigned bitptr = 0;
+    /// Inflate src_size bytes of deflate data at src into at most dest_size bytes at dest.
+    /// Returns the number of bytes written or ~(size_t)0 if the data is bad or does not fit.
+    ///
+    /// src may point straight into a memory mapped file; nothing is read past src + src_size.
+    size_t inflate(uint8_t *dest, size_t dest_size, const uint8_t *src, size_t src_size) {
+      bit_stream bs;
+      bs.bits = 0;
+      bs.count = 0;
+      bs.overrun = 0;
+      bs.src = src;
+      bs.src_max = src + src_size;
+
+      uint8_t *dest_begin = dest;
+      uint8_t *dest_max = dest + dest_size;
       unsigned is_last_block;
 
       // for each "deflate" block:
       do {
-        // prevent (bitptr / 8) from overflowing (>512Mib)
-        src += bitptr / 8;
-        bitptr %= 8;
-
         // three bits determine kind and exit condition
-        is_last_block = peek(src, bitptr, 1, "deflate last") != 0;
-        unsigned kind = peek(src, bitptr + 1, 2, "deflate kind");
+        bs.refill();
+        is_last_block = bs.get(1);
+        unsigned kind = bs.get(2);
 
-        bitptr += 3;
+        bool ok = false;
         switch (kind) {
-        case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
-        case 1: bitptr = decode_fixed(dest, dest_max, src, src_max, bitptr); break;
-        case 2: bitptr = decode_variable(dest, dest_max, src, src_max, bitptr); break;
-        default: return;
+          case 0: ok = decode_uncompressed(dest, dest_max, bs); break;
+          case 1: ok = decode_lz77(dest, dest_begin, dest_max, bs, fixed_lit_, fixed_dist_); break;
+          case 2: ok = decode_variable(dest, dest_begin, dest_max, bs); break;
+        }
+        if (!ok || bs.is_overrun()) {
+          if (debug) printf("bad deflate block\n");
+          return ~(size_t)0;
         }
-      } while( !is_last_block && bitptr != ~0);
+      } while( !is_last_block );
+
+      return (size_t)(dest - dest_begin);
+    }
+
+    /// Inflate deflate data from src to dest. Returns false if the data is bad or does not fit.
+    bool decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
+      return inflate(dest, (size_t)(dest_max - dest), src, (size_t)(src_max - src)) != ~(size_t)0;
     }
   };
-}}
 
+  #if OCTET_UNIT_TEST
+    class zip_decoder_unit_test {
+      // inflate src and check that we get expected, then check that every shorter src fails.
+      static void test(zip_decoder &decoder, const uint8_t *src, size_t src_size, const uint8_t *expected, size_t size) {
+        dynarray<uint8_t> dest(size + 1);
+        assert(decoder.inflate(dest.data(), size, src, src_size) == size);
+        assert(!memcmp(dest.data(), expected, size));
+        assert(size == 0 || decoder.inflate(dest.data(), size - 1, src, src_size) == ~(size_t)0);
+        for (size_t i = 0; i != src_size; ++i) {
+          assert(decoder.inflate(dest.data(), size + 1, src, i) == ~(size_t)0);
+        }
+      }
+
+    public:
+      zip_decoder_unit_test() {
+        zip_decoder decoder;
+
+        // raw deflate from zlib (compressobj(level, DEFLATED, -15)).
+        static const char hello[] = "Hello, Hello, Hello!";
+        static const uint8_t stored[] = {
+          0x01, 0x14, 0x00, 0xeb, 0xff, 0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x2c, 0x20, 0x48, 0x65, 0x6c, 0x6c,
+          0x6f, 0x2c, 0x20, 0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x21
+        };
+        static const uint8_t fixed[] = {
+          0xf3, 0x48, 0xcd, 0xc9, 0xc9, 0xd7, 0x51, 0xf0, 0x40, 0xa2, 0x14, 0x01
+        };
+        test(decoder, stored, sizeof(stored), (const uint8_t*)hello, sizeof(hello) - 1);
+        test(decoder, fixed, sizeof(fixed), (const uint8_t*)hello, sizeof(hello) - 1);
+
+        // 1024 bytes of "abcdefgh"[(i * i >> 3) % 8] at level 9 give a dynamic huffman block.
+        static const uint8_t dynamic[] = {
+          0xed, 0xc9, 0x41, 0x11, 0x00, 0x30, 0x08, 0xc4, 0x40, 0xad, 0xe1, 0x38, 0xc0, 0xbf, 0x82, 0xb6,
+          0x36, 0x3a, 0x24, 0xcf, 0x05, 0x42, 0xe9, 0x46, 0x1e, 0x15, 0xbe, 0x97, 0xc6, 0xa2, 0x9d, 0x0a,
+          0x5e, 0xeb, 0xeb, 0xeb, 0x9f, 0xfa, 0x01
+        };
+        uint8_t text[1024];
+        for (unsigned i = 0; i != sizeof(text); ++i) {
+          text[i] = "abcdefgh"[((i * i) >> 3) % 8];
+        }
+        test(decoder, dynamic, sizeof(dynamic), text, sizeof(text));
+
+        // block type 3 is reserved and a stored block's length must match its complement.
+        uint8_t dest[64];
+        static const uint8_t bad_type[] = { 0x07, 0x00 };
+        assert(decoder.inflate(dest, sizeof(dest), bad_type, sizeof(bad_type)) == ~(size_t)0);
+        uint8_t bad_stored[sizeof(stored)];
+        memcpy(bad_stored, stored, sizeof(stored));
+        bad_stored[3] ^= 1;
+        assert(decoder.inflate(dest, sizeof(dest), bad_stored, sizeof(bad_stored)) == ~(size_t)0);
+      }
+    };
+    static zip_decoder_unit_test zip_decoder_unit_test;
+  #endif
+}}
@@ -0,0 +1,329 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bounding volume hierarchy
+//
+
+namespace octet { namespace math {
+  /// Bounding volume hierarchy over a set of axis aligned boxes.
+  ///
+  /// The tree stores primitive numbers only; the caller keeps the primitives
+  /// and tests them in a callback during traversal.
+  ///
+  /// Example
+  ///
+  ///     bvh tree;
+  ///     tree.build(bounds.data(), bounds.size());
+  ///     float t_max = 1;
+  ///     tree.ray_cast(org, dir, t_max, [&](unsigned prim, float &t_max) {
+  ///       // test primitive "prim", reduce t_max on a hit. return true to stop.
+  ///       return false;
+  ///     });
+  class bvh {
+  public:
+    /// 32 byte node. Interior nodes have count == 0 and children first and first+1.
+    struct node {
+      float bb_min[3];
+      uint32_t first;
+      float bb_max[3];
+      uint32_t count;
+
+      bool is_leaf() const { return count != 0; }
+    };
+
+  private:
+    enum {
+      num_bins = 12,
+
+      // below this depth we use surface area splits, after it median splits to bound the depth.
+      max_sah_depth = 32,
+
+      // traversal stack size, enough for max_sah_depth + 32 median splits.
+      max_stack = 72,
+    };
+
+    dynarray<node> nodes;
+    dynarray<uint32_t> prims;
+    unsigned max_leaf_prims;
+
+    // sum of node areas at the last build; refit() compares against this.
+    float build_area;
+
+    struct bin_t {
+      vec3 bb_min;
+      vec3 bb_max;
+      unsigned count;
+    };
+
+    static float half_area(vec3_in extent) {
+      return extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x();
+    }
+
+    static void set_bounds(node &n, vec3_in bb_min, vec3_in bb_max) {
+      n.bb_min[0] = bb_min.x(); n.bb_min[1] = bb_min.y(); n.bb_min[2] = bb_min.z();
+      n.bb_max[0] = bb_max.x(); n.bb_max[1] = bb_max.y(); n.bb_max[2] = bb_max.z();
+    }
+
+    static vec3 get_node_min(const node &n) {
+      return vec3(n.bb_min[0], n.bb_min[1], n.bb_min[2]);
+    }
+
+    static vec3 get_node_max(const node &n) {
+      return vec3(n.bb_max[0], n.bb_max[1], n.bb_max[2]);
+    }
+
+    // entry distance of a ray into a node or a value > t_max for a miss.
+    static float slab_test(const node &n, vec3_in org, vec3_in inv_dir, float t_max) {
+      vec3 t0 = (get_node_min(n) - org) * inv_dir;
+      vec3 t1 = (get_node_max(n) - org) * inv_dir;
+      vec3 tmin = min(t0, t1);
+      vec3 tmax = max(t0, t1);
+      float t_enter = std::max(std::max(tmin.x(), tmin.y()), std::max(tmin.z(), 0.0f));
+      float t_exit = std::min(std::min(tmax.x(), tmax.y()), std::min(tmax.z(), t_max));
+      return t_enter <= t_exit ? t_enter : FLT_MAX;
+    }
+
+    void build_node(unsigned ni, unsigned begin, unsigned end, const aabb *bounds, const vec3 *centers, unsigned depth) {
+      vec3 bb_min = bounds[prims[begin]].get_min();
+      vec3 bb_max = bounds[prims[begin]].get_max();
+      vec3 c_min = centers[prims[begin]];
+      vec3 c_max = c_min;
+      for (unsigned i = begin + 1; i != end; ++i) {
+        const aabb &bb = bounds[prims[i]];
+        bb_min = min(bb_min, bb.get_min());
+        bb_max = max(bb_max, bb.get_max());
+        c_min = min(c_min, centers[prims[i]]);
+        c_max = max(c_max, centers[prims[i]]);
+      }
+      set_bounds(nodes[ni], bb_min, bb_max);
+      nodes[ni].first = begin;
+      nodes[ni].count = end - begin;
+
+      unsigned num = end - begin;
+      if (num <= max_leaf_prims) return;
+
+      vec3 c_extent = c_max - c_min;
+      int axis = c_extent.x() > c_extent.y() ? (c_extent.x() > c_extent.z() ? 0 : 2) : (c_extent.y() > c_extent.z() ? 1 : 2);
+
+      unsigned mid = begin;
+      if (c_extent[axis] > 0 && depth < max_sah_depth) {
+        // bin the centers along the longest axis and find the split with the lowest surface area cost.
+        bin_t bins[num_bins];
+        for (unsigned b = 0; b != num_bins; ++b) {
+          bins[b].bb_min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+          bins[b].bb_max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+          bins[b].count = 0;
+        }
+
+        float scale = num_bins * 0.9999f / c_extent[axis];
+        for (unsigned i = begin; i != end; ++i) {
+          unsigned b = (unsigned)((centers[prims[i]][axis] - c_min[axis]) * scale);
+          const aabb &bb = bounds[prims[i]];
+          bins[b].bb_min = min(bins[b].bb_min, bb.get_min());
+          bins[b].bb_max = max(bins[b].bb_max, bb.get_max());
+          bins[b].count++;
+        }
+
+        // sweep from the right to get the cost of the right hand side of each split.
+        float right_cost[num_bins];
+        vec3 r_min = bins[num_bins-1].bb_min, r_max = bins[num_bins-1].bb_max;
+        unsigned r_count = 0;
+        for (unsigned b = num_bins - 1; b != 0; --b) {
+          r_min = min(r_min, bins[b].bb_min);
+          r_max = max(r_max, bins[b].bb_max);
+          r_count += bins[b].count;
+          right_cost[b] = r_count ? half_area(r_max - r_min) * r_count : 0;
+        }
+
+        // sweep from the left and pick the best split.
+        vec3 l_min = bins[0].bb_min, l_max = bins[0].bb_max;
+        unsigned l_count = 0;
+        float best_cost = FLT_MAX;
+        unsigned best_split = 0;
+        for (unsigned b = 0; b != num_bins - 1; ++b) {
+          l_min = min(l_min, bins[b].bb_min);
+          l_max = max(l_max, bins[b].bb_max);
+          l_count += bins[b].count;
+          float cost = (l_count ? half_area(l_max - l_min) * l_count : 0) + right_cost[b+1];
+          if (l_count && l_count != num && cost < best_cost) {
+            best_cost = cost;
+            best_split = b + 1;
+          }
+        }
+
+        if (best_split != 0) {
+          uint32_t *p = std::partition(prims.data() + begin, prims.data() + end, [&](uint32_t prim) {
+            return (unsigned)((centers[prim][axis] - c_min[axis]) * scale) < best_split;
+          });
+          mid = (unsigned)(p - prims.data());
+        }
+      }
+
+      if (mid == begin || mid == end) {
+        // all centers are in the same place or we are too deep: split in the middle.
+        mid = begin + num / 2;
+        std::nth_element(prims.data() + begin, prims.data() + mid, prims.data() + end, [&](uint32_t a, uint32_t b) {
+          return centers[a][axis] < centers[b][axis];
+        });
+      }
+
+      unsigned left = nodes.size();
+      nodes.resize(left + 2);
+      nodes[ni].first = left;
+      nodes[ni].count = 0;
+      build_node(left, begin, mid, bounds, centers, depth + 1);
+      build_node(left + 1, mid, end, bounds, centers, depth + 1);
+    }
+
+    float calc_area() const {
+      float area = 0;
+      for (unsigned i = 0; i != nodes.size(); ++i) {
+        area += half_area(get_node_max(nodes[i]) - get_node_min(nodes[i]));
+      }
+      return area;
+    }
+
+  public:
+    bvh() {
+      max_leaf_prims = 4;
+      build_area = 0;
+    }
+
+    /// Build the tree from scratch for primitives 0..num_prims-1.
+    void build(const aabb *bounds, unsigned num_prims, unsigned max_leaf_prims = 4) {
+      this->max_leaf_prims = max_leaf_prims ? max_leaf_prims : 1;
+      nodes.reset();
+      prims.resize(num_prims);
+      if (num_prims == 0) {
+        build_area = 0;
+        return;
+      }
+
+      dynarray<vec3> centers(num_prims);
+      for (unsigned i = 0; i != num_prims; ++i) {
+        prims[i] = i;
+        centers[i] = bounds[i].get_center();
+      }
+
+      // we will never need more than 2n-1 nodes.
+      nodes.reserve(num_prims * 2);
+      nodes.resize(1);
+      build_node(0, 0, num_prims, bounds, centers.data(), 0);
+      build_area = calc_area();
+    }
+
+    /// Update the node boxes after the primitives have moved, keeping the tree shape.
+    /// Returns false if the tree has become much worse than a fresh build; call build() then.
+    bool refit(const aabb *bounds) {
+      // children always come after their parents, so a reverse walk is bottom up.
+      for (unsigned i = nodes.size(); i-- != 0; ) {
+        node &n = nodes[i];
+        vec3 bb_min, bb_max;
+        if (n.is_leaf()) {
+          bb_min = bounds[prims[n.first]].get_min();
+          bb_max = bounds[prims[n.first]].get_max();
+          for (unsigned j = 1; j != n.count; ++j) {
+            bb_min = min(bb_min, bounds[prims[n.first + j]].get_min());
+            bb_max = max(bb_max, bounds[prims[n.first + j]].get_max());
+          }
+        } else {
+          const node &l = nodes[n.first];
+          const node &r = nodes[n.first + 1];
+          bb_min = min(get_node_min(l), get_node_min(r));
+          bb_max = max(get_node_max(l), get_node_max(r));
+        }
+        set_bounds(n, bb_min, bb_max);
+      }
+      return calc_area() <= build_area * 2;
+    }
+
+    /// Clear the tree.
+    void reset() {
+      nodes.reset();
+      prims.reset();
+      build_area = 0;
+    }
+
+    /// True if there is nothing in the tree.
+    bool is_empty() const {
+      return nodes.size() == 0;
+    }
+
+    /// Number of primitives in the tree.
+    unsigned get_num_prims() const {
+      return prims.size();
+    }
+
+    /// Number of nodes in the tree.
+    unsigned get_num_nodes() const {
+      return nodes.size();
+    }
+
+    /// Get a node; node 0 is the root.
+    const node &get_node(unsigned index) const {
+      return nodes[index];
+    }
+
+    /// Primitives are stored in leaf order; leaves refer to a range of this array.
+    const uint32_t *get_prims() const {
+      return prims.data();
+    }
+
+    /// Visit the primitives whose boxes are hit by org + dir * t for t in [0, t_max], nearest boxes first.
+    /// fn(prim, t_max) tests the primitive, may reduce t_max and returns true to stop the search.
+    template <class fn_t> void ray_cast(vec3_in org, vec3_in dir, float &t_max, const fn_t &fn) const {
+      if (nodes.size() == 0) return;
+
+      // avoid infinities times zero in the slab test.
+      vec3 safe_dir = vec3(
+        fabsf(dir.x()) > 1e-20f ? dir.x() : 1e-20f,
+        fabsf(dir.y()) > 1e-20f ? dir.y() : 1e-20f,
+        fabsf(dir.z()) > 1e-20f ? dir.z() : 1e-20f
+      );
+      vec3 inv_dir = vec3(1.0f, 1.0f, 1.0f) / safe_dir;
+
+      if (slab_test(nodes[0], org, inv_dir, t_max) > t_max) return;
+
+      struct entry { unsigned index; float t; };
+      entry stack[max_stack];
+      unsigned sp = 0;
+      stack[sp].index = 0;
+      stack[sp].t = 0;
+      sp++;
+
+      while (sp) {
+        entry e = stack[--sp];
+        if (e.t > t_max) continue;
+
+        const node &n = nodes[e.index];
+        if (n.is_leaf()) {
+          for (unsigned i = 0; i != n.count; ++i) {
+            if (fn(prims[n.first + i], t_max)) return;
+          }
+        } else {
+          float tl = slab_test(nodes[n.first], org, inv_dir, t_max);
+          float tr = slab_test(nodes[n.first + 1], org, inv_dir, t_max);
+          unsigned near_index = n.first, far_index = n.first + 1;
+          if (tr < tl) {
+            std::swap(tl, tr);
+            std::swap(near_index, far_index);
+          }
+          // push the far child first so that the near child is popped first.
+          if (tr <= t_max) {
+            stack[sp].index = far_index;
+            stack[sp].t = tr;
+            sp++;
+          }
+          if (tl <= t_max) {
+            stack[sp].index = near_index;
+            stack[sp].t = tl;
+            sp++;
+          }
+        }
+      }
+    }
+  };
+} }
@@ -12,7 +12,7 @@ namespace octet { namespace math {
   /// dot(normal, x) + offset >= 0 if point is in the halfspace.
   class half_space : public plane {
   public:
-    half_space(vec3_in normal_, float offset_) : plane(normal_, offset_) {
+    half_space(vec3_in normal_=vec3(0, 0, 1), float offset_=0) : plane(normal_, offset_) {
     }
 
     /// Is point on positive side of plane?
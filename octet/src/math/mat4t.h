@@ -640,6 +640,16 @@ namespace octet { namespace math {
     );
   }
 
+  /// Multiply two affine matrices (with a w column of 0, 0, 0, 1); the same as a * b with a quarter fewer operations.
+  inline mat4t mul_affine(const mat4t &a, const mat4t &b) {
+    return mat4t(
+      b[0] * a[0].xxxx() + b[1] * a[0].yyyy() + b[2] * a[0].zzzz(),
+      b[0] * a[1].xxxx() + b[1] * a[1].yyyy() + b[2] * a[1].zzzz(),
+      b[0] * a[2].xxxx() + b[1] * a[2].yyyy() + b[2] * a[2].zzzz(),
+      b[0] * a[3].xxxx() + b[1] * a[3].yyyy() + b[2] * a[3].zzzz() + b[3]
+    );
+  }
+
   /// Multiply vec3 by 3x4 matrix.
   inline vec3 operator*(const vec3 &lhs, const mat4t &rhs) {
     //return rhs[0].xyz() * lhs[0] + rhs[1].xyz() * lhs[1] + rhs[2].xyz() * lhs[2] + rhs[3].xyz();
@@ -83,6 +83,7 @@ namespace octet {
 #include "plane.h"
 #include "half_space.h"
 #include "ray.h"
+#include "bvh.h"
 #include "polygon.h"
 #include "zcylinder.h"
 #include "voxel_grid.h"
@@ -26,11 +26,11 @@ namespace octet { namespace math {
     aabb get_aabb() const {
       vec3 min_aabb = min(origin, origin + distance);
       vec3 max_aabb = max(origin, origin + distance);
-      return aabb((min_aabb+max_aabb)*0.5f, (max_aabb-max_aabb)*0.5f);
+      return aabb((min_aabb+max_aabb)*0.5f, (max_aabb-min_aabb)*0.5f);
     }
 
     ray get_transform(const mat4t &mat) const {
-      return ray((origin.xyz1() * mat).xyz(), (distance.xyz0() * mat).xyz());
+      return ray((origin.xyz1() * mat).xyz(), ((origin + distance).xyz1() * mat).xyz());
     }
 
     const char *toString(char *dest, size_t len) const {
@@ -109,7 +109,7 @@ namespace octet { namespace math {
     }
 
     vec3 get_distance() const {
-      return origin + distance;
+      return distance;
     }
   };
 
@@ -147,7 +147,7 @@ namespace octet { namespace math {
       #if OCTET_SSE
         return vec2(_mm_div_ps(m, r.m));
       #else
-        return vec2(v[0]*r.v[0], v[1]*r.v[1]);
+        return vec2(v[0]/r.v[0], v[1]/r.v[1]);
       #endif
     }
 
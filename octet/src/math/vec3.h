@@ -214,7 +214,7 @@ namespace octet { namespace math {
       #if OCTET_SSE
         return vec3(_mm_div_ps(m, r.m));
       #else
-        return vec3(v[0]*r.v[0], v[1]*r.v[1], v[2]*r.v[2]);
+        return vec3(v[0]/r.v[0], v[1]/r.v[1], v[2]/r.v[2]);
       #endif
     }
 
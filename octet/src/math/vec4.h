@@ -202,7 +202,7 @@ namespace octet { namespace math {
       #if OCTET_SSE
         return vec4(_mm_div_ps(m, r.m));
       #else
-        return vec4(v[0]*r.v[0], v[1]*r.v[1], v[2]*r.v[2], v[3]*r.v[3]);
+        return vec4(v[0]/r.v[0], v[1]/r.v[1], v[2]/r.v[2], v[3]/r.v[3]);
       #endif
     }
 
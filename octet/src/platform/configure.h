@@ -26,6 +26,16 @@
   #define OCTET_OPENCL 0
 #endif
 
+// set to 0 to send all allocations to the system heap (eg. for memory checkers)
+#ifndef OCTET_POOL_ALLOCATOR
+  #define OCTET_POOL_ALLOCATOR 1
+#endif
+
+// set to 0 to skip the allocator's statistics counters
+#ifndef OCTET_ALLOCATOR_STATS
+  #define OCTET_ALLOCATOR_STATS 1
+#endif
+
 #if defined(WIN32)
   #define OCTET_SSE 1
   #pragma warning(disable : 4996)
@@ -44,6 +54,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include <string>
 #include <vector>
@@ -51,12 +62,32 @@
 #include <deque>
 #include <queue>
 #include <algorithm>
+#include <utility>
+#include <type_traits>
 #include <numeric>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
 
 #if defined(WIN32)
   #include <direct.h>
+  #include <intrin.h>
+#endif
+
+#if OCTET_SSE
+  #include <emmintrin.h>
+#endif
+
+// thread local storage for plain-old-data only (VS2013 has no thread_local)
+#if defined(WIN32)
+  #define OCTET_THREAD_LOCAL __declspec(thread)
+#else
+  #define OCTET_THREAD_LOCAL __thread
 #endif
 
 namespace octet {
@@ -52,6 +52,8 @@ namespace octet { namespace resources {
     /// open a zip file for a given URL
     static zip_file *get_zip_file(const char *url) {
       static dictionary<ref<zip_file> > zip_files;
+      static std::mutex zip_files_lock;
+      std::lock_guard<std::mutex> lock(zip_files_lock);
       int index = zip_files.get_index(url);
       if (index == -1) {
         return zip_files[url] = new zip_file(get_path(url));
@@ -118,6 +120,39 @@ namespace octet { namespace resources {
       }
     }
 
+    /// Get a read-only view of a URL without copying local files.
+    ///
+    /// Local files are memory mapped; zip:// urls are inflated into the view's buffer.
+    static void get_url(file_view &view, const char *url, file_map::advice_t advice = file_map::advice_sequential) {
+      if (!strncmp(url, "zip://", 6) || !strncmp(url, "http://", 7)) {
+        view.reset();
+        get_url(view.get_buffer(), url);
+        view.use_buffer();
+      } else {
+        const char *path = get_path(url);
+        if (!view.map_file(path, advice)) {
+          char tmp[1024];
+          printf("file %s not found. cwd=%s\n", path, getcwd(tmp, sizeof(tmp)));
+        }
+      }
+    }
+
+    /// Get the size and modification time of a file. Returns false if there is no file.
+    static bool get_file_info(const char *path, uint64_t &size, uint64_t &time) {
+      #ifdef WIN32
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return false;
+        size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        time = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+      #else
+        struct stat st;
+        if (stat(path, &st) != 0) return false;
+        size = (uint64_t)st.st_size;
+        time = (uint64_t)st.st_mtime;
+      #endif
+      return true;
+    }
+
     /// Generate a stock texture. To be deprecated.
     static GLuint get_stock_texture(unsigned gl_kind, const char *name) {
       //stock_texture_generator stock;
@@ -216,6 +251,12 @@ namespace octet { namespace resources {
       return dict;
     }
 
+    /// Names of atoms made by get_atom(), indexed by atom. These point to keys in the atom dictionary.
+    static dynarray<const char *> &get_atom_names() {
+      static dynarray<const char *> names;
+      return names;
+    }
+
     /// Get a unique int for a string (atom). Atoms are unique names with an integer representation.
     /// These values are much cheaper to work with than strings.
     static atom_t get_atom(const char *name) {
@@ -232,12 +273,24 @@ namespace octet { namespace resources {
           (*dict)[predefined_atom(num_atoms)] = (atom_t)num_atoms;
         }
       }
-      if (dict->contains(name)) {
-        //log("old atom %s %d\n", name, (*dict)[name]);
-        return (*dict)[name];
+      int index = dict->get_index(name);
+      if (index != -1) {
+        //log("old atom %s %d\n", name, dict->get_value(index));
+        return dict->get_value(index);
       } else {
         //log("new atom %s %d\n", name, num_atoms);
-        return (*dict)[name] = (atom_t)num_atoms++;
+        atom_t atom = (atom_t)num_atoms++;
+        (*dict)[name] = atom;
+
+        // the dictionary keeps its keys in place, so we can keep the name.
+        dynarray<const char *> &names = get_atom_names();
+        if (names.size() <= (unsigned)atom) {
+          unsigned old_size = names.size();
+          names.resize(atom + 1);
+          for (unsigned i = old_size; i != names.size(); ++i) names[i] = 0;
+        }
+        names[atom] = dict->get_key(dict->get_index(name));
+        return atom;
       }
     }
 
@@ -274,13 +327,9 @@ namespace octet { namespace resources {
       const char *name = predefined_atom((unsigned)atom);
       if (name) return name;
 
-      // slow!
-      dictionary<atom_t> *dict = get_atom_dict();
-      unsigned num_indices = dict->get_num_indices();
-      for (unsigned i = 0; i != num_indices; ++i) {
-        if (dict->get_value(i) == atom) {
-          return dict->get_key(i);
-        }
+      dynarray<const char *> &names = get_atom_names();
+      if ((unsigned)atom < names.size() && names[atom]) {
+        return names[atom];
       }
       return "???";
     }
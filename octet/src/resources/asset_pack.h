@@ -0,0 +1,296 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// zip file of assets that is read on many threads
+//
+
+namespace octet { namespace resources {
+  /// A zip file of assets that is inflated on all threads.
+  ///
+  /// get_files() inflates a batch of files at once. prefetch() and prefetch_manifest()
+  /// start inflating files in the background so that they are ready by the time
+  /// get_file() asks for them, for example while the previous level is still playing.
+  ///
+  /// The manifest is a text file in the pack with one file name per line;
+  /// blank lines and lines starting with # are ignored.
+  ///
+  /// Example
+  ///
+  ///     ref<asset_pack> pack = new asset_pack("assets/level1.zip");
+  ///     pack->prefetch_manifest("manifest.txt");
+  ///     ...
+  ///     dynarray<uint8_t> buffer;
+  ///     pack->get_file(buffer, "textures/wall.jpg");
+  class asset_pack : public resource {
+    // a file being inflated in the background.
+    class prefetch_job : public job {
+      zip_file *zip;
+      string name;
+      dynarray<uint8_t> buffer;
+      bool ok;
+
+      friend class asset_pack;
+    public:
+      prefetch_job(zip_file *zip, const char *name) : zip(zip), name(name), ok(false) {
+      }
+
+      void kernel() {
+        ok = zip->get_file(buffer, name.c_str());
+      }
+    };
+
+    ref<zip_file> zip;
+
+    // prefetched files that nobody has asked for yet.
+    std::mutex lock;
+    dictionary<ref<prefetch_job> > prefetched;
+
+    // do not define these.
+    asset_pack(const asset_pack &rhs);
+    void operator=(const asset_pack &rhs);
+  public:
+    /// Open a zip file of assets.
+    asset_pack(const char *path) {
+      zip = new zip_file(path);
+    }
+
+    /// Wait for any prefetches, which use the zip file.
+    ~asset_pack() {
+      reset_prefetch();
+    }
+
+    /// Get the zip file.
+    zip_file *get_zip_file() const {
+      return zip;
+    }
+
+    /// Start inflating a file in the background. Does nothing if the file
+    /// is missing or already prefetched.
+    void prefetch(const char *file) {
+      if (!zip->contains(file)) return;
+
+      prefetch_job *jb = 0;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        ref<prefetch_job> &slot = prefetched[file];
+        if (!slot) {
+          slot = jb = new prefetch_job(zip, file);
+        }
+      }
+      if (jb) jb->submit();
+    }
+
+    /// Start inflating the files listed in a manifest in the pack, in the order of the manifest.
+    /// Returns false if there is no manifest.
+    bool prefetch_manifest(const char *manifest) {
+      dynarray<uint8_t> text;
+      if (!zip->get_file(text, manifest)) return false;
+
+      const char *src = (const char*)text.data();
+      const char *src_max = src + text.size();
+      while (src != src_max) {
+        const char *eol = src;
+        while (eol != src_max && *eol != '\n' && *eol != '\r') ++eol;
+
+        const char *begin = src, *end = eol;
+        while (begin != end && isspace(*begin & 0xff)) ++begin;
+        while (end != begin && isspace(end[-1] & 0xff)) --end;
+        if (begin != end && *begin != '#') {
+          string file;
+          file.set(begin, (int)(end - begin));
+          prefetch(file.c_str());
+        }
+
+        src = eol == src_max ? eol : eol + 1;
+      }
+      return true;
+    }
+
+    /// Wait for prefetches to finish and drop any that were not used.
+    void reset_prefetch() {
+      // wait without the lock: waiting runs other jobs, which may call get_file().
+      dynarray<ref<prefetch_job> > jobs;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        for (unsigned i = 0; i != prefetched.get_num_indices(); ++i) {
+          if (prefetched.get_key(i) && prefetched.get_value(i)) {
+            jobs.push_back(prefetched.get_value(i));
+          }
+        }
+        prefetched.reset();
+      }
+      for (unsigned i = 0; i != jobs.size(); ++i) {
+        jobs[i]->wait();
+      }
+    }
+
+    /// Get a file from the pack, taking the prefetched copy if there is one.
+    /// Returns false if the file is missing or bad. Safe to call from any thread.
+    bool get_file(dynarray<uint8_t> &buffer, const char *file) {
+      ref<prefetch_job> jb;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        int index = prefetched.get_index(file);
+        if (index != -1) {
+          jb = prefetched.get_value(index);
+          prefetched.erase(file);
+        }
+      }
+
+      if (!jb) {
+        return zip->get_file(buffer, file);
+      }
+
+      // if the job has not started yet, this runs it (or other jobs) on this thread.
+      jb->wait();
+      buffer = std::move(jb->buffer);
+      return jb->ok;
+    }
+
+    /// Get a batch of files, inflating them on all threads.
+    /// buffers[i] gets the file files[i]. Returns the number of files read successfully.
+    unsigned get_files(dynarray<uint8_t> *buffers, const char *const *files, unsigned num_files) {
+      std::atomic<unsigned> num_ok(0);
+      job::get_scheduler().parallel_for(0, num_files, 1, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          if (get_file(buffers[i], files[i])) num_ok++;
+        }
+      });
+      return num_ok;
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class asset_pack_unit_test {
+      enum { num_files = 16 };
+
+      static void get_name(char *name, unsigned i) {
+        sprintf(name, "dir/file%d.bin", i);
+      }
+
+      static uint8_t get_byte(unsigned i, unsigned j) {
+        return (uint8_t)(i * 7 + j * 13 + (j >> 8));
+      }
+
+      static void put2(dynarray<uint8_t> &zip, unsigned value) {
+        zip.push_back((uint8_t)value);
+        zip.push_back((uint8_t)(value >> 8));
+      }
+
+      static void put4(dynarray<uint8_t> &zip, unsigned value) {
+        put2(zip, value & 0xffff);
+        put2(zip, value >> 16);
+      }
+
+      // write a zip file of num_files files and a manifest. Odd files are deflated (as stored deflate blocks).
+      static void write_zip(const char *path) {
+        dynarray<uint8_t> zip, dir;
+        static const char manifest[] = "# files to prefetch\r\ndir/file3.bin\r\n\n  dir/file4.bin  \nmissing.bin\ndir/file11.bin";
+        for (unsigned i = 0; i != num_files + 1; ++i) {
+          char name[32];
+          dynarray<uint8_t> data;
+          if (i == num_files) {
+            strcpy(name, "manifest.txt");
+            data.resize(sizeof(manifest) - 1);
+            memcpy(data.data(), manifest, data.size());
+          } else {
+            get_name(name, i);
+            for (unsigned j = 0; j != 1000 + i * 373; ++j) data.push_back(get_byte(i, j));
+          }
+          unsigned usize = data.size();
+          unsigned method = i & 1 ? 8 : 0;
+          if (method == 8) {
+            // one final stored block: BFINAL=1, BTYPE=00, then LEN and NLEN.
+            dynarray<uint8_t> block;
+            block.push_back(1);
+            put2(block, usize);
+            put2(block, ~usize & 0xffff);
+            for (unsigned j = 0; j != usize; ++j) block.push_back(data[j]);
+            data = block;
+          }
+
+          unsigned offset = zip.size(), name_len = (unsigned)strlen(name);
+          put4(zip, 0x04034b50); put2(zip, 20); put2(zip, 0); put2(zip, method);
+          put4(zip, 0); put4(zip, 0); put4(zip, data.size()); put4(zip, usize);
+          put2(zip, name_len); put2(zip, 0);
+          for (unsigned j = 0; j != name_len; ++j) zip.push_back((uint8_t)name[j]);
+          for (unsigned j = 0; j != data.size(); ++j) zip.push_back(data[j]);
+
+          put4(dir, 0x02014b50); put2(dir, 20); put2(dir, 20); put2(dir, 0); put2(dir, method);
+          put4(dir, 0); put4(dir, 0); put4(dir, data.size()); put4(dir, usize);
+          put2(dir, name_len); put2(dir, 0); put2(dir, 0); put2(dir, 0); put2(dir, 0);
+          put4(dir, 0); put4(dir, offset);
+          for (unsigned j = 0; j != name_len; ++j) dir.push_back((uint8_t)name[j]);
+        }
+
+        unsigned dir_offset = zip.size();
+        for (unsigned j = 0; j != dir.size(); ++j) zip.push_back(dir[j]);
+        put4(zip, 0x06054b50); put2(zip, 0); put2(zip, 0); put2(zip, num_files + 1); put2(zip, num_files + 1);
+        put4(zip, dir.size()); put4(zip, dir_offset); put2(zip, 0);
+
+        FILE *file = fopen(path, "wb");
+        assert(file);
+        fwrite(zip.data(), 1, zip.size(), file);
+        fclose(file);
+      }
+
+      static bool check(const dynarray<uint8_t> &buffer, unsigned i) {
+        if (buffer.size() != 1000 + i * 373) return false;
+        for (unsigned j = 0; j != buffer.size(); ++j) {
+          if (buffer[j] != get_byte(i, j)) return false;
+        }
+        return true;
+      }
+
+    public:
+      asset_pack_unit_test() {
+        static const char path[] = "asset_pack_unit_test.zip";
+        write_zip(path);
+        {
+          ref<asset_pack> pack = new asset_pack(path);
+
+          // many threads reading the same zip file at once.
+          char names[num_files][32];
+          const char *files[num_files];
+          dynarray<uint8_t> buffers[num_files];
+          for (unsigned i = 0; i != num_files; ++i) {
+            get_name(names[i], i);
+            files[i] = names[i];
+          }
+          for (unsigned pass = 0; pass != 4; ++pass) {
+            assert(pack->get_files(buffers, files, num_files) == num_files);
+            for (unsigned i = 0; i != num_files; ++i) {
+              assert(check(buffers[i], i));
+              buffers[i].reset();
+            }
+          }
+
+          // prefetched files are the same as the ones read directly, missing ones fail.
+          assert(pack->prefetch_manifest("manifest.txt"));
+          assert(!pack->prefetch_manifest("missing.txt"));
+          pack->prefetch("dir/file5.bin");
+          static const unsigned prefetched[] = { 3, 4, 11, 5 };
+          for (unsigned i = 0; i != 4; ++i) {
+            dynarray<uint8_t> buffer;
+            assert(pack->get_file(buffer, files[prefetched[i]]) && check(buffer, prefetched[i]));
+          }
+          dynarray<uint8_t> buffer;
+          assert(!pack->get_file(buffer, "missing.bin"));
+
+          // unused prefetches are dropped.
+          pack->prefetch("dir/file6.bin");
+          pack->prefetch("dir/file7.bin");
+          pack->reset_prefetch();
+          assert(pack->get_file(buffer, files[7]) && check(buffer, 7));
+          pack->prefetch("dir/file8.bin");
+        }
+        remove(path);
+      }
+    };
+
+    static asset_pack_unit_test asset_pack_unit_test;
+  #endif
+} }
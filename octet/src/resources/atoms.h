@@ -144,3 +144,4 @@ OCTET_ATOM(npos)
 OCTET_ATOM(diffuse_light)
 OCTET_ATOM(specular_light)
 OCTET_ATOM(first_index)
+OCTET_ATOM(solid_color)
@@ -10,16 +10,43 @@
 namespace octet { namespace resources {
   /// The binary reader is a visitor that is used to load a binary file.
   /// The binary reader will use a factory to create new classes, providied the class is in classes.h
+  ///
+  /// The reader can read from a file or from memory, such as a file_map.
   class binary_reader : public visitor {
-    enum { debug = true };
+    enum { debug = false };
     hash_map<void *, int> refs;
     dynarray<void *> id_to_ref;
     FILE *file;
+    const uint8_t *src;
+    const uint8_t *src_max;
     char tmp[256];
 
-    void read(uint8_t *src, size_t bytes) {
+    // atoms in the file -> atoms in this run.
+    dynarray<atom_t> atom_map;
+
+    void read(uint8_t *dest, size_t bytes) {
       //if (debug) log("read %08x bytes\n", bytes);
-      fread(src, 1, bytes, file);
+      if (file) {
+        if (fread(dest, 1, bytes, file) != bytes) {
+          memset(dest, 0, bytes);
+          set_error(true);
+        }
+      } else if (bytes > (size_t)(src_max - src)) {
+        memset(dest, 0, bytes);
+        src = src_max;
+        set_error(true);
+      } else {
+        memcpy(dest, src, bytes);
+        src += bytes;
+      }
+    }
+
+    int read_char() {
+      if (file) {
+        return fgetc(file);
+      } else {
+        return src == src_max ? EOF : *src++;
+      }
     }
 
     int read_int() {
@@ -41,7 +68,11 @@ namespace octet { namespace resources {
     const char *read_string() {
       int nchars = 0;
       for(;;) {
-        int c = fgetc(file);
+        int c = read_char();
+        if (c == EOF) {
+          set_error(true);
+          c = 0;
+        }
         tmp[nchars] = c;
         if (c == 0) break;
         nchars += nchars != sizeof(tmp)-1;
@@ -53,7 +84,7 @@ namespace octet { namespace resources {
     bool check_atom(atom_t sid) {
       if (!get_error()) {
         atom_t test = read_atom();
-        log("%*scheck_atom %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
+        if (debug) log("%*scheck_atom %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
         if (test != sid) {
           log("error: expected %s\n", app_utils::get_atom_name(sid));
           set_error(true);
@@ -65,7 +96,7 @@ namespace octet { namespace resources {
     bool check_size(size_t size) {
       if (!get_error()) {
         int test = read_int();
-        log("%*scheck_size %d\n", get_depth()*2, "", size);
+        if (debug) log("%*scheck_size %d\n", get_depth()*2, "", size);
         if (test != (int)size) {
           log("error: expected %d bytes\n", size);
           set_error(true);
@@ -74,8 +105,33 @@ namespace octet { namespace resources {
       return get_error();
     }
 
+    void init() {
+      if (debug) log("binary_reader\n");
+      id_to_ref.reserve(256);
+      id_to_ref.push_back(NULL);
+
+      uint8_t magic[8];
+      read(magic, sizeof(magic));
+      if (memcmp(magic, "octet", 5)) {
+        set_error(true);
+        return;
+      }
+
+      // the file has the names of its atoms, look them up in this run.
+      int num_atoms = read_int();
+      if (num_atoms < 0 || num_atoms > 0x1000000) {
+        set_error(true);
+        return;
+      }
+      atom_map.resize(num_atoms);
+      for (int i = 1; i < num_atoms && !get_error(); ++i) {
+        atom_map[i] = app_utils::get_atom(read_string());
+      }
+      if (num_atoms) atom_map[0] = atom_;
+    }
+
     void *get_ref(int id) {
-      log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
+      if (debug) log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
       if (id == (int)id_to_ref.size()) {
         return NULL;
       } else if (id > (int)id_to_ref.size()) {
@@ -90,22 +146,28 @@ namespace octet { namespace resources {
   public:
     /// Construct a binary reader for a file.
     binary_reader(FILE *file) {
-      if (debug) log("binary_reader\n");
-      id_to_ref.reserve(256);
-      id_to_ref.push_back(NULL);
-
       this->file = file;
-      char tmp[8];
-      fread(tmp, 1, sizeof(tmp), file);
-      if (memcmp(tmp, "octet", 5)) {
-        set_error(true);
-      }
+      src = src_max = 0;
+      init();
+    }
+
+    /// Construct a binary reader for bytes in memory.
+    binary_reader(const uint8_t *src, const uint8_t *src_max) {
+      this->file = 0;
+      this->src = src;
+      this->src_max = src_max;
+      init();
     }
 
     /// Destroy the reader
     ~binary_reader() {
     }
 
+    /// Translate an atom in the file to an atom in this run.
+    atom_t map_atom(atom_t value) {
+      return (unsigned)value < atom_map.size() ? atom_map[value] : value;
+    }
+
     /// This function returns true to indicate that this is a reader
     /// The visitor will behave differently for readers and writers
     bool is_reader() {
@@ -176,14 +238,19 @@ namespace octet { namespace resources {
     /// Begin reading a dynarray
     unsigned begin_read_dynarray(unsigned elem_size, atom_t &sid) {
       if (!check_atom(atom_dynarray) && !check_atom(sid)) {
-        return (unsigned)read_int() / elem_size;
+        unsigned bytes = (unsigned)read_int();
+        if (!file && bytes > (size_t)(src_max - src)) {
+          set_error(true);
+          return 0;
+        }
+        return bytes / elem_size;
       }
       return 0;
     }
 
     /// finish reading a dynarray
     void end_read_dynarray(void *ptr, unsigned bytes) {
-      read((uint8_t*)ptr, bytes);
+      if (bytes) read((uint8_t*)ptr, bytes);
     }
 
     /// called after visiting a new object
@@ -11,7 +11,7 @@ namespace octet { namespace resources {
   /// The binary writer is a visitor that writes binary files.
   /// Use this to save game worlds or to do game saves.
   class binary_writer : public visitor {
-    enum { debug = true };
+    enum { debug = false };
     hash_map<void *, int> refs;
     int next_id;
     FILE *file;
@@ -46,6 +46,14 @@ namespace octet { namespace resources {
       this->file = file;
 
       fwrite("octet\r\n\x1a", 1, 8, file);
+
+      // names of the atoms so that the reader can translate them.
+      // atoms made by get_atom() depend on the order they were made in.
+      int num_atoms = (int)app_utils::get_atom_names().size();
+      write_int(num_atoms);
+      for (int i = 1; i < num_atoms; ++i) {
+        write_string(app_utils::get_atom_name((atom_t)i));
+      }
     }
 
     /// Destroy the writer
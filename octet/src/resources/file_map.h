@@ -5,76 +5,282 @@
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
 // map a file to memory
+//
 
-class file_map {
-  #ifdef WIN32
-    HANDLE file_handle;
-    HANDLE mapping_handle;
-  #else
-    int file_handle;
-  #endif
-  uint64_t size;
-  const uint8_t *data;
-  const char *error;
-public:
-  file_map(const char *file_name) {
-    error = 0;
-    data = 0;
-    size = 0;
-
-    if (file_name == NULL) {
-      error = "no file name";
-      return;
-    }
+namespace octet { namespace resources {
+  /// Map a file into memory read-only.
+  ///
+  /// The operating system pages the file in as it is read, so there is no
+  /// copy of the file on the heap.
+  ///
+  /// Example
+  ///
+  ///     file_map map("assets/big.nii", file_map::advice_sequential);
+  ///     if (!map.get_error()) {
+  ///       decode(map.get_data(), map.get_data() + map.get_size());
+  ///     }
+  class file_map {
+  public:
+    /// Hints to the operating system about how the data will be read.
+    enum advice_t {
+      advice_normal,
+      advice_sequential,
+      advice_random,
+      advice_willneed,
+      advice_dontneed,
+    };
 
+  private:
     #ifdef WIN32
-      mapping_handle = INVALID_HANDLE_VALUE;
+      HANDLE file_handle;
+      HANDLE mapping_handle;
+    #else
+      int file_handle;
+    #endif
+    uint64_t size;
+    const uint8_t *data;
+    const char *error;
+
+    // do not define these.
+    file_map(const file_map &rhs);
+    void operator=(const file_map &rhs);
+
+    void init() {
+      #ifdef WIN32
+        file_handle = INVALID_HANDLE_VALUE;
+        mapping_handle = 0;
+      #else
+        file_handle = -1;
+      #endif
+      error = 0;
+      data = 0;
+      size = 0;
+    }
+  public:
+    /// Make an empty map, use open() to map a file.
+    file_map() {
+      init();
+    }
+
+    /// Map a file.
+    file_map(const char *file_name, advice_t advice = advice_normal) {
+      init();
+      open(file_name, advice);
+    }
 
-      file_handle = CreateFileA(
-        file_name, GENERIC_READ, FILE_SHARE_READ, 0,
-        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0
-      );
+    ~file_map() {
+      close();
+    }
 
-      if (file_handle == INVALID_HANDLE_VALUE) {
-        error = "could not open file";
-        return;
+    /// Map a file, closing any previous file. Returns false on failure, see get_error().
+    bool open(const char *file_name, advice_t advice = advice_normal) {
+      close();
+
+      if (file_name == NULL) {
+        error = "no file name";
+        return false;
       }
 
-      DWORD sizehi = 0, sizelo = GetFileSize(file_handle, &sizehi);
-      size = ((uint64_t)sizehi << 32) | sizelo;
-      mapping_handle = CreateFileMappingA(file_handle, 0, PAGE_READONLY, 0, 0, 0);
+      #ifdef WIN32
+        file_handle = CreateFileA(
+          file_name, GENERIC_READ, FILE_SHARE_READ, 0,
+          OPEN_EXISTING, advice == advice_sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, 0
+        );
+
+        if (file_handle == INVALID_HANDLE_VALUE) {
+          error = "could not open file";
+          return false;
+        }
+
+        DWORD sizehi = 0, sizelo = GetFileSize(file_handle, &sizehi);
+        size = ((uint64_t)sizehi << 32) | sizelo;
 
-      if (mapping_handle == INVALID_HANDLE_VALUE) {
+        // empty files can not be mapped.
+        if (size == 0) {
+          return true;
+        }
+
+        mapping_handle = CreateFileMappingA(file_handle, 0, PAGE_READONLY, 0, 0, 0);
+
+        if (!mapping_handle) {
+          error = "could not map file";
+          return false;
+        }
+
+        data = (const uint8_t *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+      #else
+        file_handle = ::open(file_name, O_RDONLY);
+        if (file_handle < 0) {
+          error = "could not open file";
+          return false;
+        }
+
+        struct stat st;
+        if (fstat(file_handle, &st) != 0) {
+          error = "could not stat file";
+          return false;
+        }
+        size = (uint64_t)st.st_size;
+
+        // empty files can not be mapped.
+        if (size == 0) {
+          return true;
+        }
+
+        void *ptr = mmap(0, (size_t)size, PROT_READ, MAP_PRIVATE, file_handle, 0);
+        if (ptr == MAP_FAILED) {
+          error = "could not map file";
+          return false;
+        }
+        data = (const uint8_t *)ptr;
+      #endif
+
+      if (!data) {
         error = "could not map file";
-        return;
+        return false;
       }
 
-      data = (const uint8_t *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
-    #else
-      //file_handle = open(file_name, O_RDONLY);
-      //mmap
-    #endif
-  }
+      advise(advice);
+      return true;
+    }
 
-  ~file_map() {
-    #ifdef WIN32
-      UnmapViewOfFile(data);
-      CloseHandle(file_handle);
-      CloseHandle(mapping_handle);
-    #else
-    #endif
-  }
+    /// Unmap the file.
+    void close() {
+      #ifdef WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping_handle) CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+      #else
+        if (data) munmap((void*)data, (size_t)size);
+        if (file_handle >= 0) ::close(file_handle);
+      #endif
+      init();
+    }
 
-  const char *get_error() const {
-    return error;
-  }
+    /// Tell the operating system how a range of the file will be read.
+    /// By default the hint applies to the whole file.
+    void advise(advice_t advice, uint64_t offset = 0, uint64_t length = ~(uint64_t)0) {
+      if (!data || advice == advice_normal || offset >= size) return;
+      if (length > size - offset) length = size - offset;
+      #ifdef WIN32
+        // FILE_FLAG_SEQUENTIAL_SCAN is the only hint we give on windows.
+      #else
+        // madvise needs a page aligned start address.
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = (size_t)offset & ~(page - 1);
+        size_t bytes = (size_t)(offset + length) - start;
+        int flags =
+          advice == advice_sequential ? MADV_SEQUENTIAL :
+          advice == advice_random ? MADV_RANDOM :
+          advice == advice_willneed ? MADV_WILLNEED :
+          MADV_DONTNEED
+        ;
+        madvise((void*)(data + start), bytes, flags);
+      #endif
+    }
+
+    /// Return an error string or NULL if the file is mapped.
+    const char *get_error() const {
+      return error;
+    }
+
+    /// Get the bytes of the file; NULL if the file is empty or not mapped.
+    const uint8_t *get_data() const {
+      return data;
+    }
+
+    /// Get the size of the file in bytes.
+    uint64_t get_size() const {
+      return size;
+    }
+  };
+
+  /// Read-only view of the bytes of a url.
+  ///
+  /// Local files are mapped with file_map, other urls are read into a buffer owned by the view.
+  /// Either way, decoders can consume the bytes from get_src() to get_src_max() without a copy.
+  ///
+  /// Example
+  ///
+  ///     file_view view;
+  ///     app_utils::get_url(view, "assets/duck.jpg");
+  ///     jpeg_decoder dec;
+  ///     dec.get_image(image, format, width, height, view.get_src(), view.get_src_max());
+  class file_view {
+    file_map map;
+    dynarray<uint8_t> buffer;
+    const uint8_t *data_;
+    size_t size_;
+
+    // do not define these.
+    file_view(const file_view &rhs);
+    void operator=(const file_view &rhs);
+  public:
+    /// Make an empty view.
+    file_view() {
+      data_ = 0;
+      size_ = 0;
+    }
+
+    /// Map a local file. Returns false if the file could not be opened.
+    bool map_file(const char *path, file_map::advice_t advice = file_map::advice_sequential) {
+      reset();
+      if (!map.open(path, advice)) {
+        return false;
+      }
+      data_ = map.get_data();
+      size_ = (size_t)map.get_size();
+      return true;
+    }
+
+    /// Get a buffer to fill; call use_buffer() when it is filled.
+    dynarray<uint8_t> &get_buffer() {
+      return buffer;
+    }
+
+    /// Make the view show the contents of the buffer.
+    void use_buffer() {
+      map.close();
+      data_ = buffer.data();
+      size_ = buffer.size();
+    }
+
+    /// Drop the mapping or buffer.
+    void reset() {
+      map.close();
+      buffer.reset();
+      data_ = 0;
+      size_ = 0;
+    }
+
+    /// Return true if the view is a file mapping, rather than a copy.
+    bool is_mapped() const {
+      return map.get_data() != 0;
+    }
 
-  const uint8_t *get_data() const {
-    return data;
-  }
+    /// Start of the bytes.
+    const uint8_t *get_src() const {
+      return data_;
+    }
+
+    /// End of the bytes.
+    const uint8_t *get_src_max() const {
+      return data_ + size_;
+    }
 
-  uint64_t get_size() const {
-    return size;
-  }
-};
+    /// Start of the bytes.
+    const uint8_t *data() const {
+      return data_;
+    }
 
+    /// Number of bytes.
+    size_t size() const {
+      return size_;
+    }
+
+    /// Read a byte.
+    uint8_t operator[](size_t index) const {
+      return data_[index];
+    }
+  };
+} }
@@ -23,6 +23,9 @@ namespace octet { namespace resources {
     // GL_ARRAY_BUFFER etc.
     GLuint target;
 
+    // changes whenever the contents may have changed, for caches of the data.
+    mutable unsigned version;
+
   public:
     /// Helper class to make a write-only lock
     class wolock {
@@ -70,18 +73,34 @@ namespace octet { namespace resources {
     /// Make a new OpenGL Resource
     gl_resource(unsigned target=0, unsigned size=0) {
       buffer = 0;
+      version = 0;
       this->target = target;
+      #ifndef OCTET_GLES2
+        this->size = 0;
+      #endif
       if (size) {
         allocate(target, size);
       }
     }
 
     /// serialize this object.
+    /// The contents are copied out of the GL buffer when writing and into a new buffer when reading.
     void visit(visitor &v) {
-      #ifdef OCTET_GLES2
-        v.visit(bytes, atom_bytes);
-      #endif
       v.visit(target, atom_target);
+
+      dynarray<uint8_t> contents;
+      if (!v.is_reader() && buffer && get_size()) {
+        contents.resize((unsigned)get_size());
+        memcpy(contents.data(), lock_read_only(), contents.size());
+        unlock_read_only();
+      }
+
+      v.visit(contents, atom_bytes);
+
+      if (v.is_reader() && contents.size()) {
+        allocate(target, contents.size());
+        assign(contents.data(), 0, contents.size());
+      }
     }
 
     /// Allocate a new OpenGL object.
@@ -106,8 +125,11 @@ namespace octet { namespace resources {
       }
       #ifdef OCTET_GLES2
         bytes.reset();
+      #else
+        size = 0;
       #endif
       buffer = 0;
+      version++;
     }
 
     /// Destructor
@@ -129,6 +151,11 @@ namespace octet { namespace resources {
       #endif
     }
 
+    /// get a number that changes when the buffer is written to.
+    unsigned get_version() const {
+      return version;
+    }
+
     /// get the GL buffer object we are wrapping.
     GLuint get_buffer() const {
       return buffer;
@@ -179,6 +206,7 @@ namespace octet { namespace resources {
     /// release a read-write lock
     /// deprecated
     void unlock() const {
+      version++;
       #ifdef OCTET_GLES2
         glBindBuffer(target, buffer);
         glBufferSubData(target, 0, bytes.size(), &bytes[0]);
@@ -206,6 +234,7 @@ namespace octet { namespace resources {
     /// release a read-write lock
     /// deprecated
     void unlock_write_only() const {
+      version++;
       #ifdef OCTET_GLES2
         glBindBuffer(target, buffer);
         glBufferSubData(target, 0, bytes.size(), &bytes[0]);
@@ -220,11 +249,16 @@ namespace octet { namespace resources {
     }
 
     /// copy data into the resource
+    /// Only the range offset..offset+size is sent to the GPU, so small updates are cheap.
     void assign(const void *ptr, size_t offset, size_t size) {
       assert(offset + size <= this->get_size());
 
-      memcpy((void*)((char*)lock_write_only() + offset), ptr, size);
-      unlock_write_only();
+      #ifdef OCTET_GLES2
+        memcpy(&bytes[0] + offset, ptr, size);
+      #endif
+      glBindBuffer(target, buffer);
+      glBufferSubData(target, offset, size, ptr);
+      version++;
     }
 
     /// copy data from another gl resource.
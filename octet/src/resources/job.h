@@ -4,52 +4,393 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// work in progress
+// jobs and a work-stealing scheduler to run them on worker threads.
+//
 
 namespace octet { namespace resources {
-  class job : public resource {
-    ref<job> next;
+  template <class fn_t> class parallel_for_job;
 
+  /// A unit of work to be run on a worker thread.
+  ///
+  /// Derive from job and implement kernel(). Jobs are started with submit() and
+  /// may depend on other jobs with add_dependency(); a job will not run until is_ready() returns true.
+  ///
+  /// The scheduler does not own jobs: keep the job (and any job it depends on) alive until it is done.
+  ///
+  /// Example
+  ///
+  ///     class decode_job : public job {
+  ///       void kernel() { ... }
+  ///     };
+  ///
+  ///     decode_job a, b;
+  ///     b.add_dependency(&a);
+  ///     a.submit();
+  ///     b.submit();
+  ///     b.wait();
+  class job : public resource {
+  public:
     enum state_t {
+      state_idle,
       state_waiting,
       state_running,
+      state_done,
     };
 
-    state_t state;
+    class scheduler;
+
+  private:
+    std::atomic<int> state;
+
+    // next in the scheduler's list of jobs that are not ready.
+    job *next_waiting;
+
+    // jobs that must be done before this one runs.
+    dynarray<job*> dependencies;
+
+    // do not define these.
+    job(const job &rhs);
+    void operator=(const job &rhs);
+
+    friend class scheduler;
 
+  public:
+    /// Work-stealing thread pool.
+    ///
+    /// Each worker thread has its own deque of jobs. Workers take their own jobs from the back
+    /// and steal other workers' jobs from the front. Threads that are not workers submit
+    /// to a shared queue and help to run jobs while they wait.
     class scheduler {
+      struct queue_t {
+        std::mutex lock;
+        std::deque<job*> jobs;
+      };
+
+      // queue 0 is for threads that are not workers, queue i+1 for worker i.
+      dynarray<queue_t*> queues;
+      std::vector<std::thread> threads;
+
+      // jobs that were not ready when they came to the front of a queue.
+      std::mutex waiting_lock;
       job *waiting;
-      job *running;
+
+      // idle workers sleep here until work_epoch changes.
+      std::mutex sleep_lock;
+      std::condition_variable wake;
+      std::atomic<int> num_sleeping;
+      std::atomic<unsigned> work_epoch;
+
+      std::atomic<int> num_pending;
+      std::atomic<bool> quit;
+
+      // do not define these.
+      scheduler(const scheduler &rhs);
+      void operator=(const scheduler &rhs);
+
+      // the scheduler a worker thread belongs to and its queue; must be plain old data for OCTET_THREAD_LOCAL.
+      struct worker_id {
+        scheduler *owner;
+        unsigned index;
+      };
+
+      static worker_id &get_worker_id() {
+        static OCTET_THREAD_LOCAL worker_id id;
+        return id;
+      }
+
+      // 0 for threads that are not our workers, i+1 for worker i.
+      unsigned queue_index() const {
+        const worker_id &id = get_worker_id();
+        return id.owner == this ? id.index : 0;
+      }
+
+      // wake a sleeping worker. The epoch changes before num_sleeping is read,
+      // so a worker that is about to sleep sees the change instead.
+      void notify() {
+        work_epoch++;
+        if (num_sleeping.load()) {
+          std::lock_guard<std::mutex> lock(sleep_lock);
+          wake.notify_one();
+        }
+      }
+
+      void push(job *jb) {
+        queue_t *q = queues[queue_index()];
+        {
+          std::lock_guard<std::mutex> lock(q->lock);
+          q->jobs.push_back(jb);
+        }
+        notify();
+      }
+
+      // take from the back of our own queue or the front of someone else's.
+      job *pop() {
+        unsigned num_queues = queues.size();
+        unsigned own = queue_index();
+        {
+          queue_t *q = queues[own];
+          std::lock_guard<std::mutex> lock(q->lock);
+          if (!q->jobs.empty()) {
+            job *jb = q->jobs.back();
+            q->jobs.pop_back();
+            return jb;
+          }
+        }
+        for (unsigned i = 1; i != num_queues; ++i) {
+          queue_t *q = queues[(own + i) % num_queues];
+          std::lock_guard<std::mutex> lock(q->lock);
+          if (!q->jobs.empty()) {
+            job *jb = q->jobs.front();
+            q->jobs.pop_front();
+            return jb;
+          }
+        }
+        return 0;
+      }
+
+      // move jobs that have become ready from the waiting list to our queue.
+      void check_waiting() {
+        job *ready = 0;
+        {
+          std::lock_guard<std::mutex> lock(waiting_lock);
+          job **prev = &waiting;
+          while (*prev) {
+            job *jb = *prev;
+            if (jb->is_ready()) {
+              *prev = jb->next_waiting;
+              jb->next_waiting = ready;
+              ready = jb;
+            } else {
+              prev = &jb->next_waiting;
+            }
+          }
+        }
+        while (ready) {
+          job *jb = ready;
+          ready = jb->next_waiting;
+          jb->next_waiting = 0;
+          push(jb);
+        }
+      }
+
+      void run(job *jb) {
+        if (!jb->is_ready()) {
+          std::lock_guard<std::mutex> lock(waiting_lock);
+          jb->next_waiting = waiting;
+          waiting = jb;
+          return;
+        }
+
+        jb->state.store(state_running, std::memory_order_relaxed);
+        jb->kernel();
+
+        // the job may be destroyed by its owner as soon as it is done.
+        jb->state.store(state_done, std::memory_order_release);
+        num_pending--;
+        check_waiting();
+      }
+
+      void worker(unsigned index) {
+        get_worker_id().owner = this;
+        get_worker_id().index = index;
+        while (!quit) {
+          unsigned epoch = work_epoch.load();
+          if (!run_one()) {
+            check_waiting();
+            std::unique_lock<std::mutex> lock(sleep_lock);
+            num_sleeping++;
+            wake.wait(lock, [&]() { return quit || work_epoch.load() != epoch; });
+            num_sleeping--;
+          }
+        }
+        allocator::flush_thread_cache();
+      }
+
     public:
-      scheduler() {
-        waiting = 0;
-        running = 0;
+      /// Start worker threads; by default one fewer than the number of hardware threads.
+      scheduler(unsigned num_threads = 0) : waiting(0), num_sleeping(0), work_epoch(0), num_pending(0), quit(false) {
+        if (num_threads == 0) {
+          unsigned hw = std::thread::hardware_concurrency();
+          num_threads = hw > 1 ? hw - 1 : 1;
+        }
+        for (unsigned i = 0; i <= num_threads; ++i) {
+          queues.push_back(new queue_t());
+        }
+        for (unsigned i = 0; i != num_threads; ++i) {
+          threads.push_back(std::thread(&scheduler::worker, this, i + 1));
+        }
+      }
+
+      /// Finish the jobs and stop the worker threads.
+      ~scheduler() {
+        wait_all();
+        {
+          std::lock_guard<std::mutex> lock(sleep_lock);
+          quit = true;
+        }
+        wake.notify_all();
+        for (unsigned i = 0; i != threads.size(); ++i) {
+          threads[i].join();
+        }
+        for (unsigned i = 0; i != queues.size(); ++i) {
+          delete queues[i];
+        }
+      }
+
+      /// Number of worker threads.
+      unsigned get_num_threads() const {
+        return (unsigned)threads.size();
+      }
+
+      /// Queue a job to be run when it is ready.
+      void submit(job *jb) {
+        assert(jb->state != state_waiting && jb->state != state_running);
+        jb->state = state_waiting;
+        num_pending++;
+        push(jb);
+      }
+
+      /// Queue the waiting jobs whose is_ready() has become true.
+      /// Idle workers sleep until a job is queued, so call this after changing a condition that
+      /// an overridden is_ready() depends on. Jobs finishing and wait() check for you.
+      void poll() {
+        check_waiting();
+      }
+
+      /// Run one job on this thread if there is one. Return false if there was nothing to do.
+      bool run_one() {
+        job *jb = pop();
+        if (jb) {
+          run(jb);
+          return true;
+        }
+        return false;
       }
 
-      void add_to_waiting(job *jb) {
-        jb->next = waiting;
-        waiting = this;
+      /// Help to run jobs until this job is done.
+      void wait(job *jb) {
+        while (jb->state.load(std::memory_order_acquire) != state_done) {
+          if (!run_one()) {
+            check_waiting();
+            std::this_thread::yield();
+          }
+        }
+      }
+
+      /// Fence: help to run jobs until every submitted job is done.
+      /// Note that jobs that are never ready will make this wait forever.
+      void wait_all() {
+        while (num_pending.load(std::memory_order_acquire) != 0) {
+          if (!run_one()) {
+            check_waiting();
+            std::this_thread::yield();
+          }
+        }
+      }
+
+      /// Call fn(begin, end) for sub-ranges of [begin, end) on all threads and wait for them to finish.
+      ///
+      /// Example
+      ///
+      ///     job::get_scheduler().parallel_for(0, num_nodes, 64, [&](unsigned begin, unsigned end) {
+      ///       for (unsigned i = begin; i != end; ++i) update(nodes[i]);
+      ///     });
+      template <class fn_t> void parallel_for(unsigned begin, unsigned end, unsigned grain, const fn_t &fn) {
+        if (begin >= end) return;
+        if (grain == 0) grain = 1;
+        unsigned num_chunks = (end - begin + grain - 1) / grain;
+        if (num_chunks == 1) {
+          fn(begin, end);
+          return;
+        }
+
+        // a few identical jobs share the range through an atomic counter.
+        std::atomic<unsigned> next(begin);
+        unsigned num_jobs = get_num_threads() + 1;
+        num_jobs = num_jobs < num_chunks ? num_jobs : num_chunks;
+        dynarray<parallel_for_job<fn_t>*> jobs(num_jobs);
+        for (unsigned i = 0; i != num_jobs; ++i) {
+          jobs[i] = new parallel_for_job<fn_t>();
+          jobs[i]->init(&next, end, grain, &fn);
+          if (i) submit(jobs[i]);
+        }
+
+        // this thread does its share as well.
+        jobs[0]->kernel();
+        for (unsigned i = 0; i != num_jobs; ++i) {
+          if (i) wait(jobs[i]);
+          delete jobs[i];
+        }
       }
     };
 
-    scheduler *get_scheduler() {
-      static scheduler sch;
-      return &sch;
-    }
-  public:
-    job() {
-      scheduler *sch = get_scheduler();
-      sch->add_to_waiting(this);
+    /// Make a new, idle job.
+    job() : state(state_idle), next_waiting(0) {
     }
 
     virtual ~job() {
     }
 
+    /// Get the scheduler that all jobs use; it is started on first use.
+    static scheduler &get_scheduler() {
+      static scheduler sch;
+      return sch;
+    }
+
+    /// Do the work of this job.
     virtual void kernel() = 0;
-    virtual bool is_ready() = 0;
 
+    /// Override this to delay the job until some condition is met.
+    /// By default, a job is ready when all its dependencies are done.
+    virtual bool is_ready() {
+      for (unsigned i = 0; i != dependencies.size(); ++i) {
+        if (dependencies[i]->get_state() != state_done) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    /// Do not run this job until "other" is done. Call this before submit().
+    void add_dependency(job *other) {
+      dependencies.push_back(other);
+    }
+
+    /// Queue this job on the scheduler.
+    void submit() {
+      get_scheduler().submit(this);
+    }
+
+    /// Help the scheduler until this job is done.
+    void wait() {
+      get_scheduler().wait(this);
+    }
+
+    /// Where is this job in its life?
     state_t get_state() {
-      return state;
+      return (state_t)state.load(std::memory_order_acquire);
+    }
+  };
+  /// One of several jobs sharing the range of a parallel_for; see job::scheduler::parallel_for.
+  template <class fn_t> class parallel_for_job : public job {
+    std::atomic<unsigned> *next;
+    unsigned end;
+    unsigned grain;
+    const fn_t *fn;
+  public:
+    void init(std::atomic<unsigned> *next_, unsigned end_, unsigned grain_, const fn_t *fn_) {
+      next = next_;
+      end = end_;
+      grain = grain_;
+      fn = fn_;
+    }
+
+    void kernel() {
+      for (;;) {
+        unsigned i = next->fetch_add(grain);
+        if (i >= end) break;
+        (*fn)(i, end - i > grain ? i + grain : end);
+      }
     }
   };
 } }
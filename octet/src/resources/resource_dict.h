@@ -138,6 +138,17 @@ namespace octet { namespace resources {
     #include "classes.h"
     #undef OCTET_CLASS
 
+    /// Add all the resources of another dictionary to this one.
+    void add_resources(resource_dict &rhs) {
+      unsigned num_indices = rhs.dict.get_num_indices();
+      for (unsigned i = 0; i != num_indices; ++i) {
+        const char *key = rhs.dict.get_key(i);
+        if (key) {
+          dict[key] = rhs.dict.get_value(i);
+        }
+      }
+    }
+
     /// Find all resources of a certain type
     void find_all(dynarray<resource*> &result, atom_t type) {
       unsigned num_indices = dict.get_num_indices();
@@ -26,6 +26,8 @@
   #include "../resources/xml_writer.h"
   #include "../resources/http_writer.h"
   #include "../resources/resource.h"
+  #include "../resources/job.h"
+  #include "../resources/asset_pack.h"
   #include "../resources/resource_dict.h"
   #include "../resources/gl_resource.h"
   #include "../resources/bitmap_font.h"
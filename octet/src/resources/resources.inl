@@ -14,15 +14,15 @@ GLuint octet::resources::resource_dict::get_texture_handle_internal(unsigned gl_
   } else if (url[0] == '#') {
     return app_utils::get_solid_texture(gl_kind, url+1);
   } else {
-    dynarray<uint8_t> buffer;
+    file_view buffer;
     dynarray<uint8_t> image;
     app_utils::get_url(buffer, url);
     uint16_t format = 0;
     uint16_t width = 0;
     uint16_t height = 0;
-    const unsigned char *src = &buffer[0];
-    const unsigned char *src_max = src + buffer.size();
-    if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
+    const unsigned char *src = buffer.get_src();
+    const unsigned char *src_max = buffer.get_src_max();
+    if (buffer.size() >= 6 && !memcmp(src, "GIF89a", 6)) {
       gif_decoder dec;
       dec.get_image(image, format, width, height, src, src_max);
     } else if (buffer.size() >= 6 && buffer[0] == 0xff && buffer[1] == 0xd8) {
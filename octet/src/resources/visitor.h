@@ -20,7 +20,7 @@ namespace octet { namespace resources {
   /// A visitor pattern can be used to solve a number of problems and provides
   /// "Metadata" for the classes.
   class visitor {
-    enum { debug = true };
+    enum { debug = false };
     unsigned depth;
     bool error;
 
@@ -105,6 +105,10 @@ namespace octet { namespace resources {
     /// readers use this to add a new reference
     virtual void add_new_ref(void *ref) {}
 
+    /// Readers use this to translate an atom in the file to an atom in this run.
+    /// Atoms made by get_atom() may have different values each time the program runs.
+    virtual atom_t map_atom(atom_t value) { return value; }
+
     /// begin an aggregate
     virtual bool begin_agg(void *ref, atom_t sid, atom_t type) { return true; }
 
@@ -164,6 +168,17 @@ namespace octet { namespace resources {
     /// Call this in your "visit" method
     void visit(atom_t &value, atom_t sid) {
       visit_bin(&value, sizeof(value), sid, atom_atom);
+      if (is_reader()) value = map_atom(value);
+    }
+
+    /// Call this in your "visit" method for dynarrays of atoms.
+    void visit(dynarray<atom_t> &value, atom_t sid) {
+      visit<atom_t>(value, sid);
+      if (is_reader()) {
+        for (unsigned i = 0; i != value.size(); ++i) {
+          value[i] = map_atom(value[i]);
+        }
+      }
     }
 
     /// Call this in your "visit" method
@@ -9,9 +9,13 @@ namespace octet { namespace resources {
   /// Zip file reader, uses zip_decoder to inflate compressed files.
   /// Zip files are smaller and faster than regular files.
   /// They make updates easier and work will over the internet.
+  ///
+  /// The zip file is memory mapped and files are inflated straight from the mapping
+  /// into the caller's buffer. get_file() may be called from many threads at once:
+  /// each call reads the mapping at the entry's offset and borrows a decoder of its own.
   class zip_file {
-    int ref_cnt;
-    FILE *the_file;
+    std::atomic<int> ref_cnt;
+    file_map map;
 
     struct dir_entry {
       uint32_t offset;
@@ -20,9 +24,31 @@ namespace octet { namespace resources {
       uint32_t compression;
     };
 
+    // written only by the constructor, so lookups need no lock.
     dictionary<dir_entry> directory;
 
-    zip_decoder decoder;
+    // decoders not in use by any thread.
+    std::mutex decoder_lock;
+    dynarray<zip_decoder*> free_decoders;
+
+    zip_decoder *acquire_decoder() {
+      std::lock_guard<std::mutex> lock(decoder_lock);
+      if (free_decoders.empty()) {
+        return new zip_decoder();
+      }
+      zip_decoder *result = free_decoders.back();
+      free_decoders.pop_back();
+      return result;
+    }
+
+    void release_decoder(zip_decoder *decoder) {
+      std::lock_guard<std::mutex> lock(decoder_lock);
+      free_decoders.push_back(decoder);
+    }
+
+    // do not define these.
+    zip_file(const zip_file &rhs);
+    void operator=(const zip_file &rhs);
 
     // read little endian bytes on any machine
     static unsigned u4(const uint8_t *src) {
@@ -41,56 +67,64 @@ namespace octet { namespace resources {
       return (int16_t)(src[0] + src[1] * 256);
     }
 
+    // read the central directory from the end of the file.
+    void read_directory() {
+      const uint8_t *data = map.get_data();
+      size_t size = (size_t)map.get_size();
+      if (size < 22) return;
+
+      // the end record is followed by a comment of up to 64k bytes, so search backwards.
+      size_t min_pos = size > 22 + 0xffff ? size - 22 - 0xffff : 0;
+      for (size_t pos = size - 22 + 1; pos-- > min_pos; ) {
+        const uint8_t *end = data + pos;
+        if (u4(end) != 0x06054b50) continue;
+
+        size_t dir_size = u4(end + 12);
+        size_t dir_offset = u4(end + 16);
+        if (dir_offset > size || dir_size > size - dir_offset) return;
+
+        const uint8_t *dir = data + dir_offset;
+        for (size_t i = 0; i + 46 <= dir_size;) {
+          const uint8_t *p = dir + i;
+          if (u4(p) != 0x02014b50) break;
+          struct dir_entry d;
+          d.compression = u2(p + 10);
+          d.csize = u4(p + 20);
+          d.usize = u4(p + 24);
+          unsigned file_name_len = u2(p + 28);
+          unsigned extra_len = u2(p + 30);
+          unsigned comment_len = u2(p + 32);
+          if (i + 46 + file_name_len > dir_size) break;
+          string file;
+          file.set((const char*)(p + 46), file_name_len);
+          i += 46 + file_name_len + extra_len + comment_len;
+          d.offset = u4(p + 42);
+          for (unsigned i = 0; file[i]; ++i) {
+            if (file[i] == '\\') file[i] = '/';
+          }
+          //printf("%s\n", file.c_str());
+          directory[file] = d;
+        }
+        return;
+      }
+    }
+
   public:
     /// Open a zip file for reading
     zip_file(const char *filename) {
       ref_cnt = 0;
-      the_file = fopen(filename, "rb");
-      if (!the_file) {
+      if (!map.open(filename, file_map::advice_random)) {
         printf("file %s not found\n", filename);
       } else {
-        uint8_t tmp[256];
-        unsigned tmp_size = (unsigned)sizeof(tmp);
-        fseek(the_file, 0, SEEK_END);
-        long file_size = ftell(the_file);
-        long search_offset = file_size - (long)tmp_size;
-        search_offset = search_offset < 0 ? 0 : search_offset;
-        fseek(the_file, search_offset, SEEK_SET);
-        fread(&tmp, 1, tmp_size, the_file);
-        for( unsigned i = 0; i != tmp_size; ++i) {
-          if (u4(tmp + i) == 0x06054b50) {
-            dynarray<uint8_t> dir;
-            dir.resize(u4(tmp + i + 12));
-            fseek(the_file, (long)u4(tmp + i + 16), SEEK_SET);
-            fread(&dir[0], 1, dir.size(), the_file);
-            for (unsigned i = 0; i + 4 < dir.size();) {
-              uint8_t *p = &dir[i];
-              if (u4(p) != 0x02014b50) break;
-              struct dir_entry d;
-              d.compression = u2(p + 10);
-              d.csize = u4(p + 20);
-              d.usize = u4(p + 24);
-              unsigned file_name_len = u2(p + 28);
-              unsigned extra_len = u2(p + 30);
-              string file;
-              file.set((const char*)(p + 46), file_name_len);
-              i += 46 + file_name_len + extra_len;
-              d.offset = u4(p + 42);// + (46 + file_name_len + extra_len);
-              for (unsigned i = 0; file[i]; ++i) {
-                if (file[i] == '\\') file[i] = '/';
-              }
-              //printf("%s\n", file.c_str());
-              directory[file] = d;
-            }
-            break;
-          }
-        }
+        read_directory();
       }
     }
 
     /// close the zip file
     ~zip_file() {
-      if (the_file) fclose(the_file);
+      for (unsigned i = 0; i != free_decoders.size(); ++i) {
+        delete free_decoders[i];
+      }
     }
 
     /// allow ref<zip_file>
@@ -100,19 +134,17 @@ namespace octet { namespace resources {
 
     /// allow ref<zip_file>
     void release() {
-      if (--ref_cnt) {
+      if (--ref_cnt == 0) {
         delete this;
       }
     }
 
-    /// get a file from a zip file, this is called from get_url with a zip:// prefix.
-    void get_file(dynarray<uint8_t> &buffer, const char *file) {
+    /// Get the bytes of a file as stored in the zip file, compressed or not.
+    /// Returns NULL if the file is missing or runs off the end of the zip file.
+    const uint8_t *get_stored(const char *file, size_t &csize, size_t &usize, unsigned &compression) const {
       int index = directory.get_index(file);
-      if (index < 0) return;
-      if (!the_file) return;
+      if (index < 0 || !map.get_data()) return 0;
       const dir_entry &d = directory.get_value(index);
-      buffer.resize(d.usize);
-      fseek(the_file, d.offset, SEEK_SET);
       /*local file header signature     4 bytes  (0x04034b50) 0
       version needed to extract       2 bytes 4
       general purpose bit flag        2 bytes 6
@@ -125,18 +157,51 @@ namespace octet { namespace resources {
       file name length                2 bytes 26
       extra field length              2 bytes 28 / 30*/
 
-      uint8_t tmp[30];
-      fread(tmp, 1, sizeof(tmp), the_file);
-      if (u4(tmp) != 0x04034b50) return;
-      unsigned extra = u2(tmp + 26) + u2(tmp + 28);
-      fseek(the_file, d.offset + 30 + extra, SEEK_SET);
-      if (d.compression == 0) {
-        fread(buffer.data(), 1, d.usize, the_file);
-      } else if (d.compression == 8) {
-        dynarray<uint8_t> uncomp(d.csize + 4); // note: + 4 bytes prevents decode() overflowing
-        fread(uncomp.data(), 1, d.csize, the_file);
-        decoder.decode(buffer.data(), buffer.data() + d.usize, uncomp.data(), uncomp.data() + d.csize);
+      const uint8_t *data = map.get_data();
+      uint64_t size = map.get_size();
+      if ((uint64_t)d.offset + 30 > size) return 0;
+      const uint8_t *hdr = data + d.offset;
+      if (u4(hdr) != 0x04034b50) return 0;
+      uint64_t start = (uint64_t)d.offset + 30 + u2(hdr + 26) + u2(hdr + 28);
+      if (start + d.csize > size) return 0;
+
+      csize = d.csize;
+      usize = d.usize;
+      compression = d.compression;
+      return data + start;
+    }
+
+    /// Return true if the zip file has this file.
+    bool contains(const char *file) const {
+      return directory.contains(file);
+    }
+
+    /// Get the uncompressed size of a file or zero if it is missing.
+    size_t get_size(const char *file) const {
+      int index = directory.get_index(file);
+      return index < 0 ? 0 : directory.get_value(index).usize;
+    }
+
+    /// get a file from a zip file, this is called from get_url with a zip:// prefix.
+    /// Returns false if the file is missing or bad. Safe to call from any thread.
+    bool get_file(dynarray<uint8_t> &buffer, const char *file) {
+      size_t csize = 0, usize = 0;
+      unsigned compression = 0;
+      const uint8_t *src = get_stored(file, csize, usize, compression);
+      if (!src) return false;
+
+      buffer.resize((unsigned)usize);
+      if (compression == 0) {
+        if (csize != usize) return false;
+        memcpy(buffer.data(), src, usize);
+        return true;
+      } else if (compression == 8) {
+        zip_decoder *decoder = acquire_decoder();
+        bool ok = decoder->inflate(buffer.data(), usize, src, csize) == usize;
+        release_decoder(decoder);
+        return ok;
       }
+      return false;
     }
   };
 } }
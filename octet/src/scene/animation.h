@@ -7,8 +7,28 @@
 
 namespace octet { namespace scene {
   /// Animation resource: Contains times and values.
-  /// Still a work in progress. Requires splines, compression, blending etc.
+  ///
+  /// Channels are stored either as raw floats (add_channel) or compressed (add_compressed_channel).
+  /// Compressed channels quantize each changing component to 16 bits over its range, store
+  /// components that never change only once, can drop keys that linear interpolation
+  /// reproduces within a tolerance and can use step or hermite (curve) interpolation.
+  ///
+  /// Key times are stored in milliseconds, in 16 bits for clips up to 65.5 seconds and 32 bits for longer ones.
   class animation : public resource {
+  public:
+    /// how values are interpolated between keys.
+    enum interpolation_t {
+      interp_linear,
+      interp_step,
+      interp_hermite,
+    };
+
+  private:
+    enum format_t {
+      format_float,
+      format_quantized,
+    };
+
     // todo: this could be a GL/CL buffer
     dynarray<unsigned char> data;
 
@@ -20,6 +40,14 @@ namespace octet { namespace scene {
       int offset;          /// where in data
       unsigned num_times;  /// how many time values
       unsigned component_size; /// number of bytes per component
+      unsigned pose_offset; /// where in the pose buffer, in floats
+      uint8_t format;      /// format_t
+      uint8_t interpolation; /// interpolation_t
+      uint8_t time_size;   /// 2 or 4 bytes per time
+      uint8_t num_varying; /// number of quantized components that change
+      unsigned times_offset; /// where the times are in data
+      unsigned values_offset; /// where the values are in data
+      unsigned tangents_offset; /// where the hermite tangents are in data
     };
 
     // format and component of channels
@@ -31,12 +59,230 @@ namespace octet { namespace scene {
     dynarray<ref<resource> > targets;
 
     float end_time;
+
+    // number of floats in a pose of all channels.
+    unsigned pose_size;
+
+    // Layout of a quantized channel in data, from offset:
+    //
+    //   float constants[num_floats]    value of every component at the first key
+    //   float bias[num_varying]        changing component = bias + scale * q
+    //   float scale[num_varying]
+    //   float tangent_bias[num_varying], tangent_scale[num_varying]  (hermite only)
+    //   uint8_t index[num_varying]     which components change
+    //   times[num_times]               at times_offset
+    //   uint16_t q[num_times][num_varying]   at values_offset
+    //   uint16_t q_in[num_times][num_varying], q_out[num_times][num_varying]  at tangents_offset (hermite only)
+    //
+    // every section starts on a four byte boundary.
+
+    // find a key a such that the time is between keys a and a+1, starting at a hint.
+    // forward playback usually moves zero or one keys, so we try that before searching.
+    template <class time_t> static unsigned find_key(const time_t *p, unsigned num_times, unsigned time_ms, unsigned hint) {
+      unsigned last = num_times - 2;
+      if (hint <= last && p[hint] <= time_ms) {
+        if (time_ms < p[hint+1] || hint == last) return hint;
+        if (++hint == last || time_ms < p[hint+1]) return hint;
+      } else {
+        hint = 0;
+      }
+
+      // binary search for the last key at or before time_ms.
+      unsigned a = hint;
+      unsigned b = num_times - 1;
+      while (b - a > 1) {
+        unsigned mid = a + ((b - a) >> 1);
+        if (time_ms >= p[mid]) {
+          a = mid;
+        } else {
+          b = mid;
+        }
+      }
+      return a < last ? a : last;
+    }
+
+    unsigned find_key(const channel &ch, unsigned time_ms, unsigned hint, unsigned &ta, unsigned &tb) const {
+      unsigned a;
+      if (ch.time_size == 2) {
+        const uint16_t *p = (const uint16_t *)&data[ch.times_offset];
+        a = find_key(p, ch.num_times, time_ms, hint);
+        ta = p[a]; tb = p[a+1];
+      } else {
+        const uint32_t *p = (const uint32_t *)&data[ch.times_offset];
+        a = find_key(p, ch.num_times, time_ms, hint);
+        ta = p[a]; tb = p[a+1];
+      }
+      return a;
+    }
+
+    // add bytes to data, aligned to four bytes. returns the offset.
+    unsigned alloc_data(size_t bytes) {
+      unsigned offset = (data.size() + 3) & ~3u;
+      data.resize(offset + ((bytes + 3) & ~(size_t)3));
+      return offset;
+    }
+
+    // store times as milliseconds, in 16 bits if they fit.
+    void add_times(channel &ch, const float *times, const unsigned *keys, unsigned num_keys) {
+      float last_time = times[keys[num_keys-1]];
+      end_time = last_time > end_time ? last_time : end_time;
+      ch.time_size = last_time * 1000 + 0.5f < 65536 ? 2 : 4;
+      ch.times_offset = alloc_data(num_keys * ch.time_size);
+      for (unsigned i = 0; i != num_keys; ++i) {
+        float t = times[keys[i]] * 1000 + 0.5f;
+        unsigned t_ms = t > 0 ? (unsigned)t : 0;
+        if (ch.time_size == 2) {
+          ((uint16_t*)&data[ch.times_offset])[i] = (uint16_t)t_ms;
+        } else {
+          ((uint32_t*)&data[ch.times_offset])[i] = t_ms;
+        }
+      }
+    }
+
+    // quantize one value of a changing component.
+    static uint16_t quantize(float value, float bias, float scale) {
+      float q = scale != 0 ? (value - bias) / scale + 0.5f : 0;
+      return (uint16_t)(q < 0 ? 0 : q > 65535 ? 65535 : q);
+    }
+
+    // pick keys so that linear (or step) interpolation between them is within tolerance of all the keys.
+    static void reduce_keys(dynarray<unsigned> &keys, const float *times, const float *values, unsigned num_times, unsigned num_floats, float tolerance, interpolation_t interp) {
+      // how many keys to skip at most. this keeps the search linear in the number of keys.
+      enum { max_span = 64 };
+      keys.resize(0);
+      keys.push_back(0);
+      unsigned a = 0;
+      while (a + 1 < num_times) {
+        unsigned b = a + 1;
+        while (b + 1 < num_times && b + 1 - a <= max_span) {
+          // can we go from a to b+1 without the keys in between?
+          unsigned c = b + 1;
+          const float *va = values + a * num_floats;
+          const float *vc = values + c * num_floats;
+          bool ok = true;
+          for (unsigned k = a + 1; k != c && ok; ++k) {
+            float t = times[c] > times[a] ? (times[k] - times[a]) / (times[c] - times[a]) : 0;
+            if (interp == interp_step) t = 0;
+            const float *vk = values + k * num_floats;
+            for (unsigned i = 0; i != num_floats; ++i) {
+              float v = va[i] + (vc[i] - va[i]) * t;
+              if (fabsf(v - vk[i]) > tolerance) { ok = false; break; }
+            }
+          }
+          if (!ok) break;
+          b = c;
+        }
+        keys.push_back(b);
+        a = b;
+      }
+    }
+
+    // evaluate a raw float channel.
+    void eval_float(const channel &ch, unsigned time_ms, float *result, unsigned &key) const {
+      const float *values = (const float *)&data[ch.values_offset];
+      unsigned num_floats = ch.component_size / sizeof(float);
+
+      unsigned ta, tb;
+      unsigned a = key = find_key(ch, time_ms, key, ta, tb);
+      float t = time_ms <= ta ? 0.0f : time_ms >= tb ? 1.0f : float(time_ms - ta) / (tb - ta);
+
+      const float *va = values + a * num_floats;
+      const float *vb = va + num_floats;
+      for (unsigned i = 0; i != num_floats; ++i) {
+        result[i] = va[i] + (vb[i] - va[i]) * t;
+      }
+    }
+
+    // evaluate a quantized channel.
+    void eval_quantized(const channel &ch, unsigned time_ms, float *result, unsigned &key) const {
+      unsigned num_floats = ch.component_size / sizeof(float);
+      unsigned nv = ch.num_varying;
+      const float *constants = (const float *)&data[ch.offset];
+      const float *bias = constants + num_floats;
+      const float *scale = bias + nv;
+      const float *tangent_bias = scale + nv;
+      const float *tangent_scale = tangent_bias + nv;
+      const uint8_t *index = (const uint8_t *)(ch.interpolation == interp_hermite ? tangent_scale + nv : tangent_bias);
+
+      memcpy(result, constants, ch.component_size);
+      if (nv == 0) return;
+
+      unsigned ta, tb;
+      unsigned a = key = find_key(ch, time_ms, key, ta, tb);
+      float t = time_ms <= ta ? 0.0f : time_ms >= tb ? 1.0f : float(time_ms - ta) / (tb - ta);
+
+      const uint16_t *qa = (const uint16_t *)&data[ch.values_offset] + a * nv;
+      const uint16_t *qb = qa + nv;
+      switch (ch.interpolation) {
+        case interp_linear: {
+          for (unsigned k = 0; k != nv; ++k) {
+            float q = qa[k] + ((float)qb[k] - (float)qa[k]) * t;
+            result[index[k]] = bias[k] + scale[k] * q;
+          }
+        } break;
+        case interp_step: {
+          const uint16_t *q = t >= 1.0f ? qb : qa;
+          for (unsigned k = 0; k != nv; ++k) {
+            result[index[k]] = bias[k] + scale[k] * q[k];
+          }
+        } break;
+        case interp_hermite: {
+          // tangents are in value per second.
+          const uint16_t *q_in = (const uint16_t *)&data[ch.tangents_offset];
+          const uint16_t *q_out = q_in + ch.num_times * nv;
+          const uint16_t *out_a = q_out + a * nv;
+          const uint16_t *in_b = q_in + (a + 1) * nv;
+          float dt = (tb - ta) * 0.001f;
+          float t2 = t * t, t3 = t2 * t;
+          float h00 = 2 * t3 - 3 * t2 + 1;
+          float h10 = (t3 - 2 * t2 + t) * dt;
+          float h01 = -2 * t3 + 3 * t2;
+          float h11 = (t3 - t2) * dt;
+          for (unsigned k = 0; k != nv; ++k) {
+            float va = bias[k] + scale[k] * qa[k];
+            float vb = bias[k] + scale[k] * qb[k];
+            float ma = tangent_bias[k] + tangent_scale[k] * out_a[k];
+            float mb = tangent_bias[k] + tangent_scale[k] * in_b[k];
+            result[index[k]] = h00 * va + h10 * ma + h01 * vb + h11 * mb;
+          }
+        } break;
+      }
+    }
+
+    // evaluate one channel into "result", which has room for component_size bytes.
+    void eval_channel(const channel &ch, float time, float *result, unsigned &key) const {
+      float t = time * 1000;
+      unsigned time_ms = t > 0 ? (unsigned)t : 0;
+      if (ch.format == format_quantized) {
+        eval_quantized(ch, time_ms, result, key);
+      } else if (ch.num_times < 2) {
+        memcpy(result, &data[ch.values_offset], ch.component_size);
+      } else {
+        eval_float(ch, time_ms, result, key);
+      }
+    }
+
+    channel &new_channel(resource *target, atom_t sid, atom_t sub_target, atom_t component, unsigned num_times, unsigned num_floats) {
+      channel ch;
+      memset(&ch, 0, sizeof(ch));
+      ch.num_times = num_times;
+      ch.sid = sid;
+      ch.sub_target = sub_target;
+      ch.component = component;
+      ch.component_size = num_floats * sizeof(float);
+      ch.pose_offset = pose_size;
+      pose_size += num_floats;
+      channels.push_back(ch);
+      targets.push_back(target);
+      return channels.back();
+    }
   public:
     RESOURCE_META(animation)
-  
+
     /// Default constructor. Use add_channel to add channels to the animation,
     animation() {
       end_time = 0;
+      pose_size = 0;
     }
 
     /// Serialisation, script etc.
@@ -45,6 +291,17 @@ namespace octet { namespace scene {
       v.visit(channels, atom_channels);
       v.visit(targets, atom_targets);
       v.visit(end_time, atom_end_time);
+
+      pose_size = 0;
+      for (unsigned i = 0; i != channels.size(); ++i) {
+        if (v.is_reader()) {
+          channels[i].sid = v.map_atom(channels[i].sid);
+          channels[i].sub_target = v.map_atom(channels[i].sub_target);
+          channels[i].component = v.map_atom(channels[i].component);
+        }
+        channels[i].pose_offset = pose_size;
+        pose_size += channels[i].component_size / sizeof(float);
+      }
     }
 
     /// How many channels?
@@ -72,83 +329,304 @@ namespace octet { namespace scene {
       return targets[ch];
     }
 
+    /// how many keys are stored for a channel?
+    unsigned get_num_keys(int ch) const {
+      return channels[ch].num_times;
+    }
+
+    /// how many bytes of key data do all the channels use?
+    unsigned get_data_size() const {
+      return data.size();
+    }
+
     /// how long is the animation?
     float get_end_time() const {
       return end_time;
     }
 
+    /// Number of floats needed to hold the values of all channels; see eval().
+    unsigned get_pose_size() const {
+      return pose_size;
+    }
+
+    /// Where the values of a channel start in a pose, in floats.
+    unsigned get_pose_offset(int ch) const {
+      return channels[ch].pose_offset;
+    }
+
     /// add a channel to the animation.
-    // just store the floats in the channel for now.
-    // todo: optimise animation data
-    void add_channel(resource *target, atom_t sid, atom_t sub_target, atom_t component, dynarray<float> &times, dynarray<float> &values) {
-      int num_times = (int)times.size();
-      int num_values = (int)values.size();
-      int component_size = (num_values / num_times) * sizeof(float);
+    /// The values are stored as floats and interpolated linearly.
+    void add_channel(resource *target, atom_t sid, atom_t sub_target, atom_t component, const dynarray<float> &times, const dynarray<float> &values) {
+      unsigned num_times = times.size();
+      if (num_times == 0) return;
+      unsigned num_floats = values.size() / num_times;
 
-      channel ch;
-      ch.num_times = num_times;
-      ch.sid = sid;
-      ch.sub_target = sub_target;
-      ch.component = component;
-      ch.component_size = component_size;
-
-      int offset = ch.offset = (int)data.size();
-      int bytes = num_times * sizeof(unsigned short) + component_size * num_times;
-      data.resize(ch.offset + bytes);
-      end_time = times[num_times-1] > end_time ? times[num_times-1] : end_time;
-      for (int i = 0; i != num_times; ++i) {
-        unsigned short it = (unsigned short)( times[i] * 1000 );
-        *((unsigned short*)&data[offset]) = it;
-        offset += sizeof(unsigned short);
-      }
-      
-      memcpy(&data[offset], &values[0], component_size * num_times);
-      channels.push_back(ch);
-      targets.push_back(target);
+      channel &ch = new_channel(target, sid, sub_target, component, num_times, num_floats);
+      ch.format = format_float;
+      ch.interpolation = interp_linear;
+      ch.offset = (int)data.size();
+
+      dynarray<unsigned> keys(num_times);
+      for (unsigned i = 0; i != num_times; ++i) keys[i] = i;
+      add_times(ch, times.data(), keys.data(), num_times);
+
+      ch.values_offset = alloc_data(num_floats * num_times * sizeof(float));
+      memcpy(&data[ch.values_offset], values.data(), num_floats * num_times * sizeof(float));
     }
 
-    /// Evaluate one channel. Time is in ms. This is very inefficient, it is much better to evalaute all channels together.
-    void eval_chan(int chan, float time, resource *target) const {
-      int time_ms = int(time * 1000);
-      const channel &ch = channels[chan];
-      unsigned short *p = (unsigned short *)&data[ch.offset];
-      unsigned a = 0;
-      unsigned b = ch.num_times - 1;
-      unsigned component_size = ch.component_size;
-      //log("ec %f %d\n", time, time_ms);
-
-      if (time_ms < p[0]) {
-        time_ms = p[0];
-      } else if (time_ms >= p[b]) {
-        time_ms = p[b];
-        a = b - 1;
+    /// Add a compressed channel to the animation.
+    ///
+    /// Components that change are quantized to 16 bits over their range; components that do not are stored once.
+    ///
+    /// If tolerance is not zero, keys are removed if linear (or step) interpolation of the remaining keys
+    /// stays within tolerance * (the largest range of any component). Hermite channels keep all their keys.
+    ///
+    /// Hermite channels use in_tangents and out_tangents (slopes in value per second, one for each value)
+    /// or Catmull-Rom tangents if they are NULL.
+    void add_compressed_channel(
+      resource *target, atom_t sid, atom_t sub_target, atom_t component, const dynarray<float> &times, const dynarray<float> &values,
+      interpolation_t interpolation = interp_linear, float tolerance = 0,
+      const dynarray<float> *in_tangents = 0, const dynarray<float> *out_tangents = 0
+    ) {
+      unsigned num_times = times.size();
+      if (num_times == 0) return;
+      unsigned num_floats = values.size() / num_times;
+      bool hermite = interpolation == interp_hermite;
+      if (num_floats > 255) {
+        // too many components to index with a byte.
+        add_channel(target, sid, sub_target, component, times, values);
+        return;
+      }
+
+      // find the range of each component.
+      dynarray<float> vmin(num_floats), vmax(num_floats);
+      for (unsigned i = 0; i != num_floats; ++i) {
+        vmin[i] = vmax[i] = values[i];
+        for (unsigned j = 1; j != num_times; ++j) {
+          float v = values[j * num_floats + i];
+          vmin[i] = v < vmin[i] ? v : vmin[i];
+          vmax[i] = v > vmax[i] ? v : vmax[i];
+        }
+      }
+
+      dynarray<uint8_t> varying;
+      float max_range = 0;
+      for (unsigned i = 0; i != num_floats; ++i) {
+        float range = vmax[i] - vmin[i];
+        max_range = range > max_range ? range : max_range;
+        if (range != 0) varying.push_back((uint8_t)i);
+      }
+      unsigned nv = varying.size();
+
+      // hermite tangents, in value per second.
+      dynarray<float> t_in, t_out;
+      if (hermite) {
+        if (in_tangents && out_tangents && in_tangents->size() == values.size() && out_tangents->size() == values.size()) {
+          t_in = *in_tangents;
+          t_out = *out_tangents;
+        } else {
+          // catmull-rom
+          t_in.resize(values.size());
+          for (unsigned j = 0; j != num_times; ++j) {
+            unsigned p = j ? j - 1 : j, n = j + 1 < num_times ? j + 1 : j;
+            float dt = times[n] - times[p];
+            for (unsigned i = 0; i != num_floats; ++i) {
+              t_in[j * num_floats + i] = dt > 0 ? (values[n * num_floats + i] - values[p * num_floats + i]) / dt : 0;
+            }
+          }
+          t_out = t_in;
+        }
+      }
+
+      dynarray<unsigned> keys;
+      if (tolerance > 0 && !hermite) {
+        reduce_keys(keys, times.data(), values.data(), num_times, num_floats, tolerance * max_range, interpolation);
       } else {
-        while (b - a > 1) {
-          unsigned mid = a + ((b - a) >> 1);
-          if (time_ms > p[mid]) {
-            a = mid;
-          } else {
-            b = mid;
+        keys.resize(num_times);
+        for (unsigned j = 0; j != num_times; ++j) keys[j] = j;
+      }
+      unsigned num_keys = keys.size();
+
+      channel &ch = new_channel(target, sid, sub_target, component, num_keys, num_floats);
+      ch.format = format_quantized;
+      ch.interpolation = (uint8_t)interpolation;
+      ch.num_varying = (uint8_t)nv;
+
+      unsigned header_floats = num_floats + nv * (hermite ? 4 : 2);
+      ch.offset = alloc_data(header_floats * sizeof(float) + nv);
+      float *constants = (float*)&data[ch.offset];
+      float *bias = constants + num_floats;
+      float *scale = bias + nv;
+      float *tangent_bias = scale + nv;
+      float *tangent_scale = tangent_bias + nv;
+      memcpy(constants, values.data(), num_floats * sizeof(float));
+      memcpy(constants + header_floats, varying.data(), nv);
+
+      for (unsigned k = 0; k != nv; ++k) {
+        unsigned i = varying[k];
+        bias[k] = vmin[i];
+        scale[k] = (vmax[i] - vmin[i]) / 65535;
+        if (hermite) {
+          float mmin = t_in[i], mmax = t_in[i];
+          for (unsigned j = 0; j != num_times; ++j) {
+            float a = t_in[j * num_floats + i], b = t_out[j * num_floats + i];
+            mmin = std::min(mmin, std::min(a, b));
+            mmax = std::max(mmax, std::max(a, b));
           }
+          tangent_bias[k] = mmin;
+          tangent_scale[k] = (mmax - mmin) / 65535;
         }
       }
 
-      //log("t=%d a=%d b=%d p[a]=%d p[b]=%d\n", time_ms, a, b, p[a], p[b]);
+      add_times(ch, times.data(), keys.data(), num_keys);
 
-      unsigned data_offset = ch.offset + ch.num_times * sizeof(unsigned short);
+      ch.values_offset = alloc_data(num_keys * nv * sizeof(uint16_t));
+      if (hermite) ch.tangents_offset = alloc_data(num_keys * nv * sizeof(uint16_t) * 2);
 
-      float t = float(time_ms - p[a]) / (p[b] - p[a]);
-      float tmp1[16];
-      float tmp2[16];
-      if (component_size <= sizeof(tmp1)) {
-        memcpy(tmp1, &data[data_offset + a * component_size], component_size);
-        memcpy(tmp2, &data[data_offset + b * component_size], component_size);
-        for (int i = 0; i != component_size/4; ++i) {
-          tmp1[i] = tmp1[i] * (1-t) + tmp2[i] * t;
+      // data may have moved.
+      const float *b = (const float*)&data[ch.offset] + num_floats;
+      const float *s = b + nv;
+      const float *tb = s + nv;
+      const float *ts = tb + nv;
+      uint16_t *q = (uint16_t*)&data[ch.values_offset];
+      uint16_t *q_in = hermite ? (uint16_t*)&data[ch.tangents_offset] : 0;
+      uint16_t *q_out = q_in + num_keys * nv;
+      for (unsigned j = 0; j != num_keys; ++j) {
+        unsigned src = keys[j] * num_floats;
+        for (unsigned k = 0; k != nv; ++k) {
+          unsigned i = varying[k];
+          q[j * nv + k] = quantize(values[src + i], b[k], s[k]);
+          if (hermite) {
+            q_in[j * nv + k] = quantize(t_in[src + i], tb[k], ts[k]);
+            q_out[j * nv + k] = quantize(t_out[src + i], tb[k], ts[k]);
+          }
         }
-        //log("  t=%f %f %f %f\n", t, tmp1[0], tmp1[1], tmp1[2]);
-        target->set_value(ch.sid, ch.sub_target, ch.component, tmp1);
       }
     }
+
+    /// Evaluate all channels at "time" (in seconds) into a pose of get_pose_size() floats.
+    ///
+    /// "keys" holds the last key used by each channel (get_num_channels() values, zero to start).
+    /// When playing forwards this makes finding the keys O(1). It may be NULL.
+    ///
+    /// This does not change the animation, so many threads may evaluate the same animation at once.
+    void eval(float time, float *pose, unsigned *keys) const {
+      for (unsigned c = 0; c != channels.size(); ++c) {
+        const channel &ch = channels[c];
+        unsigned key = keys ? keys[c] : 0;
+        eval_channel(ch, time, pose + ch.pose_offset, key);
+        if (keys) keys[c] = key;
+      }
+    }
+
+    /// Send a pose from eval() to the targets of the channels, or to "target" if it is not NULL.
+    void apply(const float *pose, resource *target) const {
+      for (unsigned c = 0; c != channels.size(); ++c) {
+        const channel &ch = channels[c];
+        resource *r = target ? target : (resource*)targets[c];
+        if (r) r->set_value(ch.sid, ch.sub_target, ch.component, (float*)pose + ch.pose_offset);
+      }
+    }
+
+    /// Evaluate one channel. Time is in seconds.
+    /// This is inefficient, use eval() and apply() to evaluate all channels together.
+    void eval_chan(int chan, float time, resource *target) const {
+      const channel &ch = channels[chan];
+      dynarray<float> tmp(ch.component_size / sizeof(float));
+      unsigned key = 0;
+      eval_channel(ch, time, tmp.data(), key);
+      target->set_value(ch.sid, ch.sub_target, ch.component, tmp.data());
+    }
   };
+
+  #if OCTET_UNIT_TEST
+    class animation_unit_test {
+      // evaluate the only channel of an animation.
+      static void eval1(const animation *anim, float time, float *result) {
+        anim->eval(time, result, 0);
+      }
+
+    public:
+      animation_unit_test() {
+        // a channel of (sin, constant, ramp) at 30 keys per second.
+        dynarray<float> times, values;
+        for (unsigned j = 0; j != 61; ++j) {
+          float t = j / 30.0f;
+          times.push_back(t);
+          values.push_back(sinf(t * 3));
+          values.push_back(0.25f);
+          values.push_back(t * 4);
+        }
+
+        // quantized keys are within half a step of the float keys and the constant is exact.
+        ref<animation> raw = new animation();
+        raw->add_channel(0, atom_, atom_, atom_, times, values);
+        ref<animation> lin = new animation();
+        lin->add_compressed_channel(0, atom_, atom_, atom_, times, values);
+        assert(lin->get_num_keys(0) == 61 && lin->get_data_size() < raw->get_data_size());
+        for (unsigned step = 0; step != 100; ++step) {
+          float a[3], b[3];
+          eval1(raw, step * 0.02f, a);
+          eval1(lin, step * 0.02f, b);
+          assert(fabsf(a[0] - b[0]) < 2.0f / 65535 && b[1] == 0.25f && fabsf(a[2] - b[2]) < 8.0f / 65535);
+        }
+
+        // key reduction removes keys that interpolation can rebuild: the ramp only needs its ends.
+        dynarray<float> ramp;
+        for (unsigned j = 0; j != 61; ++j) ramp.push_back(j / 30.0f * 4);
+        ref<animation> reduced = new animation();
+        reduced->add_compressed_channel(0, atom_, atom_, atom_, times, ramp, animation::interp_linear, 0.001f);
+        assert(reduced->get_num_keys(0) == 2);
+
+        // the tolerance is relative to the largest range, here 8 for the ramp component.
+        ref<animation> reduced_sin = new animation();
+        reduced_sin->add_compressed_channel(0, atom_, atom_, atom_, times, values, animation::interp_linear, 0.01f);
+        assert(reduced_sin->get_num_keys(0) < 61);
+        for (unsigned j = 0; j != 61; ++j) {
+          float r, v[3];
+          eval1(reduced, times[j], &r);
+          eval1(reduced_sin, times[j], v);
+          assert(fabsf(r - ramp[j]) < 0.01f && fabsf(v[0] - values[j * 3]) < 0.09f && fabsf(v[2] - values[j * 3 + 2]) < 0.09f);
+        }
+
+        // step channels hold each key until the next.
+        ref<animation> step = new animation();
+        step->add_compressed_channel(0, atom_, atom_, atom_, times, ramp, animation::interp_step);
+        float s;
+        eval1(step, 0.5f + 0.01f, &s);
+        assert(fabsf(s - 2.0f) < 0.001f);
+
+        // hermite curves with the true tangents reproduce a cubic between the keys.
+        dynarray<float> cubic_times, cubic, slopes;
+        for (unsigned j = 0; j != 5; ++j) {
+          float t = j * 0.5f;
+          cubic_times.push_back(t);
+          cubic.push_back(t * t * t);
+          slopes.push_back(3 * t * t);
+        }
+        ref<animation> curve = new animation();
+        curve->add_compressed_channel(0, atom_, atom_, atom_, cubic_times, cubic, animation::interp_hermite, 0, &slopes, &slopes);
+        for (unsigned j = 0; j != 40; ++j) {
+          float t = j * 0.05f, c;
+          eval1(curve, t, &c);
+          t = (unsigned)(t * 1000) * 0.001f;
+          assert(fabsf(c - t * t * t) < 0.002f);
+        }
+
+        // clips longer than 65.5 seconds use 32 bit times.
+        dynarray<float> long_times, long_values;
+        for (unsigned j = 0; j != 3; ++j) {
+          long_times.push_back(j * 50.0f);
+          long_values.push_back((float)j);
+        }
+        ref<animation> long_clip = new animation();
+        long_clip->add_compressed_channel(0, atom_, atom_, atom_, long_times, long_values);
+        float l;
+        eval1(long_clip, 75.0f, &l);
+        assert(long_clip->get_end_time() == 100.0f && fabsf(l - 1.5f) < 0.001f);
+      }
+    };
+
+    static animation_unit_test animation_unit_test;
+  #endif
 }}
@@ -15,6 +15,37 @@ namespace octet { namespace scene {
     float time;
     bool is_looping;
     bool is_paused;
+
+    // values of all channels from the last evaluate(), and the last key used by each channel.
+    dynarray<float> pose;
+    dynarray<unsigned> keys;
+
+    // where each channel goes: a node transform we can write directly or a resource to call.
+    struct binding {
+      scene_node *node;
+      resource *target;
+    };
+    dynarray<binding> bindings;
+    const animation *bound_anim;
+
+    void bind() {
+      int num_channels = anim->get_num_channels();
+      bindings.resize(num_channels);
+      for (int ch = 0; ch != num_channels; ++ch) {
+        resource *r = target ? (resource*)target : anim->get_target(ch);
+        scene_node *node = r ? r->get_scene_node() : 0;
+        binding &b = bindings[ch];
+        if (node) {
+          // scene nodes only take transforms.
+          b.node = anim->get_sub_target(ch) == atom_transform ? node : 0;
+          b.target = 0;
+        } else {
+          b.node = 0;
+          b.target = r;
+        }
+      }
+      bound_anim = anim;
+    }
   public:
     RESOURCE_META(animation_instance)
 
@@ -25,6 +56,7 @@ namespace octet { namespace scene {
       this->time = 0;
       this->is_looping = is_looping;
       this->is_paused = false;
+      this->bound_anim = 0;
     }
 
     /// serialize the animation
@@ -34,6 +66,7 @@ namespace octet { namespace scene {
       v.visit(time, atom_time);
       v.visit(is_looping, atom_is_looping);
       v.visit(is_paused, atom_is_paused);
+      bound_anim = 0;
     }
 
     /// get the animation
@@ -46,18 +79,20 @@ namespace octet { namespace scene {
       return time;
     }
 
-    /// update the animation and the resources it connects to.
-    void update(float delta_time) {
-      if (target) {
-        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
-          anim->eval_chan(ch, time, target);
-        }
-      } else {
-        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
-          resource *anim_target = anim->get_target(ch);
-          anim->eval_chan(ch, time, anim_target);
-        }
+    /// Evaluate all the channels into the pose buffer and advance the time.
+    ///
+    /// This only changes the animation_instance, so different instances may be evaluated
+    /// on different threads. Call apply() afterwards to move the targets.
+    void evaluate(float delta_time) {
+      if (!anim) return;
+
+      unsigned num_channels = anim->get_num_channels();
+      if (keys.size() != num_channels) {
+        keys.resize(num_channels);
+        memset(keys.data(), 0, num_channels * sizeof(unsigned));
       }
+      pose.resize(anim->get_pose_size());
+      anim->eval(time, pose.data(), keys.data());
 
       //log("update %f\n", delta_time);
       if (!is_paused) {
@@ -72,5 +107,92 @@ namespace octet { namespace scene {
         }
       }
     }
+
+    /// Send the pose from the last evaluate() to the targets.
+    void apply() {
+      if (!anim || pose.size() != anim->get_pose_size()) return;
+      if (bound_anim != anim || bindings.size() != anim->get_num_channels()) {
+        bind();
+      }
+
+      const float *values = pose.data();
+      for (unsigned ch = 0; ch != bindings.size(); ++ch) {
+        const binding &b = bindings[ch];
+        if (b.node) {
+          b.node->access_nodeToParent().init_transpose(values + anim->get_pose_offset(ch));
+        } else if (b.target) {
+          b.target->set_value(anim->get_sid(ch), anim->get_sub_target(ch), anim->get_component(ch), (float*)values + anim->get_pose_offset(ch));
+        }
+      }
+    }
+
+    /// update the animation and the resources it connects to.
+    void update(float delta_time) {
+      evaluate(delta_time);
+      apply();
+    }
   };
+
+  #if OCTET_UNIT_TEST
+    class animation_instance_unit_test {
+      // value i of channel c at key j: an identity matrix (as column major floats) moved by j and c.
+      static float key_value(unsigned c, unsigned j, unsigned i) {
+        return (i % 5 == 0 ? 1.0f : 0.0f) + (i == 3 ? j * 1.5f + c : 0) + (i == 7 ? (float)(j * j) : 0);
+      }
+
+    public:
+      animation_instance_unit_test() {
+        static const float key_times[] = { 0, 0.5f, 1.0f, 2.0f };
+        enum { num_keys = 4, num_channels = 2 };
+        ref<animation> anim = new animation();
+        ref<scene_node> nodes[num_channels];
+        for (unsigned c = 0; c != num_channels; ++c) {
+          dynarray<float> times, values;
+          for (unsigned j = 0; j != num_keys; ++j) {
+            times.push_back(key_times[j]);
+            for (unsigned i = 0; i != 16; ++i) values.push_back(key_value(c, j, i));
+          }
+          nodes[c] = new scene_node();
+          anim->add_channel(nodes[c], atom_, atom_transform, atom_, times, values);
+        }
+        assert(anim->get_pose_size() == num_channels * 16 && anim->get_end_time() == 2.0f);
+
+        // the key cursor must give the same pose as a search from scratch, playing forwards, backwards or jumping.
+        dynarray<float> pose(anim->get_pose_size()), ref_pose(anim->get_pose_size());
+        unsigned keys[num_channels] = { 0, 0 };
+        for (unsigned step = 0; step != 300; ++step) {
+          float time = step < 100 ? step * 0.021f : step < 200 ? (200 - step) * 0.021f : (step * 37 % 100) * 0.021f;
+          anim->eval(time, pose.data(), keys);
+          anim->eval(time, ref_pose.data(), 0);
+          assert(!memcmp(pose.data(), ref_pose.data(), pose.size() * sizeof(float)));
+
+          float ms = (float)(unsigned)(time * 1000);
+          unsigned a = 0;
+          while (a + 2 < num_keys && ms >= key_times[a+1] * 1000) ++a;
+          float t = ms >= key_times[a+1] * 1000 ? 1.0f : (ms - key_times[a] * 1000) / ((key_times[a+1] - key_times[a]) * 1000);
+          for (unsigned c = 0; c != num_channels; ++c) {
+            for (unsigned i = 0; i != 16; ++i) {
+              float expected = key_value(c, a, i) + (key_value(c, a+1, i) - key_value(c, a, i)) * t;
+              assert(fabsf(pose[anim->get_pose_offset(c) + i] - expected) < 1e-4f);
+            }
+          }
+        }
+
+        // playing an instance writes the same transforms to the nodes as set_value does.
+        ref<animation_instance> inst = new animation_instance(anim);
+        ref<scene_node> check = new scene_node();
+        for (unsigned step = 0; step != 50; ++step) {
+          float time = inst->get_time();
+          inst->update(0.1f);
+          for (unsigned c = 0; c != num_channels; ++c) {
+            anim->eval_chan(c, time, check);
+            assert(!memcmp(&nodes[c]->get_nodeToParent(), &check->get_nodeToParent(), sizeof(mat4t)));
+          }
+        }
+        assert(inst->get_time() < anim->get_end_time());
+      }
+    };
+
+    static animation_instance_unit_test animation_instance_unit_test;
+  #endif
 }}
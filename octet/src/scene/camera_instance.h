@@ -144,6 +144,21 @@ namespace octet { namespace scene {
       return cameraToProjection;
     }
 
+    /// Get the planes of the view frustum in world space: left, right, bottom, top, near and far.
+    /// Points inside the frustum are on the positive side of all six. Call after set_cameraToWorld().
+    void get_frustum_planes(half_space planes[6]) const {
+      // for row vectors, clip = world * worldToProjection so -w <= x <= w becomes dot(world, colw +/- colx) >= 0
+      mat4t worldToProjection = worldToCamera * cameraToProjection;
+      vec4 x = worldToProjection.colx();
+      vec4 y = worldToProjection.coly();
+      vec4 z = worldToProjection.colz();
+      vec4 w = worldToProjection.colw();
+      vec4 coeffs[6] = { w + x, w - x, w + y, w - y, w + z, w - z };
+      for (unsigned i = 0; i != 6; ++i) {
+        planes[i] = half_space(coeffs[i].xyz(), coeffs[i].w());
+      }
+    }
+
     /// return a ray from screen (x, y) to the far plane; used for picking.
     ray get_ray(float x, float y) {
       vec4 ray_start, ray_end;
@@ -64,153 +64,82 @@ namespace octet { namespace scene {
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
     };
 
-    /// Make mipmaps for this image.
-    void make_mipmaps() {
-      if (format != RGB && format != RGBA) return;
-
-      bytes.resize(bytes.size() * 4 / 3);
-
-      unsigned num_comps = format == RGB ? 3 : 4;
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &bytes[width * height * num_comps];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      mip_levels = 0;
-      while (w > 1 && h > 1) {
-        for (unsigned y = 0; y < h/2; ++y) {
-          for (unsigned x = 0; x < w/2; ++x) {
-            // this is a rather dreadful box filter, it is simple to make, but introduces
-            // artifacts. We can do better than this.
-            for (unsigned i = 0; i != num_comps; ++i) {
-              *dest++ = ( src[0] + src[num_comps] + src[stride] + src[stride+num_comps] + 3 ) >> 2;
-              src++;
-            }
-            src += num_comps;
-          }
-          src += stride;
+    // tables to convert between gamma encoded bytes and 16 bit linear light.
+    struct gamma_tables {
+      uint16_t to_linear[256];
+      uint8_t from_linear[65536];
+
+      gamma_tables(bool srgb) {
+        for (unsigned i = 0; i != 256; ++i) {
+          float v = i * (1.0f / 255);
+          float l = !srgb ? powf(v, 2.2f) : v <= 0.04045f ? v * (1.0f / 12.92f) : powf((v + 0.055f) * (1.0f / 1.055f), 2.4f);
+          to_linear[i] = (uint16_t)(l * 65535 + 0.5f);
+        }
+        for (unsigned i = 0; i != 65536; ++i) {
+          float l = i * (1.0f / 65535);
+          float v = !srgb ? powf(l, 1.0f / 2.2f) : l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+          from_linear[i] = (uint8_t)(v * 255 + 0.5f);
         }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        mip_levels++;
       }
-      assert(dest - &bytes[0] < (int)bytes.size());
-      //printf("%d %d\n", dest - &bytes[0], bytes.size());
-    }
-
-    /// DXT encode the image, making it smaller and grainier.
-    /// Todo: do standard error-diffusion and other improvements.
-    void dxt_encode() {
-      if (format != RGB && format != RGBA) return;
+    };
 
-      unsigned num_comps = format == RGB ? 3 : 4;
-      dynarray<uint8_t> result;
-      result.resize(bytes.size() / num_comps);
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &result[0];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      unsigned new_mip_levels = 0;
-      while (w > 4 && h > 4 && new_mip_levels < mip_levels) {
-        for (unsigned y = 0; y < h/4; ++y) {
-          log("w=%d y=%d src=%08x\n", w, y, src - &bytes[0]);
-          for (unsigned x = 0; x < w/4; ++x) {
-            // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
-            vec4 tot(0, 0, 0, 0);
-            vec4 colours[16];
-            for (unsigned j = 0; j != 4; ++j) {
-              for (unsigned i = 0; i != 4; ++i) {
-                //vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), (num_comps == 4 ? src[3] * (1.0f/255) : 1.0f));
-                vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), 1.0f);
-                colours[i+j*4] = colour;
-                tot += colour;
-                src += num_comps;
-              }
-              src += ( w - 4 ) * num_comps;
-            }
-            src -= ( w - 1 ) * 4 * num_comps;
-
-            // calculate the covariance matrix
-            vec4 mean = tot * 0.0625f;
-            mat4t covariance(0);
-            for (unsigned i = 0; i != 16; ++i) {
-              vec4 colour = colours[i] -= mean;
-              covariance += outer(colour, colour);
-            }
+    static const gamma_tables &get_gamma_tables(bool srgb) {
+      static const gamma_tables gamma(false), srgb_curve(true);
+      return srgb ? srgb_curve : gamma;
+    }
 
-            // power method to find largest eigenvector (axis)
-            vec4 axis = covariance.trace();
-            for (unsigned i = 0; i != 4; ++i) {
-              axis = axis * covariance;
-            }
-            float len = axis.length();
-            if (abs(len) >= 0.001f) axis = axis / len;
-            //if (y == 27) log("%s %s %s\n", mean.toString(), axis.toString(), covariance.toString(tmp, sizeof(tmp)));
-
-            // our colours all have to live on the axis.
-            // in practice, we can ignore "odd man out" colours
-            // for better compression. But for now, do all the colours.
-            float pmin = dot(colours[0], axis);
-            float pmax = pmin;
-            float projs[16];
-            projs[0] = pmin;
-            for (unsigned i = 1; i != 16; ++i) {
-              float proj = dot(colours[i], axis);
-              projs[i] = proj;
-              pmin = pmin < proj ? pmin : proj;
-              pmax = pmax > proj ? pmax : proj;
-            }
-            vec4 cmin = mean + axis * pmin;
-            vec4 cmax = mean + axis * pmax;
-            //if (y == 27) log("%s -> %s\n", cmin.toString(), cmax.toString(tmp, sizeof(tmp)));
-            cmin = min(max(cmin, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-            cmax = min(max(cmax, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-
-            unsigned c0 =
-              ( (unsigned)(cmin.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmin.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmin.z() * 31.999f) << 0 )
-            ;
-            unsigned c1 =
-              ( (unsigned)(cmax.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmax.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmax.z() * 31.999f) << 0 )
-            ;
-
-            if (c0 < c1) {
-              unsigned t = c0; c0 = c1; c1 = t;
-              float p = pmin; pmin = pmax; pmax = p;
-            }
+    // size of the next mip level down.
+    static unsigned next_mip_size(unsigned size) {
+      return size > 1 ? size / 2 : 1;
+    }
 
-            float pscale = abs(pmax - pmin) > 0.001f ? 3.999f / (pmax - pmin) : 0;
-            uint8_t pal[16];
-            for (unsigned i = 0; i != 16; ++i) {
-              pal[i] = (unsigned)( ( projs[i] - pmin ) * pscale );
+    // make rows [begin, end) of the mip level below "src" with a 2x2 box filter.
+    // The last row or column of odd sizes is dropped.
+    static void downsample_rows(uint8_t *dest, const uint8_t *src, unsigned sw, unsigned sh, unsigned num_comps, const gamma_tables *gamma, unsigned begin, unsigned end) {
+      unsigned dw = next_mip_size(sw);
+      for (unsigned y = begin; y != end; ++y) {
+        const uint8_t *row0 = src + (y * 2 < sh ? y * 2 : sh - 1) * sw * num_comps;
+        const uint8_t *row1 = src + (y * 2 + 1 < sh ? y * 2 + 1 : sh - 1) * sw * num_comps;
+        uint8_t *out = dest + y * dw * num_comps;
+        unsigned x = 0;
+
+        #if OCTET_SSE
+          // four RGBA pixels at a time.
+          if (!gamma && num_comps == 4) {
+            const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+            for (; x * 2 + 8 <= sw; x += 4) {
+              __m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + x * 8));
+              __m128i a1 = _mm_loadu_si128((const __m128i*)(row0 + x * 8 + 16));
+              __m128i b0 = _mm_loadu_si128((const __m128i*)(row1 + x * 8));
+              __m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + x * 8 + 16));
+              __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+              __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+              __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+              __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+              __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+              __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+              h0 = _mm_srli_epi16(_mm_add_epi16(h0, two), 2);
+              h1 = _mm_srli_epi16(_mm_add_epi16(h1, two), 2);
+              _mm_storeu_si128((__m128i*)(out + x * 4), _mm_packus_epi16(h0, h1));
             }
-
-            dest[0] = ( c0 >> 0 ) & 0xff;
-            dest[1] = ( c0 >> 8 ) & 0xff;
-            dest[2] = ( c1 >> 0 ) & 0xff;
-            dest[3] = ( c1 >> 8 ) & 0xff;
-            for (int i = 0; i != 4; ++i) {
-              dest[i+4] = pal[i*4+0] + pal[i*4+1] * 4 + pal[i*4+2] * 16 + pal[i*4+3] * 64;
+          }
+        #endif
+
+        for (; x != dw; ++x) {
+          unsigned x0 = x * 2 * num_comps;
+          unsigned x1 = x * 2 + 1 < sw ? x0 + num_comps : x0;
+          for (unsigned i = 0; i != num_comps; ++i) {
+            if (gamma && i != 3) {
+              // colour is averaged in linear light, alpha is always linear.
+              const uint16_t *lin = gamma->to_linear;
+              unsigned sum = lin[row0[x0 + i]] + lin[row0[x1 + i]] + lin[row1[x0 + i]] + lin[row1[x1 + i]];
+              out[x * num_comps + i] = gamma->from_linear[(sum + 2) >> 2];
+            } else {
+              out[x * num_comps + i] = (uint8_t)((row0[x0 + i] + row0[x1 + i] + row1[x0 + i] + row1[x1 + i] + 2) >> 2);
             }
-            dest += 8;
           }
-          src += stride * 3;
         }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        new_mip_levels++;
       }
-      assert(dest - &result[0] < (int)result.size());
-      bytes.resize((int)(dest - &result[0]));
-      memcpy(&bytes[0], &result[0], dest - &result[0]);
-      format = COMPRESSED_RGB_S3TC_DXT1_EXT;
-      mip_levels = new_mip_levels;
     }
 
     void add_texture() {
@@ -239,12 +168,11 @@ namespace octet { namespace scene {
         unsigned w = width;
         unsigned h = height;
         uint8_t *src = &bytes[0];
-        unsigned level = 0;
-        while (w != 0 && h != 0) {
-          glTexImage2D(gl_target, level++, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
+        for (unsigned level = 0; level != mip_levels; ++level) {
+          glTexImage2D(gl_target, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
           src += w * h * num_comps;
-          w >>= 1;
-          h >>= 1;
+          w = next_mip_size(w);
+          h = next_mip_size(h);
         }
       }
     }
@@ -252,6 +180,16 @@ namespace octet { namespace scene {
   public:
     RESOURCE_META(image)
 
+    /// How make_mipmaps() averages colours.
+    enum mip_colour_space {
+      /// average the bytes. Use this for normal maps and other data.
+      mip_linear,
+      /// average in linear light with a gamma of 2.2.
+      mip_gamma,
+      /// average in linear light with the sRGB curve.
+      mip_srgb,
+    };
+
     /// default constructor makes a blank image.
     image() {
       init("");
@@ -271,10 +209,114 @@ namespace octet { namespace scene {
       depth = _depth; // for 3D textures
     }
 
+    /// make an image from RGB or RGBA pixels, eg. generated content.
+    image(unsigned _format, unsigned _width, unsigned _height, const uint8_t *pixels) {
+      init("");
+      format = (uint16_t)_format;
+      width = (uint16_t)_width;
+      height = (uint16_t)_height;
+      unsigned num_comps = format == RGBA ? 4 : 3;
+      bytes.resize(width * height * num_comps);
+      memcpy(bytes.data(), pixels, bytes.size());
+    }
+
     /// release resources.
     ~image() {
     }
 
+    /// Make mipmaps for this image, down to 1x1. Each level is filtered on all threads.
+    void make_mipmaps(mip_colour_space space = mip_linear) {
+      if ((format != RGB && format != RGBA) || !width || !height) return;
+
+      unsigned num_comps = format == RGB ? 3 : 4;
+      unsigned size = 0;
+      mip_levels = 0;
+      for (unsigned w = width, h = height; ; w = next_mip_size(w), h = next_mip_size(h)) {
+        size += w * h * num_comps;
+        mip_levels++;
+        if (w == 1 && h == 1) break;
+      }
+      bytes.resize(size);
+
+      const gamma_tables *gamma = space == mip_linear ? 0 : &get_gamma_tables(space == mip_srgb);
+      uint8_t *src = bytes.data();
+      for (unsigned w = width, h = height; w != 1 || h != 1; w = next_mip_size(w), h = next_mip_size(h)) {
+        uint8_t *dest = src + w * h * num_comps;
+        unsigned dh = next_mip_size(h);
+        job::get_scheduler().parallel_for(0, dh, 16, [=](unsigned begin, unsigned end) {
+          downsample_rows(dest, src, w, h, num_comps, gamma, begin, end);
+        });
+        src = dest;
+      }
+    }
+
+    /// DXT encode the image, making it smaller and grainier.
+    /// RGB images become DXT1 and RGBA ones DXT5. Mipmaps are made first if there are none.
+    /// Rows of blocks are encoded on all threads.
+    void dxt_encode(dxt_encoder::quality_t quality = dxt_encoder::quality_normal) {
+      if ((format != RGB && format != RGBA) || !width || !height) return;
+      if (mip_levels == 1 && (width != 1 || height != 1)) make_mipmaps();
+
+      unsigned num_comps = format == RGB ? 3 : 4;
+      bool alpha = num_comps == 4;
+      unsigned size = 0;
+      for (unsigned level = 0, w = width, h = height; level != mip_levels; ++level, w = next_mip_size(w), h = next_mip_size(h)) {
+        size += dxt_encoder::get_size(w, h, alpha);
+      }
+
+      dynarray<uint8_t> result(size);
+      dxt_encoder enc(quality);
+      const uint8_t *src = bytes.data();
+      uint8_t *dest = result.data();
+      for (unsigned level = 0, w = width, h = height; level != mip_levels; ++level, w = next_mip_size(w), h = next_mip_size(h)) {
+        job::get_scheduler().parallel_for(0, dxt_encoder::get_block_rows(h), 4, [&](unsigned begin, unsigned end) {
+          enc.encode(dest, src, w, h, num_comps, begin, end);
+        });
+        src += w * h * num_comps;
+        dest += dxt_encoder::get_size(w, h, alpha);
+      }
+
+      bytes = std::move(result);
+      format = alpha ? COMPRESSED_RGBA_S3TC_DXT5_EXT : COMPRESSED_RGB_S3TC_DXT1_EXT;
+    }
+
+    /// Print the speed of make_mipmaps() and dxt_encode() on a generated image, in MB/s of source pixels.
+    static void benchmark(unsigned size = 1024) {
+      dynarray<uint8_t> pixels(size * size * 4);
+      for (unsigned y = 0; y != size; ++y) {
+        for (unsigned x = 0; x != size; ++x) {
+          uint8_t *p = pixels.data() + (y * size + x) * 4;
+          unsigned noise = (x * 1103515245u + y * 12345u) >> 24;
+          p[0] = (uint8_t)(x * 255 / size);
+          p[1] = (uint8_t)(y * 255 / size);
+          p[2] = (uint8_t)((x ^ y) + (noise & 15));
+          p[3] = (uint8_t)(128 + (noise & 127));
+        }
+      }
+
+      static const char *space_names[] = { "linear", "gamma", "srgb" };
+      for (unsigned space = mip_linear; space <= mip_srgb; ++space) {
+        ref<image> img = new image(RGBA, size, size, pixels.data());
+        std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+        img->make_mipmaps((mip_colour_space)space);
+        double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+        printf("make_mipmaps %s: %.1f MB/s\n", space_names[space], size * size * 4 / secs * 1e-6);
+      }
+
+      static const char *quality_names[] = { "fast", "normal", "high" };
+      for (unsigned quality = dxt_encoder::quality_fast; quality <= dxt_encoder::quality_high; ++quality) {
+        for (unsigned alpha = 0; alpha != 2; ++alpha) {
+          ref<image> img = new image(alpha ? RGBA : RGB, size, size, pixels.data());
+          img->make_mipmaps();
+          double src_size = img->bytes.size();
+          std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+          img->dxt_encode((dxt_encoder::quality_t)quality);
+          double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+          printf("dxt_encode %s %s: %.1f MB/s\n", alpha ? "DXT5" : "DXT1", quality_names[quality], src_size / secs * 1e-6);
+        }
+      }
+    }
+
     /// width in pixels
     unsigned get_width() const {
       return width;
@@ -300,6 +342,21 @@ namespace octet { namespace scene {
       return frames;
     }
 
+    /// RGB, RGBA or a compressed format, eg. after dxt_encode()
+    unsigned get_format() const {
+      return format;
+    }
+
+    /// number of mip levels in the bytes, largest first.
+    unsigned get_mip_levels() const {
+      return mip_levels;
+    }
+
+    /// pixels or compressed blocks of every mip level.
+    const dynarray<uint8_t> &get_bytes() const {
+      return bytes;
+    }
+
     /// access attributes by name
     void visit(visitor &v) {
       v.visit(url, atom_url);
@@ -331,19 +388,26 @@ namespace octet { namespace scene {
       } else {
         bytes.resize(0);
         load_part(url.c_str());
+        if (gl_target == GL_TEXTURE_2D) {
+          make_mipmaps();
+          //dxt_encode();
+        }
       }
     }
 
     void load_part(const char *_url) {
-      dynarray<uint8_t> buffer;
+      file_view buffer;
       app_utils::get_url(buffer, _url);
-      const unsigned char *src = &buffer[0];
-      const unsigned char *src_max = src + buffer.size();
-      if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
+      const unsigned char *src = buffer.get_src();
+      const unsigned char *src_max = buffer.get_src_max();
+      if (buffer.size() >= 6 && !memcmp(src, "GIF89a", 6)) {
         gif_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
       } else if (buffer.size() >= 6 && buffer[0] == 0xff && buffer[1] == 0xd8) {
         jpeg_decoder dec;
+        dec.set_parallel_for([](unsigned num, unsigned grain, const jpeg_decoder::range_fn &fn) {
+          job::get_scheduler().parallel_for(0, num, grain, fn);
+        });
         dec.get_image(bytes, format, width, height, src, src_max);
       } else if (buffer.size() >= 6 && buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 2) {
         tga_decoder dec;
@@ -351,7 +415,7 @@ namespace octet { namespace scene {
       } else if (buffer.size() >= 4 && buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' ') {
         dds_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
-      } else if (buffer.size() >= 348 && (!memcmp(&buffer[344], "ni1", 4) || !memcmp(&buffer[344], "n+1", 4))) {
+      } else if (buffer.size() >= 348 && (!memcmp(src + 344, "ni1", 4) || !memcmp(src + 344, "n+1", 4))) {
         nifti_decoder dec;
         gl_target = GL_TEXTURE_3D;
         dec.get_image(bytes, format, width, height, depth, frames, src, src_max);
@@ -359,9 +423,6 @@ namespace octet { namespace scene {
         printf("warning: unknown texture format\n");
         return;
       }
-
-      make_mipmaps();
-      //dxt_encode();
     }
 
     /// get the OpenGL texture handle for this image.
@@ -383,17 +444,18 @@ namespace octet { namespace scene {
           unsigned w = width;
           unsigned h = height;
           uint8_t *src = &bytes[0];
-          unsigned level = 0;
-          unsigned shift = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 1 : 0;
-          while (w != 0 && h != 0) {
-            unsigned wmin = w < 4 ? 4 : w;
-            unsigned hmin = h < 4 ? 4 : h;
-            unsigned size = ( wmin * hmin ) >> shift;
-            glCompressedTexImage2D(gl_target, level++, format, w, h, 0, size, (void*)src);
+          uint8_t *src_max = src + bytes.size();
+          bool dxt1 = format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT;
+          // upload as many levels as there are, eg. from a DDS file.
+          for (unsigned level = 0; ; ++level) {
+            unsigned size = dxt_encoder::get_size(w, h, !dxt1);
+            if (src + size > src_max) break;
+            glCompressedTexImage2D(gl_target, level, format, w, h, 0, size, (void*)src);
             //printf("%d\n", glGetError());
             src += size;
-            w >>= 1;
-            h >>= 1;
+            if (w == 1 && h == 1) break;
+            w = next_mip_size(w);
+            h = next_mip_size(h);
           }
           //printf("%d %d\n", src - image_, size);
         }
@@ -417,5 +479,74 @@ namespace octet { namespace scene {
       glTexSubImage2D(gl_target, 0, 0, 0, width, height, format, type, pixels);
     }
   };
+
+  #if OCTET_UNIT_TEST
+    class image_unit_test {
+      // one pixel of a 2x2 image of black and white with alpha 0 and 255, made into mipmaps.
+      static const uint8_t *mip_checker(ref<image> &img, image::mip_colour_space space) {
+        static const uint8_t pixels[] = { 0, 0, 0, 0,  255, 255, 255, 255,  255, 255, 255, 255,  0, 0, 0, 0 };
+        img = new image(GL_RGBA, 2, 2, pixels);
+        img->make_mipmaps(space);
+        assert(img->get_mip_levels() == 2 && img->get_bytes().size() == 5 * 4);
+        return img->get_bytes().data() + 4 * 4;
+      }
+
+    public:
+      image_unit_test() {
+        // every level is a 2x2 box filter of the one above, dropping the last row or column of odd sizes.
+        enum { width = 203, height = 150 };
+        dynarray<uint8_t> pixels(width * height * 3);
+        for (unsigned i = 0; i != pixels.size(); ++i) pixels[i] = (uint8_t)(i * 37 + (i / 611) * 11);
+        ref<image> img = new image(GL_RGB, width, height, pixels.data());
+        img->make_mipmaps();
+        assert(img->get_mip_levels() == 8);
+        const uint8_t *src = img->get_bytes().data();
+        unsigned w = width, h = height;
+        for (unsigned level = 1; level != img->get_mip_levels(); ++level) {
+          const uint8_t *dest = src + w * h * 3;
+          unsigned dw = w > 1 ? w / 2 : 1, dh = h > 1 ? h / 2 : 1;
+          for (unsigned y = 0; y != dh; ++y) {
+            for (unsigned x = 0; x != dw * 3; ++x) {
+              unsigned x0 = (x / 3) * 6 + x % 3, x1 = w > 1 ? x0 + 3 : x0;
+              unsigned r0 = y * 2 * w * 3, r1 = h > 1 ? r0 + w * 3 : r0;
+              assert(dest[y * dw * 3 + x] == (src[r0 + x0] + src[r0 + x1] + src[r1 + x0] + src[r1 + x1] + 2) >> 2);
+            }
+          }
+          src = dest;
+          w = dw;
+          h = dh;
+        }
+        assert(w == 1 && h == 1 && src + 3 == img->get_bytes().data() + img->get_bytes().size());
+
+        // gamma correct filtering averages black and white in linear light; alpha is always linear.
+        const uint8_t *p = mip_checker(img, image::mip_linear);
+        assert(p[0] == 128 && p[3] == 128);
+        p = mip_checker(img, image::mip_gamma);
+        assert(p[0] == 186 && p[1] == 186 && p[3] == 128);
+        p = mip_checker(img, image::mip_srgb);
+        assert(p[0] == 188 && p[2] == 188 && p[3] == 128);
+
+        // dxt_encode makes DXT1 from RGB and DXT5 from RGBA, with all the mip levels.
+        img = new image(GL_RGB, width, height, pixels.data());
+        img->dxt_encode(dxt_encoder::quality_fast);
+        unsigned dxt1_size = 0, dxt5_size = 0;
+        for (unsigned w = width, h = height; ; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1) {
+          dxt1_size += dxt_encoder::get_size(w, h, false);
+          dxt5_size += dxt_encoder::get_size(w, h, true);
+          if (w == 1 && h == 1) break;
+        }
+        assert(img->get_format() == 0x83F0 /*DXT1*/ && img->get_mip_levels() == 8);
+        assert(img->get_bytes().size() == dxt1_size);
+        dynarray<uint8_t> rgba(width * height * 4);
+        for (unsigned i = 0; i != rgba.size(); ++i) rgba[i] = pixels[i % pixels.size()];
+        img = new image(GL_RGBA, width, height, rgba.data());
+        img->dxt_encode(dxt_encoder::quality_fast);
+        assert(img->get_format() == 0x83F3 /*DXT5*/ && img->get_mip_levels() == 8);
+        assert(img->get_bytes().size() == dxt5_size);
+      }
+    };
+
+    static image_unit_test image_unit_test;
+  #endif
 }}
 
@@ -24,6 +24,32 @@ namespace octet { namespace scene {
     //dynarray<uint8_t> static_buffer;
     dynarray<uint8_t> buffer;
 
+    // solid materials with the default shader can be serialised by their color.
+    // params and shaders are GL objects, so they are rebuilt when reading.
+    vec4 solid_color;
+    int32_t is_solid;
+
+    // make a material from a color.
+    void init_solid(const vec4 &color, param_shader *shader) {
+      // materials are constructed from parameters which build the final shader.
+      // this allows us to use OpenGLES2 (uniforms) and 3 (buffers) as well as new shader features.
+      params.reserve(16);
+
+      create_dynamic_params();
+      create_attribute_params();
+
+      param_buffer_info static_pbi(buffer);
+      params.push_back(new param_color(static_pbi, color, atom_diffuse, param::stage_fragment));
+
+      is_solid = shader == NULL;
+      solid_color = color;
+      if (shader == NULL) {
+        shader = new param_shader("shaders/default.vs", "shaders/default_solid.fs");
+      }
+      shader->init(params);
+      custom_shader = shader;
+    }
+
     // create the parameters that change frequently such as the matrices and lighting
     void create_dynamic_params() {
       buffer.reserve(0x200);
@@ -53,29 +79,17 @@ namespace octet { namespace scene {
 
     /// Default constructor makes a blank material.
     material() {
+      is_solid = 0;
     }
 
     /// Alternative constructor.
     material(const vec4 &color, param_shader *shader = NULL) {
-      // materials are constructed from parameters which build the final shader.
-      // this allows us to use OpenGLES2 (uniforms) and 3 (buffers) as well as new shader features.
-      params.reserve(16);
-
-      create_dynamic_params();
-      create_attribute_params();
-
-      param_buffer_info static_pbi(buffer);
-      params.push_back(new param_color(static_pbi, color, atom_diffuse, param::stage_fragment));
-
-      if (shader == NULL) {
-        shader = new param_shader("shaders/default.vs", "shaders/default_solid.fs");
-      }
-      shader->init(params);
-      custom_shader = shader;
+      init_solid(color, shader);
     }
 
     /// create a material from an existing image
     material(image *img, sampler *smpl = NULL, param_shader *shader = NULL) {
+      is_solid = 0;
       if (!smpl) smpl = new sampler();
 
       params.reserve(16);
@@ -94,10 +108,16 @@ namespace octet { namespace scene {
     }
 
     material(param *diffuse, param *ambient, param *emission, param *specular, param *bump, param *shininess) {
+      is_solid = 0;
     }
 
-    /// Serialize.
+    /// Serialize. Only solid color materials with the default shader keep their contents.
     void visit(visitor &v) {
+      v.visit(is_solid, atom_solid_color);
+      v.visit(solid_color, atom_color);
+      if (v.is_reader() && is_solid && !custom_shader) {
+        init_solid(solid_color, NULL);
+      }
     }
 
     /// Set the uniforms for this material.
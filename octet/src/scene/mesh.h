@@ -57,34 +57,56 @@ namespace octet { namespace scene {
     // bounding box
     aabb mesh_aabb;
 
-    struct general_vertex {
-      const uint8_t *bytes;
-      unsigned size;
+    // triangles copied from the buffers with a bvh over them, for ray casting.
+    // rebuilt when the buffers or the parameters they were built from change.
+    struct ray_cache {
+      bvh tree;
+      dynarray<vec3p> positions;
+      dynarray<uint32_t> tri_indices;
+
+      ref<gl_resource> vertices;
+      ref<gl_resource> indices;
+      unsigned vertex_version;
+      unsigned index_version;
+      uint32_t num_indices;
+      uint32_t first_index;
+      uint16_t stride;
+      uint16_t index_type;
+      uint32_t pos_format;
+    };
 
-      bool is_empty() const { return bytes == 0; }
+    ray_cache *rays;
 
-      bool operator ==(const general_vertex &rhs) const {
-        //printf("%p %p %d\n", this, &rhs, size == rhs.size && memcmp(bytes, rhs.bytes, size) == 0);
-        return size == rhs.size && memcmp(bytes, rhs.bytes, size) == 0;
+    // Open addressing table of vertex numbers for reindex(), sized up front so that it never grows.
+    // Slots hold a vertex number + 1, or zero if empty.
+    class vertex_table {
+      dynarray<uint32_t> slots;
+      unsigned mask;
+    public:
+      vertex_table(unsigned num_vertices) {
+        unsigned size = 16;
+        while (size < num_vertices * 2) size *= 2;
+        slots.resize(size);
+        memset(slots.data(), 0, size * sizeof(uint32_t));
+        mask = size - 1;
       }
 
-      unsigned get_hash() const {
-        unsigned hash = 0;
-        for (unsigned i = 0; i != size; ++i) {
-          hash = ( hash * 7 ) + ( hash >> 13 ) + bytes[i];
-          //printf("%02x ", bytes[i]);
+      // return the first vertex added with the same bytes as v, adding v if there is none.
+      uint32_t find_or_add(uint32_t v, const uint32_t *hashes, const uint8_t *vertices, unsigned stride) {
+        for (unsigned i = hashes[v] & mask; ; i = (i + 1) & mask) {
+          uint32_t slot = slots[i];
+          if (slot == 0) {
+            slots[i] = v + 1;
+            return v;
+          }
+          uint32_t u = slot - 1;
+          if (hashes[u] == hashes[v] && !memcmp(vertices + u * stride, vertices + v * stride, stride)) {
+            return u;
+          }
         }
-        //printf("%d hash=%08x\n", size, hash_map_cmp::fuzz_hash(hash));
-        return hash;
       }
     };
 
-    class vertex_cmp : public hash_map_cmp {
-    public:
-      static unsigned get_hash(const general_vertex &key) { return fuzz_hash(key.get_hash()); }
-      static bool is_empty(const general_vertex &key) { return key.is_empty(); }
-    };
-
     // add a new edge to a hash map. (index, index) -> (triangle+1, triangle+1)
     static void add_edge(dynarray<edge> &edges, unsigned tri_idx, unsigned i0, unsigned i1) {
       edge e = { std::min(i0, i1), std::max(i0, i1), tri_idx, ~0 };
@@ -106,6 +128,31 @@ namespace octet { namespace scene {
       return dot(normal, dir) <= 0;
     }
 
+    // intersect org + dir * t with a triangle, returning barycentric coordinates and t.
+    // working relative to the first vertex rather than the ray origin avoids losing precision
+    // when the ray starts a long way from the triangle.
+    static bool ray_triangle(vec3_in org, vec3_in dir, const vec3p *tri, vec3 &bary, float &t) {
+      vec3 a = tri[0];
+      vec3 e1 = (vec3)tri[1] - a;
+      vec3 e2 = (vec3)tri[2] - a;
+      vec3 p = cross(dir, e2);
+      float det = dot(e1, p);
+      if (det == 0) return false;
+
+      float inv_det = 1.0f / det;
+      vec3 s = org - a;
+      float u = dot(s, p) * inv_det;
+      if (u < 0 || u > 1) return false;
+
+      vec3 q = cross(s, e1);
+      float v = dot(dir, q) * inv_det;
+      if (v < 0 || u + v > 1) return false;
+
+      t = dot(e2, q) * inv_det;
+      bary = vec3(1 - u - v, u, v);
+      return t >= 0;
+    }
+
     /// Get a vec4 value of an attribute.
     vec4 get_value(const uint8_t *bytes, unsigned slot, unsigned index) const {
       unsigned size = get_size(slot);
@@ -149,11 +196,11 @@ namespace octet { namespace scene {
     RESOURCE_META(mesh)
 
     /// make a new, empty, mesh.
-    mesh(skin *_skin=0) {
+    mesh(skin *_skin=0) : rays(0) {
       init(_skin, 0, 0);
     }
 
-    mesh(unsigned num_vertices, unsigned num_indices) {
+    mesh(unsigned num_vertices, unsigned num_indices) : rays(0) {
       init(0, num_vertices, num_indices);
     }
 
@@ -177,6 +224,33 @@ namespace octet { namespace scene {
       mode = rhs.mode;
 
       mesh_skin = rhs.mesh_skin;
+      rays = 0;
+    }
+
+    /// copy another mesh's parameters (eg. in indexer::update). Like the copy constructor,
+    /// this shares the vertices and indices but not the ray cache, which is rebuilt on demand.
+    mesh &operator=(const mesh &rhs) {
+      if (this == &rhs) return *this;
+      vertices = rhs.vertices;
+      indices = rhs.indices;
+
+      memcpy(format, rhs.format, sizeof(format));
+
+      num_indices = rhs.num_indices;
+      num_vertices = rhs.num_vertices;
+      first_index = rhs.first_index;
+      stride = rhs.stride;
+      mode = rhs.mode;
+      index_type = rhs.index_type;
+      normalized = rhs.normalized;
+
+      num_slots = rhs.num_slots;
+
+      mesh_skin = rhs.mesh_skin;
+      mesh_aabb = rhs.mesh_aabb;
+      delete rays;
+      rays = 0;
+      return *this;
     }
 
     /// Init function used for aggregated meshes.
@@ -199,6 +273,8 @@ namespace octet { namespace scene {
       mode = GL_TRIANGLES;
 
       mesh_skin = _skin;
+      delete rays;
+      rays = 0;
 
       if (max_vertices || max_indices) {
         set_default_attributes();
@@ -225,6 +301,7 @@ namespace octet { namespace scene {
 
     // Destructor
     ~mesh() {
+      delete rays;
     }
 
     /// Set the defuault mesh parameters, used for boxes, spheres etc.
@@ -382,22 +459,24 @@ namespace octet { namespace scene {
       virtual btCollisionShape *get_static_bullet_shape() {
         // note that it is your responsibility to deallocate resources!
         btIndexedMesh mesh;
+        size_t index_bytes = get_num_indices() * get_index_size();
         mesh.m_numTriangles = get_num_indices() / 3;
-        mesh.m_triangleIndexBase = (const unsigned char *)malloc(get_indices()->get_size());
-        mesh.m_triangleIndexStride = sizeof(uint32_t) * 3;
+        mesh.m_triangleIndexBase = (const unsigned char *)malloc(index_bytes);
+        mesh.m_triangleIndexStride = get_index_size() * 3;
+        mesh.m_indexType = get_index_type() == GL_UNSIGNED_SHORT ? PHY_SHORT : PHY_INTEGER;
         mesh.m_numVertices = get_num_vertices();
-        mesh.m_vertexBase = (const unsigned char *)malloc(get_vertices()->get_size());
-        mesh.m_vertexStride = get_stride();
-
-        {
+        mesh.m_vertexBase = (const unsigned char *)malloc(get_vertices()->get_size());
+        mesh.m_vertexStride = get_stride();
+
+        {
           gl_resource::rolock idx_lock(get_indices());
           gl_resource::rolock vtx_lock(get_vertices());
-          memcpy((void*)mesh.m_triangleIndexBase, idx_lock.u8() + get_index_size() * first_index, get_indices()->get_size());
+          memcpy((void*)mesh.m_triangleIndexBase, idx_lock.u8() + get_index_size() * first_index, index_bytes);
           memcpy((void*)mesh.m_vertexBase, vtx_lock.u8(), get_vertices()->get_size());
         }
 
         btTriangleIndexVertexArray *trimesh = new btTriangleIndexVertexArray();
-        trimesh->addIndexedMesh(mesh);
+        trimesh->addIndexedMesh(mesh, mesh.m_indexType);
         btBvhTriangleMeshShape *result = new btBvhTriangleMeshShape(trimesh, true);
         return result;
       }
@@ -427,6 +506,17 @@ namespace octet { namespace scene {
       return result;
     }
 
+    /// Get all the indices as 32 bit values, whatever the index type.
+    void get_indices_u32(dynarray<uint32_t> &result) {
+      unsigned ni = index_type ? get_num_indices() : 0;
+      result.resize(ni);
+      if (!ni) return;
+      gl_resource::rolock idx_lock(get_indices());
+      for (unsigned i = 0; i != ni; ++i) {
+        result[i] = get_index(idx_lock.u8(), i);
+      }
+    }
+
     /// Allocate VBO and IBO objects together.
     void allocate(size_t vsize, size_t isize) {
       vertices->allocate(GL_ARRAY_BUFFER, vsize);
@@ -531,94 +621,165 @@ namespace octet { namespace scene {
       for (unsigned i = 1; i < num_vertices; ++i) {
         vec3 pos = get_value(vtx_lock.u8(), slot, i).xyz();
         vmin = min(pos, vmin);
-        vmax = max(pos, vmin);
+        vmax = max(pos, vmax);
       }
       mesh_aabb = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
     }
 
-    /// *very* slow ray cast.
-    /// returns "barycentric" coordinates.
-    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
-    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
-    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+    /// The triangle that a ray hit.
+    struct ray_hit {
+      /// vertex indices of the triangle.
+      int indices[3];
+
+      /// barycentric coordinates of the hit. eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
+      vec3 bary;
+
+      /// hit pos = ray.get_start() + ray.get_distance() * t
+      float t;
+    };
+
+    /// Build the triangle bvh used by ray_cast if the vertices or indices have changed.
+    /// Returns false if this mesh can not be ray cast (it needs GL_TRIANGLES and float positions).
+    /// ray_cast calls this, but call it on the thread that owns the GL context before casting rays from other threads.
+    bool prepare_ray_cast() {
+      if (get_mode() != GL_TRIANGLES || !vertices) return false;
+      if (index_type && !indices) return false;
       unsigned pos_slot = get_slot(attribute_pos);
-      if (get_index_type() != GL_UNSIGNED_INT) return false;
+      if (pos_slot == ~0u) return false;
       if (get_size(pos_slot) < 3) return false;
       if (get_kind(pos_slot) != GL_FLOAT) return false;
 
-      vec3 org = the_ray.get_start();
-      vec3 dir = the_ray.get_distance();
-      //log("ray_cast: org=%s dir=%s\n", org.toString(), dir.toString());
+      if (
+        rays && (gl_resource*)rays->vertices == vertices && (gl_resource*)rays->indices == indices &&
+        rays->vertex_version == vertices->get_version() &&
+        (!indices || rays->index_version == indices->get_version()) &&
+        rays->num_indices == num_indices && rays->first_index == first_index &&
+        rays->stride == stride && rays->index_type == index_type && rays->pos_format == format[pos_slot]
+      ) {
+        return true;
+      }
 
-      unsigned pos_offset = get_offset(pos_slot);
-      gl_resource::rolock idx_lock(get_indices());
-      gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *idx = idx_lock.u32() + first_index;
-      const uint8_t *vtx = vtx_lock.u8();
-
-      float best_denom = 0;
-      vec4 best_numer(0, 0, 0, 0);
-      for (unsigned i = 0; i != get_num_indices(); i += 3) {
-        vec3 a = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+0]) - org;
-        vec3 b = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+1]) - org;
-        vec3 c = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+2]) - org;
-        vec3 d = dir;
-
-        // solve [ba, bb, bc, bd] * [[ax, ay, az, 1], [bx, by, bz, 1], [cx, cy, cz, 1], [-dx, -dy, -dz, 0]] = [0, 0, 0, 1]
-        //
-        // ie. ba + bb + bc = 1  and  ba * a + bb * b + bc * c = bd * d
-        //
-        // [ba, bb, bc] are barycentric coordinates, bd is the distance along the vector
-
-        // The last line of the inverse matrix is the solution (vector triple products)
-
-        // numerator
-        vec4 numer(
-          dot(cross(b, c), d),
-          dot(cross(c, a), d),
-          dot(cross(a, b), d),
-          dot(cross(a, b), c)
-        );
-
-        // denominator
-        float denom = numer[0] + numer[1] + numer[2];
-
-        //log("a=%s b=%s c=%s d=%s denom=%f\n", a.toString(), b.toString(), c.toString(), d.toString(), denom);
-        //log("numer=%s\n", numer.toString());
-        //log("res=%s\n", (numer / denom).toString());
-
-        // using a multiply lets us check the sign without using a divide.
-        vec4 bary2 = numer * denom;
-
-        if (all(bary2 >= vec4(0, 0, 0, 0))) {
-          rational best_distance(best_numer[3], best_denom);
-          rational new_distance(numer[3], denom);
-          /*printf(
-            "t%d %9.3f %d %d %d  %s %s %s\n",
-            i, numer[3]/denom, idx[i+0], idx[i+1], idx[i+2],
-            (numer/denom).toString(), best_distance.toString(), new_distance.toString()
-          );*/
-
-          unsigned further = new_distance > best_distance;
-          if (!further) {
-            indices[0] = idx[i+0];
-            indices[1] = idx[i+1];
-            indices[2] = idx[i+2];
-            best_numer = numer;
-            best_denom = denom;
+      if (!rays) rays = new ray_cache();
+      rays->vertices = vertices;
+      rays->indices = indices;
+      rays->vertex_version = vertices->get_version();
+      rays->index_version = indices ? indices->get_version() : 0;
+      rays->num_indices = num_indices;
+      rays->first_index = first_index;
+      rays->stride = stride;
+      rays->index_type = index_type;
+      rays->pos_format = format[pos_slot];
+
+      unsigned num_tris = (index_type ? num_indices : num_vertices) / 3;
+      rays->positions.resize(num_tris * 3);
+      rays->tri_indices.resize(num_tris * 3);
+      dynarray<aabb> bounds(num_tris);
+
+      {
+        unsigned pos_offset = get_offset(pos_slot);
+        gl_resource::rolock vtx_lock(get_vertices());
+        const uint8_t *vtx = vtx_lock.u8();
+        for (unsigned i = 0; i != num_tris * 3; ++i) {
+          rays->tri_indices[i] = i;
+        }
+        if (index_type) {
+          gl_resource::rolock idx_lock(get_indices());
+          for (unsigned i = 0; i != num_tris * 3; ++i) {
+            rays->tri_indices[i] = get_index(idx_lock.u8(), i);
           }
         }
+        for (unsigned tri = 0; tri != num_tris; ++tri) {
+          const uint32_t *ti = &rays->tri_indices[tri * 3];
+          vec3 a = *(const vec3p*)(vtx + pos_offset + stride * ti[0]);
+          vec3 b = *(const vec3p*)(vtx + pos_offset + stride * ti[1]);
+          vec3 c = *(const vec3p*)(vtx + pos_offset + stride * ti[2]);
+          rays->positions[tri * 3 + 0] = a;
+          rays->positions[tri * 3 + 1] = b;
+          rays->positions[tri * 3 + 2] = c;
+          vec3 vmin = min(min(a, b), c);
+          vec3 vmax = max(max(a, b), c);
+          bounds[tri] = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
+        }
       }
 
-      if (fabsf(best_denom) < 1e-6f) {
+      rays->tree.build(bounds.data(), num_tris);
+      return true;
+    }
+
+    /// Cast a ray in model space against the triangles using a cached bvh.
+    /// t_max limits the search along the ray; 1 is the end of the ray.
+    /// With any_hit, returns the first hit found rather than the nearest.
+    bool ray_cast(const ray &the_ray, ray_hit &result, float t_max = 1, bool any_hit = false) {
+      if (!prepare_ray_cast()) return false;
+
+      vec3 org = the_ray.get_start();
+      vec3 dir = the_ray.get_distance();
+      const vec3p *pos = rays->positions.data();
+      bool found = false;
+
+      rays->tree.ray_cast(org, dir, t_max, [&](unsigned tri, float &t_max) {
+        vec3 bary;
+        float t;
+        if (!ray_triangle(org, dir, pos + tri * 3, bary, t) || t > t_max) return false;
+        t_max = t;
+        const uint32_t *ti = &rays->tri_indices[tri * 3];
+        result.indices[0] = ti[0];
+        result.indices[1] = ti[1];
+        result.indices[2] = ti[2];
+        result.bary = bary;
+        result.t = t;
+        found = true;
+        return any_hit;
+      });
+
+      return found;
+    }
+
+    /// Cast a ray in model space and add every triangle it hits to "hits", in no particular order.
+    /// Returns the number of hits added.
+    unsigned ray_cast_all(const ray &the_ray, dynarray<ray_hit> &hits, float t_max = 1) {
+      if (!prepare_ray_cast()) return 0;
+
+      vec3 org = the_ray.get_start();
+      vec3 dir = the_ray.get_distance();
+      const vec3p *pos = rays->positions.data();
+      unsigned num_hits = 0;
+
+      rays->tree.ray_cast(org, dir, t_max, [&](unsigned tri, float &t_max) {
+        vec3 bary;
+        float t;
+        if (!ray_triangle(org, dir, pos + tri * 3, bary, t) || t > t_max) return false;
+        const uint32_t *ti = &rays->tri_indices[tri * 3];
+        ray_hit hit;
+        hit.indices[0] = ti[0];
+        hit.indices[1] = ti[1];
+        hit.indices[2] = ti[2];
+        hit.bary = bary;
+        hit.t = t;
+        hits.push_back(hit);
+        num_hits++;
+        return false;
+      });
+
+      return num_hits;
+    }
+
+    /// ray cast returning "barycentric" coordinates.
+    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
+    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
+    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+      ray_hit hit;
+      if (!ray_cast(the_ray, hit)) {
         bary_numer = vec4(0, 0, 0, 0);
         bary_denom = 0;
         return false;
-      } else {
-        bary_numer = best_numer;
-        bary_denom = best_denom;
-        return true;
       }
+      indices[0] = hit.indices[0];
+      indices[1] = hit.indices[1];
+      indices[2] = hit.indices[2];
+      bary_numer = vec4(hit.bary, hit.t);
+      bary_denom = 1;
+      return true;
     }
 
     /// access the vertex buffer (VBO) or memory buffer
@@ -667,25 +828,27 @@ namespace octet { namespace scene {
     /// Get all the edges in a hash map to avoid duplicates.
     /// record the triangle indices that they came from.
     void get_edges(dynarray<edge> &edges) {
-      if (get_index_type() != GL_UNSIGNED_INT) return;
+      edges.resize(0);
+      if (!get_index_type()) return;
 
-      gl_resource::rolock idx_lock(get_indices());
-      const uint32_t *ip = idx_lock.u32();
+      dynarray<uint32_t> idx;
+      get_indices_u32(idx);
+      const uint32_t *ip = idx.data();
 
-      edges.resize(0);
-      for (unsigned i = 0; i < get_num_indices(); i += 3) {
+      for (unsigned i = 0; i + 3 <= idx.size(); i += 3) {
         add_edge(edges, i, ip[i+0], ip[i+1]);
         add_edge(edges, i, ip[i+1], ip[i+2]);
         add_edge(edges, i, ip[i+2], ip[i+0]);
       }
 
+      if (edges.empty()) return;
       std::sort(edges.data(), edges.data() + edges.size());
 
       size_t dest = 0, src = 0;
       for (; src < edges.size()-1; ) {
         edge &e0 = edges[src];
         edge &e1 = edges[src+1];
-        if (dest != src && e0.idx0 == e1.idx0 && e0.idx1 == e1.idx1) {
+        if (e0.idx0 == e1.idx0 && e0.idx1 == e1.idx1) {
           // combine two similar edges.
           edge &ed = edges[dest++];
           ed = e0;
@@ -697,7 +860,7 @@ namespace octet { namespace scene {
         }
       }
 
-      if (src < edges.size()-1) {
+      if (src < edges.size()) {
         edges[dest++] = edges[src++];
       }
       edges.resize(dest);
@@ -713,7 +876,7 @@ namespace octet { namespace scene {
     ///   One triangle can be seen from the viewpoint, the other can't.
     void get_silhouette_edges(const vec3 &viewpoint, bool is_directional, dynarray<edge> &edges) {
       unsigned pos_slot = get_slot(attribute_pos);
-      if (get_index_type() != GL_UNSIGNED_INT) return;
+      if (!get_index_type()) return;
       if (get_size(pos_slot) < 3) return;
       if (get_kind(pos_slot) != GL_FLOAT) return;
 
@@ -721,9 +884,10 @@ namespace octet { namespace scene {
 
       get_edges(edges);
 
-      gl_resource::rolock idx_lock(get_indices());
+      dynarray<uint32_t> idx;
+      get_indices_u32(idx);
       gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *ip = idx_lock.u32() + first_index;
+      const uint32_t *ip = idx.data();
       const uint8_t *vp = vtx_lock.u8();
       unsigned stride = get_stride();
       
@@ -731,6 +895,7 @@ namespace octet { namespace scene {
       for (size_t i = 0; i != edges.size(); ++i) {
         const edge &edge = edges[i];
         if (
+          edge.tri1 < 0 ||
           tri_is_visible(
             edge.tri0, pos_offset, stride, ip, vp, viewpoint, is_directional
           ) != tri_is_visible(
@@ -747,12 +912,13 @@ namespace octet { namespace scene {
     /// If the vertices are outside [[-1,1], [-1,1], [-1,1]] then something is wrong!
     void dump_transformed(mat4t_in modelToProjection) {
       unsigned pos_offset = get_offset(get_slot(attribute_pos));
-      gl_resource::rolock idx_lock(get_indices());
+      dynarray<uint32_t> idx;
+      get_indices_u32(idx);
       gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *ip = idx_lock.u32();
+      const uint32_t *ip = idx.data();
       const uint8_t *vp = vtx_lock.u8();
       unsigned stride = get_stride();
-      for (unsigned i = 0; i != get_num_indices(); ++i) {
+      for (unsigned i = 0; i != idx.size(); ++i) {
         vec4 pos_in = vec4((vec3)*(const vec3p*)(vp + ip[i] * stride + pos_offset), 1.0f );
         vec4 pos_out = pos_in * modelToProjection;
         vec3 res = pos_out.perspectiveDivide();
@@ -767,79 +933,208 @@ namespace octet { namespace scene {
     /// Double the number of indices.
     void make_wireframe() {
       if (mode != GL_TRIANGLES) return;
-      if (index_type != GL_UNSIGNED_INT) return;
+      if (!index_type) return;
 
-      gl_resource::rolock idx_lock(get_indices());
-      const uint32_t *sip = idx_lock.u32();
+      dynarray<uint32_t> idx;
+      get_indices_u32(idx);
+      unsigned num_tri_indices = idx.size() / 3 * 3;
+      const uint32_t *sip = idx.data();
       gl_resource *new_indices = new gl_resource();
-      new_indices->allocate(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * get_num_indices() * 2);
-      gl_resource::wolock new_idx_lock(new_indices);
-      uint32_t *dip = new_idx_lock.u32();
-
-      for (unsigned i = 0; i < num_indices; i += 3) {
-        dip[0] = dip[5] = sip[0];
-        dip[2] = dip[1] = sip[1];
-        dip[4] = dip[3] = sip[2];
-        sip += 3;
-        dip += 6;
+      new_indices->allocate(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * num_tri_indices * 2);
+      {
+        gl_resource::wolock new_idx_lock(new_indices);
+        uint32_t *dip = new_idx_lock.u32();
+
+        for (unsigned i = 0; i < num_tri_indices; i += 3) {
+          dip[0] = dip[5] = sip[0];
+          dip[2] = dip[1] = sip[1];
+          dip[4] = dip[3] = sip[2];
+          sip += 3;
+          dip += 6;
+        }
       }
       set_indices(new_indices);
-      set_num_indices(get_num_indices() * 2);
+      set_index_type(GL_UNSIGNED_INT);
+      set_num_indices(num_tri_indices * 2);
+      set_first_index(0);
       set_mode(GL_LINES);
     }
 
-    /// re-index the mesh
+    /// Merge vertices with the same bytes and remove vertices that are not used.
+    /// Vertices are numbered in the order the indices first use them.
+    ///
+    /// Vertices are hashed on all threads, then each thread merges the vertices
+    /// whose hashes fall in its share of the hash range.
     void reindex() {
-      if (get_index_type() != GL_UNSIGNED_INT) return;
+      if (get_index_type() != GL_UNSIGNED_INT && get_index_type() != GL_UNSIGNED_SHORT) return;
 
-      hash_map<general_vertex, unsigned, vertex_cmp> vertex_to_index;
+      unsigned num_indices = get_num_indices();
+      unsigned num_vertices = get_num_vertices();
+      unsigned stride = get_stride();
+      if (!num_indices || !num_vertices || !stride) return;
 
+      dynarray<uint32_t> dest_indices(num_indices);
       dynarray<uint8_t> dest_vertices;
-      dynarray<uint32_t> dest_indices;
-      dest_indices.reserve(get_num_indices());
-
-      //The code below is inside a new scope { ... } with the purpose of be sure that outside the scope idx_lock will be deleted
-      //  why do we want to delete idx_lock? When the object is created it locks indices to read only, and we want to unlock it after using it
-      //  the unlocking of indices at the end of this scope will help us while trying to write to indices again
+      unsigned num_unique = 0;
       {
-        // This is the begining of a scope, every instance declared inside will be deleted at the end of the scope
         gl_resource::rolock idx_lock(get_indices());
         gl_resource::rolock vtx_lock(get_vertices());
-        const uint32_t *ip = idx_lock.u32();
         const uint8_t *vp = vtx_lock.u8();
 
-        unsigned stride = get_stride();
-        unsigned num_vertices = 0;
-        for (unsigned i = 0; i != get_num_indices(); ++i) {
-          uint32_t idx = ip[i];
-          general_vertex v = { vp + idx * stride, stride };
-          unsigned &e = vertex_to_index[v];
-          if (e == 0) { // hash_map inits to zero
-            // vertex is unique.
-            e = ++num_vertices;
-            unsigned old_size = dest_vertices.size();
-            dest_vertices.resize(old_size + stride);
-            memcpy(&dest_vertices[old_size], vp + idx * stride, stride);
+        // pass one: hash the vertices.
+        dynarray<uint32_t> hashes(num_vertices);
+        job::get_scheduler().parallel_for(0, num_vertices, 4096, [&](unsigned begin, unsigned end) {
+          for (unsigned v = begin; v != end; ++v) {
+            hashes[v] = hash_map_cmp::hash_bytes(vp + v * stride, stride);
+          }
+        });
+
+        // pass two: map each vertex to the first one with the same bytes.
+        // The top bits of the hash choose the part, the bottom bits the slot in its table.
+        unsigned num_parts = num_vertices < 16384 ? 1 : job::get_scheduler().get_num_threads() + 1;
+        dynarray<uint32_t> first_same(num_vertices);
+        job::get_scheduler().parallel_for(0, num_parts, 1, [&](unsigned begin, unsigned end) {
+          for (unsigned part = begin; part != end; ++part) {
+            unsigned part_size = 0;
+            for (unsigned v = 0; v != num_vertices; ++v) {
+              part_size += (unsigned)(((uint64_t)hashes[v] * num_parts) >> 32) == part;
+            }
+            vertex_table table(part_size);
+            for (unsigned v = 0; v != num_vertices; ++v) {
+              if ((unsigned)(((uint64_t)hashes[v] * num_parts) >> 32) == part) {
+                first_same[v] = table.find_or_add(v, hashes.data(), vp, stride);
+              }
+            }
+          }
+        });
+
+        // number the merged vertices in order of first use.
+        dynarray<uint32_t> remap(num_vertices);
+        dynarray<uint32_t> unique(num_vertices);
+        memset(remap.data(), 0xff, num_vertices * sizeof(uint32_t));
+        for (unsigned i = 0; i != num_indices; ++i) {
+          uint32_t v = get_index(idx_lock.u8(), i);
+          if (v >= num_vertices) return;
+          uint32_t &r = remap[first_same[v]];
+          if (r == ~0u) {
+            unique[num_unique] = first_same[v];
+            r = num_unique++;
           }
-          dest_indices.push_back(e - 1);
+          dest_indices[i] = r;
         }
+
+        if (num_unique == num_vertices) return;
+
+        dest_vertices.resize(num_unique * stride);
+        job::get_scheduler().parallel_for(0, num_unique, 4096, [&](unsigned begin, unsigned end) {
+          for (unsigned v = begin; v != end; ++v) {
+            memcpy(&dest_vertices[v * stride], vp + unique[v] * stride, stride);
+          }
+        });
       }
 
-      // This is the end of the scope, not the end of the reindex() function, hence idx_lock, vtx_lock... will be deleted at this point
-      //    and in the case of idx_lock (check gl_resources.h), it will unlock indices, letting us to write in it
+      // the buffers may be shared with other meshes, so make new ones.
+      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, dest_vertices.size());
+      vertices->assign(dest_vertices.data(), 0, dest_vertices.size());
+      set_vertices(vertices);
+      set_num_vertices(num_unique);
+
+      gl_resource *indices = 0;
+      if (get_index_type() == GL_UNSIGNED_SHORT) {
+        dynarray<uint16_t> short_indices(num_indices);
+        for (unsigned i = 0; i != num_indices; ++i) {
+          short_indices[i] = (uint16_t)dest_indices[i];
+        }
+        indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(uint16_t));
+        indices->assign(short_indices.data(), 0, num_indices * sizeof(uint16_t));
+      } else {
+        indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(uint32_t));
+        indices->assign(dest_indices.data(), 0, num_indices * sizeof(uint32_t));
+      }
+      set_indices(indices);
+      set_first_index(0);
+    }
 
-      // if we have fewer vertices now, update the index and vertices.
-      if (num_vertices != get_num_vertices()) {
-        unsigned isize = dest_indices.size() * sizeof(uint32_t);
-        unsigned vsize = dest_vertices.size() * sizeof(uint8_t);
-        gl_resource *indices = get_indices();
-        gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, vsize);
-        indices->assign(&dest_indices[0], 0, isize);
-        vertices->assign(&dest_vertices[0], 0, vsize);
+    /// Number of vertices transformed per triangle with a FIFO cache of cache_size vertices.
+    float get_acmr(unsigned cache_size=32) {
+      if (get_mode() != GL_TRIANGLES || !get_index_type() || !get_num_indices()) return 0;
 
-        set_vertices(vertices);
-        set_num_vertices(num_vertices);
+      dynarray<uint32_t> idx(get_num_indices());
+      {
+        gl_resource::rolock idx_lock(get_indices());
+        for (unsigned i = 0; i != get_num_indices(); ++i) {
+          idx[i] = get_index(idx_lock.u8(), i);
+        }
       }
+      return vertex_cache_optimizer::get_acmr(idx.data(), idx.size(), get_num_vertices(), cache_size);
+    }
+
+    /// Optimise an indexed triangle mesh for the GPU (see vertex_cache_optimizer).
+    /// Duplicate vertices are merged, triangles are reordered for the vertex cache and
+    /// vertices are renumbered in order of first use. If reduce_overdraw is true, clusters
+    /// of triangles that face outward are drawn first. Indices are 16 bit when there are few
+    /// enough vertices, unless short_indices is false and the mesh had 32 bit indices.
+    /// Returns false if this is not an indexed triangle mesh.
+    bool optimize(bool reduce_overdraw=false, bool short_indices=true) {
+      if (get_mode() != GL_TRIANGLES || !get_index_type() || !get_num_indices()) return false;
+
+      short_indices = short_indices || get_index_type() == GL_UNSIGNED_SHORT;
+      reindex();
+
+      unsigned num_vertices = get_num_vertices();
+      unsigned stride = get_stride();
+      dynarray<uint32_t> idx(get_num_indices() / 3 * 3);
+      dynarray<uint32_t> remap(num_vertices);
+      dynarray<uint8_t> dest_vertices;
+      unsigned num_used = 0;
+      {
+        gl_resource::rolock idx_lock(get_indices());
+        gl_resource::rolock vtx_lock(get_vertices());
+        for (unsigned i = 0; i != idx.size(); ++i) {
+          idx[i] = get_index(idx_lock.u8(), i);
+          if (idx[i] >= num_vertices) return false;
+        }
+
+        vertex_cache_optimizer::optimize_triangles(idx.data(), idx.size(), num_vertices);
+
+        unsigned pos_slot = get_slot(attribute_pos);
+        if (reduce_overdraw && pos_slot != ~0u && get_kind(pos_slot) == GL_FLOAT && get_size(pos_slot) >= 3) {
+          vertex_cache_optimizer::reduce_overdraw(idx.data(), idx.size(), num_vertices, vtx_lock.u8() + get_offset(pos_slot), stride);
+        }
+
+        num_used = vertex_cache_optimizer::reorder_vertices(remap.data(), idx.data(), idx.size(), num_vertices);
+        dest_vertices.resize(num_used * stride);
+        for (unsigned v = 0; v != num_vertices; ++v) {
+          if (remap[v] != ~0u) {
+            memcpy(&dest_vertices[remap[v] * stride], vtx_lock.u8() + v * stride, stride);
+          }
+        }
+      }
+
+      // the buffers may be shared with other meshes, so make new ones.
+      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, dest_vertices.size());
+      vertices->assign(dest_vertices.data(), 0, dest_vertices.size());
+      set_vertices(vertices);
+      set_num_vertices(num_used);
+
+      gl_resource *indices = 0;
+      if (short_indices && num_used <= 0x10000) {
+        dynarray<uint16_t> short_idx(idx.size());
+        for (unsigned i = 0; i != idx.size(); ++i) {
+          short_idx[i] = (uint16_t)idx[i];
+        }
+        indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, short_idx.size() * sizeof(uint16_t));
+        indices->assign(short_idx.data(), 0, short_idx.size() * sizeof(uint16_t));
+        set_index_type(GL_UNSIGNED_SHORT);
+      } else {
+        indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(uint32_t));
+        indices->assign(idx.data(), 0, idx.size() * sizeof(uint32_t));
+        set_index_type(GL_UNSIGNED_INT);
+      }
+      set_indices(indices);
+      set_num_indices(idx.size());
+      set_first_index(0);
+      return true;
     }
 
     /// Add a polygon to the mesh, appending vertices until the buffer size is exceeded.
@@ -1005,4 +1300,83 @@ namespace octet { namespace scene {
       shape.get_geometry(sink_, steps);
     }
   };
+
+  #if OCTET_UNIT_TEST
+    class mesh_unit_test {
+      // a grid of quads where every triangle has its own three vertices.
+      template <class index_t> static void test_reindex() {
+        enum { n = 8 };
+        dynarray<mesh::vertex> vertices;
+        dynarray<index_t> indices;
+        for (unsigned z = 0; z != n; ++z) {
+          for (unsigned x = 0; x != n; ++x) {
+            static const unsigned corners[6] = { 0, 2, 1, 1, 2, 3 };
+            for (unsigned i = 0; i != 6; ++i) {
+              vec3 pos((float)(x + (corners[i] & 1)), 0, (float)(z + (corners[i] >> 1)));
+              indices.push_back((index_t)vertices.size());
+              vertices.push_back(mesh::vertex(pos, vec3(0, 1, 0), pos * (1.0f / n)));
+            }
+          }
+        }
+
+        ref<mesh> msh = new mesh();
+        msh->set_default_attributes();
+        msh->set_vertices(vertices);
+        msh->set_indices(indices);
+        msh->reindex();
+
+        // shared corners are merged, the index type is kept and each index still finds the same vertex.
+        assert(msh->get_num_vertices() == (n + 1) * (n + 1));
+        assert(msh->get_index_type() == (sizeof(index_t) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT));
+        dynarray<uint32_t> idx;
+        msh->get_indices_u32(idx);
+        assert(idx.size() == indices.size());
+        {
+          gl_resource::rolock vtx_lock(msh->get_vertices());
+          const mesh::vertex *vp = (const mesh::vertex *)vtx_lock.u8();
+          for (unsigned i = 0; i != idx.size(); ++i) {
+            assert(idx[i] < msh->get_num_vertices());
+            assert(!memcmp(&vp[idx[i]], &vertices[indices[i]], sizeof(mesh::vertex)));
+          }
+        }
+
+        // assigning a mesh (as indexer::update does) must not share its ray cache.
+        ray down(vec3(2.5f, 1, 3.5f), vec3(2.5f, -1, 3.5f));
+        mesh::ray_hit hit;
+        assert(msh->ray_cast(down, hit) && hit.t > 0.49f && hit.t < 0.51f);
+        ref<mesh> copy = new mesh();
+        *copy = *msh;
+        copy->reindex();
+        assert(copy->ray_cast(down, hit) && msh->ray_cast(down, hit));
+        copy = 0;
+        assert(msh->ray_cast(down, hit));
+
+        // optimize keeps the index type when asked for 32 bits and otherwise uses 16 bits.
+        ref<mesh> opt = new mesh();
+        *opt = *msh;
+        assert(opt->optimize(false, false));
+        assert(opt->get_index_type() == msh->get_index_type());
+        assert(opt->optimize());
+        assert(opt->get_index_type() == GL_UNSIGNED_SHORT && opt->get_num_indices() == indices.size());
+        assert(opt->ray_cast(down, hit) && hit.t > 0.49f && hit.t < 0.51f);
+      }
+
+    public:
+      mesh_unit_test() {
+        test_reindex<uint16_t>();
+        test_reindex<uint32_t>();
+
+        // mesh_builder meshes are optimized and stay 16 bit.
+        mesh_builder builder;
+        builder.init();
+        builder.add_sphere(1, 16, 8);
+        ref<mesh> sphere = new mesh();
+        builder.get_mesh(*sphere);
+        assert(sphere->get_index_type() == GL_UNSIGNED_SHORT);
+        mesh::ray_hit hit;
+        assert(sphere->ray_cast(ray(vec3(0, 0, 5), vec3(0, 0, -5)), hit) && hit.t > 0.39f && hit.t < 0.41f);
+      }
+    };
+    static mesh_unit_test mesh_unit_test;
+  #endif
 }}
@@ -11,7 +11,7 @@ namespace octet { namespace scene {
   /// Instance of a mesh in a game world; node, mesh, material and skin.
   class mesh_instance : public resource {
   public:
-    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2 };
+    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2, flag_no_cull = 1 << 3, flag_cpu_skinning = 1 << 4 };
 
   private:
     // which scene_node (model to world matrix) to use in the scene
@@ -35,6 +35,9 @@ namespace octet { namespace scene {
     // if the object is further than this from the camera, do not draw.
     float max_draw_distance;
 
+    // for CPU skinning, the skinned copy of the mesh.
+    ref<skin_deformer> deformer;
+
   public:
     RESOURCE_META(mesh_instance)
 
@@ -150,6 +153,15 @@ namespace octet { namespace scene {
 
     /// Set the flags for this instance.
     void set_max_draw_distance(float value) { max_draw_distance = value; }
+
+    /// Skin the mesh on the CPU with a palette from skeleton::calc_transforms and return the skinned copy.
+    /// Returns NULL if the mesh can not be skinned on the CPU.
+    mesh *deform(const mat4t *palette, unsigned num_bones) {
+      if (!deformer || deformer->get_source() != msh) {
+        deformer = new skin_deformer(msh);
+      }
+      return deformer->deform(palette, num_bones) ? deformer->get_result() : NULL;
+    }
   };
 }}
 
@@ -29,12 +29,16 @@ namespace octet { namespace scene {
     };
 
     /// trail-like particle, tyre streaks, missile trails, lasers, volumetric lights, hair etc.
-    /// link points to previous particle in trail.
+    /// link points to previous particle in trail (-1 for the first).
+    /// axis is the half-width of the ribbon in world space; if it is zero,
+    /// the ribbon faces the camera and is size wide either side.
     struct trail_particle : particle {
       vec3p axis;
       float size;
       vec2p uv_top;
       vec2p uv_bottom;
+      bool enabled;
+      trail_particle() {}
     };
 
     /// cloth-like particle
@@ -57,6 +61,10 @@ namespace octet { namespace scene {
 
     /// animator for cloth particles
     /// left, bottom link to other particle animators
+    /// In add_cloth(), mass is the mass of each particle, spacing the rest distance to the
+    /// neighbours in x and y (zero to use the starting distance) and spacing_stiffness and
+    /// angle_stiffness (0 to 1) how hard neighbours and next-but-one neighbours,
+    /// which resist folding, are pulled back to their spacing on each iteration.
     struct cloth_particle_animator : particle_animator {
       int left;
       int bottom;
@@ -73,8 +81,35 @@ namespace octet { namespace scene {
       sphere geom;
     };
   private:
+    // animated billboards are kept as a structure of arrays so that animate() can move four at once.
+    // A dead particle is replaced by the last one (swap and pop), so the arrays stay packed.
+    enum {
+      soa_pos_x, soa_pos_y, soa_pos_z,
+      soa_vel_x, soa_vel_y, soa_vel_z,
+      soa_acc_x, soa_acc_y, soa_acc_z,
+      soa_spin,
+      soa_size_x, soa_size_y,
+      soa_uv_left, soa_uv_bottom, soa_uv_right, soa_uv_top,
+      num_float_streams
+    };
+
+    enum { soa_angle, soa_age, soa_lifetime, soa_handle, num_int_streams };
+
+    // particles per job in animate() and update().
+    enum { block_size = 4096 };
+
+    // num_float_streams arrays of soa_capacity floats, then the same for the integers.
+    dynarray<float> float_streams;
+    dynarray<uint32_t> int_streams;
+    unsigned num_animated;
+    unsigned soa_capacity;
+
+    // handles to animated billboards, which move when others die.
+    // A live handle holds the billboard's index, a free one -2 - the next free handle.
+    dynarray<int> animated_index;
+    int free_animated_handle;
 
-    // POD (plain-old-data) structure dynarray of camera-facing particles
+    // POD (plain-old-data) structure dynarray of camera-facing particles that do not move.
     dynarray<billboard_particle> billboard_particles;
     int free_billboard_particle;
 
@@ -82,26 +117,468 @@ namespace octet { namespace scene {
     dynarray<trail_particle> trail_particles;
     int free_trail_particle;
 
-    // POD structure dynarray of animators for particles.
-    dynarray<particle_animator> particle_animators;
-    int free_particle_animator;
+    // a rectangular patch of cloth, kept as a structure of arrays.
+    // Particle (x, y) is at index x + y * num_x. An inverse mass of zero pins a particle.
+    class cloth_patch : public resource {
+    public:
+      enum {
+        cloth_pos_x, cloth_pos_y, cloth_pos_z,
+        cloth_old_x, cloth_old_y, cloth_old_z,
+        cloth_inv_mass, cloth_u, cloth_v,
+        num_cloth_streams
+      };
+
+      unsigned num_x;
+      unsigned num_y;
+      unsigned num_particles;
+      dynarray<float> streams;
+
+      // scratch space for the constraint solver and the normals, three arrays of pad + num_particles.
+      // The first pad floats of each are always zero, so that c[i - offset] can be read for any i.
+      dynarray<float> scratch;
+      unsigned pad;
+
+      vec3 acceleration;
+      float mass;
+      vec2 spacing;
+      vec2 spacing_stiffness;
+      vec2 angle_stiffness;
+
+      float *stream(unsigned i) { return streams.data() + i * num_particles; }
+      float *scratch_stream(unsigned i) { return scratch.data() + i * (pad + num_particles) + pad; }
+    };
+
+    dynarray<ref<cloth_patch> > cloth_patches;
+    dynarray<sphere_collider> sphere_colliders;
+    unsigned cloth_iterations;
+    float cloth_damping;
+
+    // number of quads the vertex buffer can hold.
+    unsigned max_quads;
 
     // camera matrix
     mat4t cameraToWorld;
 
+    float *fstream(unsigned i) { return float_streams.data() + i * soa_capacity; }
+    uint32_t *istream(unsigned i) { return int_streams.data() + i * soa_capacity; }
+
     void init(const aabb &size, int bbcap, int tpcap, int pacap) {
       set_default_attributes();
       set_aabb(size);
       billboard_particles.reserve(bbcap);
       trail_particles.reserve(tpcap);
-      particle_animators.reserve(pacap);
       free_billboard_particle = -1;
       free_trail_particle = -1;
-      free_particle_animator = -1;
 
-      unsigned vsize = (bbcap * 4 + tpcap * 2) * sizeof(vertex);
-      unsigned isize = (bbcap * 6 + tpcap * 6) * sizeof(uint32_t);
-      mesh::allocate(vsize, isize);
+      num_animated = soa_capacity = 0;
+      reserve_animated(pacap);
+      animated_index.reserve(pacap);
+      free_animated_handle = -1;
+
+      cloth_iterations = 8;
+      cloth_damping = 0.01f;
+
+      max_quads = 0;
+      reserve_quads(bbcap + pacap + tpcap / 2);
+    }
+
+    // make room for this many animated billboards.
+    void reserve_animated(unsigned capacity) {
+      if (capacity <= soa_capacity) return;
+      capacity = (capacity + 3) & ~3;
+      dynarray<float> new_floats(capacity * num_float_streams);
+      dynarray<uint32_t> new_ints(capacity * num_int_streams);
+      for (unsigned i = 0; i != num_float_streams; ++i) {
+        memcpy(new_floats.data() + i * capacity, fstream(i), num_animated * sizeof(float));
+      }
+      for (unsigned i = 0; i != num_int_streams; ++i) {
+        memcpy(new_ints.data() + i * capacity, istream(i), num_animated * sizeof(uint32_t));
+      }
+      float_streams = std::move(new_floats);
+      int_streams = std::move(new_ints);
+      soa_capacity = capacity;
+    }
+
+    // make the vertex buffer big enough for num_quads quads.
+    // The index buffer is the same two triangles for every quad, so we only write it here.
+    void reserve_quads(unsigned num_quads) {
+      if (num_quads <= max_quads) return;
+      unsigned new_max = max_quads ? max_quads : 256;
+      while (new_max < num_quads) new_max *= 2;
+      max_quads = new_max;
+
+      dynarray<uint32_t> idx(max_quads * 6);
+      for (unsigned i = 0; i != max_quads; ++i) {
+        uint32_t *dest = idx.data() + i * 6;
+        dest[0] = i * 4; dest[1] = i * 4 + 1; dest[2] = i * 4 + 2;
+        dest[3] = i * 4; dest[4] = i * 4 + 2; dest[5] = i * 4 + 3;
+      }
+
+      get_vertices()->allocate(GL_ARRAY_BUFFER, max_quads * 4 * sizeof(vertex), GL_DYNAMIC_DRAW);
+      get_indices()->allocate(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(uint32_t));
+      get_indices()->assign(idx.data(), 0, idx.size() * sizeof(uint32_t));
+    }
+
+    // move animated billboards [begin, end) one step. Returns the number that have died.
+    unsigned animate_range(unsigned begin, unsigned end, float time_step) {
+      float *pos[3] = { fstream(soa_pos_x), fstream(soa_pos_y), fstream(soa_pos_z) };
+      float *vel[3] = { fstream(soa_vel_x), fstream(soa_vel_y), fstream(soa_vel_z) };
+      const float *acc[3] = { fstream(soa_acc_x), fstream(soa_acc_y), fstream(soa_acc_z) };
+      const float *spin = fstream(soa_spin);
+      uint32_t *angle = istream(soa_angle);
+      uint32_t *age = istream(soa_age);
+      const uint32_t *lifetime = istream(soa_lifetime);
+      unsigned num_dead = 0;
+      unsigned i = begin;
+
+      #if OCTET_SSE
+        const __m128 t = _mm_set1_ps(time_step);
+        const __m128i one = _mm_set1_epi32(1), bias = _mm_set1_epi32((int)0x80000000);
+        const __m128 two31 = _mm_set1_ps(2147483648.0f);
+        for (; i + 4 <= end; i += 4) {
+          for (unsigned c = 0; c != 3; ++c) {
+            __m128 p = _mm_loadu_ps(pos[c] + i);
+            __m128 v = _mm_loadu_ps(vel[c] + i);
+            __m128 a = _mm_loadu_ps(acc[c] + i);
+            _mm_storeu_ps(pos[c] + i, _mm_add_ps(p, _mm_mul_ps(v, t)));
+            _mm_storeu_ps(vel[c] + i, _mm_add_ps(v, _mm_mul_ps(a, t)));
+          }
+          // unsigned float to int: take 2^31 off large turns and put it back in the top bit.
+          __m128 f = _mm_mul_ps(_mm_loadu_ps(spin + i), t);
+          __m128 big = _mm_cmpge_ps(f, two31);
+          __m128i turn = _mm_cvttps_epi32(_mm_sub_ps(f, _mm_and_ps(big, two31)));
+          turn = _mm_add_epi32(turn, _mm_and_si128(_mm_castps_si128(big), bias));
+          _mm_storeu_si128((__m128i*)(angle + i), _mm_add_epi32(_mm_loadu_si128((__m128i*)(angle + i)), turn));
+          __m128i new_age = _mm_add_epi32(_mm_loadu_si128((__m128i*)(age + i)), one);
+          _mm_storeu_si128((__m128i*)(age + i), new_age);
+          // unsigned age > lifetime
+          __m128i dead = _mm_cmpgt_epi32(_mm_xor_si128(new_age, bias), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(lifetime + i)), bias));
+          num_dead += pop_count(_mm_movemask_ps(_mm_castsi128_ps(dead)));
+        }
+      #endif
+
+      for (; i != end; ++i) {
+        for (unsigned c = 0; c != 3; ++c) {
+          pos[c][i] = pos[c][i] + vel[c][i] * time_step;
+          vel[c][i] = vel[c][i] + acc[c][i] * time_step;
+        }
+        angle[i] += (uint32_t)(spin[i] * time_step);
+        age[i]++;
+        num_dead += age[i] > lifetime[i];
+      }
+      return num_dead;
+    }
+
+    // write four vertices for each animated billboard in [begin, end).
+    void build_range(vertex *vtx, unsigned begin, unsigned end) {
+      const float *pos[3] = { fstream(soa_pos_x), fstream(soa_pos_y), fstream(soa_pos_z) };
+      const float *size_x = fstream(soa_size_x), *size_y = fstream(soa_size_y);
+      const float *left = fstream(soa_uv_left), *bottom = fstream(soa_uv_bottom);
+      const float *right = fstream(soa_uv_right), *top = fstream(soa_uv_top);
+      vec3 cx = cameraToWorld.x().xyz();
+      vec3 cy = cameraToWorld.y().xyz();
+      vec3p n = cameraToWorld.z().xyz();
+
+      for (unsigned i = begin; i != end; ++i) {
+        vec3 p(pos[0][i], pos[1][i], pos[2][i]);
+        vec3 dx = size_x[i] * cx;
+        vec3 dy = size_y[i] * cy;
+        vtx->pos = p - dx + dy; vtx->normal = n; vtx->uv = vec2p(left[i], top[i]); vtx++;
+        vtx->pos = p + dx + dy; vtx->normal = n; vtx->uv = vec2p(right[i], top[i]); vtx++;
+        vtx->pos = p + dx - dy; vtx->normal = n; vtx->uv = vec2p(right[i], bottom[i]); vtx++;
+        vtx->pos = p - dx - dy; vtx->normal = n; vtx->uv = vec2p(left[i], bottom[i]); vtx++;
+      }
+    }
+
+    // write a quad for each trail particle in [begin, end) joining it to the particle before.
+    // Particles without an enabled particle before get an empty quad.
+    void build_trails(vertex *vtx, unsigned begin, unsigned end) {
+      vec3 eye = cameraToWorld.w().xyz();
+      for (unsigned i = begin; i != end; ++i, vtx += 4) {
+        const trail_particle &p = trail_particles[i];
+        const trail_particle *prev = get_trail_prev(p);
+        if (!prev) {
+          memset(vtx, 0, sizeof(vertex) * 4);
+          continue;
+        }
+
+        vec3 pos = p.pos, prev_pos = prev->pos;
+        vec3 dir = pos - prev_pos;
+        const trail_particle *prev_prev = get_trail_prev(*prev);
+        vec3 prev_dir = prev_prev ? prev_pos - (vec3)prev_prev->pos : dir;
+        vec3 side = get_trail_side(p, dir, eye);
+        vec3 prev_side = get_trail_side(*prev, prev_dir, eye);
+        vec3 n = cross(side, dir);
+        n = squared(n) > 1e-20f ? normalize(n) : cameraToWorld.z().xyz();
+
+        vtx[0].pos = prev_pos - prev_side; vtx[0].normal = n; vtx[0].uv = prev->uv_bottom;
+        vtx[1].pos = prev_pos + prev_side; vtx[1].normal = n; vtx[1].uv = prev->uv_top;
+        vtx[2].pos = pos + side; vtx[2].normal = n; vtx[2].uv = p.uv_top;
+        vtx[3].pos = pos - side; vtx[3].normal = n; vtx[3].uv = p.uv_bottom;
+      }
+    }
+
+    const trail_particle *get_trail_prev(const trail_particle &p) const {
+      if (!p.enabled || p.link < 0 || p.link >= (int)trail_particles.size()) return 0;
+      const trail_particle &prev = trail_particles[p.link];
+      return prev.enabled ? &prev : 0;
+    }
+
+    // half-width of a trail at particle p going in direction dir.
+    static vec3 get_trail_side(const trail_particle &p, vec3_in dir, vec3_in eye) {
+      vec3 axis = p.axis;
+      if (squared(axis) != 0) return axis;
+      vec3 side = cross(dir, eye - (vec3)p.pos);
+      float len2 = squared(side);
+      return len2 > 1e-20f ? side * (p.size / sqrtf(len2)) : vec3(0, 0, 0);
+    }
+
+    // box around everything update() draws. Returns false if there is nothing to draw.
+    bool get_particle_bounds(aabb &result) {
+      vec3 lo(1e37f, 1e37f, 1e37f), hi(-1e37f, -1e37f, -1e37f);
+
+      for (unsigned i = 0; i != billboard_particles.size(); ++i) {
+        const billboard_particle &p = billboard_particles[i];
+        if (p.enabled) {
+          vec3 pos = p.pos;
+          vec2 size = p.size;
+          vec3 r(length(size));
+          lo = min(lo, pos - r);
+          hi = max(hi, pos + r);
+        }
+      }
+
+      if (num_animated) {
+        scoped_arena scope;
+        unsigned num_blocks = (num_animated + block_size - 1) / block_size;
+        dynarray<vec3, arena_allocator> block_lo(num_blocks), block_hi(num_blocks);
+        job::get_scheduler().parallel_for(0, num_blocks, 1, [&](unsigned begin, unsigned end) {
+          const float *pos[3] = { fstream(soa_pos_x), fstream(soa_pos_y), fstream(soa_pos_z) };
+          const float *size_x = fstream(soa_size_x), *size_y = fstream(soa_size_y);
+          for (unsigned b = begin; b != end; ++b) {
+            unsigned first = b * block_size;
+            unsigned last = first + block_size < num_animated ? first + block_size : num_animated;
+            float bmin[3] = { 1e37f, 1e37f, 1e37f }, bmax[3] = { -1e37f, -1e37f, -1e37f }, r2 = 0;
+            for (unsigned i = first; i != last; ++i) {
+              for (unsigned j = 0; j != 3; ++j) {
+                bmin[j] = pos[j][i] < bmin[j] ? pos[j][i] : bmin[j];
+                bmax[j] = pos[j][i] > bmax[j] ? pos[j][i] : bmax[j];
+              }
+              float s2 = size_x[i] * size_x[i] + size_y[i] * size_y[i];
+              r2 = s2 > r2 ? s2 : r2;
+            }
+            vec3 r(sqrtf(r2));
+            block_lo[b] = vec3(bmin[0], bmin[1], bmin[2]) - r;
+            block_hi[b] = vec3(bmax[0], bmax[1], bmax[2]) + r;
+          }
+        });
+        for (unsigned b = 0; b != num_blocks; ++b) {
+          lo = min(lo, block_lo[b]);
+          hi = max(hi, block_hi[b]);
+        }
+      }
+
+      for (unsigned i = 0; i != trail_particles.size(); ++i) {
+        const trail_particle &p = trail_particles[i];
+        if (p.enabled) {
+          vec3 pos = p.pos, axis = p.axis;
+          float len = length(axis);
+          vec3 r(len > p.size ? len : p.size);
+          lo = min(lo, pos - r);
+          hi = max(hi, pos + r);
+        }
+      }
+
+      for (unsigned c = 0; c != cloth_patches.size(); ++c) {
+        cloth_patch *cp = cloth_patches[c];
+        for (unsigned j = 0; j != 3; ++j) {
+          const float *pos = cp->stream(cloth_patch::cloth_pos_x + j);
+          for (unsigned i = 0; i != cp->num_particles; ++i) {
+            lo[j] = pos[i] < lo[j] ? pos[i] : lo[j];
+            hi[j] = pos[i] > hi[j] ? pos[i] : hi[j];
+          }
+        }
+      }
+
+      if (lo.x() > hi.x()) return false;
+      result = aabb((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+      return true;
+    }
+
+    // corrections for the cloth constraints between particles i and i + offset, i in [begin, end):
+    // c[i] = stiffness * (len - rest) / (len * (w[i] + w[i + offset])) * (p[i + offset] - p[i])
+    // where len = |p[i + offset] - p[i]| and w is the inverse mass.
+    static void cloth_corrections(float *const *c, const float *const *p, const float *w, unsigned begin, unsigned end, unsigned offset, float rest, float stiffness) {
+      unsigned i = begin;
+
+      #if OCTET_SSE
+        const __m128 r = _mm_set1_ps(rest), k = _mm_set1_ps(stiffness), zero = _mm_setzero_ps();
+        for (; i + 4 <= end; i += 4) {
+          __m128 dx = _mm_sub_ps(_mm_loadu_ps(p[0] + i + offset), _mm_loadu_ps(p[0] + i));
+          __m128 dy = _mm_sub_ps(_mm_loadu_ps(p[1] + i + offset), _mm_loadu_ps(p[1] + i));
+          __m128 dz = _mm_sub_ps(_mm_loadu_ps(p[2] + i + offset), _mm_loadu_ps(p[2] + i));
+          __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+          __m128 denom = _mm_mul_ps(len, _mm_add_ps(_mm_loadu_ps(w + i), _mm_loadu_ps(w + i + offset)));
+          // pinned pairs and coincident particles get no correction.
+          __m128 f = _mm_and_ps(_mm_cmpgt_ps(denom, zero), _mm_div_ps(_mm_mul_ps(k, _mm_sub_ps(len, r)), denom));
+          _mm_storeu_ps(c[0] + i, _mm_mul_ps(f, dx));
+          _mm_storeu_ps(c[1] + i, _mm_mul_ps(f, dy));
+          _mm_storeu_ps(c[2] + i, _mm_mul_ps(f, dz));
+        }
+      #endif
+
+      for (; i != end; ++i) {
+        float dx = p[0][i + offset] - p[0][i];
+        float dy = p[1][i + offset] - p[1][i];
+        float dz = p[2][i + offset] - p[2][i];
+        float len = sqrtf(dx * dx + dy * dy + dz * dz);
+        float denom = len * (w[i] + w[i + offset]);
+        float f = denom > 0 ? stiffness * (len - rest) / denom : 0;
+        c[0][i] = f * dx;
+        c[1][i] = f * dy;
+        c[2][i] = f * dz;
+      }
+    }
+
+    // one Jacobi pass over the constraints between particles offset apart.
+    // Every particle is in at most two of them, so the corrections are averaged.
+    static void solve_cloth_constraints(cloth_patch *cp, unsigned offset, bool along_rows, float rest, float stiffness) {
+      if (stiffness <= 0) return;
+      unsigned n = cp->num_particles;
+      float *p[3] = { cp->stream(cloth_patch::cloth_pos_x), cp->stream(cloth_patch::cloth_pos_y), cp->stream(cloth_patch::cloth_pos_z) };
+      float *c[3] = { cp->scratch_stream(0), cp->scratch_stream(1), cp->scratch_stream(2) };
+      const float *w = cp->stream(cloth_patch::cloth_inv_mass);
+
+      for (unsigned j = 0; j != 3; ++j) memset(c[j], 0, n * sizeof(float));
+      if (along_rows) {
+        // no constraints across the end of a row.
+        if (offset < cp->num_x) {
+          for (unsigned y = 0; y != cp->num_y; ++y) {
+            cloth_corrections(c, p, w, y * cp->num_x, (y + 1) * cp->num_x - offset, offset, rest, stiffness);
+          }
+        }
+      } else if (offset < n) {
+        cloth_corrections(c, p, w, 0, n - offset, offset, rest, stiffness);
+      }
+
+      for (unsigned j = 0; j != 3; ++j) {
+        float *pj = p[j];
+        const float *cj = c[j], *cj_before = c[j] - offset;
+        for (unsigned i = 0; i != n; ++i) {
+          pj[i] += 0.5f * w[i] * (cj[i] - cj_before[i]);
+        }
+      }
+    }
+
+    // Verlet step, constraint iterations and sphere collisions for one cloth patch.
+    void step_cloth(cloth_patch *cp, float time_step) {
+      unsigned n = cp->num_particles;
+      float *pos[3] = { cp->stream(cloth_patch::cloth_pos_x), cp->stream(cloth_patch::cloth_pos_y), cp->stream(cloth_patch::cloth_pos_z) };
+      float *old[3] = { cp->stream(cloth_patch::cloth_old_x), cp->stream(cloth_patch::cloth_old_y), cp->stream(cloth_patch::cloth_old_z) };
+      const float *w = cp->stream(cloth_patch::cloth_inv_mass);
+
+      float keep = 1.0f - cloth_damping;
+      for (unsigned j = 0; j != 3; ++j) {
+        float *p = pos[j], *o = old[j];
+        float a = cp->acceleration[j] * time_step * time_step;
+        for (unsigned i = 0; i != n; ++i) {
+          float new_pos = w[i] != 0 ? p[i] + (p[i] - o[i]) * keep + a : p[i];
+          o[i] = p[i];
+          p[i] = new_pos;
+        }
+      }
+
+      unsigned nx = cp->num_x;
+      for (unsigned iter = 0; iter != cloth_iterations; ++iter) {
+        solve_cloth_constraints(cp, 1, true, cp->spacing.x(), cp->spacing_stiffness.x());
+        solve_cloth_constraints(cp, nx, false, cp->spacing.y(), cp->spacing_stiffness.y());
+        solve_cloth_constraints(cp, 2, true, cp->spacing.x() * 2, cp->angle_stiffness.x());
+        solve_cloth_constraints(cp, nx * 2, false, cp->spacing.y() * 2, cp->angle_stiffness.y());
+      }
+
+      // push particles out of the spheres, bouncing and sliding by changing the old position.
+      for (unsigned s = 0; s != sphere_colliders.size(); ++s) {
+        const sphere_collider &col = sphere_colliders[s];
+        vec3 center = col.geom.get_center();
+        float radius = col.geom.get_radius();
+        for (unsigned i = 0; i != n; ++i) {
+          if (w[i] == 0) continue;
+          vec3 p(pos[0][i], pos[1][i], pos[2][i]);
+          vec3 d = p - center;
+          float dist2 = squared(d);
+          if (dist2 >= radius * radius || dist2 == 0) continue;
+          vec3 normal = d * (1.0f / sqrtf(dist2));
+          p = center + normal * radius;
+          vec3 vel = p - vec3(old[0][i], old[1][i], old[2][i]);
+          float vn = dot(vel, normal);
+          if (vn < 0) {
+            vec3 tangent = vel - normal * vn;
+            vel = tangent * (1.0f - col.friction) - normal * (vn * col.restitution);
+          }
+          vec3 o = p - vel;
+          for (unsigned j = 0; j != 3; ++j) {
+            pos[j][i] = p[j];
+            old[j][i] = o[j];
+          }
+        }
+      }
+    }
+
+    // write the quads of one cloth patch with normals from the neighbouring particles.
+    static void build_cloth(vertex *vtx, cloth_patch *cp) {
+      unsigned nx = cp->num_x, ny = cp->num_y;
+      const float *pos[3] = { cp->stream(cloth_patch::cloth_pos_x), cp->stream(cloth_patch::cloth_pos_y), cp->stream(cloth_patch::cloth_pos_z) };
+      const float *u = cp->stream(cloth_patch::cloth_u), *v = cp->stream(cloth_patch::cloth_v);
+      float *normal[3] = { cp->scratch_stream(0), cp->scratch_stream(1), cp->scratch_stream(2) };
+
+      for (unsigned y = 0; y != ny; ++y) {
+        unsigned y0 = y ? y - 1 : y, y1 = y + 1 != ny ? y + 1 : y;
+        for (unsigned x = 0; x != nx; ++x) {
+          unsigned x0 = x ? x - 1 : x, x1 = x + 1 != nx ? x + 1 : x;
+          unsigned ix0 = x0 + y * nx, ix1 = x1 + y * nx, iy0 = x + y0 * nx, iy1 = x + y1 * nx;
+          vec3 dx(pos[0][ix1] - pos[0][ix0], pos[1][ix1] - pos[1][ix0], pos[2][ix1] - pos[2][ix0]);
+          vec3 dy(pos[0][iy1] - pos[0][iy0], pos[1][iy1] - pos[1][iy0], pos[2][iy1] - pos[2][iy0]);
+          vec3 n = cross(dx, dy);
+          n = squared(n) > 1e-20f ? normalize(n) : vec3(0, 0, 1);
+          unsigned i = x + y * nx;
+          normal[0][i] = n.x(); normal[1][i] = n.y(); normal[2][i] = n.z();
+        }
+      }
+
+      static const unsigned corner[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+      for (unsigned y = 0; y + 1 < ny; ++y) {
+        for (unsigned x = 0; x + 1 < nx; ++x) {
+          for (unsigned k = 0; k != 4; ++k, ++vtx) {
+            unsigned i = (x + corner[k][0]) + (y + corner[k][1]) * nx;
+            vtx->pos = vec3(pos[0][i], pos[1][i], pos[2][i]);
+            vtx->normal = vec3(normal[0][i], normal[1][i], normal[2][i]);
+            vtx->uv = vec2(u[i], v[i]);
+          }
+        }
+      }
+    }
+
+    static unsigned get_num_cloth_quads(const cloth_patch *cp) {
+      return (cp->num_x - 1) * (cp->num_y - 1);
+    }
+
+    // remove animated billboards that have lived their lifetime, moving the last one into each gap.
+    void remove_dead(unsigned begin, unsigned end) {
+      uint32_t *age = istream(soa_age);
+      uint32_t *lifetime = istream(soa_lifetime);
+      for (unsigned i = begin; i < end && i < num_animated; ) {
+        if (age[i] > lifetime[i]) {
+          int handle = (int)istream(soa_handle)[i];
+          animated_index[handle] = -2 - free_animated_handle;
+          free_animated_handle = handle;
+          unsigned last = --num_animated;
+          for (unsigned s = 0; s != num_float_streams; ++s) fstream(s)[i] = fstream(s)[last];
+          for (unsigned s = 0; s != num_int_streams; ++s) istream(s)[i] = istream(s)[last];
+          if (i != last) animated_index[istream(soa_handle)[i]] = (int)i;
+        } else {
+          ++i;
+        }
+      }
     }
 
     // pool allocation of particles.
@@ -119,7 +596,7 @@ namespace octet { namespace scene {
 
     // return to pool
     template <class Type> void free(dynarray<Type> &array, int &free, int element) {
-      array[free].link = free;
+      array[element].link = free;
       free = element;
     }
 
@@ -127,27 +604,39 @@ namespace octet { namespace scene {
     RESOURCE_META(mesh_particle_system)
 
     /// Default constructor
+    /// bbcap and tpcap are the most billboards and trail particles that do not move,
+    /// pacap is the number of animated billboards to make room for (there can be more).
     mesh_particle_system(aabb_in size=aabb(vec3(0, 0, 0), vec3(1, 1, 1)), int bbcap=256, int tpcap=256, int pacap=256) {
       init(size, bbcap, tpcap, pacap);
     }
 
     /// Update the vertices for newtonian physics.
+    /// Animated billboards are moved on all threads, four at a time with SSE.
+    /// Billboards that have lived their lifetime are removed.
+    /// Cloth patches are stepped on all threads, one patch per job.
     void animate(float time_step) {
-      for (unsigned i = 0; i != particle_animators.size(); ++i) {
-        particle_animator &g = particle_animators[i];
-        if (g.link >= 0) {
-          billboard_particle &p = billboard_particles[g.link];
-          if (g.age >= g.lifetime) {
-            p.enabled = false;
-            free(billboard_particles, free_billboard_particle, g.link);
-            g.link = -1;
-            free(particle_animators, free_particle_animator, i);
-          } else {
-            p.pos = (vec3)p.pos + (vec3)g.vel * time_step;
-            g.vel = (vec3)g.vel + (vec3)g.acceleration * time_step;
-            p.angle += (uint32_t)(g.spin * time_step);
-            g.age++;
-          }
+      job::get_scheduler().parallel_for(0, cloth_patches.size(), 1, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          step_cloth(cloth_patches[i], time_step);
+        }
+      });
+
+      // per-frame scratch comes from this thread's arena.
+      scoped_arena scope;
+      unsigned num_blocks = (num_animated + block_size - 1) / block_size;
+      dynarray<unsigned, arena_allocator> num_dead(num_blocks);
+      job::get_scheduler().parallel_for(0, num_blocks, 1, [&](unsigned begin, unsigned end) {
+        for (unsigned b = begin; b != end; ++b) {
+          unsigned first = b * block_size;
+          unsigned last = first + block_size < num_animated ? first + block_size : num_animated;
+          num_dead[b] = animate_range(first, last, time_step);
+        }
+      });
+
+      // compact from the back, so that only dead particles or ones we have checked move.
+      for (unsigned b = num_blocks; b-- != 0; ) {
+        if (num_dead[b]) {
+          remove_dead(b * block_size, (b + 1) * block_size);
         }
       }
     }
@@ -157,18 +646,18 @@ namespace octet { namespace scene {
       cameraToWorld = mx;
     }
 
-    /// Generate mesh from particles
+    /// Generate mesh from particles and fit the mesh's box around them.
     virtual void update() {
-      //unsigned np = billboard_particles.size();
-      //unsigned vsize = billboard_particles.capacity() * sizeof(vertex) * 4;
-      //unsigned isize = billboard_particles.capacity() * sizeof(uint32_t) * 4;
+      unsigned num_cloth_quads = 0;
+      for (unsigned i = 0; i != cloth_patches.size(); ++i) {
+        num_cloth_quads += get_num_cloth_quads(cloth_patches[i]);
+      }
+      reserve_quads(billboard_particles.size() + num_animated + trail_particles.size() + num_cloth_quads);
 
       gl_resource::wolock vlock(get_vertices());
-      vertex *vtx = (vertex*)vlock.u8();
-      gl_resource::wolock ilock(get_indices());
-      uint32_t *idx = ilock.u32();
-      unsigned num_vertices = 0;
-      unsigned num_indices = 0;
+      vertex *base = (vertex*)vlock.u8();
+      vertex *vtx = base;
+      unsigned num_quads = 0;
 
       vec3 cx = cameraToWorld.x().xyz();
       vec3 cy = cameraToWorld.y().xyz();
@@ -188,20 +677,46 @@ namespace octet { namespace scene {
           vtx->pos = (vec3)p.pos + dx + dy; vtx->normal = n; vtx->uv = tr; vtx++;
           vtx->pos = (vec3)p.pos + dx - dy; vtx->normal = n; vtx->uv = br; vtx++;
           vtx->pos = (vec3)p.pos - dx - dy; vtx->normal = n; vtx->uv = bl; vtx++;
-          idx[0] = num_vertices; idx[1] = num_vertices+1; idx[2] = num_vertices+2;
-          idx[3] = num_vertices; idx[4] = num_vertices+2; idx[5] = num_vertices+3;
-          idx += 6;
-          num_vertices += 4;
-          num_indices += 6;
+          num_quads++;
+        }
+      }
+
+      // the rest are placed by quad number from the start of the buffer.
+      job::get_scheduler().parallel_for(0, num_animated, block_size, [&](unsigned begin, unsigned end) {
+        build_range(base + (num_quads + begin) * 4, begin, end);
+      });
+      num_quads += num_animated;
+
+      // one quad per trail particle, joining it to the one before.
+      job::get_scheduler().parallel_for(0, trail_particles.size(), block_size, [&](unsigned begin, unsigned end) {
+        build_trails(base + (num_quads + begin) * 4, begin, end);
+      });
+      num_quads += trail_particles.size();
+
+      scoped_arena scope;
+      dynarray<unsigned, arena_allocator> first_quad(cloth_patches.size());
+      for (unsigned i = 0; i != cloth_patches.size(); ++i) {
+        first_quad[i] = num_quads;
+        num_quads += get_num_cloth_quads(cloth_patches[i]);
+      }
+      job::get_scheduler().parallel_for(0, cloth_patches.size(), 1, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          build_cloth(base + first_quad[i] * 4, cloth_patches[i]);
         }
+      });
+
+      // the particles go where they like, so keep the box up to date for culling.
+      aabb bounds;
+      if (get_particle_bounds(bounds)) {
+        set_aabb(bounds);
       }
 
-      set_num_vertices(num_vertices);
-      set_num_indices(num_indices);
+      set_num_vertices(num_quads * 4);
+      set_num_indices(num_quads * 6);
       //dump(log("mesh\n"));
     }
 
-    /// Add a billboard particle. Returns -1 if capacity reached.
+    /// Add a billboard particle that does not move. Returns -1 if capacity reached.
     int add_billboard_particle(const billboard_particle &p) {
       int i = allocate(billboard_particles, free_billboard_particle);
       if (i != -1) {
@@ -210,16 +725,86 @@ namespace octet { namespace scene {
       return i;
     }
 
-    /// Add a particle animator. Returns -1 if capacity reached.
+    /// Add a billboard particle that moves with an animator (a.link is not used).
+    /// The particle is removed after a.lifetime calls to animate().
+    /// There is no limit on the number of these.
+    /// Returns a handle for get_particle_animator() which stays valid while the particle lives.
+    int add_billboard_particle(const billboard_particle &p, const particle_animator &a) {
+      if (num_animated == soa_capacity) {
+        reserve_animated(soa_capacity * 2 + 4);
+      }
+      unsigned i = num_animated++;
+      int handle = free_animated_handle;
+      if (handle != -1) {
+        free_animated_handle = -2 - animated_index[handle];
+      } else {
+        handle = (int)animated_index.size();
+        animated_index.push_back(0);
+      }
+      animated_index[handle] = (int)i;
+      istream(soa_handle)[i] = (uint32_t)handle;
+      vec3 pos = p.pos, vel = a.vel, acc = a.acceleration;
+      fstream(soa_pos_x)[i] = pos.x(); fstream(soa_pos_y)[i] = pos.y(); fstream(soa_pos_z)[i] = pos.z();
+      fstream(soa_vel_x)[i] = vel.x(); fstream(soa_vel_y)[i] = vel.y(); fstream(soa_vel_z)[i] = vel.z();
+      fstream(soa_acc_x)[i] = acc.x(); fstream(soa_acc_y)[i] = acc.y(); fstream(soa_acc_z)[i] = acc.z();
+      fstream(soa_spin)[i] = (float)a.spin;
+      vec2 size = p.size, bl = p.uv_bottom_left, tr = p.uv_top_right;
+      fstream(soa_size_x)[i] = size.x(); fstream(soa_size_y)[i] = size.y();
+      fstream(soa_uv_left)[i] = bl.x(); fstream(soa_uv_bottom)[i] = bl.y();
+      fstream(soa_uv_right)[i] = tr.x(); fstream(soa_uv_top)[i] = tr.y();
+      istream(soa_angle)[i] = p.angle;
+      istream(soa_age)[i] = a.age;
+      istream(soa_lifetime)[i] = a.lifetime;
+      return handle;
+    }
+
+    /// Add a particle animator to the billboard particle p.link.
+    /// The billboard becomes an animated billboard (see add_billboard_particle(p, a))
+    /// and its billboard index is no longer valid.
+    /// Returns the animator's handle, or -1 if there is no such billboard.
     int add_particle_animator(const particle_animator &p) {
-      int i = allocate(particle_animators, free_particle_animator);
-      if (i != -1) {
-        particle_animators[i] = p;
+      if (p.link < 0 || p.link >= (int)billboard_particles.size() || !billboard_particles[p.link].enabled) {
+        return -1;
       }
-      return i;
+      billboard_particle &bp = billboard_particles[p.link];
+      int handle = add_billboard_particle(bp, p);
+      bp.enabled = false;
+      free(billboard_particles, free_billboard_particle, p.link);
+      return handle;
+    }
+
+    /// True if the animated billboard with this handle has not yet died.
+    bool is_particle_animator_alive(int handle) const {
+      return handle >= 0 && handle < (int)animated_index.size() && animated_index[handle] >= 0;
+    }
+
+    /// Get the animator of a live animated billboard (link is the handle).
+    /// Animators are stored as separate arrays, so change them with set_particle_animator().
+    particle_animator get_particle_animator(int handle) {
+      unsigned i = (unsigned)animated_index[handle];
+      particle_animator a;
+      a.link = handle;
+      a.vel = vec3(fstream(soa_vel_x)[i], fstream(soa_vel_y)[i], fstream(soa_vel_z)[i]);
+      a.acceleration = vec3(fstream(soa_acc_x)[i], fstream(soa_acc_y)[i], fstream(soa_acc_z)[i]);
+      a.lifetime = istream(soa_lifetime)[i];
+      a.age = istream(soa_age)[i];
+      a.spin = (uint32_t)fstream(soa_spin)[i];
+      return a;
+    }
+
+    /// Change the animator of a live animated billboard (a.link is not used).
+    void set_particle_animator(int handle, const particle_animator &a) {
+      unsigned i = (unsigned)animated_index[handle];
+      vec3 vel = a.vel, acc = a.acceleration;
+      fstream(soa_vel_x)[i] = vel.x(); fstream(soa_vel_y)[i] = vel.y(); fstream(soa_vel_z)[i] = vel.z();
+      fstream(soa_acc_x)[i] = acc.x(); fstream(soa_acc_y)[i] = acc.y(); fstream(soa_acc_z)[i] = acc.z();
+      fstream(soa_spin)[i] = (float)a.spin;
+      istream(soa_lifetime)[i] = a.lifetime;
+      istream(soa_age)[i] = a.age;
     }
 
     /// Add a trail particle. Returns -1 if capacity reached.
+    /// To grow a trail, add a particle whose link is the last one added.
     int add_trail_particle(const trail_particle &p) {
       int i = allocate(trail_particles, free_trail_particle);
       if (i != -1) {
@@ -228,9 +813,109 @@ namespace octet { namespace scene {
       return i;
     }
 
+    /// Remove a trail particle, usually the oldest of a trail.
+    /// The index may be reused, so set the link of any particle pointing to it to -1.
+    void remove_trail_particle(int i) {
+      trail_particles[i].enabled = false;
+      free(trail_particles, free_trail_particle, i);
+    }
+
+    /// Add a patch of num_x by num_y cloth particles, starting at origin with
+    /// dx between particles in a row and dy between rows. Returns the index of the patch.
+    /// Texture coordinates go from (0, 0) at origin to (1, 1) at the far corner.
+    /// The particles of a patch are stepped by animate() and drawn as a grid of quads.
+    int add_cloth(const cloth_particle_animator &a, vec3_in origin, vec3_in dx, vec3_in dy, unsigned num_x, unsigned num_y) {
+      cloth_patch *cp = new cloth_patch();
+      cp->num_x = num_x < 2 ? 2 : num_x;
+      cp->num_y = num_y < 2 ? 2 : num_y;
+      cp->num_particles = cp->num_x * cp->num_y;
+      cp->streams.resize(cp->num_particles * cloth_patch::num_cloth_streams);
+      cp->pad = cp->num_x * 2;
+      cp->scratch.resize((cp->pad + cp->num_particles) * 3);
+      memset(cp->scratch.data(), 0, cp->scratch.size() * sizeof(float));
+
+      cp->acceleration = a.acceleration;
+      cp->mass = a.mass > 0 ? a.mass : 1.0f;
+      vec2 spacing = a.spacing;
+      cp->spacing = vec2(spacing.x() > 0 ? spacing.x() : length(dx), spacing.y() > 0 ? spacing.y() : length(dy));
+      cp->spacing_stiffness = a.spacing_stiffness;
+      cp->angle_stiffness = a.angle_stiffness;
+
+      for (unsigned y = 0; y != cp->num_y; ++y) {
+        for (unsigned x = 0; x != cp->num_x; ++x) {
+          unsigned i = x + y * cp->num_x;
+          vec3 pos = origin + dx * (float)x + dy * (float)y;
+          for (unsigned j = 0; j != 3; ++j) {
+            cp->stream(cloth_patch::cloth_pos_x + j)[i] = pos[j];
+            cp->stream(cloth_patch::cloth_old_x + j)[i] = pos[j];
+          }
+          cp->stream(cloth_patch::cloth_inv_mass)[i] = 1.0f / cp->mass;
+          cp->stream(cloth_patch::cloth_u)[i] = (float)x / (cp->num_x - 1);
+          cp->stream(cloth_patch::cloth_v)[i] = (float)y / (cp->num_y - 1);
+        }
+      }
+
+      cloth_patches.push_back(cp);
+      return (int)cloth_patches.size() - 1;
+    }
+
+    /// Pin a cloth particle in place (or free it). Pinned particles can be moved with set_cloth_pos().
+    void set_cloth_pinned(int patch, unsigned x, unsigned y, bool pinned) {
+      cloth_patch *cp = cloth_patches[patch];
+      cp->stream(cloth_patch::cloth_inv_mass)[x + y * cp->num_x] = pinned ? 0.0f : 1.0f / cp->mass;
+    }
+
+    /// Move a cloth particle without giving it any velocity.
+    void set_cloth_pos(int patch, unsigned x, unsigned y, vec3_in pos) {
+      cloth_patch *cp = cloth_patches[patch];
+      unsigned i = x + y * cp->num_x;
+      for (unsigned j = 0; j != 3; ++j) {
+        cp->stream(cloth_patch::cloth_pos_x + j)[i] = pos[j];
+        cp->stream(cloth_patch::cloth_old_x + j)[i] = pos[j];
+      }
+    }
+
+    /// Get a cloth particle. link and y_link are the indices in the patch
+    /// of the particles to the left and below, or -1 at the edges.
+    cloth_particle get_cloth_particle(int patch, unsigned x, unsigned y) {
+      cloth_patch *cp = cloth_patches[patch];
+      unsigned i = x + y * cp->num_x;
+      cloth_particle result;
+      result.link = x ? (int)i - 1 : -1;
+      result.y_link = y ? (int)(i - cp->num_x) : -1;
+      result.pos = vec3(cp->stream(cloth_patch::cloth_pos_x)[i], cp->stream(cloth_patch::cloth_pos_y)[i], cp->stream(cloth_patch::cloth_pos_z)[i]);
+      result.uv = vec2(cp->stream(cloth_patch::cloth_u)[i], cp->stream(cloth_patch::cloth_v)[i]);
+      return result;
+    }
+
+    /// Number of cloth patches.
+    unsigned get_num_cloth() const {
+      return cloth_patches.size();
+    }
+
+    /// Set the number of constraint iterations per animate() and the fraction
+    /// of cloth velocity lost each step.
+    void set_cloth_solver(unsigned iterations, float damping) {
+      cloth_iterations = iterations;
+      cloth_damping = damping;
+    }
+
+    /// Add a sphere that cloth particles can not get into. Returns the index of the collider.
+    int add_sphere_collider(const sphere_collider &c) {
+      sphere_colliders.push_back(c);
+      return (int)sphere_colliders.size() - 1;
+    }
+
+    /// Get a sphere collider, for example to move it.
+    sphere_collider &access_sphere_collider(int i) { return sphere_colliders[i]; }
+
+    /// Number of animated billboards alive.
+    unsigned get_num_animated() const {
+      return num_animated;
+    }
+
     billboard_particle &access_billboard_particle(int i) { return billboard_particles[i]; }
     trail_particle &access_trail_particle(int i) { return trail_particles[i]; }
-    particle_animator &access_particle_animator(int i) { return particle_animators[i]; }
 
     /// Serialise
     void visit(visitor &v) {
@@ -240,11 +925,83 @@ namespace octet { namespace scene {
       v.visit(free_billboard_particle);
       v.visit(trail_particles);
       v.visit(free_trail_particle);
-      v.visit(particle_animators);
-      v.visit(free_particle_animator);
       v.visit(cameraToWorld);
       */
     }
+
+    /// Print how many animated billboards and cloth particles animate() and update() handle per millisecond.
+    static void benchmark(unsigned num_particles = 200000) {
+      ref<mesh_particle_system> system = new mesh_particle_system(aabb(vec3(0, 0, 0), vec3(1, 1, 1)), 256, 256, num_particles);
+      random r;
+      billboard_particle p;
+      memset(&p, 0, sizeof(p));
+      p.size = vec2p(0.1f, 0.1f);
+      p.uv_top_right = vec2p(1, 1);
+      particle_animator a;
+      memset(&a, 0, sizeof(a));
+      a.acceleration = vec3p(0, -9.8f, 0);
+      for (unsigned i = 0; i != num_particles; ++i) {
+        a.vel = vec3p(r.get(-3.0f, 3.0f), r.get(5.0f, 15.0f), r.get(-3.0f, 3.0f));
+        a.lifetime = 1000000 + i;
+        a.spin = i;
+        system->add_billboard_particle(p, a);
+      }
+
+      mat4t cameraToWorld;
+      cameraToWorld.loadIdentity();
+      system->set_cameraToWorld(cameraToWorld);
+
+      enum { num_frames = 20 };
+      std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+      for (unsigned i = 0; i != num_frames; ++i) {
+        system->animate(1.0f/30);
+      }
+      std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+      for (unsigned i = 0; i != num_frames; ++i) {
+        system->update();
+      }
+      std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+
+      double animate_ms = std::chrono::duration<double>(t1 - t0).count() * 1e3 / num_frames;
+      double update_ms = std::chrono::duration<double>(t2 - t1).count() * 1e3 / num_frames;
+      printf("mesh_particle_system: %u particles, animate %.0f particles/ms, update %.0f particles/ms\n", num_particles, num_particles / animate_ms, num_particles / update_ms);
+
+      // sixteen 32x32 cloth patches hanging from their top rows over a sphere.
+      ref<mesh_particle_system> cloth = new mesh_particle_system();
+      cloth_particle_animator ca;
+      memset(&ca, 0, sizeof(ca));
+      ca.acceleration = vec3p(0, -9.8f, 0);
+      ca.mass = 1;
+      ca.spacing_stiffness = vec2p(1, 1);
+      ca.angle_stiffness = vec2p(0.2f, 0.2f);
+      for (unsigned i = 0; i != 16; ++i) {
+        int patch = cloth->add_cloth(ca, vec3((float)i * 4, 0, 0), vec3(0.1f, 0, 0), vec3(0, 0, 0.1f), 32, 32);
+        for (unsigned x = 0; x != 32; ++x) {
+          cloth->set_cloth_pinned(patch, x, 0, true);
+        }
+      }
+      sphere_collider sc;
+      sc.restitution = 0;
+      sc.friction = 0.5f;
+      sc.geom = sphere(vec3(1.5f, -2, 1.5f), 1);
+      cloth->add_sphere_collider(sc);
+      cloth->set_cameraToWorld(cameraToWorld);
+
+      t0 = std::chrono::high_resolution_clock::now();
+      for (unsigned i = 0; i != num_frames; ++i) {
+        cloth->animate(1.0f/30);
+      }
+      t1 = std::chrono::high_resolution_clock::now();
+      for (unsigned i = 0; i != num_frames; ++i) {
+        cloth->update();
+      }
+      t2 = std::chrono::high_resolution_clock::now();
+
+      unsigned num_cloth = 16 * 32 * 32;
+      animate_ms = std::chrono::duration<double>(t1 - t0).count() * 1e3 / num_frames;
+      update_ms = std::chrono::duration<double>(t2 - t1).count() * 1e3 / num_frames;
+      printf("mesh_particle_system: %u cloth particles, animate %.0f particles/ms, update %.0f particles/ms\n", num_cloth, num_cloth / animate_ms, num_cloth / update_ms);
+    }
   };
 }}
 
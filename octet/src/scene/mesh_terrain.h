@@ -12,6 +12,7 @@ namespace octet { namespace scene {
   public:
     /// override this to generate terrain.
     /// note: this doesn't need to be a heightfield.
+    /// vertex() is called from the worker threads, so it must not change shared state.
     struct geometry_source {
       virtual mesh::vertex vertex(vec3_in bb_min, vec3_in uv_min, vec3_in uv_delta, vec3_in pos) = 0;
     };
@@ -30,11 +31,11 @@ namespace octet { namespace scene {
     }
 
     // override the update function to draw different geometry.
+    // the vertices are made on all threads, so source.vertex() must be thread safe.
     void update() {
-      dynarray<mesh::vertex> vertices;
-      dynarray<uint32_t> indices;
-
-      vertices.reserve((dimensions.x()+1) * (dimensions.z()+1));
+      int dx = dimensions.x(), dz = dimensions.z();
+      dynarray<mesh::vertex> vertices((dx+1) * (dz+1));
+      dynarray<uint32_t> indices(dx * dz * 6);
 
       vec3 dimf = (vec3)(dimensions);
       aabb bb = get_aabb();
@@ -42,32 +43,88 @@ namespace octet { namespace scene {
       vec3 bb_delta = bb.get_half_extent() / dimf * 2.0f;
       vec3 uv_min = vec3(0);
       vec3 uv_delta = vec3(30.0f/dimf.x(), 30.0f/dimf.z(), 0);
-      for (int x = 0; x <= dimensions.x(); ++x) {
-        for (int z = 0; z <= dimensions.z(); ++z) {
-          vec3 xz = vec3((float)x, 0, (float)z) * bb_delta;
-          vertices.push_back(source.vertex(bb_min, uv_min, uv_delta, xz));
-        }
-      }
 
-      indices.reserve(dimensions.x() * dimensions.z() * 6);
+      // vertex (x, z) is at x*(dz+1) + z.
+      job::get_scheduler().parallel_for(0, dx + 1, 8, [&](unsigned begin, unsigned end) {
+        for (int x = (int)begin; x != (int)end; ++x) {
+          mesh::vertex *dest = vertices.data() + x * (dz+1);
+          for (int z = 0; z <= dz; ++z) {
+            vec3 xz = vec3((float)x, 0, (float)z) * bb_delta;
+            dest[z] = source.vertex(bb_min, uv_min, uv_delta, xz);
+          }
+        }
+      });
 
-      int stride = dimensions.x() + 1;
-      for (int x = 0; x < dimensions.x(); ++x) {
-        for (int z = 0; z < dimensions.z(); ++z) {
+      uint32_t *dest = indices.data();
+      int stride = dz + 1;
+      for (int z = 0; z < dz; ++z) {
+        for (int x = 0; x < dx; ++x) {
           // 01 11
           // 00 10
-          indices.push_back((x+0) + (z+0)*stride);
-          indices.push_back((x+0) + (z+1)*stride);
-          indices.push_back((x+1) + (z+0)*stride);
-          indices.push_back((x+1) + (z+0)*stride);
-          indices.push_back((x+0) + (z+1)*stride);
-          indices.push_back((x+1) + (z+1)*stride);
+          uint32_t v00 = x * stride + z;
+          dest[0] = v00;
+          dest[1] = dest[4] = v00 + stride;
+          dest[2] = dest[3] = v00 + 1;
+          dest[5] = v00 + stride + 1;
+          dest += 6;
         }
       }
 
       set_vertices(vertices);
       set_indices(indices);
     }
-  };
+  };
+
+  #if OCTET_UNIT_TEST
+    class mesh_terrain_unit_test {
+      // a flat terrain with uvs from the position.
+      struct flat : mesh_terrain::geometry_source {
+        mesh::vertex vertex(vec3_in bb_min, vec3_in uv_min, vec3_in uv_delta, vec3_in pos) {
+          vec3 uv = uv_min + vec3(pos.x(), pos.z(), 0) * uv_delta;
+          return mesh::vertex(bb_min + pos, vec3(0, 1, 0), uv);
+        }
+      };
+
+    public:
+      mesh_terrain_unit_test() {
+        flat source;
+        ref<mesh_terrain> terrain = new mesh_terrain(vec3(8, 1, 4), ivec3(8, 1, 4), source);
+        assert(terrain->get_num_vertices() == 9 * 5 && terrain->get_num_indices() == 8 * 4 * 6);
+
+        // vertex (x, z) is at x*5 + z, two units apart from -size to size.
+        {
+          gl_resource::rolock vtx_lock(terrain->get_vertices());
+          const mesh::vertex *vtx = (const mesh::vertex *)vtx_lock.u8();
+          for (unsigned x = 0; x != 9; ++x) {
+            for (unsigned z = 0; z != 5; ++z) {
+              vec3 pos = vtx[x * 5 + z].pos;
+              assert(pos.x() == x * 2.0f - 8 && pos.y() == -1 && pos.z() == z * 2.0f - 4);
+            }
+          }
+        }
+
+        // every triangle is wound the same way and every vertex is used.
+        dynarray<uint32_t> idx;
+        terrain->get_indices_u32(idx);
+        gl_resource::rolock vtx_lock(terrain->get_vertices());
+        const mesh::vertex *vtx = (const mesh::vertex *)vtx_lock.u8();
+        unsigned used[9 * 5] = {};
+        float winding = 0;
+        for (unsigned i = 0; i != idx.size(); i += 3) {
+          assert(idx[i] < 45 && idx[i+1] < 45 && idx[i+2] < 45);
+          vec3 a = vtx[idx[i]].pos, b = vtx[idx[i+1]].pos, c = vtx[idx[i+2]].pos;
+          float y = cross(b - a, c - a).y();
+          assert(y != 0 && (winding == 0 || (y > 0) == (winding > 0)));
+          winding = y;
+          used[idx[i]]++; used[idx[i+1]]++; used[idx[i+2]]++;
+        }
+        for (unsigned i = 0; i != 45; ++i) {
+          assert(used[i] != 0);
+        }
+      }
+    };
+
+    static mesh_terrain_unit_test mesh_terrain_unit_test;
+  #endif
 }}
 
@@ -0,0 +1,645 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Streaming terrain with level of detail.
+//
+
+namespace octet { namespace scene {
+  /// Terrain made of square tiles in a quadtree, for worlds too big for one vertex buffer.
+  ///
+  /// Every tile has the same number of vertices. Call update_view() once a frame: tiles near
+  /// the camera are split into four smaller tiles, so the detail falls off with distance,
+  /// and tiles outside the view frustum are skipped.
+  ///
+  /// Tiles are made from a mesh_terrain::geometry_source on the worker threads (see job).
+  /// A tile is only split when its visible children are ready, so there are never holes.
+  /// Tiles are cached and the least recently used are dropped when the cache is over budget.
+  ///
+  /// Only the tiles being drawn are in the vertex buffer, one slot each, and only tiles that
+  /// are new, moved or re-stitched are sent to the GPU, so the cost of a frame does not depend
+  /// on the size of the world.
+  ///
+  /// Where a tile meets a coarser one, its edge vertices between the coarser tile's vertices
+  /// are moved onto the coarser tile's edge so that there are no cracks.
+  ///
+  /// The source is called from several threads and must give the same vertex for the same position.
+  class mesh_terrain_lod : public mesh {
+  public:
+    typedef mesh_terrain::geometry_source geometry_source;
+
+  private:
+    enum { max_levels = 20 };
+
+    // the vertices of one cell of the quadtree, made on a worker thread.
+    class tile : public job {
+      mesh_terrain_lod *owner;
+    public:
+      // level 0 tiles are the roots.
+      unsigned level;
+      int x, z;
+
+      dynarray<mesh::vertex> vertices;
+      aabb bounds;
+
+      // frames this tile was last visited and drawn.
+      unsigned last_used;
+      unsigned drawn_frame;
+
+      // slot in the vertex buffer (-1 if not drawn), the stitch it was sent with and if it needs sending.
+      int slot;
+      unsigned stitch;
+      bool dirty;
+
+      // true once collect_tiles() has counted the tile in cache_bytes and dropped it from building.
+      bool collected;
+
+      tile(mesh_terrain_lod *owner, unsigned level, int x, int z) :
+        owner(owner), level(level), x(x), z(z), last_used(0), drawn_frame(0), slot(-1), stitch(0), dirty(false), collected(false)
+      {
+      }
+
+      void kernel() {
+        owner->build_tile(this);
+      }
+
+      bool is_built() {
+        return get_state() == state_done;
+      }
+
+      size_t get_bytes() const {
+        return sizeof(*this) + vertices.size() * sizeof(mesh::vertex);
+      }
+    };
+
+    // a tile that we would like to make, nearest first.
+    struct request {
+      unsigned level;
+      int x, z;
+      float distance;
+
+      bool operator<(const request &rhs) const {
+        return level != rhs.level ? level < rhs.level : distance < rhs.distance;
+      }
+    };
+
+    geometry_source &source;
+
+    // distance between vertices of the smallest tiles, and quads along the side of every tile.
+    float spacing;
+    unsigned tile_dim;
+    unsigned log2_tile_dim;
+
+    // level of the smallest tiles and number of root tiles.
+    unsigned max_level;
+    int num_roots_x;
+    int num_roots_z;
+
+    vec3 bb_min;
+    vec3 uv_min;
+    vec3 uv_delta;
+
+    // a tile is split when the camera is nearer than this many tile widths.
+    float lod_ratio;
+
+    size_t cache_budget;
+    size_t cache_bytes;
+    unsigned max_jobs;
+
+    hash_map<uint64_t, ref<tile> > tiles;
+    dynarray<tile*> roots;
+    dynarray<tile*> building;
+    dynarray<request> requests;
+
+    // the tile in each slot of the vertex buffer and the number of slots allocated.
+    dynarray<tile*> slot_tiles;
+    unsigned max_slots;
+
+    dynarray<tile*> drawn;
+    dynarray<mesh::vertex> scratch;
+    unsigned frame;
+    unsigned num_uploads;
+
+    static uint64_t get_key(unsigned level, int x, int z) {
+      return (uint64_t)level << 56 | (uint64_t)(uint32_t)x << 28 | (uint32_t)z;
+    }
+
+    tile *find_tile(unsigned level, int x, int z) {
+      int index = tiles.get_index(get_key(level, x, z));
+      return index >= 0 ? (tile*)tiles.get_value(index) : 0;
+    }
+
+    float get_tile_width(unsigned level) const {
+      return spacing * (float)(tile_dim << (max_level - level));
+    }
+
+    bool is_inside(unsigned level, int x, int z) const {
+      return x >= 0 && z >= 0 && x < (num_roots_x << level) && z < (num_roots_z << level);
+    }
+
+    // cell of a tile that is not made yet, with the height of its parent.
+    aabb get_cell_bounds(unsigned level, int x, int z, const aabb &parent) const {
+      float width = get_tile_width(level);
+      vec3 half(width * 0.5f, parent.get_half_extent().y(), width * 0.5f);
+      vec3 center = bb_min + vec3((float)x * width, 0, (float)z * width) + half;
+      return aabb(vec3(center.x(), parent.get_center().y(), center.z()), half);
+    }
+
+    static float get_distance(const aabb &bb, vec3_in pos) {
+      vec3 d = max((pos - bb.get_center()).abs() - bb.get_half_extent(), vec3(0, 0, 0));
+      return d.length();
+    }
+
+    static bool is_visible(const aabb &bb, const half_space *planes) {
+      if (!planes) return true;
+      for (unsigned i = 0; i != 6; ++i) {
+        if (!planes[i].intersects(bb)) return false;
+      }
+      return true;
+    }
+
+    // called on a worker thread. Sample positions come from integers so that neighbours match exactly.
+    void build_tile(tile *t) {
+      unsigned n = tile_dim, shift = max_level - t->level;
+      t->vertices.resize((n+1) * (n+1));
+      vec3 lo(1e37f, 1e37f, 1e37f), hi(-1e37f, -1e37f, -1e37f);
+      mesh::vertex *dest = t->vertices.data();
+      for (unsigned i = 0; i <= n; ++i) {
+        int gx = (t->x * (int)n + (int)i) << shift;
+        for (unsigned j = 0; j <= n; ++j) {
+          int gz = (t->z * (int)n + (int)j) << shift;
+          vec3 pos((float)gx * spacing, 0, (float)gz * spacing);
+          *dest = source.vertex(bb_min, uv_min, uv_delta, pos);
+          vec3 p = dest->pos;
+          lo = min(lo, p);
+          hi = max(hi, p);
+          ++dest;
+        }
+      }
+      t->bounds = aabb((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+    }
+
+    // index of vertex t along edge e (z=0, x=n, z=n, x=0).
+    unsigned get_edge_vertex(unsigned e, unsigned t) const {
+      unsigned n = tile_dim;
+      switch (e) {
+        case 0: return t * (n+1);
+        case 1: return n * (n+1) + t;
+        case 2: return t * (n+1) + n;
+        default: return t;
+      }
+    }
+
+    static mesh::vertex lerp_vertex(const mesh::vertex &a, const mesh::vertex &b, float f) {
+      vec3 pa = a.pos, pb = b.pos, na = a.normal, nb = b.normal;
+      vec2 ua = a.uv, ub = b.uv, uv = ua + (ub - ua) * f;
+      return mesh::vertex(pa + (pb - pa) * f, normalize(na + (nb - na) * f), vec3(uv.x(), uv.y(), 0));
+    }
+
+    // for each edge, log2 of the ratio of a drawn coarser neighbour's spacing to ours (4 bits per edge).
+    unsigned get_stitch(tile *t) {
+      static const int dx[] = { 0, 1, 0, -1 }, dz[] = { -1, 0, 1, 0 };
+      unsigned result = 0;
+      for (unsigned e = 0; e != 4; ++e) {
+        int x = t->x + dx[e], z = t->z + dz[e];
+        if (!is_inside(t->level, x, z)) continue;
+        tile *same = find_tile(t->level, x, z);
+        if (same && same->drawn_frame == frame) continue;
+        for (unsigned k = 1; k <= t->level; ++k) {
+          tile *coarser = find_tile(t->level - k, x >> k, z >> k);
+          if (coarser && coarser->drawn_frame == frame) {
+            result |= (k < log2_tile_dim ? k : log2_tile_dim) << (e * 4);
+            break;
+          }
+        }
+      }
+      return result;
+    }
+
+    // send a tile to its slot, with its edges stitched to any coarser neighbours.
+    void upload_tile(tile *t) {
+      scratch = t->vertices;
+      for (unsigned e = 0; e != 4; ++e) {
+        unsigned step = 1 << ((t->stitch >> (e * 4)) & 15);
+        for (unsigned first = 0; step != 1 && first != tile_dim; first += step) {
+          mesh::vertex a = scratch[get_edge_vertex(e, first)];
+          mesh::vertex b = scratch[get_edge_vertex(e, first + step)];
+          for (unsigned i = 1; i != step; ++i) {
+            scratch[get_edge_vertex(e, first + i)] = lerp_vertex(a, b, (float)i / step);
+          }
+        }
+      }
+      unsigned bytes = scratch.size() * sizeof(mesh::vertex);
+      get_vertices()->assign(scratch.data(), t->slot * bytes, bytes);
+      t->dirty = false;
+      num_uploads++;
+    }
+
+    // make new buffers with room for at least num_slots tiles; every tile is sent again.
+    void grow_buffers(unsigned num_slots) {
+      unsigned new_max = max_slots ? max_slots : 16;
+      while (new_max < num_slots) new_max *= 2;
+      max_slots = new_max;
+
+      unsigned n = tile_dim, num_vertices = (n+1) * (n+1);
+      dynarray<uint32_t> idx(max_slots * n * n * 6);
+      uint32_t *dest = idx.data();
+      for (unsigned s = 0; s != max_slots; ++s) {
+        // the same triangles as mesh_terrain. vertex (x, z) is at x*(n+1) + z.
+        for (unsigned z = 0; z != n; ++z) {
+          for (unsigned x = 0; x != n; ++x) {
+            uint32_t v00 = s * num_vertices + x * (n+1) + z;
+            dest[0] = v00;
+            dest[1] = dest[4] = v00 + (n+1);
+            dest[2] = dest[3] = v00 + 1;
+            dest[5] = v00 + (n+1) + 1;
+            dest += 6;
+          }
+        }
+      }
+
+      get_vertices()->allocate(GL_ARRAY_BUFFER, max_slots * num_vertices * sizeof(mesh::vertex), GL_DYNAMIC_DRAW);
+      get_indices()->allocate(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(uint32_t));
+      get_indices()->assign(idx.data(), 0, idx.size() * sizeof(uint32_t));
+      for (unsigned s = 0; s != slot_tiles.size(); ++s) {
+        slot_tiles[s]->dirty = true;
+      }
+    }
+
+    // draw this tile or its children. The tile is ready.
+    void select(tile *t, vec3_in camera, const half_space *planes) {
+      t->last_used = frame;
+      if (t->level < max_level && get_distance(t->bounds, camera) < lod_ratio * get_tile_width(t->level)) {
+        unsigned level = t->level + 1;
+        tile *kids[4];
+        bool ready = true;
+        for (unsigned i = 0; i != 4; ++i) {
+          int x = t->x * 2 + (i & 1), z = t->z * 2 + (i >> 1);
+          tile *kid = find_tile(level, x, z);
+          kids[i] = 0;
+          if (kid && kid->is_built()) {
+            if (is_visible(kid->bounds, planes)) {
+              kid->last_used = frame;
+              kids[i] = kid;
+            }
+          } else {
+            aabb guess = get_cell_bounds(level, x, z, t->bounds);
+            if (is_visible(guess, planes)) {
+              ready = false;
+              if (!kid) {
+                request r = { level, x, z, get_distance(guess, camera) };
+                requests.push_back(r);
+              }
+            }
+          }
+        }
+        if (ready) {
+          for (unsigned i = 0; i != 4; ++i) {
+            if (kids[i]) select(kids[i], camera, planes);
+          }
+          return;
+        }
+      }
+      t->drawn_frame = frame;
+      drawn.push_back(t);
+    }
+
+    // start making the most urgent tiles, keeping a few jobs per thread.
+    void submit_requests() {
+      std::sort(requests.data(), requests.data() + requests.size());
+      for (unsigned i = 0; i != requests.size() && building.size() < max_jobs; ++i) {
+        const request &r = requests[i];
+        tile *t = new tile(this, r.level, r.x, r.z);
+        t->last_used = frame;
+        tiles[get_key(r.level, r.x, r.z)] = t;
+        t->submit();
+        building.push_back(t);
+      }
+      requests.resize(0);
+    }
+
+    // count tiles that the workers have finished.
+    void collect_tiles() {
+      for (unsigned i = 0; i != building.size(); ) {
+        tile *t = building[i];
+        if (t->is_built()) {
+          cache_bytes += t->get_bytes();
+          t->collected = true;
+          building[i] = building.back();
+          building.pop_back();
+        } else {
+          ++i;
+        }
+      }
+    }
+
+    // give each drawn tile a slot, with the slots in one range, and send the tiles that changed.
+    void update_slots() {
+      for (unsigned i = 0; i != drawn.size(); ++i) {
+        tile *t = drawn[i];
+        unsigned stitch = get_stitch(t);
+        if (stitch != t->stitch) {
+          t->stitch = stitch;
+          t->dirty = true;
+        }
+      }
+
+      for (unsigned s = 0; s != slot_tiles.size(); ++s) {
+        tile *t = slot_tiles[s];
+        if (t && t->drawn_frame != frame) {
+          t->slot = -1;
+          slot_tiles[s] = 0;
+        }
+      }
+
+      unsigned hole = 0;
+      for (unsigned i = 0; i != drawn.size(); ++i) {
+        tile *t = drawn[i];
+        if (t->slot >= 0) continue;
+        while (hole != slot_tiles.size() && slot_tiles[hole]) ++hole;
+        if (hole == slot_tiles.size()) slot_tiles.push_back(0);
+        slot_tiles[hole] = t;
+        t->slot = (int)hole;
+        t->dirty = true;
+      }
+
+      // fill the remaining holes with tiles from the top.
+      for (unsigned s = 0; s != slot_tiles.size(); ) {
+        if (slot_tiles[s]) {
+          ++s;
+          continue;
+        }
+        tile *last = slot_tiles.back();
+        slot_tiles.pop_back();
+        if (last && s != slot_tiles.size()) {
+          slot_tiles[s] = last;
+          last->slot = (int)s;
+          last->dirty = true;
+        }
+      }
+
+      if (slot_tiles.size() > max_slots) {
+        grow_buffers(slot_tiles.size());
+      }
+
+      num_uploads = 0;
+      for (unsigned s = 0; s != slot_tiles.size(); ++s) {
+        if (slot_tiles[s]->dirty) upload_tile(slot_tiles[s]);
+      }
+
+      set_num_vertices(slot_tiles.size() * (tile_dim+1) * (tile_dim+1));
+      set_num_indices(slot_tiles.size() * tile_dim * tile_dim * 6);
+    }
+
+    // drop the least recently used tiles until the cache is within budget. Roots are kept.
+    // Tiles that finished after collect_tiles() are still in building and are not counted yet.
+    void evict_tiles() {
+      if (cache_bytes <= cache_budget) return;
+
+      struct by_last_used {
+        bool operator()(const tile *a, const tile *b) const { return a->last_used < b->last_used; }
+      };
+
+      dynarray<tile*> old;
+      for (unsigned i = 0; i != tiles.get_num_indices(); ++i) {
+        if (tiles.is_used(i)) {
+          tile *t = tiles.get_value(i);
+          if (t->level && t->last_used != frame && t->slot < 0 && t->collected) {
+            old.push_back(t);
+          }
+        }
+      }
+      std::sort(old.data(), old.data() + old.size(), by_last_used());
+
+      for (unsigned i = 0; i != old.size() && cache_bytes > cache_budget; ++i) {
+        tile *t = old[i];
+        cache_bytes -= t->get_bytes();
+        tiles.erase(get_key(t->level, t->x, t->z));
+      }
+    }
+
+  public:
+    /// Make a terrain centred on the origin with half-extent "size" and vertices "spacing" apart
+    /// at the finest level. tile_dim quads along each side of a tile (rounded up to a power of two).
+    /// The tiles cover the extent rounded up to a whole number of root tiles.
+    mesh_terrain_lod(vec3_in size, float spacing, geometry_source &source, unsigned tile_dim=32) :
+      mesh(), source(source), spacing(spacing)
+    {
+      set_default_attributes();
+
+      log2_tile_dim = 1;
+      while ((1u << log2_tile_dim) < tile_dim && log2_tile_dim < 8) log2_tile_dim++;
+      this->tile_dim = 1 << log2_tile_dim;
+
+      float extent = std::max(size.x(), size.z()) * 2.0f;
+      float finest = spacing * this->tile_dim;
+      max_level = 0;
+      while (max_level < max_levels && finest * (float)(2 << max_level) <= extent) max_level++;
+      float root_width = get_tile_width(0);
+      num_roots_x = std::max(1, (int)ceilf(size.x() * 2.0f / root_width));
+      num_roots_z = std::max(1, (int)ceilf(size.z() * 2.0f / root_width));
+
+      // the same texture scale as mesh_terrain with the same number of vertices.
+      bb_min = -size;
+      uv_min = vec3(0);
+      uv_delta = vec3(30.0f * spacing / (size.x() * 2.0f), 30.0f * spacing / (size.z() * 2.0f), 0);
+
+      lod_ratio = 2.0f;
+      cache_budget = 64 << 20;
+      cache_bytes = 0;
+      max_jobs = (job::get_scheduler().get_num_threads() + 1) * 2;
+      max_slots = 0;
+      frame = 0;
+      num_uploads = 0;
+
+      // the roots are always ready, so there is always something to draw.
+      for (int z = 0; z != num_roots_z; ++z) {
+        for (int x = 0; x != num_roots_x; ++x) {
+          tile *t = new tile(this, 0, x, z);
+          tiles[get_key(0, x, z)] = t;
+          roots.push_back(t);
+          t->submit();
+        }
+      }
+      aabb bb = aabb(vec3(0, 0, 0), size);
+      for (unsigned i = 0; i != roots.size(); ++i) {
+        roots[i]->wait();
+        roots[i]->collected = true;
+        cache_bytes += roots[i]->get_bytes();
+        bb = bb.get_union(roots[i]->bounds);
+      }
+      set_aabb(bb);
+    }
+
+    ~mesh_terrain_lod() {
+      // the workers may still be making tiles that point to us.
+      for (unsigned i = 0; i != building.size(); ++i) {
+        building[i]->wait();
+      }
+    }
+
+    /// Choose and send the tiles for a camera at camera_pos, skipping tiles outside the
+    /// six planes if there are any. Both are in the terrain's model space. Call once a frame.
+    void update_view(vec3_in camera_pos, const half_space *planes=0) {
+      frame++;
+      collect_tiles();
+
+      drawn.resize(0);
+      for (unsigned i = 0; i != roots.size(); ++i) {
+        if (is_visible(roots[i]->bounds, planes)) {
+          select(roots[i], camera_pos, planes);
+        }
+      }
+
+      submit_requests();
+      update_slots();
+      evict_tiles();
+
+      // finer tiles may poke out of the roots' box.
+      aabb bb = get_aabb();
+      for (unsigned i = 0; i != drawn.size(); ++i) {
+        bb = bb.get_union(drawn[i]->bounds);
+      }
+      set_aabb(bb);
+    }
+
+    /// Choose and send the tiles for a camera, with the terrain drawn with this modelToWorld.
+    /// Uses the camera matrices from the last frame's render.
+    void update_view(camera_instance *cam, mat4t_in modelToWorld) {
+      mat4t worldToModel = modelToWorld.inverse3x4();
+      vec3 camera_pos = cam->get_node()->calcModelToWorld().w().xyz() * worldToModel;
+
+      // for row vectors, dot(model * modelToWorld, plane) = dot(model, modelToWorld * plane).
+      half_space planes[6];
+      cam->get_frustum_planes(planes);
+      for (unsigned i = 0; i != 6; ++i) {
+        vec4 p = modelToWorld * vec4(planes[i].get_normal(), planes[i].get_offset());
+        planes[i] = half_space(p.xyz(), p.w());
+      }
+      update_view(camera_pos, planes);
+    }
+
+    /// Make room in the buffers for this many tiles. The buffers grow by doubling when they are full,
+    /// which sends every drawn tile again; reserve enough tiles to avoid that during play.
+    void reserve_tiles(unsigned num_tiles) {
+      if (num_tiles > max_slots) {
+        grow_buffers(num_tiles);
+        for (unsigned s = 0; s != slot_tiles.size(); ++s) {
+          upload_tile(slot_tiles[s]);
+        }
+      }
+    }
+
+    /// Split tiles when the camera is nearer than ratio tile widths (default 2).
+    void set_lod_ratio(float ratio) {
+      lod_ratio = ratio;
+    }
+
+    /// Keep about this many bytes of tiles (default 64MB). Tiles in use are never dropped.
+    void set_cache_budget(size_t bytes) {
+      cache_budget = bytes;
+    }
+
+    /// Number of tiles drawn by the last update_view().
+    unsigned get_num_drawn_tiles() const {
+      return drawn.size();
+    }
+
+    /// Number of tiles sent to the GPU by the last update_view().
+    unsigned get_num_uploads() const {
+      return num_uploads;
+    }
+
+    /// Number of tiles in the cache, including those being made.
+    unsigned get_num_cached_tiles() const {
+      return tiles.get_size();
+    }
+
+    /// Bytes used by the finished tiles in the cache.
+    size_t get_cache_bytes() const {
+      return cache_bytes;
+    }
+
+    /// Print the cost of update_view() while flying over a 16km square world.
+    static void benchmark(unsigned num_frames = 300) {
+      struct hills : geometry_source {
+        mesh::vertex vertex(vec3_in bb_min, vec3_in uv_min, vec3_in uv_delta, vec3_in pos) {
+          float y = 0, dy_dx = 0, dy_dz = 0, freq = 1.0f / 512, amp = 64;
+          for (unsigned i = 0; i != 6; ++i) {
+            y += sinf(pos.x() * freq) * cosf(pos.z() * freq) * amp;
+            dy_dx += cosf(pos.x() * freq) * cosf(pos.z() * freq) * amp * freq;
+            dy_dz -= sinf(pos.x() * freq) * sinf(pos.z() * freq) * amp * freq;
+            freq *= 2.1f;
+            amp *= 0.45f;
+          }
+          vec3 uv = uv_min + vec3(pos.x(), pos.z(), 0) * uv_delta;
+          return mesh::vertex(bb_min + pos + vec3(0, y, 0), normalize(vec3(-dy_dx, 1, -dy_dz)), uv);
+        }
+      };
+
+      hills source;
+      std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+      ref<mesh_terrain_lod> terrain = new mesh_terrain_lod(vec3(8192, 64, 8192), 1.0f, source);
+      terrain->reserve_tiles(512);
+      double init_ms = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count() * 1e3;
+
+      double total_ms = 0, worst_ms = 0;
+      unsigned uploads = 0;
+      for (unsigned i = 0; i != num_frames; ++i) {
+        // fly diagonally at 30m a frame, 100m up.
+        vec3 camera((float)i * 30.0f - 4000.0f, 100.0f, (float)i * 20.0f - 3000.0f);
+        std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+        terrain->update_view(camera);
+        double ms = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t1).count() * 1e3;
+        total_ms += ms;
+        worst_ms = ms > worst_ms ? ms : worst_ms;
+        uploads += terrain->get_num_uploads();
+
+        // let the workers finish, as they would during the rest of a frame.
+        job::get_scheduler().wait_all();
+      }
+      printf(
+        "mesh_terrain_lod: setup %.1f ms, update_view %.2f ms avg %.2f ms max, %u tiles drawn, %.1f uploads/frame, %u tiles cached (%.1f MB)\n",
+        init_ms, total_ms / num_frames, worst_ms, terrain->get_num_drawn_tiles(), (float)uploads / num_frames,
+        terrain->get_num_cached_tiles(), terrain->get_cache_bytes() / 1048576.0
+      );
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class mesh_terrain_lod_unit_test {
+      struct flat : mesh_terrain_lod::geometry_source {
+        mesh::vertex vertex(vec3_in bb_min, vec3_in uv_min, vec3_in uv_delta, vec3_in pos) {
+          vec3 uv = uv_min + vec3(pos.x(), pos.z(), 0) * uv_delta;
+          return mesh::vertex(bb_min + pos, vec3(0, 1, 0), uv);
+        }
+      };
+
+    public:
+      mesh_terrain_lod_unit_test() {
+        flat source;
+        ref<mesh_terrain_lod> terrain = new mesh_terrain_lod(vec3(256, 8, 256), 1.0f, source, 8);
+        unsigned most_drawn = 0;
+
+        // fly low across the terrain and then hover; the mesh always holds exactly the drawn tiles.
+        for (unsigned i = 0; i != 60; ++i) {
+          float t = i < 40 ? (float)i : 40.0f;
+          terrain->update_view(vec3(t * 12.0f - 240.0f, 4.0f, t * 6.0f - 120.0f));
+          unsigned drawn = terrain->get_num_drawn_tiles();
+          assert(drawn != 0);
+          assert(terrain->get_num_vertices() == drawn * 9 * 9);
+          assert(terrain->get_num_indices() == drawn * 8 * 8 * 6);
+          most_drawn = drawn > most_drawn ? drawn : most_drawn;
+          job::get_scheduler().wait_all();
+        }
+
+        // the tiles near the camera were split.
+        assert(most_drawn > 4);
+      }
+    };
+
+    static mesh_terrain_lod_unit_test mesh_terrain_lod_unit_test;
+  #endif
+}}
@@ -8,6 +8,9 @@
 //
 
 namespace octet { namespace scene {
+  /// Calls interface_t with a bit mask of the exposed faces in each row of voxels.
+  /// Bit x of each mask is the voxel at x. add_bottoms and add_backs get y-1 and z-1
+  /// for the voxel whose face it is.
   template <class interface_t, int dim> class mesh_iterate_faces : public interface_t {
   public:
     void iterate(const uint32_t *opaque) {
@@ -20,7 +23,7 @@ namespace octet { namespace scene {
       }
 
       for (int z = 0; z != dim; ++z) {
-        interface_t::add_bottoms( opaque[z*dim+0], 0, z );
+        interface_t::add_bottoms( opaque[z*dim+0], -1, z );
         for (int y = 0; y != dim-1; ++y) {
           uint32_t p00 = opaque[z*dim+y];
           uint32_t p01 = opaque[z*dim+(y+1)];
@@ -31,7 +34,7 @@ namespace octet { namespace scene {
       }
 
       for (int y = 0; y != dim; ++y) {
-        interface_t::add_backs( opaque[0*dim+y], y, 0 );
+        interface_t::add_backs( opaque[0*dim+y], y, -1 );
         for (int z = 0; z != dim-1; ++z) {
           uint32_t p00 = opaque[z*dim+y];
           uint32_t p10 = opaque[(z+1)*dim+y];
@@ -62,6 +65,7 @@ namespace octet { namespace scene {
     vec3 dy;
     vec3 dz;
     mesh::vertex *vtx;
+    // may be NULL if the indices are made elsewhere.
     uint32_t *idx;
     float voxel_size;
     unsigned num_faces;
@@ -79,11 +83,13 @@ namespace octet { namespace scene {
           vtx->pos = pos + du; vtx->normal = normal; vtx->uv = vec2p(1, 0); vtx++;
           vtx->pos = pos + du + dv; vtx->normal = normal; vtx->uv = vec2p(1, 1); vtx++;
           vtx->pos = pos + dv; vtx->normal = normal; vtx->uv = vec2p(0, 1); vtx++;
-          idx[0] = idx_val + 0;
-          idx[3] = idx[1] = idx_val + 1;
-          idx[5] = idx[2] = idx_val + 3;
-          idx[4] = idx_val + 2;
-          idx += 6;
+          if (idx) {
+            idx[0] = idx_val + 0;
+            idx[3] = idx[1] = idx_val + 1;
+            idx[5] = idx[2] = idx_val + 3;
+            idx[4] = idx_val + 2;
+            idx += 6;
+          }
           num_faces++;
           idx_val += 4;
         }
@@ -134,6 +140,136 @@ namespace octet { namespace scene {
     }
   };
 
+  /// Greedy meshing: joins the exposed faces of a 32x32x32 block into rectangles.
+  ///
+  /// A flat 32x32 wall is one quad instead of 1024. Use with mesh_iterate_faces to
+  /// collect the faces, then call finish() to add the quads to vertices, four vertices each.
+  /// The uvs count voxels, so textures repeat once per voxel as they do for single faces.
+  class face_greedy_adder {
+    enum { dim = 32 };
+
+    enum { left, right, bottom, top, back, front, num_dirs };
+
+    // exposed faces for each direction, one word per row of voxels: [z*dim+y], bit x.
+    uint32_t faces[num_dirs][dim*dim];
+
+    void add_quad(vec3_in base, vec3_in du, vec3_in dv, const vec3p &normal, float width, float height) {
+      vertices->resize(vertices->size() + 4);
+      mesh::vertex *vtx = vertices->data() + vertices->size() - 4;
+      vtx->pos = base; vtx->normal = normal; vtx->uv = vec2p(0, 0); vtx++;
+      vtx->pos = base + du; vtx->normal = normal; vtx->uv = vec2p(width, 0); vtx++;
+      vtx->pos = base + du + dv; vtx->normal = normal; vtx->uv = vec2p(width, height); vtx++;
+      vtx->pos = base + dv; vtx->normal = normal; vtx->uv = vec2p(0, height); vtx++;
+      num_faces++;
+    }
+
+    // turn rows of bits into rectangles. rows[i*stride] are the rows of one plane.
+    // calls emit(bit, num_bits, row, num_rows) for each rectangle, clearing the rows as it goes.
+    template <class emit_t> static void merge(uint32_t *rows, unsigned stride, const emit_t &emit) {
+      for (unsigned r0 = 0; r0 != dim; ++r0) {
+        uint32_t bits = rows[r0 * stride];
+        while (bits) {
+          unsigned start = hash_map_ctrl::lowest_bit(bits);
+          uint32_t run = ~(bits >> start);
+          unsigned len = run ? hash_map_ctrl::lowest_bit(run) : dim - start;
+          uint32_t run_mask = (len == 32 ? ~0u : (1u << len) - 1) << start;
+          bits &= ~run_mask;
+
+          // grow the rectangle while the next row has the whole run.
+          unsigned r1 = r0 + 1;
+          while (r1 != dim && (rows[r1 * stride] & run_mask) == run_mask) {
+            rows[r1 * stride] &= ~run_mask;
+            r1++;
+          }
+          emit(start, len, r0, r1 - r0);
+        }
+      }
+    }
+
+    // swap rows and columns of a 32x32 bit matrix. a[y] bit x becomes a[x] bit y.
+    static void transpose(uint32_t *a) {
+      static const uint32_t masks[] = { 0x0000ffff, 0x00ff00ff, 0x0f0f0f0f, 0x33333333, 0x55555555 };
+      for (unsigned level = 0, j = 16; j != 0; ++level, j >>= 1) {
+        uint32_t m = masks[level];
+        for (unsigned k = 0; k != 32; k = (k + j + 1) & ~j) {
+          uint32_t t = ((a[k] >> j) ^ a[k+j]) & m;
+          a[k] ^= t << j;
+          a[k+j] ^= t;
+        }
+      }
+    }
+
+  public:
+    vec3 origin;
+    float voxel_size;
+    dynarray<mesh::vertex> *vertices;
+    unsigned num_faces;
+
+    face_greedy_adder() {
+      memset(faces, 0, sizeof(faces));
+      vertices = 0;
+      num_faces = 0;
+    }
+
+    void add_lefts(uint32_t v, int y, int z) { faces[left][z*dim+y] |= v; }
+    void add_rights(uint32_t v, int y, int z) { faces[right][z*dim+y] |= v; }
+    void add_bottoms(uint32_t v, int y, int z) { faces[bottom][z*dim+y+1] |= v; }
+    void add_tops(uint32_t v, int y, int z) { faces[top][z*dim+y] |= v; }
+    void add_backs(uint32_t v, int y, int z) { faces[back][(z+1)*dim+y] |= v; }
+    void add_fronts(uint32_t v, int y, int z) { faces[front][z*dim+y] |= v; }
+
+    /// Make the quads for the faces collected so far.
+    void finish() {
+      float s = voxel_size;
+      vec3 dx(s, 0, 0), dy(0, s, 0), dz(0, 0, s);
+
+      // bottoms and tops: planes of y, rows of z.
+      for (int y = 0; y != dim; ++y) {
+        merge(faces[bottom] + y, dim, [&](unsigned x, unsigned w, unsigned z, unsigned h) {
+          add_quad(origin + vec3((float)x, (float)y, (float)z) * s, dx * (float)w, dz * (float)h, vec3p(0.0f, -1.0f, 0.0f), (float)w, (float)h);
+        });
+        merge(faces[top] + y, dim, [&](unsigned x, unsigned w, unsigned z, unsigned h) {
+          add_quad(origin + vec3((float)(x+w), (float)(y+1), (float)(z+h)) * s, dx * -(float)w, dz * -(float)h, vec3p(0.0f, 1.0f, 0.0f), (float)w, (float)h);
+        });
+      }
+
+      // backs and fronts: planes of z, rows of y.
+      for (int z = 0; z != dim; ++z) {
+        merge(faces[back] + z*dim, 1, [&](unsigned x, unsigned w, unsigned y, unsigned h) {
+          add_quad(origin + vec3((float)x, (float)y, (float)z) * s, dx * (float)w, dy * (float)h, vec3p(0.0f, 0.0f, -1.0f), (float)w, (float)h);
+        });
+        merge(faces[front] + z*dim, 1, [&](unsigned x, unsigned w, unsigned y, unsigned h) {
+          add_quad(origin + vec3((float)(x+w), (float)(y+h), (float)(z+1)) * s, dx * -(float)w, dy * -(float)h, vec3p(0.0f, 0.0f, 1.0f), (float)w, (float)h);
+        });
+      }
+
+      // lefts and rights: transpose each z slice so that the rows are [x*dim+z], bit y.
+      for (unsigned dir = left; dir <= right; ++dir) {
+        uint32_t planes[dim*dim];
+        for (int z = 0; z != dim; ++z) {
+          uint32_t slice[dim];
+          memcpy(slice, faces[dir] + z*dim, sizeof(slice));
+          transpose(slice);
+          for (int x = 0; x != dim; ++x) {
+            planes[x*dim+z] = slice[x];
+          }
+        }
+
+        for (int x = 0; x != dim; ++x) {
+          if (dir == left) {
+            merge(planes + x*dim, 1, [&](unsigned y, unsigned w, unsigned z, unsigned h) {
+              add_quad(origin + vec3((float)x, (float)y, (float)z) * s, dy * (float)w, dz * (float)h, vec3p(-1.0f, 0.0f, 0.0f), (float)w, (float)h);
+            });
+          } else {
+            merge(planes + x*dim, 1, [&](unsigned y, unsigned w, unsigned z, unsigned h) {
+              add_quad(origin + vec3((float)(x+1), (float)(y+w), (float)(z+h)) * s, dy * -(float)w, dz * -(float)h, vec3p(1.0f, 0.0f, 0.0f), (float)w, (float)h);
+            });
+          }
+        }
+      }
+    }
+  };
+
   /// experimental voxel world subcube class.
   class mesh_voxel_subcube : public resource {
     enum {
@@ -151,6 +287,13 @@ namespace octet { namespace scene {
     uint32_t any_opaque[num_lod];
     uint32_t all_opaque[num_lod];
 
+    // set when opaque changes, cleared by update_lod() and build_mesh().
+    bool lod_dirty;
+    bool mesh_dirty;
+
+    // four vertices per face, made by build_mesh().
+    dynarray<mesh::vertex> vertices;
+
 
     static unsigned off32(unsigned x, unsigned y, unsigned z) { return z*32+y; }
     static unsigned off16(unsigned x, unsigned y, unsigned z) { return d16+z*8+y/2; }
@@ -180,10 +323,82 @@ namespace octet { namespace scene {
 
     mesh_voxel_subcube() {
       memset(opaque, 0, sizeof(opaque));
+      lod_dirty = mesh_dirty = true;
       //update_lod();
     }
 
+    /// true if the voxels have changed since the last update_lod()
+    bool is_lod_dirty() const {
+      return lod_dirty;
+    }
+
+    /// true if the voxels have changed since the last build_mesh()
+    bool is_mesh_dirty() const {
+      return mesh_dirty;
+    }
+
+    /// make the next update build the mesh again
+    void set_mesh_dirty() {
+      mesh_dirty = true;
+    }
+
+    /// get one voxel
+    unsigned get_voxel(unsigned x, unsigned y, unsigned z) const {
+      return (opaque[z*dim+y] >> x) & 1;
+    }
+
+    /// set or clear one voxel
+    void set_voxel(unsigned x, unsigned y, unsigned z, bool value) {
+      uint32_t old = opaque[z*dim+y];
+      uint32_t bits = value ? old | (1u << x) : old & ~(1u << x);
+      if (bits != old) {
+        opaque[z*dim+y] = bits;
+        lod_dirty = mesh_dirty = true;
+      }
+    }
+
+    /// Make the faces of this subcube, four vertices each, into get_vertices().
+    /// If greedy is true, faces are joined into rectangles (see face_greedy_adder).
+    /// Only touches this subcube, so many subcubes can be built at once on different threads.
+    void build_mesh(vec3_in origin, float voxel_size, bool greedy = false) {
+      if (greedy) {
+        vertices.resize(0);
+        mesh_iterate_faces<face_greedy_adder, dim> add;
+        add.vertices = &vertices;
+        add.voxel_size = voxel_size;
+        add.origin = origin;
+        add.iterate(opaque);
+        add.finish();
+        mesh_dirty = false;
+        return;
+      }
+
+      mesh_iterate_faces<face_counter, dim> count;
+      count.iterate(opaque);
+
+      vertices.resize(count.num_faces * 4);
+
+      mesh_iterate_faces<face_adder, dim> add;
+      add.vtx = vertices.data();
+      add.idx = 0;
+      add.dx = vec3(voxel_size, 0.0f, 0.0f);
+      add.dy = vec3(0.0f, voxel_size, 0.0f);
+      add.dz = vec3(0.0f, 0.0f, voxel_size);
+      add.voxel_size = voxel_size;
+      add.origin = origin;
+      add.iterate(opaque);
+
+      assert(count.num_faces == add.num_faces);
+      mesh_dirty = false;
+    }
+
+    /// vertices made by build_mesh()
+    dynarray<mesh::vertex> &get_vertices() {
+      return vertices;
+    }
+
     void update_lod() {
+      lod_dirty = false;
       uint32_t *any = any_opaque + d16;
       uint32_t *all = all_opaque + d16;
 
@@ -272,16 +487,39 @@ namespace octet { namespace scene {
     }
 
     template <class set> void add_voxels(mat4t_in voxelToWorld, const set &set_in) {
+      uint32_t changed = 0;
+      for (int z = 0; z != dim; ++z) {
+        for (int y = 0; y != dim; ++y) {
+          uint32_t bits = 0;
+          for (int x = 0; x != dim; ++x) {
+            vec3 txyz = vec3(x, y, z) * voxelToWorld;
+            if (set_in.intersects(txyz)) {
+              bits |= 1u << x;
+            }
+          }
+          changed |= bits & ~opaque[z*dim+y];
+          opaque[z*dim+y] |= bits;
+        }
+      }
+      if (changed) lod_dirty = mesh_dirty = true;
+    }
+
+    template <class set> void erase_voxels(mat4t_in voxelToWorld, const set &set_in) {
+      uint32_t changed = 0;
       for (int z = 0; z != dim; ++z) {
         for (int y = 0; y != dim; ++y) {
+          uint32_t bits = 0;
           for (int x = 0; x != dim; ++x) {
             vec3 txyz = vec3(x, y, z) * voxelToWorld;
             if (set_in.intersects(txyz)) {
-              opaque[z*dim+y] |= 1 << x;
+              bits |= 1u << x;
             }
           }
+          changed |= bits & opaque[z*dim+y];
+          opaque[z*dim+y] &= ~bits;
         }
       }
+      if (changed) lod_dirty = mesh_dirty = true;
     }
 
     void dump_lod(FILE *fp, const char *label, uint32_t *src) {
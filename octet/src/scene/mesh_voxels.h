@@ -26,14 +26,51 @@ namespace octet { namespace scene {
   typedef pair<entry, entry> entries;
 
   /// Experimental Voxel world mesh, uses subcubes to create a voxel world.
+  ///
+  /// Each subcube has its own run of faces (a slot) in one shared vertex buffer.
+  /// update() only rebuilds the subcubes that have changed, on all threads,
+  /// and only sends their slots to the GPU. Unused faces in the buffer are left
+  /// as zero-area quads so the index buffer never needs to change.
+  ///
+  /// set_meshing(meshing_greedy) joins faces into rectangles, which makes far fewer
+  /// vertices for flat walls and floors.
   class mesh_voxels : public mesh {
+  public:
+    /// How faces are turned into quads.
+    enum meshing_t {
+      /// one quad for each exposed voxel face.
+      meshing_faces,
+      /// join coplanar faces into rectangles, see face_greedy_adder.
+      meshing_greedy,
+    };
+
+  private:
     ivec3 size;
     float voxel_size;
+    meshing_t meshing;
 
-    enum { log_subcube_dim = 5, subcube_dim = 1 << log_subcube_dim };
+    enum {
+      log_subcube_dim = 5, subcube_dim = 1 << log_subcube_dim,
+      // slots are a multiple of this many faces so that small edits fit in the old slot.
+      slot_granularity = 64
+    };
 
     dynarray<ref<mesh_voxel_subcube> > subcubes;
 
+    // a run of faces in the vertex buffer.
+    struct slot {
+      unsigned first_face;
+      unsigned max_faces;
+    };
+
+    // one slot per subcube and a list of unused slots.
+    dynarray<slot> slots;
+    dynarray<slot> free_slots;
+
+    // faces used in the buffer (including gaps) and faces allocated.
+    unsigned top_face;
+    unsigned max_faces;
+
     struct kd_node {
       int axis;
       int kids[2];
@@ -64,64 +101,176 @@ namespace octet { namespace scene {
       return d[i];
     }
 
-    void update_mesh() {
-      mesh_iterate_faces<face_counter, subcube_dim> count;
-      for (unsigned i = 0; i != subcubes.size(); ++i) {
-        mesh_voxel_subcube *p = subcubes[i];
-        if (p) {
-          p->count_faces(count);
+    vec3 get_subcube_origin(unsigned index) const {
+      int x = index % size.x();
+      int y = (index / size.x()) % size.y();
+      int z = index / (size.x() * size.y());
+      vec3 offset = vec3(size) * (-0.5f * subcube_dim * voxel_size);
+      return vec3((float)x, (float)y, (float)z) * (subcube_dim * voxel_size) + offset;
+    }
+
+    // give a slot back, joining it to its neighbours.
+    void free_slot(slot s) {
+      if (!s.max_faces) return;
+      for (unsigned i = 0; i != free_slots.size(); ) {
+        slot &f = free_slots[i];
+        if (f.first_face + f.max_faces == s.first_face || s.first_face + s.max_faces == f.first_face) {
+          s.first_face = f.first_face < s.first_face ? f.first_face : s.first_face;
+          s.max_faces += f.max_faces;
+          f = free_slots.back();
+          free_slots.pop_back();
+          i = 0;
+        } else {
+          ++i;
+        }
+      }
+      if (s.first_face + s.max_faces == top_face) {
+        top_face = s.first_face;
+      } else {
+        free_slots.push_back(s);
+      }
+    }
+
+    // find room for num_faces, first fit from the free list, otherwise at the top.
+    slot alloc_slot(unsigned num_faces) {
+      slot s;
+      s.max_faces = (num_faces + slot_granularity - 1) & ~(slot_granularity - 1);
+      s.first_face = top_face;
+      if (!s.max_faces) return s;
+
+      for (unsigned i = 0; i != free_slots.size(); ++i) {
+        slot &f = free_slots[i];
+        if (f.max_faces >= s.max_faces) {
+          s.first_face = f.first_face;
+          f.first_face += s.max_faces;
+          f.max_faces -= s.max_faces;
+          if (!f.max_faces) {
+            f = free_slots.back();
+            free_slots.pop_back();
+          }
+          return s;
         }
       }
 
-      allocate(sizeof(vertex)*count.num_faces*4, sizeof(uint32_t)*count.num_faces*6);
-      set_num_indices(count.num_faces*6);
-      set_num_vertices(count.num_faces*4);
+      top_face += s.max_faces;
+      return s;
+    }
 
-      mesh_iterate_faces<face_adder, subcube_dim> add;
-      add.vtx = (vertex *)get_vertices()->lock();
-      add.idx = (uint32_t *)get_indices()->lock();
-      add.dx = vec3(voxel_size, 0.0f, 0.0f);
-      add.dy = vec3(0.0f, voxel_size, 0.0f);
-      add.dz = vec3(0.0f, 0.0f, voxel_size);
-      add.voxel_size = voxel_size;
+    // upload the faces of one subcube, padding its slot with zero-area faces.
+    void upload_slot(unsigned index) {
+      const slot &s = slots[index];
+      if (!s.max_faces) return;
+      dynarray<vertex> &vtx = subcubes[index]->get_vertices();
+      unsigned num_vertices = vtx.size();
+      vtx.resize(s.max_faces * 4);
+      memset((void*)(vtx.data() + num_vertices), 0, (vtx.size() - num_vertices) * sizeof(vertex));
+      get_vertices()->assign(vtx.data(), s.first_face * 4 * sizeof(vertex), vtx.size() * sizeof(vertex));
+      vtx.resize(num_vertices);
+    }
 
-      vec3 offset = vec3(size) * (-0.5f * subcube_dim * voxel_size);
-      vec3 scale(subcube_dim * voxel_size);
-      int idx = 0;
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            mesh_voxel_subcube *p = subcubes[idx++];
-            add.origin = vec3(x, y, z) * scale + offset;
-            if (p) {
-              p->add_faces(add);
-            }
-          }
+    // make new buffers with room for at least num_faces and send all the slots.
+    void grow_buffers(unsigned num_faces) {
+      unsigned new_max = max_faces ? max_faces : 1024;
+      while (new_max < num_faces) new_max *= 2;
+      max_faces = new_max;
+
+      dynarray<vertex> vtx(max_faces * 4);
+      memset((void*)vtx.data(), 0, vtx.size() * sizeof(vertex));
+      for (unsigned i = 0; i != slots.size(); ++i) {
+        const dynarray<vertex> &src = subcubes[i]->get_vertices();
+        if (src.size()) {
+          memcpy((void*)(vtx.data() + slots[i].first_face * 4), src.data(), src.size() * sizeof(vertex));
+        }
+      }
+
+      // the same two triangles for every face.
+      dynarray<uint32_t> idx(max_faces * 6);
+      for (unsigned i = 0; i != max_faces; ++i) {
+        uint32_t *dest = idx.data() + i * 6;
+        dest[0] = i * 4 + 0;
+        dest[3] = dest[1] = i * 4 + 1;
+        dest[5] = dest[2] = i * 4 + 3;
+        dest[4] = i * 4 + 2;
+      }
+
+      get_vertices()->allocate(GL_ARRAY_BUFFER, vtx.size() * sizeof(vertex), GL_DYNAMIC_DRAW);
+      get_vertices()->assign(vtx.data(), 0, vtx.size() * sizeof(vertex));
+      get_indices()->allocate(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(uint32_t));
+      get_indices()->assign(idx.data(), 0, idx.size() * sizeof(uint32_t));
+    }
+
+    void update_mesh() {
+      dynarray<unsigned> dirty;
+      for (unsigned i = 0; i != subcubes.size(); ++i) {
+        if (subcubes[i]->is_mesh_dirty()) {
+          dirty.push_back(i);
         }
       }
+      if (dirty.empty()) return;
 
-      assert(count.num_faces == add.num_faces);
+      // make the faces of the changed subcubes on all threads.
+      job::get_scheduler().parallel_for(0, dirty.size(), 1, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          unsigned index = dirty[i];
+          subcubes[index]->build_mesh(get_subcube_origin(index), voxel_size, meshing == meshing_greedy);
+        }
+      });
+
+      // move subcubes that have outgrown (or mostly emptied) their slots.
+      dynarray<slot> vacated;
+      for (unsigned i = 0; i != dirty.size(); ++i) {
+        unsigned index = dirty[i];
+        unsigned num_faces = subcubes[index]->get_vertices().size() / 4;
+        slot &s = slots[index];
+        if (num_faces > s.max_faces || num_faces * 4 < s.max_faces) {
+          slot old = s;
+          free_slot(old);
+          s = alloc_slot(num_faces);
+          // the old faces are still in the buffer, so hide them.
+          if (old.max_faces) vacated.push_back(old);
+        }
+      }
+
+      if (top_face > max_faces) {
+        grow_buffers(top_face);
+      } else {
+        // hide the vacated faces before the new slots, which may overlap them, are sent.
+        dynarray<vertex> zeros;
+        for (unsigned i = 0; i != vacated.size(); ++i) {
+          zeros.resize(vacated[i].max_faces * 4);
+          memset((void*)zeros.data(), 0, zeros.size() * sizeof(vertex));
+          get_vertices()->assign(zeros.data(), vacated[i].first_face * 4 * sizeof(vertex), zeros.size() * sizeof(vertex));
+        }
+        for (unsigned i = 0; i != dirty.size(); ++i) {
+          upload_slot(dirty[i]);
+        }
+      }
 
-      get_vertices()->unlock();
-      get_indices()->unlock();
+      set_num_vertices(top_face * 4);
+      set_num_indices(top_face * 6);
       //dump(log("voxels\n"));
     }
 
-    template <class set> void add_voxels(mat4t_in voxelToWorld, const set &set_in) {
-      int idx = 0;
+    // add (or erase) voxels in every subcube, on all threads.
+    template <class set> void add_voxels(mat4t_in voxelToWorld, const set &set_in, bool erase = false) {
       vec3 offset = vec3(size) * (-0.5f * subcube_dim) + vec3(0.5f);
       vec3 scale = vec3(subcube_dim);
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            mat4t localVoxelToWorld = voxelToWorld;
-            vec3 pos = vec3(x, y, z) * scale + offset;
-            localVoxelToWorld.translate(pos.x(), pos.y(), pos.z());
-            //localVoxelToWorld.w() += vec4(0.5f, 0.5f, 0.5f, 0.0f);
-            subcubes[idx++]->add_voxels(localVoxelToWorld, set_in);
+      job::get_scheduler().parallel_for(0, subcubes.size(), 1, [&](unsigned begin, unsigned end) {
+        for (unsigned idx = begin; idx != end; ++idx) {
+          int x = idx % size.x();
+          int y = (idx / size.x()) % size.y();
+          int z = idx / (size.x() * size.y());
+          mat4t localVoxelToWorld = voxelToWorld;
+          vec3 pos = vec3(x, y, z) * scale + offset;
+          localVoxelToWorld.translate(pos.x(), pos.y(), pos.z());
+          //localVoxelToWorld.w() += vec4(0.5f, 0.5f, 0.5f, 0.0f);
+          if (erase) {
+            subcubes[idx]->erase_voxels(localVoxelToWorld, set_in);
+          } else {
+            subcubes[idx]->add_voxels(localVoxelToWorld, set_in);
           }
         }
-      }
+      });
     }
 
     /*mesh_voxels &cylinder(vec3_in centre, vec3_in axis, float radius, float half_length) {
@@ -166,9 +315,13 @@ namespace octet { namespace scene {
       set_default_attributes();
       voxel_size = voxel_size_in;
       size = size_in;
+      meshing = meshing_faces;
       //set_aabb(aabb(vec3(0, 0, 0), size));
 
       subcubes.resize(size.x() * size.y() * size.z());
+      slots.resize(subcubes.size());
+      memset((void*)slots.data(), 0, slots.size() * sizeof(slot));
+      top_face = max_faces = 0;
       set_aabb(aabb(vec3(0, 0, 0), vec3(size)*(voxel_size*subcube_dim*0.5f)));
       int idx = 0;
       for (int z = 0; z != size.z(); ++z) {
@@ -185,31 +338,107 @@ namespace octet { namespace scene {
     }
 
     /// Update only the LODs used for collision detection.
+    /// Only subcubes that have changed are updated.
     void update_lod() {
+      dynarray<unsigned> dirty;
       for (unsigned i = 0; i != subcubes.size(); ++i) {
-        mesh_voxel_subcube *p = subcubes[i];
-        if (p) {
-          p->update_lod();
+        if (subcubes[i]->is_lod_dirty()) {
+          dirty.push_back(i);
         }
       }
+
+      job::get_scheduler().parallel_for(0, dirty.size(), 1, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          subcubes[dirty[i]]->update_lod();
+        }
+      });
     }
 
     /// Update both the mesh and the LODs.
+    /// Only subcubes that have changed since the last update are rebuilt and sent to the GPU.
     void update() {
       update_lod();
       update_mesh();
     }
 
+    /// Choose how faces are made. Every subcube is rebuilt by the next update().
+    void set_meshing(meshing_t value) {
+      if (value == meshing) return;
+      meshing = value;
+      for (unsigned i = 0; i != subcubes.size(); ++i) {
+        subcubes[i]->set_mesh_dirty();
+      }
+    }
+
+    /// How faces are made.
+    meshing_t get_meshing() const {
+      return meshing;
+    }
+
+    /// Number of quads made by the last update(), not counting unused space in the buffer.
+    unsigned get_num_faces() const {
+      unsigned num_faces = 0;
+      for (unsigned i = 0; i != subcubes.size(); ++i) {
+        num_faces += subcubes[i]->get_vertices().size() / 4;
+      }
+      return num_faces;
+    }
+
     /// Serialize.
     void visit(visitor &v) {
       mesh::visit(v);
     }
 
+    /// Print the number of vertices and the time to mesh some test shapes with and without greedy meshing.
+    static void benchmark(const ivec3 &size = ivec3(4, 2, 4)) {
+      mat4t voxelToWorld;
+      voxelToWorld.loadIdentity();
+      float extent = (float)(size.x() * subcube_dim);
+
+      static const char *names[] = { "faces", "greedy" };
+      for (unsigned shape = 0; shape != 2; ++shape) {
+        for (unsigned mode = meshing_faces; mode <= meshing_greedy; ++mode) {
+          ref<mesh_voxels> voxels = new mesh_voxels(1.0f/subcube_dim, size);
+          voxels->set_meshing((meshing_t)mode);
+          if (shape == 0) {
+            // terrain-like floor with a wall: big flat areas.
+            voxels->draw(voxelToWorld, aabb(vec3(0, -extent * 0.25f, 0), vec3(extent, extent * 0.125f, extent)));
+            voxels->draw(voxelToWorld, aabb(vec3(0, 0, 0), vec3(extent * 0.25f, extent, 4)));
+          } else {
+            // a sphere: many small steps.
+            voxels->draw(voxelToWorld, sphere(vec3(0, 0, 0), extent * 0.2f));
+          }
+
+          std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+          voxels->update();
+          double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+          printf("mesh_voxels %s %s: %u vertices, %.1f ms\n", shape ? "sphere" : "floor", names[mode], voxels->get_num_faces() * 4, secs * 1e3);
+        }
+      }
+    }
+
     template <class bounds_t> mesh_voxels &draw(mat4t_in voxelToWorld, const bounds_t &bounds) {
       add_voxels(voxelToWorld, bounds);
       return *this;
     }
 
+    /// Clear the voxels inside some bounds, for example to dig a hole.
+    template <class bounds_t> mesh_voxels &erase(mat4t_in voxelToWorld, const bounds_t &bounds) {
+      add_voxels(voxelToWorld, bounds, true);
+      return *this;
+    }
+
+    /// Get one voxel. pos is in voxels from the corner of the world.
+    unsigned get_voxel(ivec3_in pos) const {
+      return get_subcube(pos >> log_subcube_dim)->get_voxel(pos.x() & (subcube_dim-1), pos.y() & (subcube_dim-1), pos.z() & (subcube_dim-1));
+    }
+
+    /// Set or clear one voxel. pos is in voxels from the corner of the world.
+    /// Call update() to see the change.
+    void set_voxel(ivec3_in pos, bool value) {
+      get_subcube(pos >> log_subcube_dim)->set_voxel(pos.x() & (subcube_dim-1), pos.y() & (subcube_dim-1), pos.z() & (subcube_dim-1), value);
+    }
+
     void dump(FILE *fp) {
       int idx = 0;
       for (int z = 0; z != size.z(); ++z) {
@@ -271,7 +500,7 @@ namespace octet { namespace scene {
         return false;
       }
 
-      while(!stack.is_empty()) {
+      while(!stack.empty()) {
         entry ta = stack.back().first;
         entry tb = stack.back().second;
         stack.pop_back();
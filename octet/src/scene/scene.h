@@ -14,7 +14,9 @@
 #include "../scene/skin.h"
 #include "../scene/skeleton.h"
 #include "../scene/animation.h"
+#include "../scene/vertex_cache_optimizer.h"
 #include "../scene/mesh.h"
+#include "../scene/skin_deformer.h"
 #include "../scene/image.h"
 #include "../scene/sampler.h"
 #include "../scene/param.h"
@@ -34,6 +36,7 @@
 #include "../scene/mesh_sphere.h"
 #include "../scene/mesh_particle_system.h"
 #include "../scene/mesh_terrain.h"
+#include "../scene/mesh_terrain_lod.h"
 #ifdef OCTET_VOXEL_TEST
   #include "../scene/mesh_voxel_subcube.h"
   #include "../scene/mesh_voxels.h"
@@ -27,6 +27,37 @@ namespace octet { namespace scene {
     // is this node and all its children renderable?
     bool enabled;
 
+    // cached node to world transform, valid when world_dirty is false.
+    mat4t nodeToWorld;
+
+    // cached result of calcEnabled(), valid when world_dirty is false.
+    bool world_enabled;
+
+    // set when this node or a parent has changed. Children of a dirty node are always dirty.
+    bool world_dirty;
+
+    // invalidate the cached transforms of this node and all its children.
+    void set_dirty() {
+      if (world_dirty) return;
+      world_dirty = true;
+      for (unsigned i = 0; i != children.size(); ++i) {
+        children[i]->set_dirty();
+      }
+    }
+
+    // recalculate the cached transform from the parent's cached transform.
+    void update_world() {
+      if (parent) {
+        scene_node *p = parent;
+        nodeToWorld = nodeToParent * p->get_nodeToWorld();
+        world_enabled = enabled && p->world_enabled;
+      } else {
+        nodeToWorld = nodeToParent;
+        world_enabled = enabled;
+      }
+      world_dirty = false;
+    }
+
   public:
     RESOURCE_META(scene_node)
 
@@ -35,6 +66,8 @@ namespace octet { namespace scene {
       nodeToParent.loadIdentity();
       sid = atom_;
       enabled = true;
+      world_enabled = true;
+      world_dirty = true;
       if (parent) {
         parent->add_child(this);
       }
@@ -45,6 +78,8 @@ namespace octet { namespace scene {
       this->nodeToParent = nodeToParent;
       this->sid = sid;
       enabled = true;
+      world_enabled = true;
+      world_dirty = true;
     }
 
     /// the virtual add_ref on animation_target gets passed to here and we pass iton (delegate it) to the resource
@@ -61,6 +96,7 @@ namespace octet { namespace scene {
     void set_value(atom_t sid, atom_t sub_target, atom_t component, float *value) {
       if (sub_target == atom_transform) {
         nodeToParent.init_transpose(value);
+        set_dirty();
       }
     }
 
@@ -73,6 +109,8 @@ namespace octet { namespace scene {
       //log("visit scene_node nodeToParent\n");
       v.visit(nodeToParent, atom_nodeToParent);
       v.visit(sid, atom_sid);
+      world_dirty = false;
+      set_dirty();
     }
 
 
@@ -80,6 +118,8 @@ namespace octet { namespace scene {
     void add_child(scene_node *new_node) {
       new_node->parent = this;
       children.push_back(new_node);
+      new_node->world_dirty = false;
+      new_node->set_dirty();
     }
 
     /// Get the parent node of this node.
@@ -97,21 +137,39 @@ namespace octet { namespace scene {
       return children[index];
     }
 
+    /// get the cached scene_node to world matrix, recalculating it if this node or a parent has changed.
+    const mat4t &get_nodeToWorld() {
+      if (world_dirty) update_world();
+      return nodeToWorld;
+    }
+
     // compute the scene_node to world matrix for an individual scene_node;
     mat4t calcModelToWorld() {
-      mat4t result = nodeToParent;
-      for (scene_node *p = parent; p != NULL; p = p->parent) {
-        result = result * p->nodeToParent;
-      }
-      return result;
+      return get_nodeToWorld();
     }
 
     // calculate whether this node is enabled (recursively)
     bool calcEnabled() {
-      for (scene_node *p = this; p != NULL; p = p->parent) {
-        if (!p->enabled) return false;
+      if (world_dirty) update_world();
+      return world_enabled;
+    }
+
+    /// Recalculate the world transforms of this node and all its children in one top-down pass.
+    ///
+    /// The nodes and their node to world matrices are appended to "nodes" and "nodeToWorlds"
+    /// in the same order, parents before children.
+    void update_world_transforms(dynarray<mat4t> &nodeToWorlds, dynarray<scene_node*> &nodes) {
+      dynarray<scene_node*> stack;
+      stack.push_back(this);
+      while (!stack.empty()) {
+        scene_node *node = stack.back();
+        stack.pop_back();
+        nodeToWorlds.push_back(node->get_nodeToWorld());
+        nodes.push_back(node);
+        for (int i = node->children.size(); i-- != 0; ) {
+          stack.push_back(node->children[i]);
+        }
       }
-      return true;
     }
 
     /// transform a point from model space to world space
@@ -134,7 +192,9 @@ namespace octet { namespace scene {
     }
 
     /// access the node to parent transform matrix for writing.
+    /// This invalidates the cached world transforms of the node and its children.
     mat4t &access_nodeToParent() {
+      set_dirty();
       return nodeToParent;
     }
 
@@ -166,26 +226,27 @@ namespace octet { namespace scene {
     /// set enabled state
     void set_enabled(bool value) {
       enabled = value;
+      set_dirty();
     }
 
     /// reset the matrix
     void loadIdentity() {
-      nodeToParent.loadIdentity();
+      access_nodeToParent().loadIdentity();
     }
 
     /// Translate the matrix
     void translate(vec3_in xyz) {
-      nodeToParent.translate(xyz[0], xyz[1], xyz[2]);
+      access_nodeToParent().translate(xyz[0], xyz[1], xyz[2]);
     }
 
     /// Rotate the matrix
     void rotate(float angle, vec3_in axis) {
-      nodeToParent.rotate(angle, axis[0], axis[1], axis[2]);
+      access_nodeToParent().rotate(angle, axis[0], axis[1], axis[2]);
     }
 
     /// Scale the matrix
     void scale(vec3_in xyz) {
-      nodeToParent.scale(xyz[0], xyz[1], xyz[2]);
+      access_nodeToParent().scale(xyz[0], xyz[1], xyz[2]);
     }
 
     /// Get the identifying sid
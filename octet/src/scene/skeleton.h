@@ -20,10 +20,12 @@ namespace octet { namespace scene {
     // cached skin components
     dynarray<mat4t> result;  /// uniforms to shader
     dynarray<int> indices;   /// map skeleton to skin indices
+    const skin *indexed_skin; /// which skin the indices are for
   public:
     RESOURCE_META(skeleton)
 
     skeleton() {
+      indexed_skin = 0;
     }
 
     void visit(visitor &v) {
@@ -34,6 +36,7 @@ namespace octet { namespace scene {
       v.visit(boneToNode, atom_boneToNode);
       v.visit(result, atom_result);  /// uniforms to shader
       v.visit(indices, atom_indices);   /// map skeleton to skin indices
+      indexed_skin = 0;
     }
 
     void add_bone(scene_node *node, int parent) {
@@ -56,52 +59,46 @@ namespace octet { namespace scene {
       return -1;
     }
 
+    /// Calculate the skinning matrices (skin -> bone -> parent -> ... -> world -> camera) for every joint of a skin.
+    ///
+    /// Bones must come after their parents. All the matrices are treated as affine (3x4).
+    /// Pass an identity matrix for worldToCamera to get skin to model space, for CPU skinning.
     mat4t *calc_transforms(const mat4t &worldToCamera, skin *skn) {
-      //static bool first_frame = true;
-      if (boneToNode.size() < nodeToParents.size()) {
-        boneToNode.resize(nodeToParents.size());
+      unsigned num_nodes = nodes.size();
+      if (boneToNode.size() != num_nodes) {
+        boneToNode.resize(num_nodes);
       }
 
       // todo: optionally drive animation directly to the skeleton.
-      for (int i = 0; i != nodes.size(); ++i) {
-        nodeToParents[i] = nodes[i]->access_nodeToParent();
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        nodeToParents[i] = nodes[i]->get_nodeToParent();
       }
 
       // compute matrix heirachy
-      for (int i = 0; i != nodeToParents.size(); ++i) {
+      for (unsigned i = 0; i != num_nodes; ++i) {
         int parent = parents[i];
         // skeleton -> parent -> parent -> world -> camera
-        if (parent == -1) {
-          boneToNode[i] = nodeToParents[i] * worldToCamera;
-        } else {
-          boneToNode[i] = nodeToParents[i] * boneToNode[parent];
-        }
-        //log("%d %s p=%d\n", i, result[i].toString(), parent);
+        boneToNode[i] = mul_affine(nodeToParents[i], parent == -1 ? worldToCamera : boneToNode[parent]);
       }
 
       unsigned num_joints = skn->get_num_joints();
-      if (result.size() < num_joints) {
+      if (indexed_skin != skn || result.size() != num_joints) {
         result.resize(num_joints);
         indices.resize(num_joints);
-        for (int i = 0; i != num_joints; ++i) {
-          // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
+        for (unsigned i = 0; i != num_joints; ++i) {
           indices[i] = find_joint(skn->get_joint(i));
         }
+        indexed_skin = skn;
       }
 
-      // premultiply by skin matrices
-      for (int i = 0; i != num_joints; ++i) {
+      // premultiply by the constant skin matrices
+      for (unsigned i = 0; i != num_joints; ++i) {
         // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
         int index = indices[i];
-        if (index != -1) {
-          result[i] = skn->get_modelToBind() * skn->get_bindToModel(i) * boneToNode[index];
-        } else {
-          result[i] = worldToCamera;
-        }
-        //if (first_frame) log("%d %d [%s]\n", i, index, result[i].toString());
+        result[i] = index != -1 ? mul_affine(skn->get_bind_palette(i), boneToNode[index]) : worldToCamera;
       }
 
-      return &result[0];
+      return result.data();
     }
 
     // convert an sid into an index. (should be cached!)
@@ -18,10 +18,21 @@ namespace octet { namespace scene {
     // a name for each joint (sid)
     dynarray<atom_t> joints;
 
+    // modelToBind * bindToModel[i] for each joint, which does not change.
+    dynarray<mat4t> bind_palette;
+
+    void update_palette() {
+      bind_palette.resize(bindToModel.size());
+      for (unsigned i = 0; i != bindToModel.size(); ++i) {
+        bind_palette[i] = mul_affine(modelToBind, bindToModel[i]);
+      }
+    }
+
   public:
     RESOURCE_META(skin)
 
     skin() {
+      modelToBind.loadIdentity();
     }
 
     skin(const mat4t &modelToBind) {
@@ -32,11 +43,13 @@ namespace octet { namespace scene {
       v.visit(modelToBind, atom_modelToBind);
       v.visit(bindToModel, atom_bindToModel);
       v.visit(joints, atom_joints);
+      update_palette();
     }
 
     void add_joint(const mat4t &bindToModel, atom_t sid) {
       this->bindToModel.push_back(bindToModel);
       joints.push_back(sid);
+      bind_palette.push_back(mul_affine(modelToBind, bindToModel));
       log("skin: add_joint %d\n", sid);
     }
 
@@ -51,6 +64,9 @@ namespace octet { namespace scene {
 
     const mat4t &get_bindToModel(int i) const { return bindToModel[i]; }
     const mat4t &get_modelToBind() const { return modelToBind; }
+
+    /// get modelToBind * bindToModel(i), which takes the skin to the space of joint i.
+    const mat4t &get_bind_palette(int i) const { return bind_palette[i]; }
     atom_t get_joint(int i) const { return joints[i]; }
     unsigned get_num_joints() const { return joints.size(); }
   };
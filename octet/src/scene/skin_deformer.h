@@ -0,0 +1,190 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// CPU skinning
+//
+
+namespace octet { namespace scene {
+  /// Skin a mesh on the CPU: move its vertices by a palette of joint matrices into a copy of the mesh.
+  ///
+  /// Unlike skinning in the vertex shader, there is no limit on the number of joints.
+  /// The mesh needs float positions, blend weights and blend indices;
+  /// normals, tangents and bitangents are moved too if it has them.
+  ///
+  /// Example
+  ///
+  ///     ref<skin_deformer> deformer = new skin_deformer(msh);
+  ///     mat4t modelToModel;
+  ///     modelToModel.loadIdentity();
+  ///     mat4t *palette = skel->calc_transforms(modelToModel, msh->get_skin());
+  ///     deformer->deform(palette, skel->get_num_bones());
+  ///     // now draw deformer->get_result() as an ordinary mesh.
+  class skin_deformer : public resource {
+    enum { max_influences = 4 };
+
+    ref<mesh> source;
+    ref<mesh> result;
+
+    // a copy of the source vertices, so that we don't read back from the GPU every frame.
+    dynarray<uint8_t> bind_vertices;
+    ref<gl_resource> bind_buffer;
+    unsigned bind_version;
+    unsigned num_vertices;
+    unsigned stride;
+
+    // byte offsets of the attributes in a vertex, or -1
+    int pos_offset;
+    int normal_offset;
+    int tangent_offset;
+    int bitangent_offset;
+    int weight_offset;
+    int index_offset;
+    unsigned num_weights;
+    unsigned num_indices;
+
+    int get_float_offset(unsigned attr, unsigned min_size, unsigned max_size, unsigned *size = 0) const {
+      unsigned slot = source->get_slot(attr);
+      if (slot == ~0u || source->get_kind(slot) != GL_FLOAT) return -1;
+      unsigned sz = source->get_size(slot);
+      if (sz < min_size || sz > max_size) return -1;
+      if (size) *size = sz;
+      return (int)source->get_offset(slot);
+    }
+
+    // read the source vertices and find the attributes. returns false if we can't skin this mesh.
+    bool prepare() {
+      gl_resource *vertices = source->get_vertices();
+      if (!vertices) return false;
+      if (bind_buffer == vertices && bind_version == vertices->get_version() && result) return pos_offset != -1;
+
+      bind_buffer = vertices;
+      bind_version = vertices->get_version();
+      stride = source->get_stride();
+      pos_offset = get_float_offset(attribute_pos, 3, 4);
+      normal_offset = get_float_offset(attribute_normal, 3, 3);
+      tangent_offset = get_float_offset(attribute_tangent, 3, 3);
+      bitangent_offset = get_float_offset(attribute_bitangent, 3, 3);
+      weight_offset = get_float_offset(attribute_blendweight, 1, 4, &num_weights);
+      index_offset = get_float_offset(attribute_blendindices, 1, 4, &num_indices);
+      if (stride == 0 || pos_offset == -1 || weight_offset == -1 || index_offset == -1) {
+        pos_offset = -1;
+        return false;
+      }
+
+      size_t size = vertices->get_size();
+      num_vertices = (unsigned)(size / stride);
+      bind_vertices.resize(size);
+      {
+        gl_resource::rolock lock(vertices);
+        memcpy(bind_vertices.data(), lock.u8(), size);
+      }
+
+      // the result shares the indices and format of the source but has its own vertices.
+      result = new mesh(*source);
+      result->set_skin(0);
+      result->set_vertices(new gl_resource(GL_ARRAY_BUFFER, (unsigned)size));
+      return true;
+    }
+
+    static vec4 load3(const uint8_t *src, int offset) {
+      const float *f = (const float*)(src + offset);
+      return vec4(f[0], f[1], f[2], 0);
+    }
+
+    static void store3(uint8_t *dest, int offset, const vec4 &value) {
+      float *f = (float*)(dest + offset);
+      f[0] = value.x(); f[1] = value.y(); f[2] = value.z();
+    }
+
+    // skin a range of vertices from src to dest.
+    void deform_range(uint8_t *dest, const mat4t *palette, unsigned num_bones, unsigned begin, unsigned end) const {
+      for (unsigned v = begin; v != end; ++v) {
+        const uint8_t *src = bind_vertices.data() + v * stride;
+        uint8_t *dst = dest + v * stride;
+        memcpy(dst, src, stride);
+
+        // blend the matrices of the joints. with one fewer weight than index, the first weight is implied.
+        const float *w = (const float*)(src + weight_offset);
+        const float *idx = (const float*)(src + index_offset);
+        float weights[max_influences];
+        if (num_weights >= num_indices) {
+          for (unsigned i = 0; i != num_indices; ++i) weights[i] = w[i];
+        } else {
+          float sum = 0;
+          for (unsigned i = 1; i != num_indices; ++i) {
+            weights[i] = i - 1 < num_weights ? w[i-1] : 0;
+            sum += weights[i];
+          }
+          weights[0] = 1 - sum;
+        }
+
+        vec4 r0(0, 0, 0, 0), r1(0, 0, 0, 0), r2(0, 0, 0, 0), r3(0, 0, 0, 0);
+        for (unsigned i = 0; i != num_indices; ++i) {
+          unsigned bone = (unsigned)idx[i];
+          float wi = weights[i];
+          if (wi == 0 || bone >= num_bones) continue;
+          const mat4t &m = palette[bone];
+          r0 = r0 + m[0] * wi;
+          r1 = r1 + m[1] * wi;
+          r2 = r2 + m[2] * wi;
+          r3 = r3 + m[3] * wi;
+        }
+
+        vec4 pos = load3(src, pos_offset);
+        store3(dst, pos_offset, r0 * pos.xxxx() + r1 * pos.yyyy() + r2 * pos.zzzz() + r3);
+
+        int dir_offsets[3] = { normal_offset, tangent_offset, bitangent_offset };
+        for (unsigned i = 0; i != 3; ++i) {
+          int offset = dir_offsets[i];
+          if (offset != -1) {
+            vec4 d = load3(src, offset);
+            vec4 rd = r0 * d.xxxx() + r1 * d.yyyy() + r2 * d.zzzz();
+            float len2 = rd.dot(rd);
+            store3(dst, offset, len2 > 0 ? rd * (1.0f / sqrtf(len2)) : rd);
+          }
+        }
+      }
+    }
+
+  public:
+    /// Make a deformer for a mesh with blend weights and indices.
+    skin_deformer(mesh *source = 0) {
+      this->source = source;
+      bind_version = 0;
+      num_vertices = 0;
+      stride = 0;
+      pos_offset = -1;
+      normal_offset = tangent_offset = bitangent_offset = -1;
+      weight_offset = index_offset = -1;
+      num_weights = num_indices = 0;
+    }
+
+    /// get the mesh we are skinning.
+    mesh *get_source() const {
+      return source;
+    }
+
+    /// get the skinned copy of the mesh; valid after deform() returns true.
+    mesh *get_result() const {
+      return result;
+    }
+
+    /// Move the vertices of the source mesh by the joint matrices in "palette" into the result mesh.
+    /// Returns false if the mesh does not have the attributes needed to skin it.
+    ///
+    /// The vertices are done on all threads, so call this from the thread that owns the GL context.
+    bool deform(const mat4t *palette, unsigned num_bones) {
+      if (!source || !prepare()) return false;
+
+      gl_resource::wolock lock(result->get_vertices());
+      uint8_t *dest = lock.u8();
+      job::get_scheduler().parallel_for(0, num_vertices, 1024, [&](unsigned begin, unsigned end) {
+        deform_range(dest, palette, num_bones, begin, end);
+      });
+      return true;
+    }
+  };
+}}
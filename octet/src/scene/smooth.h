@@ -202,13 +202,13 @@ namespace octet { namespace scene {
       src->get_vertices()->unlock_read_only();
       num_dest_vertices = get_num_vertices();
 
-      const void *sip = src->get_indices()->lock_read_only();
+      // optimized meshes may have 16 bit indices.
+      dynarray<uint32_t> src_indices;
+      src->get_indices_u32(src_indices);
       depth = 0;
-      for (unsigned i = 0; i+2 < get_num_indices(); i += 3) {
-        uint32_t *tp = ((uint32_t*)sip) + i;
-        add_triangle(tp[0], tp[1], tp[2]);
+      for (unsigned i = 0; i+2 < src_indices.size(); i += 3) {
+        add_triangle(src_indices[i], src_indices[i+1], src_indices[i+2]);
       }
-      src->get_indices()->unlock_read_only();
 
       unsigned isize = dest_indices.size() * sizeof(dest_indices[0]);
       unsigned vsize = dest_vertices.size() * sizeof(dest_vertices[0]);
@@ -221,6 +221,7 @@ namespace octet { namespace scene {
       set_vertices(vertices);
       set_num_vertices(num_dest_vertices);
       set_num_indices(dest_indices.size());
+      set_index_type(GL_UNSIGNED_INT);
 
       dump(log("dump"));
     }
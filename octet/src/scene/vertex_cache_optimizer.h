@@ -0,0 +1,341 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Triangle and vertex reordering for the post-transform vertex cache.
+//
+
+namespace octet { namespace scene {
+  /// Reorder an indexed triangle list so that the GPU transforms each vertex fewer times.
+  ///
+  /// optimize_triangles() is Tom Forsyth's linear-speed vertex cache optimisation. It simulates
+  /// an LRU cache and always draws next the triangle whose vertices score best, favouring
+  /// vertices that are in the cache and vertices with few triangles left to draw.
+  ///
+  /// reduce_overdraw() splits that order into clusters where the cache starts afresh and
+  /// draws the clusters that face outward first, so that they hide the ones behind them
+  /// (Sander, Nehab and Barczak, "Fast triangle reordering for vertex locality and reduced overdraw").
+  ///
+  /// reorder_vertices() numbers the vertices in the order they are first used, so that
+  /// vertex fetches walk through memory.
+  ///
+  /// The ACMR (average cache miss ratio) is the number of vertices transformed per triangle.
+  /// It is 3 for unindexed triangles and about 0.6 for a well ordered regular grid.
+  class vertex_cache_optimizer {
+    enum { cache_size = 32, max_valence = 32 };
+
+    // score of a vertex at a position in the LRU cache (-1 for none) with some triangles left to draw.
+    class vertex_scores {
+      float cache_scores[cache_size];
+      float valence_scores[max_valence];
+    public:
+      vertex_scores() {
+        for (unsigned i = 0; i != cache_size; ++i) {
+          // the last triangle's vertices get a fixed score so that we do not favour strips.
+          cache_scores[i] = i < 3 ? 0.75f : powf(1.0f - (i - 3) * (1.0f / (cache_size - 3)), 1.5f);
+        }
+        for (unsigned i = 0; i != max_valence; ++i) {
+          // boost vertices with few triangles left to get rid of lone triangles.
+          valence_scores[i] = i ? 2.0f * powf((float)i, -0.5f) : 0.0f;
+        }
+      }
+
+      float get(int cache_pos, unsigned valence) const {
+        if (valence == 0) return -1.0f;
+        float score = cache_pos >= 0 ? cache_scores[cache_pos] : 0.0f;
+        return score + (valence < max_valence ? valence_scores[valence] : 2.0f * powf((float)valence, -0.5f));
+      }
+    };
+
+  public:
+    /// Number of vertices transformed per triangle with a FIFO cache of cache_size vertices.
+    static float get_acmr(const uint32_t *indices, unsigned num_indices, unsigned num_vertices, unsigned cache_size=32) {
+      unsigned num_tris = num_indices / 3;
+      if (num_tris == 0) return 0;
+
+      // a vertex is in the cache if fewer than cache_size misses have happened since its own.
+      dynarray<unsigned> stamp(num_vertices);
+      memset(stamp.data(), 0, num_vertices * sizeof(unsigned));
+      unsigned misses = cache_size;
+      for (unsigned i = 0; i != num_tris * 3; ++i) {
+        uint32_t v = indices[i];
+        if (misses - stamp[v] >= cache_size) {
+          stamp[v] = ++misses;
+        }
+      }
+      return (float)(misses - cache_size) / num_tris;
+    }
+
+    /// Reorder the triangles in place for the vertex cache.
+    static void optimize_triangles(uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      unsigned num_tris = num_indices / 3;
+      if (num_tris < 2) return;
+
+      // triangles using each vertex. The first valence[v] of them are not drawn yet.
+      dynarray<unsigned> valence(num_vertices);
+      dynarray<unsigned> first_tri(num_vertices + 1);
+      dynarray<unsigned> tris(num_tris * 3);
+      memset(valence.data(), 0, num_vertices * sizeof(unsigned));
+      for (unsigned i = 0; i != num_tris * 3; ++i) {
+        valence[indices[i]]++;
+      }
+      first_tri[0] = 0;
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        first_tri[v+1] = first_tri[v] + valence[v];
+        valence[v] = 0;
+      }
+      for (unsigned i = 0; i != num_tris * 3; ++i) {
+        uint32_t v = indices[i];
+        tris[first_tri[v] + valence[v]++] = i / 3;
+      }
+
+      vertex_scores scores;
+      dynarray<int> cache_pos(num_vertices);
+      dynarray<float> score(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        cache_pos[v] = -1;
+        score[v] = scores.get(-1, valence[v]);
+      }
+
+      dynarray<uint8_t> drawn(num_tris);
+      memset(drawn.data(), 0, num_tris);
+      dynarray<uint32_t> result(num_tris * 3);
+
+      // the cache holds three extra vertices while the new triangle pushes old ones out.
+      uint32_t cache[cache_size + 3];
+      unsigned cache_used = 0;
+      unsigned next_undrawn = 0;
+      int best = -1;
+
+      for (unsigned n = 0; n != num_tris; ++n) {
+        if (best == -1) {
+          // no triangle touches the cache: start again with the next one in the input.
+          while (drawn[next_undrawn]) ++next_undrawn;
+          best = (int)next_undrawn;
+        }
+
+        const uint32_t *tri = indices + best * 3;
+        result[n*3+0] = tri[0];
+        result[n*3+1] = tri[1];
+        result[n*3+2] = tri[2];
+        drawn[best] = 1;
+
+        uint32_t new_cache[cache_size + 3];
+        unsigned new_used = 0;
+        for (unsigned k = 0; k != 3; ++k) {
+          uint32_t v = tri[k];
+
+          // move this triangle past the undrawn ones of the vertex.
+          unsigned *vtris = tris.data() + first_tri[v];
+          unsigned last = --valence[v];
+          for (unsigned j = 0; j != last; ++j) {
+            if (vtris[j] == (unsigned)best) {
+              vtris[j] = vtris[last];
+              vtris[last] = best;
+              break;
+            }
+          }
+
+          if (k == 0 || (v != tri[0] && (k == 1 || v != tri[1]))) {
+            new_cache[new_used++] = v;
+          }
+        }
+
+        for (unsigned j = 0; j != cache_used; ++j) {
+          uint32_t v = cache[j];
+          if (v != tri[0] && v != tri[1] && v != tri[2]) {
+            new_cache[new_used++] = v;
+          }
+        }
+
+        for (unsigned j = 0; j != new_used; ++j) {
+          uint32_t v = new_cache[j];
+          cache_pos[v] = j < cache_size ? (int)j : -1;
+          score[v] = scores.get(cache_pos[v], valence[v]);
+        }
+
+        cache_used = new_used < cache_size ? new_used : cache_size;
+        memcpy(cache, new_cache, cache_used * sizeof(uint32_t));
+
+        // the next triangle is the best one using a vertex in the cache.
+        best = -1;
+        float best_score = -1.0f;
+        for (unsigned j = 0; j != cache_used; ++j) {
+          uint32_t v = cache[j];
+          const unsigned *vtris = tris.data() + first_tri[v];
+          for (unsigned t = 0; t != valence[v]; ++t) {
+            const uint32_t *cand = indices + vtris[t] * 3;
+            float s = score[cand[0]] + score[cand[1]] + score[cand[2]];
+            if (s > best_score) {
+              best_score = s;
+              best = (int)vtris[t];
+            }
+          }
+        }
+      }
+
+      memcpy(indices, result.data(), num_tris * 3 * sizeof(uint32_t));
+    }
+
+    /// Reorder clusters of triangles so that those facing out from the centre of the mesh come first.
+    /// Use after optimize_triangles(). Clusters only start where the cache misses anyway,
+    /// so the ACMR hardly changes. pos points to the first position (three floats), stride bytes apart.
+    static void reduce_overdraw(uint32_t *indices, unsigned num_indices, unsigned num_vertices, const uint8_t *pos, unsigned stride) {
+      unsigned num_tris = num_indices / 3;
+      if (num_tris < 2) return;
+
+      // start a new cluster at a triangle that misses the cache at least twice,
+      // once the current cluster is big enough and uses the cache well.
+      enum { min_cluster = 32 };
+      const float max_cluster_acmr = 0.75f;
+      dynarray<unsigned> cluster_start;
+      cluster_start.push_back(0);
+      dynarray<unsigned> stamp(num_vertices);
+      memset(stamp.data(), 0, num_vertices * sizeof(unsigned));
+      unsigned misses = cache_size, cluster_tris = 0, cluster_misses = 0;
+      for (unsigned t = 0; t != num_tris; ++t) {
+        unsigned tri_misses = 0;
+        for (unsigned k = 0; k != 3; ++k) {
+          uint32_t v = indices[t*3+k];
+          if (misses - stamp[v] >= cache_size) {
+            stamp[v] = ++misses;
+            tri_misses++;
+          }
+        }
+        if (tri_misses >= 2 && cluster_tris >= min_cluster && cluster_misses <= cluster_tris * max_cluster_acmr) {
+          cluster_start.push_back(t);
+          cluster_tris = cluster_misses = 0;
+        }
+        cluster_tris++;
+        cluster_misses += tri_misses;
+      }
+      unsigned num_clusters = cluster_start.size();
+      cluster_start.push_back(num_tris);
+      if (num_clusters < 2) return;
+
+      // area weighted centre and normal of each cluster.
+      dynarray<vec3> centers(num_clusters);
+      dynarray<vec3> normals(num_clusters);
+      vec3 mesh_center(0, 0, 0);
+      float mesh_area = 0;
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        vec3 center(0, 0, 0), normal(0, 0, 0);
+        float area = 0;
+        for (unsigned t = cluster_start[c]; t != cluster_start[c+1]; ++t) {
+          const float *p0 = (const float*)(pos + indices[t*3+0] * stride);
+          const float *p1 = (const float*)(pos + indices[t*3+1] * stride);
+          const float *p2 = (const float*)(pos + indices[t*3+2] * stride);
+          vec3 a(p0[0], p0[1], p0[2]), b(p1[0], p1[1], p1[2]), d(p2[0], p2[1], p2[2]);
+          vec3 n = cross(b - a, d - a);
+          float tri_area = length(n);
+          center += (a + b + d) * (tri_area * (1.0f/3));
+          normal += n;
+          area += tri_area;
+        }
+        mesh_center += center;
+        mesh_area += area;
+        centers[c] = area > 0 ? center / area : center;
+        normals[c] = normal;
+      }
+      if (mesh_area > 0) mesh_center = mesh_center / mesh_area;
+
+      struct cluster {
+        float key;
+        unsigned index;
+        bool operator<(const cluster &rhs) const { return key > rhs.key; }
+      };
+      dynarray<cluster> order(num_clusters);
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        vec3 n = normals[c];
+        float len2 = squared(n);
+        order[c].key = len2 > 0 ? dot(centers[c] - mesh_center, n) / sqrtf(len2) : 0.0f;
+        order[c].index = c;
+      }
+      std::stable_sort(order.data(), order.data() + num_clusters);
+
+      dynarray<uint32_t> result(num_tris * 3);
+      uint32_t *dest = result.data();
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        unsigned index = order[c].index;
+        unsigned first = cluster_start[index], last = cluster_start[index+1];
+        memcpy(dest, indices + first * 3, (last - first) * 3 * sizeof(uint32_t));
+        dest += (last - first) * 3;
+      }
+      memcpy(indices, result.data(), num_tris * 3 * sizeof(uint32_t));
+    }
+
+    /// Renumber the vertices in the order the indices first use them.
+    /// remap[old vertex] gets the new number, or ~0 for vertices that are not used.
+    /// Returns the number of vertices used.
+    static unsigned reorder_vertices(uint32_t *remap, uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        remap[v] = ~0u;
+      }
+      unsigned num_used = 0;
+      for (unsigned i = 0; i != num_indices; ++i) {
+        uint32_t &r = remap[indices[i]];
+        if (r == ~0u) r = num_used++;
+        indices[i] = r;
+      }
+      return num_used;
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class vertex_cache_optimizer_unit_test {
+      // rotate a triangle so that its smallest index comes first, keeping the winding.
+      static uint64_t get_key(const uint32_t *tri) {
+        unsigned first = tri[1] < tri[0] ? (tri[2] < tri[1] ? 2 : 1) : (tri[2] < tri[0] ? 2 : 0);
+        uint64_t a = tri[first], b = tri[(first + 1) % 3], c = tri[(first + 2) % 3];
+        return (a << 42) | (b << 21) | c;
+      }
+
+      static void get_keys(dynarray<uint64_t> &keys, const dynarray<uint32_t> &indices) {
+        keys.resize(indices.size() / 3);
+        for (unsigned i = 0; i != keys.size(); ++i) {
+          keys[i] = get_key(&indices[i * 3]);
+        }
+        std::sort(keys.data(), keys.data() + keys.size());
+      }
+
+    public:
+      vertex_cache_optimizer_unit_test() {
+        // a grid of quads with the triangles in a random order.
+        enum { n = 32, num_vertices = (n + 1) * (n + 1) };
+        dynarray<uint32_t> indices;
+        for (unsigned z = 0; z != n; ++z) {
+          for (unsigned x = 0; x != n; ++x) {
+            uint32_t a = z * (n + 1) + x, b = a + 1, c = a + n + 1, d = c + 1;
+            uint32_t quad[6] = { a, c, b, b, c, d };
+            for (unsigned i = 0; i != 6; ++i) indices.push_back(quad[i]);
+          }
+        }
+        unsigned num_tris = indices.size() / 3;
+        uint32_t seed = 0x9e3779b9;
+        for (unsigned i = num_tris - 1; i != 0; --i) {
+          seed = seed * 1664525 + 1013904223;
+          unsigned j = (seed >> 8) % (i + 1);
+          for (unsigned k = 0; k != 3; ++k) std::swap(indices[i * 3 + k], indices[j * 3 + k]);
+        }
+
+        dynarray<uint64_t> keys_before;
+        get_keys(keys_before, indices);
+        float acmr_before = vertex_cache_optimizer::get_acmr(indices.data(), indices.size(), num_vertices);
+
+        vertex_cache_optimizer::optimize_triangles(indices.data(), indices.size(), num_vertices);
+
+        dynarray<uint64_t> keys_after;
+        get_keys(keys_after, indices);
+        float acmr_after = vertex_cache_optimizer::get_acmr(indices.data(), indices.size(), num_vertices);
+
+        // the same triangles with the same winding, drawn in a better order.
+        assert(keys_after.size() == keys_before.size());
+        assert(!memcmp(keys_after.data(), keys_before.data(), keys_after.size() * sizeof(uint64_t)));
+        assert(acmr_after < acmr_before && acmr_after < 1.0f);
+      }
+    };
+    static vertex_cache_optimizer_unit_test vertex_cache_optimizer_unit_test;
+  #endif
+} }
@@ -10,6 +10,35 @@
 namespace octet { namespace scene {
   /// Visual scene; contains instances of meshes, cameras and lights required to draw a scene.
   class visual_scene : public scene_node {
+  public:
+    /// Kinds of ray cast.
+    enum cast_mode {
+      /// find the closest hit.
+      cast_nearest,
+
+      /// stop at the first hit found; faster, for line of sight tests.
+      cast_any,
+    };
+
+    /// The result of a ray cast.
+    struct cast_result {
+      /// the instance hit or NULL.
+      mesh_instance *mi;
+
+      /// hit pos = ray.get_start() + ray.get_distance() * depth
+      rational depth;
+
+      /// vertex indices of the triangle hit.
+      int indices[3];
+
+      /// barycentric coordinates of the hit on the triangle.
+      vec3 bary;
+    };
+
+  private:
+    // the skinned vertex shader has this many matrices; bigger skins are skinned on the CPU.
+    enum { max_shader_bones = 192 };
+
     ///////////////////////////////////////////
     //
     // rendering information
@@ -27,6 +56,27 @@ namespace octet { namespace scene {
     /// lights available
     dynarray<ref<light_instance> > light_instances;
 
+    /// every node in the scene and its node to world matrix, parents first.
+    dynarray<scene_node*> world_nodes;
+    dynarray<mat4t> world_transforms;
+
+    /// mesh instances that survived culling this frame, in draw order.
+    dynarray<mesh_instance*> visible_instances;
+
+    /// set this to skip instances outside the view frustum.
+    bool frustum_culling;
+
+    /// culling counters for the last frame.
+    unsigned num_cull_tests;
+    unsigned num_culled;
+
+    /// bvh over the world space boxes of the mesh instances for ray casting.
+    /// each mesh keeps its own triangle bvh, see mesh::ray_cast.
+    bvh ray_tree;
+    dynarray<mesh_instance*> ray_instances;
+    dynarray<aabb> ray_bounds;
+    dynarray<mat4t> ray_worldToNode;
+
     /// set this to draw bounding boxes
     bool render_aabbs;
     bool render_debug_lines;
@@ -181,18 +231,81 @@ namespace octet { namespace scene {
       }
     }
 
-    void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
-      mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
+    // rebuild the instance bvh if instances have come or gone, refit it if they have moved.
+    void update_ray_tree() {
+      unsigned num = 0;
+      bool rebuild = false;
+      bool moved = false;
+      for (unsigned i = 0; i != mesh_instances.size(); ++i) {
+        mesh_instance *mi = mesh_instances[i];
+        if (!mi || !mi->get_node() || !mi->get_mesh() || !mi->get_node()->calcEnabled()) continue;
+
+        mat4t nodeToWorld = mi->get_node()->calcModelToWorld();
+        aabb bb = mi->get_mesh()->get_aabb().get_transform(nodeToWorld);
+        if (num == ray_instances.size()) {
+          ray_instances.push_back(mi);
+          ray_bounds.push_back(bb);
+          ray_worldToNode.push_back(nodeToWorld.inverse3x4());
+          rebuild = true;
+        } else {
+          if (ray_instances[num] != mi) {
+            ray_instances[num] = mi;
+            rebuild = true;
+          }
+          const aabb &old = ray_bounds[num];
+          if (!all(old.get_center() <= bb.get_center()) || !all(bb.get_center() <= old.get_center()) ||
+            !all(old.get_half_extent() <= bb.get_half_extent()) || !all(bb.get_half_extent() <= old.get_half_extent())
+          ) {
+            ray_bounds[num] = bb;
+            moved = true;
+          }
+          ray_worldToNode[num] = nodeToWorld.inverse3x4();
+        }
+        num++;
+      }
 
-      mat4t worldToCamera;
-      cameraToWorld.invertQuick(worldToCamera);
+      if (num != ray_instances.size()) {
+        ray_instances.resize(num);
+        ray_bounds.resize(num);
+        ray_worldToNode.resize(num);
+        rebuild = true;
+      }
 
-      calc_lighting(worldToCamera);
+      if (rebuild || (moved && !ray_tree.refit(ray_bounds.data()))) {
+        ray_tree.build(ray_bounds.data(), num, 1);
+      }
+    }
 
-      cam.set_cameraToWorld(cameraToWorld, aspect_ratio);
-      mat4t cameraToProjection = cam.get_cameraToProjection();
+    // cast a ray against the instance bvh, then the triangle bvh of each instance it reaches.
+    void cast_ray_internal(cast_result &result, const ray &the_ray, cast_mode mode) {
+      result.mi = 0;
+      result.depth = rational(0, 0);
 
-      draw_debug_data(cam);
+      float t_max = 1;
+      ray_tree.ray_cast(the_ray.get_start(), the_ray.get_distance(), t_max, [&](unsigned prim, float &t_max) {
+        // t is the same in model space as the transform is affine.
+        ray model_ray = the_ray.get_transform(ray_worldToNode[prim]);
+        mesh::ray_hit hit;
+        if (!ray_instances[prim]->get_mesh()->ray_cast(model_ray, hit, t_max, mode == cast_any)) return false;
+        t_max = hit.t;
+        result.mi = ray_instances[prim];
+        result.depth = rational(hit.t);
+        result.indices[0] = hit.indices[0];
+        result.indices[1] = hit.indices[1];
+        result.indices[2] = hit.indices[2];
+        result.bary = hit.bary;
+        return mode == cast_any;
+      });
+    }
+
+    // build a compact list of the instances to draw before making any GL calls.
+    void cull_instances(camera_instance &cam, const mat4t &worldToCamera) {
+      half_space planes[6];
+      cam.get_frustum_planes(planes);
+
+      visible_instances.resize(0);
+      num_cull_tests = 0;
+      num_culled = 0;
 
       for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
         mesh_instance *mi = mesh_instances[mesh_index];
@@ -205,21 +318,11 @@ namespace octet { namespace scene {
           !node->calcEnabled()
         ) continue;
 
-        mesh *msh = mi->get_mesh();
-        skin *skn = msh->get_skin();
-        skeleton *skel = mi->get_skeleton();
-        material *mat = mi->get_material();
-
-        mat4t modelToWorld = node->calcModelToWorld();
-        mat4t modelToCamera;
-        mat4t modelToProjection;
-        cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
-        //printf("%d %f\n", mesh_index, modelToWorld.w().y());
+        const mat4t &modelToWorld = node->get_nodeToWorld();
 
         // selecting LOD meshes by distance
         if (flags & mesh_instance::flag_lod) {
-          float distance = -modelToCamera.w().z();
-          //printf("%f %f %f\n", distance, mi->get_min_draw_distance(), mi->get_max_draw_distance());
+          float distance = -(modelToWorld.w() * worldToCamera).z();
           if (
             distance < mi->get_min_draw_distance() ||
             distance >= mi->get_max_draw_distance()
@@ -228,22 +331,83 @@ namespace octet { namespace scene {
           }
         }
 
+        // skinned meshes move outside their bind pose box and an empty box means no box was set.
+        mesh *msh = mi->get_mesh();
+        aabb bb = msh->get_aabb();
+        vec3 half = bb.get_half_extent();
+        bool can_cull =
+          frustum_culling &&
+          !(flags & mesh_instance::flag_no_cull) &&
+          !(mi->get_skeleton() && msh->get_skin()) &&
+          (half.x() != 0 || half.y() != 0 || half.z() != 0)
+        ;
+
+        if (can_cull) {
+          num_cull_tests++;
+          bb = bb.get_transform(modelToWorld);
+          bool inside = true;
+          for (unsigned i = 0; i != 6 && inside; ++i) {
+            inside = planes[i].intersects(bb);
+          }
+          if (!inside) {
+            num_culled++;
+            continue;
+          }
+        }
+
+        visible_instances.push_back(mi);
+      }
+    }
+
+    void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
+      mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
+
+      mat4t worldToCamera;
+      cameraToWorld.invertQuick(worldToCamera);
+
+      calc_lighting(worldToCamera);
+
+      cam.set_cameraToWorld(cameraToWorld, aspect_ratio);
+      mat4t cameraToProjection = cam.get_cameraToProjection();
+
+      cull_instances(cam, worldToCamera);
+
+      draw_debug_data(cam);
+
+      for (unsigned visible_index = 0; visible_index != visible_instances.size(); ++visible_index) {
+        mesh_instance *mi = visible_instances[visible_index];
+
+        scene_node *node = mi->get_node();
+
+        mesh *msh = mi->get_mesh();
+        skin *skn = msh->get_skin();
+        skeleton *skel = mi->get_skeleton();
+        material *mat = mi->get_material();
+
+        mat4t modelToWorld = node->calcModelToWorld();
+        mat4t modelToCamera;
+        mat4t modelToProjection;
+        cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
+
         if (!skel || !skn) {
           /// normal rendering for single matrix objects
           /// build a projection matrix: model -> world -> camera_instance -> projection
           /// the projection space is the cube -1 <= x/w, y/w, z/w <= 1
           mat->render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
+        } else if ((mi->get_flags() & mesh_instance::flag_cpu_skinning) || skn->get_num_joints() > max_shader_bones) {
+          /// CPU skinning: move the vertices into model space and draw them as a normal object.
+          mat4t modelToModel;
+          modelToModel.loadIdentity();
+          mat4t *transforms = skel->calc_transforms(modelToModel, skn);
+          mesh *skinned = mi->deform(transforms, skel->get_num_bones());
+          if (!skinned) continue;
+          msh = skinned;
+          mat->render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
         } else {
           /// multi-matrix rendering
           mat4t *transforms = skel->calc_transforms(modelToCamera, skn);
           int num_bones = skel->get_num_bones();
-          if(num_bones > 192) {
-            GLint mvuv = 0;
-            //glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &mvuv);
-            printf("warning: too many bones (%d/%d)\n", num_bones, mvuv/4);
-          } else {
-            mat->render_skinned(cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
-          }
+          mat->render_skinned(cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
         }
 
         /*if (true) {
@@ -273,6 +437,9 @@ namespace octet { namespace scene {
       render_aabbs = false;
       dump_vertices = false;
       render_debug_lines = false;
+      frustum_culling = true;
+      num_cull_tests = 0;
+      num_culled = 0;
       debug_material = new material(vec4(1, 0, 0, 1));
       debug_line_buffer.resize(256);
       assert(is_power_of_two(debug_line_buffer.size()));
@@ -511,6 +678,26 @@ namespace octet { namespace scene {
       dump_vertices = value;
     }
 
+    /// skip mesh instances outside the camera's view frustum (on by default)
+    void set_frustum_culling(bool value) {
+      frustum_culling = value;
+    }
+
+    /// number of mesh instances tested against the view frustum in the last render
+    unsigned get_num_cull_tests() const {
+      return num_cull_tests;
+    }
+
+    /// number of mesh instances rejected by the view frustum in the last render
+    unsigned get_num_culled() const {
+      return num_culled;
+    }
+
+    /// number of mesh instances drawn in the last render
+    unsigned get_num_visible_instances() const {
+      return visible_instances.size();
+    }
+
     /// access camera_instance information
     camera_instance *get_camera_instance(int index) {
       return camera_instances[index];
@@ -543,15 +730,47 @@ namespace octet { namespace scene {
         }
       #endif
 
+      // evaluate the animations on all threads, then move their targets on this one
+      // as several animations may drive the same nodes.
+      job::get_scheduler().parallel_for(0, animation_instances.size(), 4, [&](unsigned begin, unsigned end) {
+        for (unsigned idx = begin; idx != end; ++idx) {
+          animation_instances[idx]->evaluate(delta_time);
+        }
+      });
+
       for (int idx = 0; idx != animation_instances.size(); ++idx) {
-        animation_instance *inst = animation_instances[idx];
-        inst->update(delta_time);
+        animation_instances[idx]->apply();
       }
 
       for (int idx = 0; idx != mesh_instances.size(); ++idx) {
         mesh_instance *inst = mesh_instances[idx];
         inst->update(delta_time);
       }
+
+      update_world_transforms();
+    }
+
+    /// Refresh the cached world transforms of every node in the scene in one top-down pass.
+    /// update() calls this after physics and animation have moved the nodes.
+    void update_world_transforms() {
+      world_nodes.resize(0);
+      world_transforms.resize(0);
+      scene_node::update_world_transforms(world_transforms, world_nodes);
+    }
+
+    /// number of nodes found by the last update_world_transforms()
+    unsigned get_num_world_nodes() const {
+      return world_nodes.size();
+    }
+
+    /// node found by the last update_world_transforms()
+    scene_node *get_world_node(unsigned index) const {
+      return world_nodes[index];
+    }
+
+    /// node to world matrices found by the last update_world_transforms(), in the same order as the nodes
+    const mat4t *get_world_transforms() const {
+      return world_transforms.data();
     }
 
     /// render using specific shaders.
@@ -612,41 +831,62 @@ namespace octet { namespace scene {
       return world_aabb;
     }
 
-    struct cast_result {
-      mesh_instance *mi;
-      rational depth;
-    };
+    /// Cast a ray in world space against the triangles of the mesh instances.
+    /// Returns true and the instance and location of the hit if there was one.
+    /// The instances and triangles are held in bounding volume hierarchies
+    /// which are refitted or rebuilt here when the scene changes.
+    bool cast_ray(cast_result &result, const ray &the_ray, cast_mode mode = cast_nearest) {
+      update_ray_tree();
+      cast_ray_internal(result, the_ray, mode);
+      return result.mi != 0;
+    }
+
+    /// Cast a ray and return every hit, nearest first.
+    unsigned cast_ray_all(dynarray<cast_result> &results, const ray &the_ray) {
+      update_ray_tree();
+      results.resize(0);
+
+      dynarray<mesh::ray_hit> hits;
+      float t_max = 1;
+      ray_tree.ray_cast(the_ray.get_start(), the_ray.get_distance(), t_max, [&](unsigned prim, float &t_max) {
+        ray model_ray = the_ray.get_transform(ray_worldToNode[prim]);
+        hits.resize(0);
+        ray_instances[prim]->get_mesh()->ray_cast_all(model_ray, hits, t_max);
+        for (unsigned i = 0; i != hits.size(); ++i) {
+          cast_result res;
+          res.mi = ray_instances[prim];
+          res.depth = rational(hits[i].t);
+          res.indices[0] = hits[i].indices[0];
+          res.indices[1] = hits[i].indices[1];
+          res.indices[2] = hits[i].indices[2];
+          res.bary = hits[i].bary;
+          results.push_back(res);
+        }
+        return false;
+      });
 
-    /// brute force & ignorance ray cast.
-    /// return the mesh instance and location of hits.
-    /// todo: build a kd tree for mesh instance bbs & mesh triangles
-    void cast_ray(cast_result &result, const ray &the_ray) {
-      result.mi = 0;
-      result.depth = rational(0, 0);
+      // all the depths have a denominator of one.
+      std::sort(results.data(), results.data() + results.size(), [](const cast_result &a, const cast_result &b) {
+        return a.depth.numer() < b.depth.numer();
+      });
+      return results.size();
+    }
 
-      for (int i = 0; i != mesh_instances.size(); ++i) {
-        mesh_instance *mi = mesh_instances[i];
-        if (mi && mi->get_node()) {
-          mat4t nodeToWorld = mi->get_node()->calcModelToWorld();
-          mesh *mesh = mi->get_mesh();
-          aabb bb = mesh->get_aabb();
-          bb = bb.get_transform(nodeToWorld);
-          if (the_ray.intersects(bb)) {
-            mat4t worldToNode = nodeToWorld.inverse3x4();
-            //ray model_ray = ray(vec3(0, 0, -1), vec3(0, 0, 2)); //the_ray.get_transform(worldToNode);
-            ray model_ray = the_ray.get_transform(worldToNode);
-            int indices[3] = {0};
-            vec4 bary_numer(0, 0, 0, 0);
-            float bary_denom;
-            bool hit = mesh->ray_cast(model_ray, indices, bary_numer, bary_denom);
-            if (hit) {
-              rational depth(bary_numer.w() / bary_denom);
-              result.depth = min(depth, result.depth);
-            }
-            //printf("hit=%d %s %f\n", hit, (bary_numer/bary_denom).toString(tmp, sizeof(tmp)), (float)result.depth);
-          }
-        }
+    /// Cast a batch of rays, eg. for picking with many samples or visibility tests.
+    /// The bvhs are brought up to date on this thread and the rays are cast on the job threads.
+    void cast_rays(cast_result *results, const ray *rays, unsigned num_rays, cast_mode mode = cast_nearest) {
+      update_ray_tree();
+
+      // triangle bvhs must be built here as they read from GL buffers.
+      for (unsigned i = 0; i != ray_instances.size(); ++i) {
+        ray_instances[i]->get_mesh()->prepare_ray_cast();
       }
+
+      job::get_scheduler().parallel_for(0, num_rays, 16, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          cast_ray_internal(results[i], rays[i], mode);
+        }
+      });
     }
 
     /// Debug rendering: add a new line in world space (old ones will be lost)